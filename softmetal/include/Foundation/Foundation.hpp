@@ -0,0 +1,157 @@
+#ifndef SOFTMETAL_FOUNDATION_HPP
+#define SOFTMETAL_FOUNDATION_HPP
+
+// The part of metal-cpp's Foundation that the renderer uses, for softmetal.
+// Objects are reference counted like their Objective-C counterparts: alloc
+// and new* return an owned reference, everything else an autoreleased one
+// that lives until the innermost AutoreleasePool on the thread is released.
+
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <functional>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace NS
+{
+    typedef uintptr_t UInteger;
+    typedef intptr_t Integer;
+
+    enum StringEncoding : UInteger
+    {
+        ASCIIStringEncoding = 1,
+        UTF8StringEncoding = 4,
+    };
+
+    struct Range
+    {
+        UInteger location;
+        UInteger length;
+
+        static Range Make( UInteger loc, UInteger len ) { return Range{ loc, len }; }
+    };
+
+    class Object
+    {
+        public:
+            Object() = default;
+            virtual ~Object() = default;
+
+            void release();
+            UInteger retainCount() const { return _refs.load(std::memory_order_relaxed); }
+
+        protected:
+            void retainObject() { _refs.fetch_add(1, std::memory_order_relaxed); }
+            void autoreleaseObject();
+
+        private:
+            friend class Array;
+
+            Object( const Object& ) = delete;
+            Object &operator=( const Object& ) = delete;
+
+            std::atomic<UInteger> _refs{ 1 };
+    };
+
+    template <class T, class Base = Object>
+    class Referencing : public Base
+    {
+        public:
+            static T *alloc() { return new T(); }
+            T *init() { return static_cast<T*>(this); }
+            T *retain() { this->retainObject(); return static_cast<T*>(this); }
+            T *autorelease() { this->autoreleaseObject(); return static_cast<T*>(this); }
+    };
+
+    class AutoreleasePool : public Referencing<AutoreleasePool>
+    {
+        public:
+            AutoreleasePool();
+            ~AutoreleasePool();
+
+            void drain() { release(); }
+            void addObject( Object *obj ) { _objects.push_back(obj); }
+
+        private:
+            std::vector<Object*> _objects;
+            AutoreleasePool *_outer;
+    };
+
+    class String : public Referencing<String>
+    {
+        public:
+            static String *string( const char *s, StringEncoding encoding );
+
+            const char *utf8String() const { return _s.c_str(); }
+            const char *cString( StringEncoding encoding ) const { return _s.c_str(); }
+            UInteger length() const { return _s.size(); }
+
+        private:
+            std::string _s;
+    };
+
+    class Error : public Referencing<Error>
+    {
+        public:
+            // softmetal only
+            static Error *error( const char *description );
+
+            String *localizedDescription() const { return _description; }
+            ~Error() { if (_description) _description->release(); }
+
+        private:
+            String *_description = nullptr;
+    };
+
+    class URL : public Referencing<URL>
+    {
+        public:
+            static URL *fileURLWithPath( const String *path );
+
+            const char *fileSystemRepresentation() const { return _path.c_str(); }
+
+        private:
+            std::string _path;
+    };
+
+    class Array : public Referencing<Array>
+    {
+        public:
+            static Array *array( const Object *obj );
+            ~Array();
+
+            UInteger count() const { return _objects.size(); }
+            template <class T>
+            T *object( UInteger index ) const { return static_cast<T*>(_objects[index]); }
+
+        private:
+            std::vector<Object*> _objects;
+    };
+}
+
+// CoreGraphics geometry, for MTK::View
+typedef double CGFloat;
+
+struct CGPoint
+{
+    CGFloat x, y;
+};
+
+struct CGSize
+{
+    CGFloat width, height;
+};
+
+struct CGRect
+{
+    CGPoint origin;
+    CGSize size;
+};
+
+#endif
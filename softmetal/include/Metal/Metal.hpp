@@ -0,0 +1,535 @@
+#ifndef SOFTMETAL_METAL_HPP
+#define SOFTMETAL_METAL_HPP
+
+// A software Metal device behind the subset of metal-cpp the renderer uses,
+// so renderer.cpp builds and runs unmodified where there is no Metal.
+//
+// Command buffers are executed in commit order on one thread per queue,
+// standing in for the gpu, and call their completed handlers from there.
+// Buffers model managed storage: the cpu writes contents(), and commands only
+// see what didModifyRange() copied over. Compute pipelines run a CpuKernel
+// over a ThreadPool (see softmetal.h), and render pipelines draw textured
+// triangles the way quad.metal does.
+
+#include <Foundation/Foundation.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+struct CpuKernel;
+class ThreadPool;
+
+namespace MTL
+{
+    enum PixelFormat : NS::UInteger
+    {
+        PixelFormatInvalid = 0,
+        PixelFormatRGBA8Unorm = 70,
+        PixelFormatBGRA8Unorm = 80,
+        PixelFormatBGRA8Unorm_sRGB = 81,
+    };
+
+    enum TextureType : NS::UInteger
+    {
+        TextureType2D = 2,
+    };
+
+    enum StorageMode : NS::UInteger
+    {
+        StorageModeShared = 0,
+        StorageModeManaged = 1,
+        StorageModePrivate = 2,
+    };
+
+    typedef NS::UInteger ResourceOptions;
+    enum : NS::UInteger
+    {
+        ResourceStorageModeShared = 0,
+        ResourceStorageModeManaged = 16,
+        ResourceStorageModePrivate = 32,
+    };
+
+    typedef NS::UInteger ResourceUsage;
+    enum : NS::UInteger
+    {
+        ResourceUsageRead = 1,
+        ResourceUsageWrite = 2,
+        ResourceUsageSample = 4,
+    };
+
+    typedef NS::UInteger TextureUsage;
+    enum : NS::UInteger
+    {
+        TextureUsageShaderRead = 1,
+        TextureUsageShaderWrite = 2,
+        TextureUsageRenderTarget = 4,
+    };
+
+    typedef NS::UInteger PipelineOption;
+    enum : NS::UInteger
+    {
+        PipelineOptionNone = 0,
+        PipelineOptionFailOnBinaryArchiveMiss = 4,
+    };
+
+    enum PrimitiveType : NS::UInteger
+    {
+        PrimitiveTypeTriangle = 3,
+    };
+
+    enum IndexType : NS::UInteger
+    {
+        IndexTypeUInt16 = 0,
+        IndexTypeUInt32 = 1,
+    };
+
+    enum LoadAction : NS::UInteger
+    {
+        LoadActionDontCare = 0,
+        LoadActionLoad = 1,
+        LoadActionClear = 2,
+    };
+
+    enum CommandBufferStatus : NS::UInteger
+    {
+        CommandBufferStatusNotEnqueued = 0,
+        CommandBufferStatusCommitted = 2,
+        CommandBufferStatusCompleted = 4,
+    };
+
+    struct Origin
+    {
+        NS::UInteger x, y, z;
+
+        static Origin Make( NS::UInteger x, NS::UInteger y, NS::UInteger z ) { return Origin{ x, y, z }; }
+    };
+
+    struct Size
+    {
+        NS::UInteger width, height, depth;
+
+        static Size Make( NS::UInteger w, NS::UInteger h, NS::UInteger d ) { return Size{ w, h, d }; }
+    };
+
+    struct Region
+    {
+        Origin origin;
+        Size size;
+
+        static Region Make2D( NS::UInteger x, NS::UInteger y, NS::UInteger w, NS::UInteger h )
+        {
+            return Region{ { x, y, 0 }, { w, h, 1 } };
+        }
+    };
+
+    struct ClearColor
+    {
+        double red, green, blue, alpha;
+
+        static ClearColor Make( double r, double g, double b, double a ) { return ClearColor{ r, g, b, a }; }
+    };
+
+    class Device;
+    class CommandQueue;
+
+    class Buffer : public NS::Referencing<Buffer>
+    {
+        public:
+            void *contents() { return _cpu.data(); }
+            NS::UInteger length() const { return _cpu.size(); }
+            void didModifyRange( NS::Range range );
+
+            // softmetal: what commands see
+            const uint8_t *gpuContents() const { return _managed ? _gpu.data() : _cpu.data(); }
+            uint8_t *gpuContents() { return _managed ? _gpu.data() : _cpu.data(); }
+
+        private:
+            friend class Device;
+
+            std::vector<uint8_t> _cpu;
+            std::vector<uint8_t> _gpu; // only for managed storage
+            bool _managed = false;
+    };
+
+    class TextureDescriptor : public NS::Referencing<TextureDescriptor>
+    {
+        public:
+            void setWidth( NS::UInteger width ) { _width = width; }
+            void setHeight( NS::UInteger height ) { _height = height; }
+            void setPixelFormat( PixelFormat format ) { _format = format; }
+            void setTextureType( TextureType type ) {}
+            void setStorageMode( StorageMode mode ) {}
+            void setUsage( TextureUsage usage ) {}
+
+            NS::UInteger width() const { return _width; }
+            NS::UInteger height() const { return _height; }
+            PixelFormat pixelFormat() const { return _format; }
+
+        private:
+            NS::UInteger _width = 1;
+            NS::UInteger _height = 1;
+            PixelFormat _format = PixelFormatRGBA8Unorm;
+    };
+
+    // four bytes per pixel, rows packed
+    class Texture : public NS::Referencing<Texture>
+    {
+        public:
+            NS::UInteger width() const { return _width; }
+            NS::UInteger height() const { return _height; }
+            PixelFormat pixelFormat() const { return _format; }
+
+            void replaceRegion( Region region, NS::UInteger level, const void *bytes, NS::UInteger bytesPerRow );
+            void getBytes( void *bytes, NS::UInteger bytesPerRow, Region region, NS::UInteger level ) const;
+
+            // softmetal: the pixels, for commands
+            uint8_t *data() { return _data.data(); }
+            const uint8_t *data() const { return _data.data(); }
+
+        private:
+            friend class Device;
+
+            NS::UInteger _width = 0;
+            NS::UInteger _height = 0;
+            PixelFormat _format = PixelFormatInvalid;
+            std::vector<uint8_t> _data;
+    };
+
+    class Drawable : public NS::Referencing<Drawable>
+    {
+        public:
+            // softmetal: runs on the queue thread once the drawable's
+            // commands are done
+            virtual void present() {}
+    };
+
+    class Function : public NS::Referencing<Function>
+    {
+        public:
+            NS::String *name() const { return _name; }
+            ~Function() { if (_name) _name->release(); }
+
+        private:
+            friend class Library;
+
+            NS::String *_name = nullptr;
+    };
+
+    class CompileOptions : public NS::Referencing<CompileOptions>
+    {
+    };
+
+    class Library : public NS::Referencing<Library>
+    {
+        public:
+            // nullptr if the source has no function of that name
+            Function *newFunction( const NS::String *name );
+
+        private:
+            friend class Device;
+
+            std::string _source;
+    };
+
+    class BinaryArchiveDescriptor : public NS::Referencing<BinaryArchiveDescriptor>
+    {
+        public:
+            NS::URL *url() const { return _url; }
+            void setUrl( const NS::URL *url );
+            ~BinaryArchiveDescriptor() { if (_url) _url->release(); }
+
+        private:
+            NS::URL *_url = nullptr;
+    };
+
+    class ComputePipelineDescriptor;
+    class RenderPipelineDescriptor;
+
+    // Records the names of the functions added, the software device has
+    // nothing to compile.
+    class BinaryArchive : public NS::Referencing<BinaryArchive>
+    {
+        public:
+            bool addComputePipelineFunctions( const ComputePipelineDescriptor *descriptor, NS::Error **error );
+            bool addRenderPipelineFunctions( const RenderPipelineDescriptor *descriptor, NS::Error **error );
+            bool serializeToURL( const NS::URL *url, NS::Error **error );
+
+        private:
+            friend class Device;
+
+            std::string _functions;
+    };
+
+    class ComputePipelineDescriptor : public NS::Referencing<ComputePipelineDescriptor>
+    {
+        public:
+            void setComputeFunction( const Function *fn ) { _function = fn; }
+            const Function *computeFunction() const { return _function; }
+            void setBinaryArchives( const NS::Array *archives ) {}
+
+        private:
+            const Function *_function = nullptr;
+    };
+
+    class RenderPipelineColorAttachmentDescriptor : public NS::Referencing<RenderPipelineColorAttachmentDescriptor>
+    {
+        public:
+            void setPixelFormat( PixelFormat format ) { _format = format; }
+            PixelFormat pixelFormat() const { return _format; }
+
+        private:
+            PixelFormat _format = PixelFormatInvalid;
+    };
+
+    class RenderPipelineColorAttachmentDescriptorArray
+    {
+        public:
+            RenderPipelineColorAttachmentDescriptor *object( NS::UInteger index ) { return &_attachment; }
+
+        private:
+            RenderPipelineColorAttachmentDescriptor _attachment;
+    };
+
+    class RenderPipelineDescriptor : public NS::Referencing<RenderPipelineDescriptor>
+    {
+        public:
+            void setVertexFunction( const Function *fn ) { _vertex = fn; }
+            void setFragmentFunction( const Function *fn ) { _fragment = fn; }
+            const Function *vertexFunction() const { return _vertex; }
+            const Function *fragmentFunction() const { return _fragment; }
+            RenderPipelineColorAttachmentDescriptorArray *colorAttachments() { return &_attachments; }
+            void setBinaryArchives( const NS::Array *archives ) {}
+
+        private:
+            const Function *_vertex = nullptr;
+            const Function *_fragment = nullptr;
+            RenderPipelineColorAttachmentDescriptorArray _attachments;
+    };
+
+    class ComputePipelineState : public NS::Referencing<ComputePipelineState>
+    {
+        public:
+            NS::UInteger maxTotalThreadsPerThreadgroup() const { return 1024; }
+
+            // softmetal: what computeMain runs
+            const CpuKernel *kernel() const { return _kernel; }
+            // softmetal: resolveMain of resolve.metal instead of computeMain
+            bool resolves() const { return _resolves; }
+
+        private:
+            friend class Device;
+
+            const CpuKernel *_kernel = nullptr;
+            bool _resolves = false;
+    };
+
+    class RenderPipelineState : public NS::Referencing<RenderPipelineState>
+    {
+        public:
+            PixelFormat pixelFormat() const { return _format; }
+
+        private:
+            friend class Device;
+
+            PixelFormat _format = PixelFormatInvalid;
+    };
+
+    class RenderPassColorAttachmentDescriptor : public NS::Referencing<RenderPassColorAttachmentDescriptor>
+    {
+        public:
+            ~RenderPassColorAttachmentDescriptor() { if (_texture) _texture->release(); }
+
+            Texture *texture() const { return _texture; }
+            void setTexture( Texture *texture );
+            LoadAction loadAction() const { return _load; }
+            void setLoadAction( LoadAction action ) { _load = action; }
+            ClearColor clearColor() const { return _clear; }
+            void setClearColor( ClearColor color ) { _clear = color; }
+
+        private:
+            Texture *_texture = nullptr;
+            LoadAction _load = LoadActionClear;
+            ClearColor _clear = { 0.0, 0.0, 0.0, 1.0 };
+    };
+
+    class RenderPassColorAttachmentDescriptorArray
+    {
+        public:
+            RenderPassColorAttachmentDescriptor *object( NS::UInteger index ) { return &_attachment; }
+
+        private:
+            RenderPassColorAttachmentDescriptor _attachment;
+    };
+
+    class RenderPassDescriptor : public NS::Referencing<RenderPassDescriptor>
+    {
+        public:
+            static RenderPassDescriptor *renderPassDescriptor() { return alloc()->init()->autorelease(); }
+            RenderPassColorAttachmentDescriptorArray *colorAttachments() { return &_attachments; }
+
+        private:
+            RenderPassColorAttachmentDescriptorArray _attachments;
+    };
+
+    class CommandBuffer;
+
+    // what an encoder recorded, run on the queue thread
+    typedef std::function<void()> SoftCommand;
+
+    class CommandEncoder
+    {
+        public:
+            void endEncoding() {}
+
+        protected:
+            CommandBuffer *_buffer = nullptr;
+    };
+
+    class ComputeCommandEncoder : public NS::Referencing<ComputeCommandEncoder>, public CommandEncoder
+    {
+        public:
+            ~ComputeCommandEncoder();
+
+            void setComputePipelineState( const ComputePipelineState *pso );
+            void setTexture( const Texture *texture, NS::UInteger index );
+            void setBuffer( const Buffer *buffer, NS::UInteger offset, NS::UInteger index );
+            void dispatchThreads( Size threadsPerGrid, Size threadsPerThreadgroup );
+
+        private:
+            friend class CommandBuffer;
+
+            // computeMain writes texture(0), resolveMain reads it into texture(1)
+            static const unsigned compute_textures = 2;
+
+            ComputePipelineState *_pso = nullptr;
+            Texture *_textures[compute_textures] = {};
+            Buffer *_buffer0 = nullptr;
+            NS::UInteger _offset0 = 0;
+    };
+
+    class RenderCommandEncoder : public NS::Referencing<RenderCommandEncoder>, public CommandEncoder
+    {
+        public:
+            ~RenderCommandEncoder();
+
+            void setRenderPipelineState( const RenderPipelineState *pso );
+            void setVertexBuffer( const Buffer *buffer, NS::UInteger offset, NS::UInteger index );
+            void setFragmentTexture( const Texture *texture, NS::UInteger index );
+            void drawIndexedPrimitives( PrimitiveType type, NS::UInteger indexCount, IndexType indexType,
+                    const Buffer *indexBuffer, NS::UInteger indexBufferOffset );
+
+        private:
+            friend class CommandBuffer;
+
+            static const unsigned vertex_buffers = 3;
+
+            Texture *_target = nullptr;
+            RenderPipelineState *_pso = nullptr;
+            Buffer *_vertexbuffers[vertex_buffers] = {};
+            NS::UInteger _vertexoffsets[vertex_buffers] = {};
+            Texture *_fragmenttexture = nullptr;
+    };
+
+    class BlitCommandEncoder : public NS::Referencing<BlitCommandEncoder>, public CommandEncoder
+    {
+        public:
+            // only what a readback needs: one slice of a 2D texture
+            void copyFromTexture( const Texture *sourceTexture, NS::UInteger sourceSlice, NS::UInteger sourceLevel,
+                    Origin sourceOrigin, Size sourceSize, const Buffer *destinationBuffer,
+                    NS::UInteger destinationOffset, NS::UInteger destinationBytesPerRow,
+                    NS::UInteger destinationBytesPerImage );
+
+        private:
+            friend class CommandBuffer;
+    };
+
+    class CommandBuffer : public NS::Referencing<CommandBuffer>
+    {
+        public:
+            ~CommandBuffer();
+
+            ComputeCommandEncoder *computeCommandEncoder();
+            RenderCommandEncoder *renderCommandEncoder( const RenderPassDescriptor *descriptor );
+            BlitCommandEncoder *blitCommandEncoder();
+            void presentDrawable( const Drawable *drawable );
+            void addCompletedHandler( const std::function<void(CommandBuffer*)> &handler );
+            void commit();
+            void waitUntilCompleted();
+            CommandBufferStatus status() const;
+
+            // softmetal
+            void record( SoftCommand command ) { _commands.push_back(std::move(command)); }
+            Device *device() const { return _device; }
+
+        private:
+            friend class CommandQueue;
+
+            void execute();
+
+            Device *_device = nullptr;
+            CommandQueue *_queue = nullptr;
+            std::vector<SoftCommand> _commands;
+            std::vector<std::function<void(CommandBuffer*)>> _handlers;
+            mutable std::mutex _mutex;
+            std::condition_variable _done;
+            CommandBufferStatus _status = CommandBufferStatusNotEnqueued;
+    };
+
+    class CommandQueue : public NS::Referencing<CommandQueue>
+    {
+        public:
+            ~CommandQueue();
+
+            CommandBuffer *commandBuffer();
+
+        private:
+            friend class Device;
+            friend class CommandBuffer;
+
+            void start( Device *device );
+            void enqueue( CommandBuffer *buffer );
+            void run();
+
+            Device *_device = nullptr;
+            std::mutex _mutex;
+            std::condition_variable _wake;
+            std::deque<CommandBuffer*> _pending;
+            bool _quit = false;
+            std::thread _thread;
+    };
+
+    class Device : public NS::Referencing<Device>
+    {
+        public:
+            Device();
+            ~Device();
+
+            NS::String *name() const;
+
+            Buffer *newBuffer( NS::UInteger length, ResourceOptions options );
+            Texture *newTexture( const TextureDescriptor *descriptor );
+            CommandQueue *newCommandQueue();
+
+            Library *newLibrary( const NS::String *source, const CompileOptions *options, NS::Error **error );
+            ComputePipelineState *newComputePipelineState( const Function *fn, NS::Error **error );
+            ComputePipelineState *newComputePipelineState( const ComputePipelineDescriptor *descriptor,
+                    PipelineOption options, const void *reflection, NS::Error **error );
+            RenderPipelineState *newRenderPipelineState( const RenderPipelineDescriptor *descriptor, NS::Error **error );
+            RenderPipelineState *newRenderPipelineState( const RenderPipelineDescriptor *descriptor,
+                    PipelineOption options, const void *reflection, NS::Error **error );
+            BinaryArchive *newBinaryArchive( const BinaryArchiveDescriptor *descriptor, NS::Error **error );
+
+            // softmetal: the workers compute dispatches run on
+            ThreadPool &pool() { return *_pool; }
+
+        private:
+            std::unique_ptr<ThreadPool> _pool;
+    };
+
+    Device *CreateSystemDefaultDevice();
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef SOFTMETAL_METALKIT_HPP
+#define SOFTMETAL_METALKIT_HPP
+
+// MTK::View without a window: every frame is drawn into the same offscreen
+// drawable, and presenting it hands the pixels to a callback instead of the
+// display.
+
+#include <Metal/Metal.hpp>
+
+namespace MTK
+{
+    class View;
+}
+
+namespace CA
+{
+    class MetalDrawable : public NS::Referencing<MetalDrawable, MTL::Drawable>
+    {
+        public:
+            ~MetalDrawable() { if (_texture) _texture->release(); }
+
+            MTL::Texture *texture() const { return _texture; }
+            void present() override;
+
+        private:
+            friend class MTK::View;
+
+            MTL::Texture *_texture = nullptr;
+            MTK::View *_view = nullptr;
+    };
+}
+
+namespace MTK
+{
+    class ViewDelegate
+    {
+        public:
+            virtual ~ViewDelegate() {}
+            virtual void drawInMTKView( View *view ) {}
+            virtual void drawableSizeWillChange( View *view, CGSize size ) {}
+    };
+
+    class View : public NS::Referencing<View>
+    {
+        public:
+            ~View();
+
+            View *init( CGRect frame, const MTL::Device *device );
+
+            MTL::Device *device() const { return _device; }
+            void setDelegate( const ViewDelegate *delegate ) { _delegate = const_cast<ViewDelegate*>(delegate); }
+            ViewDelegate *delegate() const { return _delegate; }
+
+            void setColorPixelFormat( MTL::PixelFormat format );
+            MTL::PixelFormat colorPixelFormat() const { return _format; }
+            void setClearColor( MTL::ClearColor color ) { _clear = color; }
+            MTL::ClearColor clearColor() const { return _clear; }
+            CGSize drawableSize() const { return CGSize{ (CGFloat)_width, (CGFloat)_height }; }
+
+            CA::MetalDrawable *currentDrawable();
+            MTL::RenderPassDescriptor *currentRenderPassDescriptor();
+
+            // softmetal: called on the queue thread with every presented
+            // frame, and how many there were
+            void setPresentHandler( std::function<void(const MTL::Texture*)> handler ) { _onpresent = handler; }
+            NS::UInteger presentedCount() const { return _presented.load(); }
+
+            // softmetal: runs the delegate's drawInMTKView, in place of the
+            // display link
+            void draw();
+
+        private:
+            friend class CA::MetalDrawable;
+
+            MTL::Device *_device = nullptr;
+            ViewDelegate *_delegate = nullptr;
+            NS::UInteger _width = 0;
+            NS::UInteger _height = 0;
+            MTL::PixelFormat _format = MTL::PixelFormatBGRA8Unorm;
+            MTL::ClearColor _clear = { 0.0, 0.0, 0.0, 1.0 };
+            CA::MetalDrawable *_drawable = nullptr;
+            std::function<void(const MTL::Texture*)> _onpresent;
+            std::atomic<NS::UInteger> _presented{ 0 };
+    };
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef SOFTMETAL_SIMD_H
+#define SOFTMETAL_SIMD_H
+
+// The simd vector types with the size and alignment of Apple's: a float3
+// takes as much room as a float4.
+
+namespace simd
+{
+    struct alignas(8) float2
+    {
+        float x, y;
+    };
+
+    struct alignas(16) float3
+    {
+        float x, y, z;
+    };
+
+    struct alignas(16) float4
+    {
+        float x, y, z, w;
+    };
+}
+
+static_assert(sizeof(simd::float3) == 16, "simd::float3 is padded to 16 bytes");
+
+#endif
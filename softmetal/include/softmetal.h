@@ -0,0 +1,15 @@
+#ifndef SOFTMETAL_H
+#define SOFTMETAL_H
+
+// What only the software Metal device has: it cannot compile Metal shading
+// language, so the compute function of a library runs a CpuKernel instead,
+// the one set here when the pipeline is created. The default is
+// "mandelbrot", the port of shader.metal.
+
+#include <Metal/Metal.hpp>
+
+// Returns false, and changes nothing, for kernels that need more than the
+// uniforms and the grid, like mandelbrot-deep.
+bool softmetal_set_compute_kernel( const CpuKernel *kernel );
+
+#endif
@@ -0,0 +1,973 @@
+#include <Metal/Metal.hpp>
+#include <MetalKit/MetalKit.hpp>
+#include <softmetal.h>
+
+#include "cpukernels.h"
+#include "resolve.h"
+#include "threadpool.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+static thread_local NS::AutoreleasePool *current_pool = nullptr;
+static std::atomic<const CpuKernel*> compute_kernel{ nullptr };
+
+// A reference that commands hold on to, so what they use outlives the
+// encoder and whatever the caller releases in the meantime.
+template <class T>
+class Ref
+{
+    public:
+        Ref( const T *obj = nullptr ) : _obj( const_cast<T*>(obj) ) { if (_obj) _obj->retain(); }
+        Ref( const Ref &other ) : Ref( other._obj ) {}
+        ~Ref() { if (_obj) _obj->release(); }
+        Ref &operator=( const Ref &other )
+        {
+            Ref copy(other);
+            std::swap(_obj, copy._obj);
+            return *this;
+        }
+
+        T *get() const { return _obj; }
+        T *operator->() const { return _obj; }
+        explicit operator bool() const { return _obj != nullptr; }
+
+    private:
+        T *_obj;
+};
+
+// NS
+
+void NS::Object::release()
+{
+    if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
+
+void NS::Object::autoreleaseObject()
+{
+    // like Objective-C without a pool, this leaks
+    if (current_pool)
+        current_pool->addObject(this);
+}
+
+NS::AutoreleasePool::AutoreleasePool()
+: _outer( current_pool )
+{
+    current_pool = this;
+}
+
+NS::AutoreleasePool::~AutoreleasePool()
+{
+    current_pool = _outer;
+    for (Object *obj : _objects)
+        obj->release();
+}
+
+NS::String *NS::String::string( const char *s, StringEncoding encoding )
+{
+    String *str = alloc()->init();
+    str->_s = s;
+    return str->autorelease();
+}
+
+NS::Error *NS::Error::error( const char *description )
+{
+    Error *err = alloc()->init();
+    err->_description = String::string(description, UTF8StringEncoding)->retain();
+    return err->autorelease();
+}
+
+NS::URL *NS::URL::fileURLWithPath( const String *path )
+{
+    URL *url = alloc()->init();
+    url->_path = path->utf8String();
+    return url->autorelease();
+}
+
+NS::Array *NS::Array::array( const Object *obj )
+{
+    Array *a = alloc()->init();
+    Object *o = const_cast<Object*>(obj);
+
+    o->retainObject();
+    a->_objects.push_back(o);
+    return a->autorelease();
+}
+
+NS::Array::~Array()
+{
+    for (Object *obj : _objects)
+        obj->release();
+}
+
+// MTL resources
+
+void MTL::Buffer::didModifyRange( NS::Range range )
+{
+    if (!_managed || range.location >= _cpu.size())
+        return;
+
+    NS::UInteger n = range.length < _cpu.size() - range.location ? range.length : _cpu.size() - range.location;
+    memcpy(_gpu.data() + range.location, _cpu.data() + range.location, n);
+}
+
+void MTL::Texture::replaceRegion( Region region, NS::UInteger level, const void *bytes, NS::UInteger bytesPerRow )
+{
+    const uint8_t *src = static_cast<const uint8_t*>(bytes);
+
+    for (NS::UInteger y = 0; y < region.size.height && region.origin.y + y < _height; ++y)
+    {
+        NS::UInteger n = region.size.width;
+        if (region.origin.x + n > _width)
+            n = _width > region.origin.x ? _width - region.origin.x : 0;
+        memcpy(&_data[((region.origin.y + y) * _width + region.origin.x) * 4], src + y * bytesPerRow, n * 4);
+    }
+}
+
+void MTL::Texture::getBytes( void *bytes, NS::UInteger bytesPerRow, Region region, NS::UInteger level ) const
+{
+    uint8_t *dst = static_cast<uint8_t*>(bytes);
+
+    for (NS::UInteger y = 0; y < region.size.height && region.origin.y + y < _height; ++y)
+    {
+        NS::UInteger n = region.size.width;
+        if (region.origin.x + n > _width)
+            n = _width > region.origin.x ? _width - region.origin.x : 0;
+        memcpy(dst + y * bytesPerRow, &_data[((region.origin.y + y) * _width + region.origin.x) * 4], n * 4);
+    }
+}
+
+// Finds name followed by an opening parenthesis, as an identifier of its own
+MTL::Function *MTL::Library::newFunction( const NS::String *name )
+{
+    const char *n = name->utf8String();
+    size_t len = strlen(n);
+
+    for (size_t at = _source.find(n); at != std::string::npos; at = _source.find(n, at + 1))
+    {
+        size_t end = at + len;
+
+        if (at > 0 && (isalnum((unsigned char)_source[at - 1]) || _source[at - 1] == '_'))
+            continue;
+        while (end < _source.size() && isspace((unsigned char)_source[end]))
+            ++end;
+        if (end >= _source.size() || _source[end] != '(')
+            continue;
+
+        Function *fn = Function::alloc()->init();
+        fn->_name = NS::String::string(n, NS::UTF8StringEncoding)->retain();
+        return fn;
+    }
+    return nullptr;
+}
+
+void MTL::BinaryArchiveDescriptor::setUrl( const NS::URL *url )
+{
+    NS::URL *old = _url;
+
+    _url = url ? const_cast<NS::URL*>(url)->retain() : nullptr;
+    if (old)
+        old->release();
+}
+
+bool MTL::BinaryArchive::addComputePipelineFunctions( const ComputePipelineDescriptor *descriptor, NS::Error **error )
+{
+    _functions += std::string(descriptor->computeFunction()->name()->utf8String()) + "\n";
+    return true;
+}
+
+bool MTL::BinaryArchive::addRenderPipelineFunctions( const RenderPipelineDescriptor *descriptor, NS::Error **error )
+{
+    _functions += std::string(descriptor->vertexFunction()->name()->utf8String()) + "\n";
+    _functions += std::string(descriptor->fragmentFunction()->name()->utf8String()) + "\n";
+    return true;
+}
+
+bool MTL::BinaryArchive::serializeToURL( const NS::URL *url, NS::Error **error )
+{
+    FILE *fd = fopen(url->fileSystemRepresentation(), "wb");
+
+    if (!fd)
+    {
+        *error = NS::Error::error("Cannot write binary archive");
+        return false;
+    }
+
+    bool failed = fwrite(_functions.data(), 1, _functions.size(), fd) != _functions.size();
+    if (fclose(fd) || failed)
+    {
+        *error = NS::Error::error("Cannot write binary archive");
+        return false;
+    }
+    return true;
+}
+
+void MTL::RenderPassColorAttachmentDescriptor::setTexture( Texture *texture )
+{
+    Texture *old = _texture;
+
+    _texture = texture ? texture->retain() : nullptr;
+    if (old)
+        old->release();
+}
+
+// Execution
+
+// what a write of a color channel to a unorm8 format stores
+static inline uint8_t unorm8(float c)
+{
+    c = c < 0.0f ? 0.0f : (c > 1.0f ? 1.0f : c);
+    return (uint8_t)(c * 255.0f + 0.5f);
+}
+
+// the same for an _sRGB format, which encodes linear values
+static inline uint8_t srgb8(float c)
+{
+    static const std::vector<uint8_t> lut = []{
+        std::vector<uint8_t> v(4097);
+        for (unsigned i = 0; i <= 4096; ++i)
+        {
+            float l = i / 4096.0f;
+            v[i] = unorm8(l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f);
+        }
+        return v;
+    }();
+
+    c = c < 0.0f ? 0.0f : (c > 1.0f ? 1.0f : c);
+    return lut[(unsigned)(c * 4096.0f + 0.5f)];
+}
+
+static void store_pixel(MTL::PixelFormat format, uint8_t *out, const float rgba[4])
+{
+    switch (format)
+    {
+        case MTL::PixelFormatBGRA8Unorm_sRGB:
+            out[0] = srgb8(rgba[2]);
+            out[1] = srgb8(rgba[1]);
+            out[2] = srgb8(rgba[0]);
+            out[3] = unorm8(rgba[3]);
+            break;
+        case MTL::PixelFormatBGRA8Unorm:
+            out[0] = unorm8(rgba[2]);
+            out[1] = unorm8(rgba[1]);
+            out[2] = unorm8(rgba[0]);
+            out[3] = unorm8(rgba[3]);
+            break;
+        default:
+            out[0] = unorm8(rgba[0]);
+            out[1] = unorm8(rgba[1]);
+            out[2] = unorm8(rgba[2]);
+            out[3] = unorm8(rgba[3]);
+            break;
+    }
+}
+
+// computeMain, by the pipeline's CpuKernel, a row of the grid at a time
+static void run_compute(MTL::Device *device, const CpuKernel *kernel, MTL::Texture *tex,
+        const Uniforms *uniforms, MTL::Size grid)
+{
+    static const CpuColormap colormap = []{
+        CpuColormap map;
+        cpu_build_colormap(CpuPalette(), &map);
+        return map;
+    }();
+
+    unsigned w = (unsigned)grid.width;
+    unsigned h = (unsigned)grid.height;
+    unsigned tw = tex ? (unsigned)tex->width() : 0;
+    unsigned th = tex ? (unsigned)tex->height() : 0;
+    CpuView view = cpu_default_view(w, h);
+    std::vector<float> cx(w + cpu_coord_padding), cy(h + cpu_coord_padding);
+    std::atomic<unsigned> nextrow{ 0 };
+    Uniforms zero = {};
+
+    for (unsigned x = 0; x < w + cpu_coord_padding; ++x)
+        cx[x] = (float)(view.x0 + x * view.stepx);
+    for (unsigned y = 0; y < h + cpu_coord_padding; ++y)
+        cy[y] = (float)(view.y0 + y * view.stepy);
+
+    CpuDispatch d = { w, h, uniforms ? uniforms : &zero, cx.data(), cy.data(), nullptr, true, nullptr };
+
+    device->pool().run([&](unsigned worker) {
+        std::vector<float> field(w);
+        std::vector<uint8_t> rgba((size_t)w * 4);
+        unsigned y;
+
+        while ((y = nextrow.fetch_add(1, std::memory_order_relaxed)) < h)
+        {
+            kernel->eval(&d, y, 0, w, field.data());
+            kernel->colorize(&colormap, field.data(), w, rgba.data());
+            // writes outside the texture are dropped
+            if (y < th)
+                memcpy(tex->data() + (size_t)y * tw * 4, rgba.data(), (size_t)(w < tw ? w : tw) * 4);
+        }
+    });
+}
+
+// resolveMain of resolve.metal, by the Resolver, from the RGBA8 src into the
+// RGBA8 dst
+static void run_resolve(MTL::Device *device, const MTL::Texture *src, MTL::Texture *dst,
+        const ResolveParams *params)
+{
+    Resolver resolver;
+
+    if (!src || !dst || !params || resolver.setup((unsigned)src->width(), (unsigned)src->height(),
+                (unsigned)dst->width(), (unsigned)dst->height(), (ResolveFilter)params->filter))
+        return;
+    resolver.resolve(src->data(), dst->data(), &device->pool());
+}
+
+static void clear_texture(MTL::Texture *tex, MTL::ClearColor color)
+{
+    float rgba[4] = { (float)color.red, (float)color.green, (float)color.blue, (float)color.alpha };
+    uint8_t px[4];
+    uint8_t *p = tex->data();
+
+    store_pixel(tex->pixelFormat(), px, rgba);
+    for (size_t i = 0, n = tex->width() * tex->height(); i < n; ++i, p += 4)
+        memcpy(p, px, 4);
+}
+
+// a region of tex into rows of dst, bytesperrow apart
+static void copy_texture(const MTL::Texture *tex, MTL::Origin origin, MTL::Size size,
+        uint8_t *dst, NS::UInteger bytesperrow)
+{
+    size_t tw = tex->width();
+
+    for (NS::UInteger y = 0; y < size.height; ++y)
+        memcpy(dst + y * bytesperrow, tex->data() + ((origin.y + y) * tw + origin.x) * 4, size.width * 4);
+}
+
+static inline float texel(const MTL::Texture *tex, long x, long y, unsigned c)
+{
+    long w = (long)tex->width(), h = (long)tex->height();
+
+    // address::repeat
+    x = ((x % w) + w) % w;
+    y = ((y % h) + h) % h;
+    return tex->data()[(y * w + x) * 4 + c] * (1.0f / 255.0f);
+}
+
+// tex.sample() with filter::linear and address::repeat, of an RGBA texture
+static void sample_linear(const MTL::Texture *tex, float u, float v, float out[4])
+{
+    float x = u * tex->width() - 0.5f;
+    float y = v * tex->height() - 0.5f;
+    long x0 = (long)floorf(x), y0 = (long)floorf(y);
+    float fx = x - x0, fy = y - y0;
+
+    for (unsigned c = 0; c < 4; ++c)
+    {
+        float top = texel(tex, x0, y0, c) * (1.0f - fx) + texel(tex, x0 + 1, y0, c) * fx;
+        float bottom = texel(tex, x0, y0 + 1, c) * (1.0f - fx) + texel(tex, x0 + 1, y0 + 1, c) * fx;
+        out[c] = top * (1.0f - fy) + bottom * fy;
+    }
+}
+
+struct DrawCall
+{
+    Ref<MTL::Texture> target;
+    Ref<MTL::Texture> texture;
+    Ref<MTL::Buffer> positions;
+    Ref<MTL::Buffer> uvs;
+    Ref<MTL::Buffer> indices;
+    NS::UInteger positionoffset, uvoffset, indexoffset;
+    NS::UInteger count;
+    MTL::IndexType indextype;
+};
+
+// vertexMain and fragmentMain of quad.metal: positions are float3 in
+// buffer(0), texture coordinates float2 in buffer(2), and each fragment is
+// the texture sampled at its interpolated coordinate
+static void run_draw(MTL::Device *device, const DrawCall &dc)
+{
+    MTL::Texture *target = dc.target.get();
+    const uint8_t *idx = dc.indices->gpuContents() + dc.indexoffset;
+    const uint8_t *pos = dc.positions->gpuContents() + dc.positionoffset;
+    const uint8_t *uv = dc.uvs->gpuContents() + dc.uvoffset;
+    float tw = (float)target->width(), th = (float)target->height();
+
+    for (NS::UInteger t = 0; t + 3 <= dc.count; t += 3)
+    {
+        float sx[3], sy[3], su[3], sv[3];
+
+        for (unsigned k = 0; k < 3; ++k)
+        {
+            uint32_t i = dc.indextype == MTL::IndexTypeUInt16
+                ? ((const uint16_t*)idx)[t + k] : ((const uint32_t*)idx)[t + k];
+            const float *p = (const float*)(pos + i * 16);
+            const float *q = (const float*)(uv + i * 8);
+
+            // normalized device coordinates to pixels, y pointing down
+            sx[k] = (p[0] + 1.0f) * 0.5f * tw;
+            sy[k] = (1.0f - p[1]) * 0.5f * th;
+            su[k] = q[0];
+            sv[k] = q[1];
+        }
+
+        float area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sx[2] - sx[0]) * (sy[1] - sy[0]);
+        if (area == 0.0f)
+            continue;
+
+        long x0 = (long)floorf(fminf(sx[0], fminf(sx[1], sx[2])));
+        long x1 = (long)ceilf(fmaxf(sx[0], fmaxf(sx[1], sx[2])));
+        long y0 = (long)floorf(fminf(sy[0], fminf(sy[1], sy[2])));
+        long y1 = (long)ceilf(fmaxf(sy[0], fmaxf(sy[1], sy[2])));
+        x0 = x0 < 0 ? 0 : x0;
+        y0 = y0 < 0 ? 0 : y0;
+        x1 = x1 > (long)tw ? (long)tw : x1;
+        y1 = y1 > (long)th ? (long)th : y1;
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+
+        std::atomic<long> nextrow{ y0 };
+
+        device->pool().run([&](unsigned worker) {
+            long y;
+
+            while ((y = nextrow.fetch_add(1, std::memory_order_relaxed)) < y1)
+            {
+                float py = y + 0.5f;
+                uint8_t *row = target->data() + (size_t)y * target->width() * 4;
+
+                for (long x = x0; x < x1; ++x)
+                {
+                    float px = x + 0.5f;
+                    float w0 = ((sx[1] - px) * (sy[2] - py) - (sx[2] - px) * (sy[1] - py)) / area;
+                    float w1 = ((sx[2] - px) * (sy[0] - py) - (sx[0] - px) * (sy[2] - py)) / area;
+                    float w2 = 1.0f - w0 - w1;
+                    float color[4];
+
+                    if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+                        continue;
+
+                    sample_linear(dc.texture.get(), w0 * su[0] + w1 * su[1] + w2 * su[2],
+                            w0 * sv[0] + w1 * sv[1] + w2 * sv[2], color);
+                    store_pixel(target->pixelFormat(), row + x * 4, color);
+                }
+            }
+        });
+    }
+}
+
+// Encoders
+
+MTL::ComputeCommandEncoder::~ComputeCommandEncoder()
+{
+    if (_pso)
+        _pso->release();
+    for (Texture *t : _textures)
+        if (t)
+            t->release();
+    if (_buffer0)
+        _buffer0->release();
+}
+
+void MTL::ComputeCommandEncoder::setComputePipelineState( const ComputePipelineState *pso )
+{
+    ComputePipelineState *old = _pso;
+
+    _pso = const_cast<ComputePipelineState*>(pso)->retain();
+    if (old)
+        old->release();
+}
+
+void MTL::ComputeCommandEncoder::setTexture( const Texture *texture, NS::UInteger index )
+{
+    if (index >= compute_textures)
+        return;
+    Texture *old = _textures[index];
+
+    _textures[index] = texture ? const_cast<Texture*>(texture)->retain() : nullptr;
+    if (old)
+        old->release();
+}
+
+void MTL::ComputeCommandEncoder::setBuffer( const Buffer *buffer, NS::UInteger offset, NS::UInteger index )
+{
+    if (index != 0)
+        return;
+    Buffer *old = _buffer0;
+
+    _buffer0 = buffer ? const_cast<Buffer*>(buffer)->retain() : nullptr;
+    if (old)
+        old->release();
+    _offset0 = offset;
+}
+
+void MTL::ComputeCommandEncoder::dispatchThreads( Size threadsPerGrid, Size threadsPerThreadgroup )
+{
+    Ref<ComputePipelineState> pso(_pso);
+    Ref<Texture> texture(_textures[0]);
+    Ref<Texture> target(_textures[1]);
+    Ref<Buffer> buffer(_buffer0);
+    NS::UInteger offset = _offset0;
+    Device *device = CommandEncoder::_buffer->device();
+
+    CommandEncoder::_buffer->record([=]() {
+        if (pso->resolves())
+        {
+            const ResolveParams *params = buffer
+                ? reinterpret_cast<const ResolveParams*>(buffer->gpuContents() + offset) : nullptr;
+            run_resolve(device, texture.get(), target.get(), params);
+            return;
+        }
+        const Uniforms *u = buffer ? reinterpret_cast<const Uniforms*>(buffer->gpuContents() + offset) : nullptr;
+        run_compute(device, pso->kernel(), texture.get(), u, threadsPerGrid);
+    });
+}
+
+MTL::RenderCommandEncoder::~RenderCommandEncoder()
+{
+    if (_target)
+        _target->release();
+    if (_pso)
+        _pso->release();
+    for (Buffer *b : _vertexbuffers)
+        if (b)
+            b->release();
+    if (_fragmenttexture)
+        _fragmenttexture->release();
+}
+
+void MTL::RenderCommandEncoder::setRenderPipelineState( const RenderPipelineState *pso )
+{
+    RenderPipelineState *old = _pso;
+
+    _pso = const_cast<RenderPipelineState*>(pso)->retain();
+    if (old)
+        old->release();
+}
+
+void MTL::RenderCommandEncoder::setVertexBuffer( const Buffer *buffer, NS::UInteger offset, NS::UInteger index )
+{
+    if (index >= vertex_buffers)
+        return;
+    Buffer *old = _vertexbuffers[index];
+
+    _vertexbuffers[index] = buffer ? const_cast<Buffer*>(buffer)->retain() : nullptr;
+    if (old)
+        old->release();
+    _vertexoffsets[index] = offset;
+}
+
+void MTL::RenderCommandEncoder::setFragmentTexture( const Texture *texture, NS::UInteger index )
+{
+    if (index != 0)
+        return;
+    Texture *old = _fragmenttexture;
+
+    _fragmenttexture = texture ? const_cast<Texture*>(texture)->retain() : nullptr;
+    if (old)
+        old->release();
+}
+
+void MTL::RenderCommandEncoder::drawIndexedPrimitives( PrimitiveType type, NS::UInteger indexCount,
+        IndexType indexType, const Buffer *indexBuffer, NS::UInteger indexBufferOffset )
+{
+    DrawCall dc;
+    Device *device = CommandEncoder::_buffer->device();
+
+    assert(type == PrimitiveTypeTriangle && "softmetal only draws triangles");
+    if (!_target || !_pso || !_vertexbuffers[0] || !_vertexbuffers[2] || !_fragmenttexture)
+        return;
+
+    dc.target = Ref<Texture>(_target);
+    dc.texture = Ref<Texture>(_fragmenttexture);
+    dc.positions = Ref<Buffer>(_vertexbuffers[0]);
+    dc.uvs = Ref<Buffer>(_vertexbuffers[2]);
+    dc.indices = Ref<Buffer>(indexBuffer);
+    dc.positionoffset = _vertexoffsets[0];
+    dc.uvoffset = _vertexoffsets[2];
+    dc.indexoffset = indexBufferOffset;
+    dc.count = indexCount;
+    dc.indextype = indexType;
+
+    CommandEncoder::_buffer->record([=]() {
+        run_draw(device, dc);
+    });
+}
+
+void MTL::BlitCommandEncoder::copyFromTexture( const Texture *sourceTexture, NS::UInteger sourceSlice,
+        NS::UInteger sourceLevel, Origin sourceOrigin, Size sourceSize, const Buffer *destinationBuffer,
+        NS::UInteger destinationOffset, NS::UInteger destinationBytesPerRow,
+        NS::UInteger destinationBytesPerImage )
+{
+    Ref<Texture> texture(sourceTexture);
+    Ref<Buffer> buffer(destinationBuffer);
+
+    assert(sourceOrigin.x + sourceSize.width <= sourceTexture->width()
+            && sourceOrigin.y + sourceSize.height <= sourceTexture->height() && "copy outside the texture");
+    CommandEncoder::_buffer->record([=]() {
+        copy_texture(texture.get(), sourceOrigin, sourceSize,
+                buffer->gpuContents() + destinationOffset, destinationBytesPerRow);
+    });
+}
+
+// Command buffers and queues
+
+MTL::CommandBuffer::~CommandBuffer()
+{
+}
+
+MTL::ComputeCommandEncoder *MTL::CommandBuffer::computeCommandEncoder()
+{
+    ComputeCommandEncoder *enc = ComputeCommandEncoder::alloc()->init();
+    enc->CommandEncoder::_buffer = this;
+    return enc->autorelease();
+}
+
+MTL::RenderCommandEncoder *MTL::CommandBuffer::renderCommandEncoder( const RenderPassDescriptor *descriptor )
+{
+    RenderCommandEncoder *enc = RenderCommandEncoder::alloc()->init();
+    RenderPassColorAttachmentDescriptor *color =
+        const_cast<RenderPassDescriptor*>(descriptor)->colorAttachments()->object(0);
+
+    enc->CommandEncoder::_buffer = this;
+    if (color->texture())
+    {
+        enc->_target = color->texture()->retain();
+        if (color->loadAction() == LoadActionClear)
+        {
+            Ref<Texture> target(color->texture());
+            ClearColor clear = color->clearColor();
+            record([=]() { clear_texture(target.get(), clear); });
+        }
+    }
+    return enc->autorelease();
+}
+
+MTL::BlitCommandEncoder *MTL::CommandBuffer::blitCommandEncoder()
+{
+    BlitCommandEncoder *enc = BlitCommandEncoder::alloc()->init();
+    enc->CommandEncoder::_buffer = this;
+    return enc->autorelease();
+}
+
+void MTL::CommandBuffer::presentDrawable( const Drawable *drawable )
+{
+    Ref<Drawable> d(drawable);
+    record([=]() { d->present(); });
+}
+
+void MTL::CommandBuffer::addCompletedHandler( const std::function<void(CommandBuffer*)> &handler )
+{
+    _handlers.push_back(handler);
+}
+
+void MTL::CommandBuffer::commit()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _status = CommandBufferStatusCommitted;
+    }
+    _queue->enqueue(this);
+}
+
+void MTL::CommandBuffer::waitUntilCompleted()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [this]{ return _status == CommandBufferStatusCompleted; });
+}
+
+MTL::CommandBufferStatus MTL::CommandBuffer::status() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _status;
+}
+
+void MTL::CommandBuffer::execute()
+{
+    for (SoftCommand &c : _commands)
+        c();
+    _commands.clear();
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _status = CommandBufferStatusCompleted;
+    }
+    _done.notify_all();
+
+    for (auto &h : _handlers)
+        h(this);
+    _handlers.clear();
+}
+
+MTL::CommandBuffer *MTL::CommandQueue::commandBuffer()
+{
+    CommandBuffer *buf = CommandBuffer::alloc()->init();
+    buf->_device = _device;
+    buf->_queue = this;
+    return buf->autorelease();
+}
+
+void MTL::CommandQueue::start( Device *device )
+{
+    _device = device->retain();
+    _thread = std::thread(&CommandQueue::run, this);
+}
+
+void MTL::CommandQueue::enqueue( CommandBuffer *buffer )
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending.push_back(buffer->retain());
+    }
+    _wake.notify_one();
+}
+
+void MTL::CommandQueue::run()
+{
+    for (;;)
+    {
+        CommandBuffer *buf;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this]{ return _quit || !_pending.empty(); });
+            // what was committed still runs
+            if (_pending.empty())
+                return;
+            buf = _pending.front();
+            _pending.pop_front();
+        }
+
+        buf->execute();
+        buf->release();
+    }
+}
+
+MTL::CommandQueue::~CommandQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _wake.notify_one();
+    if (_thread.joinable())
+        _thread.join();
+    if (_device)
+        _device->release();
+}
+
+// Device
+
+MTL::Device::Device()
+: _pool( new ThreadPool(0) )
+{
+}
+
+MTL::Device::~Device()
+{
+}
+
+NS::String *MTL::Device::name() const
+{
+    return NS::String::string("softmetal", NS::UTF8StringEncoding);
+}
+
+MTL::Buffer *MTL::Device::newBuffer( NS::UInteger length, ResourceOptions options )
+{
+    Buffer *buf = Buffer::alloc()->init();
+
+    buf->_cpu.resize(length);
+    buf->_managed = (options & 0xf0) == ResourceStorageModeManaged;
+    if (buf->_managed)
+        buf->_gpu.resize(length);
+    return buf;
+}
+
+MTL::Texture *MTL::Device::newTexture( const TextureDescriptor *descriptor )
+{
+    Texture *tex = Texture::alloc()->init();
+
+    tex->_width = descriptor->width();
+    tex->_height = descriptor->height();
+    tex->_format = descriptor->pixelFormat();
+    tex->_data.resize(tex->_width * tex->_height * 4);
+    return tex;
+}
+
+MTL::CommandQueue *MTL::Device::newCommandQueue()
+{
+    CommandQueue *queue = CommandQueue::alloc()->init();
+    queue->start(this);
+    return queue;
+}
+
+// There is no compiler for Metal shading language, the source is kept for
+// newFunction to look up names in.
+MTL::Library *MTL::Device::newLibrary( const NS::String *source, const CompileOptions *options, NS::Error **error )
+{
+    Library *lib = Library::alloc()->init();
+    lib->_source = source->utf8String();
+    return lib;
+}
+
+MTL::ComputePipelineState *MTL::Device::newComputePipelineState( const Function *fn, NS::Error **error )
+{
+    ComputePipelineDescriptor *desc = ComputePipelineDescriptor::alloc()->init();
+    ComputePipelineState *pso;
+
+    desc->setComputeFunction(fn);
+    pso = newComputePipelineState(desc, PipelineOptionNone, nullptr, error);
+    desc->release();
+    return pso;
+}
+
+MTL::ComputePipelineState *MTL::Device::newComputePipelineState( const ComputePipelineDescriptor *descriptor,
+        PipelineOption options, const void *reflection, NS::Error **error )
+{
+    const CpuKernel *kernel = compute_kernel.load();
+    const Function *fn = descriptor->computeFunction();
+
+    // the one other compute function the renderer has
+    if (fn && !strcmp(fn->name()->utf8String(), "resolveMain"))
+    {
+        ComputePipelineState *pso = ComputePipelineState::alloc()->init();
+        pso->_resolves = true;
+        return pso;
+    }
+
+    if (!kernel)
+        kernel = cpu_find_kernel("mandelbrot");
+    if (!fn || !kernel)
+    {
+        if (error)
+            *error = NS::Error::error("No compute function");
+        return nullptr;
+    }
+
+    ComputePipelineState *pso = ComputePipelineState::alloc()->init();
+    pso->_kernel = kernel;
+    return pso;
+}
+
+MTL::RenderPipelineState *MTL::Device::newRenderPipelineState( const RenderPipelineDescriptor *descriptor,
+        NS::Error **error )
+{
+    return newRenderPipelineState(descriptor, PipelineOptionNone, nullptr, error);
+}
+
+MTL::RenderPipelineState *MTL::Device::newRenderPipelineState( const RenderPipelineDescriptor *descriptor,
+        PipelineOption options, const void *reflection, NS::Error **error )
+{
+    if (!descriptor->vertexFunction() || !descriptor->fragmentFunction())
+    {
+        if (error)
+            *error = NS::Error::error("Missing vertex or fragment function");
+        return nullptr;
+    }
+
+    RenderPipelineState *pso = RenderPipelineState::alloc()->init();
+    pso->_format = const_cast<RenderPipelineDescriptor*>(descriptor)->colorAttachments()->object(0)->pixelFormat();
+    return pso;
+}
+
+MTL::BinaryArchive *MTL::Device::newBinaryArchive( const BinaryArchiveDescriptor *descriptor, NS::Error **error )
+{
+    BinaryArchive *archive = BinaryArchive::alloc()->init();
+
+    if (descriptor->url())
+    {
+        FILE *fd = fopen(descriptor->url()->fileSystemRepresentation(), "rb");
+        char buf[4096];
+        size_t n;
+
+        if (!fd)
+        {
+            archive->release();
+            if (error)
+                *error = NS::Error::error("Cannot read binary archive");
+            return nullptr;
+        }
+        while ((n = fread(buf, 1, sizeof(buf), fd)) > 0)
+            archive->_functions.append(buf, n);
+        fclose(fd);
+    }
+    return archive;
+}
+
+MTL::Device *MTL::CreateSystemDefaultDevice()
+{
+    return Device::alloc()->init();
+}
+
+bool softmetal_set_compute_kernel( const CpuKernel *kernel )
+{
+    if (!kernel || (kernel->flags & CpuKernelDeepZoom))
+        return false;
+    compute_kernel = kernel;
+    return true;
+}
+
+// MetalKit
+
+void CA::MetalDrawable::present()
+{
+    _view->_presented++;
+    if (_view->_onpresent)
+        _view->_onpresent(_texture);
+}
+
+MTK::View *MTK::View::init( CGRect frame, const MTL::Device *device )
+{
+    _device = const_cast<MTL::Device*>(device)->retain();
+    _width = (NS::UInteger)frame.size.width;
+    _height = (NS::UInteger)frame.size.height;
+    return this;
+}
+
+MTK::View::~View()
+{
+    if (_drawable)
+        _drawable->release();
+    if (_device)
+        _device->release();
+}
+
+void MTK::View::setColorPixelFormat( MTL::PixelFormat format )
+{
+    _format = format;
+    // made again with the new format when next asked for
+    if (_drawable)
+        _drawable->release();
+    _drawable = nullptr;
+}
+
+CA::MetalDrawable *MTK::View::currentDrawable()
+{
+    if (!_drawable)
+    {
+        MTL::TextureDescriptor *td = MTL::TextureDescriptor::alloc()->init();
+
+        td->setWidth(_width);
+        td->setHeight(_height);
+        td->setPixelFormat(_format);
+
+        _drawable = CA::MetalDrawable::alloc()->init();
+        _drawable->_texture = _device->newTexture(td);
+        _drawable->_view = this;
+        td->release();
+    }
+    return _drawable;
+}
+
+MTL::RenderPassDescriptor *MTK::View::currentRenderPassDescriptor()
+{
+    MTL::RenderPassDescriptor *rpd = MTL::RenderPassDescriptor::renderPassDescriptor();
+    MTL::RenderPassColorAttachmentDescriptor *color = rpd->colorAttachments()->object(0);
+
+    color->setTexture(currentDrawable()->texture());
+    color->setLoadAction(MTL::LoadActionClear);
+    color->setClearColor(_clear);
+    return rpd;
+}
+
+void MTK::View::draw()
+{
+    if (_delegate)
+        _delegate->drawInMTKView(this);
+}
@@ -0,0 +1,87 @@
+#include "asyncbuild.h"
+#include "trace.h"
+
+#include <stdlib.h>
+
+AsyncBuilder::AsyncBuilder( BuildFn build, DestroyFn destroy )
+: _build( build )
+, _destroy( destroy )
+{
+    _thread = std::thread(&AsyncBuilder::run, this);
+}
+
+AsyncBuilder::~AsyncBuilder()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+        // make any build in flight give up
+        _generation++;
+    }
+    _wake.notify_one();
+    _thread.join();
+
+    free(_pending);
+
+    void *product = _ready.exchange(nullptr);
+    if (product)
+        _destroy(product);
+}
+
+void AsyncBuilder::submit( char *src )
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // an older source that never got started is simply dropped
+        free(_pending);
+        _pending = src;
+        _generation++;
+    }
+    _wake.notify_one();
+}
+
+void *AsyncBuilder::take()
+{
+    // cheap check first, so an idle frame does not even write the cache line
+    if (!_ready.load(std::memory_order_relaxed))
+        return nullptr;
+    return _ready.exchange(nullptr, std::memory_order_acquire);
+}
+
+void AsyncBuilder::run()
+{
+    trace_set_thread_name("shader builder");
+
+    for (;;)
+    {
+        char *src;
+        unsigned long generation;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this]{ return _quit || _pending; });
+            if (_quit)
+                return;
+            src = _pending;
+            _pending = nullptr;
+            generation = _generation;
+        }
+
+        void *product = _build(src, generation);
+        free(src);
+
+        if (!product)
+            continue;
+
+        if (superseded(generation))
+        {
+            _destroy(product);
+            continue;
+        }
+
+        // replaces a product the frame loop has not picked up yet
+        void *old = _ready.exchange(product, std::memory_order_acq_rel);
+        if (old)
+            _destroy(old);
+    }
+}
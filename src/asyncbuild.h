@@ -0,0 +1,57 @@
+#ifndef METALTOY_ASYNCBUILD_H
+#define METALTOY_ASYNCBUILD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Builds products (pipelines, kernels, ...) from source on a worker thread so
+// the frame loop never waits on a compiler.
+//
+// Only the newest source matters. Submitting cancels whatever is in flight:
+// the build function can poll superseded() to give up early, and a product
+// built from stale source is destroyed instead of published. Finished
+// products are handed over through a single atomic slot, so the frame loop
+// picks them up with one exchange and keeps using its previous product until
+// then. Failed builds publish nothing.
+class AsyncBuilder
+{
+    public:
+        // Returns the product, or nullptr on failure or cancellation.
+        typedef std::function<void*(const char *src, unsigned long generation)> BuildFn;
+        typedef std::function<void(void *product)> DestroyFn;
+
+        AsyncBuilder( BuildFn build, DestroyFn destroy );
+        ~AsyncBuilder();
+
+        // Queues src for building. Takes ownership of src, which must come
+        // from malloc.
+        void submit( char *src );
+
+        // The newest finished product, or nullptr if there is none since the
+        // last call. The caller owns the result.
+        void *take();
+
+        // True if a newer source was submitted after the given generation.
+        bool superseded( unsigned long generation ) const
+        {
+            return generation != _generation.load(std::memory_order_relaxed);
+        }
+
+    private:
+        void run();
+
+        BuildFn _build;
+        DestroyFn _destroy;
+        std::atomic<void*> _ready{ nullptr };
+        std::atomic<unsigned long> _generation{ 0 };
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        char *_pending = nullptr; // guarded by _mutex
+        bool _quit = false;       // guarded by _mutex
+        std::thread _thread;
+};
+
+#endif
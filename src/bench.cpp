@@ -0,0 +1,646 @@
+// metaltoy-bench: runs the cpu kernels headlessly over a sweep of resolutions,
+// thread counts and kernel variants and reports their throughput as JSON.
+// Given a baseline report from an earlier run, it also flags statistically
+// significant regressions and exits with status 2 if there are any.
+
+#include "cpurenderer.h"
+#include "mandelbrot.h"
+#include "trace.h"
+
+#include <chrono>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options
+{
+    std::vector<unsigned> sizes = { 256, 1024, 4096 };
+    std::vector<unsigned> threads;       // default: 1, 2, 4, ... hardware threads
+    std::vector<std::string> kernels;    // default: all
+    unsigned reps = 5;
+    unsigned warmup = 1;
+    const char *out = nullptr;           // stdout if null
+    const char *baseline = nullptr;
+    double threshold = 3.0;              // percent slowdown that counts
+    double alpha = 0.05;                 // significance level
+    bool quiet = false;
+    bool interiorchecks = true;
+    CpuSubdivision subdivision = CpuSubdivisionOff;
+};
+
+// --subdivide values, by CpuSubdivision
+static const char *subdivision_names[] = { "off", "interior", "any", "interior-approx" };
+
+struct Result
+{
+    std::string kernel;
+    unsigned width, height, threads;
+    std::vector<double> mpix;   // one sample per rep
+    double iterations = 0.0;    // done per frame, 0 if the kernel does not count them
+    double mean = 0.0, stddev = 0.0, min = 0.0, max = 0.0;
+    double nsperiteration = 0.0;
+};
+
+static inline double getCurrentTimeInSeconds()
+{
+    using Clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: metaltoy-bench [options]\n"
+        "  --sizes a,b,...    square resolutions to render (default 256,1024,4096)\n"
+        "  --threads a,b,...  thread counts (default powers of two up to all threads)\n"
+        "  --kernels a,b,...  kernel names (default all)\n"
+        "  --reps n           measured frames per configuration (default 5)\n"
+        "  --warmup n         unmeasured frames first (default 1)\n"
+        "  --out file         write the JSON report there instead of stdout\n"
+        "  --baseline file    compare against an earlier report, run with the same\n"
+        "                     --no-interior-checks and --subdivide\n"
+        "  --threshold pct    slowdown that counts as a regression (default 3)\n"
+        "  --alpha p          significance level of the comparison (default 0.05)\n"
+        "  --no-interior-checks  iterate mandelbrot pixels inside the set in full\n"
+        "  --subdivide mode   off, interior, any or interior-approx (default off).\n"
+        "                     interior is exact. interior-approx fills more and\n"
+        "                     misses a few pixels per million, any can also paint\n"
+        "                     over detail inside a band\n"
+        "  -q                 no progress output\n");
+}
+
+static std::vector<std::string> split_list(const char *s)
+{
+    std::vector<std::string> v;
+    const char *start = s;
+
+    for (;; ++s)
+    {
+        if (*s == ',' || *s == '\0')
+        {
+            if (s > start)
+                v.emplace_back(start, s - start);
+            if (*s == '\0')
+                break;
+            start = s + 1;
+        }
+    }
+    return v;
+}
+
+static std::vector<unsigned> split_uints(const char *s)
+{
+    std::vector<unsigned> v;
+    for (const std::string &item : split_list(s))
+        v.push_back((unsigned)strtoul(item.c_str(), nullptr, 10));
+    return v;
+}
+
+static void summarize(Result *r)
+{
+    size_t n = r->mpix.size();
+    double sum = 0.0, sq = 0.0;
+
+    r->min = r->max = r->mpix[0];
+    for (double x : r->mpix)
+    {
+        sum += x;
+        r->min = x < r->min ? x : r->min;
+        r->max = x > r->max ? x : r->max;
+    }
+    r->mean = sum / n;
+
+    for (double x : r->mpix)
+        sq += (x - r->mean) * (x - r->mean);
+    r->stddev = n > 1 ? sqrt(sq / (n - 1)) : 0.0;
+
+    // cpu time per iteration, comparable across thread counts
+    if (r->iterations > 0.0)
+    {
+        double seconds = (double)r->width * r->height / (r->mean * 1e6);
+        r->nsperiteration = seconds * r->threads * 1e9 / r->iterations;
+    }
+}
+
+static Result run_one(const CpuKernel *kernel, unsigned size, unsigned threads, const Options &opts)
+{
+    Result r;
+    CpuRenderer renderer(size, size, threads);
+
+    r.kernel = kernel->name;
+    r.width = size;
+    r.height = size;
+    r.threads = renderer.threadCount();
+
+    renderer.setKernel(kernel);
+    renderer.setInteriorChecks(opts.interiorchecks);
+    renderer.setSubdivision(opts.subdivision);
+
+    for (unsigned i = 0; i < opts.warmup + opts.reps; ++i)
+    {
+        // every frame has to do all the work
+        renderer.invalidate();
+        renderer.generateTexture(0.0f);
+
+        if (i >= opts.warmup)
+            r.mpix.push_back(renderer.megapixelsPerSecond());
+    }
+
+    // The iterations the kernel ran, as its rows report them. The field
+    // would count pixels the interior checks or subdivision settled as
+    // the full maximum they never ran.
+    if (kernel->flags & CpuKernelIterations)
+        r.iterations = (double)renderer.scheduler().totalCost();
+
+    summarize(&r);
+    return r;
+}
+
+// Minimal JSON reader, enough for reading back our own reports.
+
+struct Json
+{
+    enum Type { Null, Bool, Number, String, Array, Object } type = Null;
+    double number = 0.0;
+    std::string string;
+    std::vector<Json> items;
+    std::vector<std::string> keys; // parallel to items for objects
+
+    const Json *get(const char *key) const
+    {
+        for (size_t i = 0; i < keys.size(); ++i)
+            if (keys[i] == key)
+                return &items[i];
+        return nullptr;
+    }
+};
+
+static void skip_space(const char **p)
+{
+    while (isspace((unsigned char)**p))
+        ++*p;
+}
+
+// return 0 on success
+static int parse_json(const char **p, Json *out)
+{
+    skip_space(p);
+
+    switch (**p)
+    {
+        case '{':
+        case '[':
+        {
+            bool object = **p == '{';
+            char close = object ? '}' : ']';
+
+            out->type = object ? Json::Object : Json::Array;
+            ++*p;
+            skip_space(p);
+            if (**p == close)
+            {
+                ++*p;
+                return 0;
+            }
+
+            for (;;)
+            {
+                Json value;
+
+                if (object)
+                {
+                    Json key;
+                    if (parse_json(p, &key) || key.type != Json::String)
+                        return -1;
+                    skip_space(p);
+                    if (*(*p)++ != ':')
+                        return -1;
+                    out->keys.push_back(key.string);
+                }
+
+                if (parse_json(p, &value))
+                    return -1;
+                out->items.push_back(std::move(value));
+
+                skip_space(p);
+                if (**p == ',')
+                {
+                    ++*p;
+                    continue;
+                }
+                if (*(*p)++ != close)
+                    return -1;
+                return 0;
+            }
+        }
+        case '"':
+            out->type = Json::String;
+            for (++*p; **p && **p != '"'; ++*p)
+            {
+                // our reports only escape quotes and backslashes
+                if (**p == '\\' && (*p)[1])
+                    ++*p;
+                out->string += **p;
+            }
+            if (**p != '"')
+                return -1;
+            ++*p;
+            return 0;
+        case 't':
+        case 'f':
+        case 'n':
+        {
+            static const char *words[] = { "true", "false", "null" };
+            for (const char *w : words)
+            {
+                size_t n = strlen(w);
+                if (!strncmp(*p, w, n))
+                {
+                    out->type = w[0] == 'n' ? Json::Null : Json::Bool;
+                    out->number = w[0] == 't';
+                    *p += n;
+                    return 0;
+                }
+            }
+            return -1;
+        }
+        default:
+        {
+            char *end;
+            out->type = Json::Number;
+            out->number = strtod(*p, &end);
+            if (end == *p)
+                return -1;
+            *p = end;
+            return 0;
+        }
+    }
+}
+
+// settings gets what the baseline was recorded with. return 0 on success
+static int load_baseline(const char *path, std::vector<Result> *out, Options *settings)
+{
+    FILE *fd = fopen(path, "rb");
+    std::string text;
+    char buf[4096];
+    size_t n;
+    Json root;
+    const Json *results;
+
+    if (!fd)
+        return -1;
+    while ((n = fread(buf, 1, sizeof(buf), fd)) > 0)
+        text.append(buf, n);
+    fclose(fd);
+
+    const char *p = text.c_str();
+    if (parse_json(&p, &root) || root.type != Json::Object)
+        return -1;
+
+    results = root.get("results");
+    if (!results || results->type != Json::Array)
+        return -1;
+
+    // reports from before the checks existed iterated every pixel
+    const Json *checks = root.get("interior_checks");
+    settings->interiorchecks = checks && checks->type == Json::Bool && checks->number != 0.0;
+    // and so did those from before subdivision
+    const Json *subdivision = root.get("subdivision");
+    settings->subdivision = CpuSubdivisionOff;
+    if (subdivision && subdivision->type == Json::Number)
+    {
+        if (subdivision->number < CpuSubdivisionOff || subdivision->number > CpuSubdivisionInteriorApprox)
+            return -1;
+        settings->subdivision = (CpuSubdivision)(int)subdivision->number;
+    }
+
+    for (const Json &item : results->items)
+    {
+        const Json *kernel = item.get("kernel");
+        const Json *width = item.get("width");
+        const Json *height = item.get("height");
+        const Json *threads = item.get("threads");
+        const Json *samples = item.get("samples");
+        Result r;
+
+        if (!kernel || !width || !height || !threads || !samples || samples->items.empty())
+            continue;
+
+        r.kernel = kernel->string;
+        r.width = (unsigned)width->number;
+        r.height = (unsigned)height->number;
+        r.threads = (unsigned)threads->number;
+        for (const Json &s : samples->items)
+            r.mpix.push_back(s.number);
+        summarize(&r);
+        out->push_back(r);
+    }
+
+    return 0;
+}
+
+// Continued fraction for the regularized incomplete beta function.
+static double beta_cf(double a, double b, double x)
+{
+    const double tiny = 1e-300;
+    double c = 1.0, d = 1.0 - (a + b) * x / (a + 1.0), h;
+
+    d = fabs(d) < tiny ? tiny : d;
+    d = 1.0 / d;
+    h = d;
+
+    for (int m = 1; m <= 200; ++m)
+    {
+        double m2 = 2.0 * m;
+        double aa = m * (b - m) * x / ((a + m2 - 1.0) * (a + m2));
+
+        d = 1.0 + aa * d;
+        d = fabs(d) < tiny ? tiny : d;
+        c = 1.0 + aa / c;
+        c = fabs(c) < tiny ? tiny : c;
+        d = 1.0 / d;
+        h *= d * c;
+
+        aa = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1.0));
+        d = 1.0 + aa * d;
+        d = fabs(d) < tiny ? tiny : d;
+        c = 1.0 + aa / c;
+        c = fabs(c) < tiny ? tiny : c;
+        d = 1.0 / d;
+
+        double del = d * c;
+        h *= del;
+        if (fabs(del - 1.0) < 1e-12)
+            break;
+    }
+    return h;
+}
+
+static double incomplete_beta(double a, double b, double x)
+{
+    if (x <= 0.0)
+        return 0.0;
+    if (x >= 1.0)
+        return 1.0;
+
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1.0 - x));
+
+    if (x < (a + 1.0) / (a + b + 2.0))
+        return front * beta_cf(a, b, x) / a;
+    return 1.0 - front * beta_cf(b, a, 1.0 - x) / b;
+}
+
+// P(T <= t) for Student's t with df degrees of freedom
+static double student_t_cdf(double t, double df)
+{
+    double tail = 0.5 * incomplete_beta(df / 2.0, 0.5, df / (df + t * t));
+    return t < 0.0 ? tail : 1.0 - tail;
+}
+
+// One-sided Welch t-test of "current is slower than base". Returns the p
+// value.
+static double welch_slower(const Result &current, const Result &base)
+{
+    double n1 = current.mpix.size(), n2 = base.mpix.size();
+    double v1 = current.stddev * current.stddev / n1;
+    double v2 = base.stddev * base.stddev / n2;
+    double se = sqrt(v1 + v2);
+
+    if (n1 < 2 || n2 < 2 || se == 0.0)
+        return current.mean < base.mean ? 0.0 : 1.0;
+
+    double t = (current.mean - base.mean) / se;
+    double df = (v1 + v2) * (v1 + v2) / (v1 * v1 / (n1 - 1) + v2 * v2 / (n2 - 1));
+
+    return student_t_cdf(t, df);
+}
+
+static void write_string(FILE *fd, const std::string &s)
+{
+    fputc('"', fd);
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            fputc('\\', fd);
+        fputc(c, fd);
+    }
+    fputc('"', fd);
+}
+
+int main( int argc, char* argv[] )
+{
+    Options opts;
+    std::vector<Result> results, baseline;
+    unsigned regressions = 0;
+    unsigned hwthreads = std::thread::hardware_concurrency();
+
+    if (!hwthreads)
+        hwthreads = 1;
+
+    trace_init_from_env();
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (!strcmp(arg, "-q"))
+        {
+            opts.quiet = true;
+            continue;
+        }
+        if (!strcmp(arg, "--no-interior-checks"))
+        {
+            opts.interiorchecks = false;
+            continue;
+        }
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help"))
+        {
+            usage();
+            return 0;
+        }
+        if (!val)
+        {
+            usage();
+            return 1;
+        }
+        ++i;
+
+        if (!strcmp(arg, "--sizes")) opts.sizes = split_uints(val);
+        else if (!strcmp(arg, "--threads")) opts.threads = split_uints(val);
+        else if (!strcmp(arg, "--kernels")) opts.kernels = split_list(val);
+        else if (!strcmp(arg, "--reps")) opts.reps = (unsigned)atoi(val);
+        else if (!strcmp(arg, "--warmup")) opts.warmup = (unsigned)atoi(val);
+        else if (!strcmp(arg, "--out")) opts.out = val;
+        else if (!strcmp(arg, "--baseline")) opts.baseline = val;
+        else if (!strcmp(arg, "--threshold")) opts.threshold = atof(val);
+        else if (!strcmp(arg, "--alpha")) opts.alpha = atof(val);
+        else if (!strcmp(arg, "--subdivide"))
+        {
+            int mode = -1;
+
+            for (int m = CpuSubdivisionOff; m <= CpuSubdivisionInteriorApprox; ++m)
+                if (!strcmp(val, subdivision_names[m]))
+                    mode = m;
+            if (mode < 0)
+            {
+                usage();
+                return 1;
+            }
+            opts.subdivision = (CpuSubdivision)mode;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown argument %s\n", arg);
+            usage();
+            return 1;
+        }
+    }
+
+    if (opts.reps == 0)
+        opts.reps = 1;
+
+    if (opts.threads.empty())
+    {
+        for (unsigned t = 1; t < hwthreads; t *= 2)
+            opts.threads.push_back(t);
+        opts.threads.push_back(hwthreads);
+    }
+
+    if (opts.kernels.empty())
+    {
+        unsigned count;
+        const CpuKernel *all = cpu_kernels(&count);
+        for (unsigned i = 0; i < count; ++i)
+            opts.kernels.push_back(all[i].name);
+    }
+
+    for (const std::string &name : opts.kernels)
+    {
+        if (!cpu_find_kernel(name.c_str()))
+        {
+            fprintf(stderr, "No cpu kernel named %s\n", name.c_str());
+            return 1;
+        }
+    }
+
+    if (opts.baseline)
+    {
+        Options recorded;
+
+        if (load_baseline(opts.baseline, &baseline, &recorded))
+        {
+            fprintf(stderr, "Failed to read baseline %s\n", opts.baseline);
+            return 1;
+        }
+
+        // results are matched by kernel, size and threads, so anything else
+        // that changes throughput has to be the same for the whole report
+        if (recorded.interiorchecks != opts.interiorchecks)
+        {
+            fprintf(stderr, "Baseline %s was recorded with interior checks %s, rerun with%s "
+                    "--no-interior-checks\n", opts.baseline, recorded.interiorchecks ? "on" : "off",
+                    recorded.interiorchecks ? "out" : "");
+            return 1;
+        }
+        if (recorded.subdivision != opts.subdivision)
+        {
+            fprintf(stderr, "Baseline %s was recorded with --subdivide %s, this run uses %s\n",
+                    opts.baseline, subdivision_names[recorded.subdivision], subdivision_names[opts.subdivision]);
+            return 1;
+        }
+    }
+
+    for (const std::string &name : opts.kernels)
+    {
+        const CpuKernel *kernel = cpu_find_kernel(name.c_str());
+
+        for (unsigned size : opts.sizes)
+        {
+            for (unsigned threads : opts.threads)
+            {
+                Result r = run_one(kernel, size, threads, opts);
+
+                if (!opts.quiet)
+                    fprintf(stderr, "%-18s %5ux%-5u %3u threads: %9.2f Mpix/s +- %5.1f%%\n",
+                            r.kernel.c_str(), r.width, r.height, r.threads, r.mean,
+                            r.mean > 0.0 ? 100.0 * r.stddev / r.mean : 0.0);
+
+                results.push_back(std::move(r));
+            }
+        }
+    }
+
+    FILE *fd = opts.out ? fopen(opts.out, "w") : stdout;
+    if (!fd)
+    {
+        fprintf(stderr, "Failed to open %s\n", opts.out);
+        return 1;
+    }
+
+    fprintf(fd, "{\n  \"version\": 1,\n");
+    fprintf(fd, "  \"host\": { \"hardware_threads\": %u, \"isa\": \"%s\" },\n",
+            hwthreads, mandelbrot_isa_name(mandelbrot_best_isa()));
+    fprintf(fd, "  \"interior_checks\": %s,\n", opts.interiorchecks ? "true" : "false");
+    fprintf(fd, "  \"subdivision\": %d,\n", (int)opts.subdivision);
+    fprintf(fd, "  \"reps\": %u,\n  \"warmup\": %u,\n  \"results\": [", opts.reps, opts.warmup);
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const Result &r = results[i];
+        const Result *base = nullptr;
+
+        for (const Result &b : baseline)
+        {
+            if (b.kernel == r.kernel && b.width == r.width && b.height == r.height
+                    && b.threads == r.threads)
+                base = &b;
+        }
+
+        fprintf(fd, "%s\n    { \"kernel\": ", i ? "," : "");
+        write_string(fd, r.kernel);
+        fprintf(fd, ", \"width\": %u, \"height\": %u, \"threads\": %u,\n", r.width, r.height, r.threads);
+        fprintf(fd, "      \"mpix_per_s\": { \"mean\": %.4f, \"stddev\": %.4f, \"min\": %.4f, \"max\": %.4f },\n",
+                r.mean, r.stddev, r.min, r.max);
+        if (r.nsperiteration > 0.0)
+            fprintf(fd, "      \"ns_per_iteration\": %.5f, \"iterations\": %.0f,\n",
+                    r.nsperiteration, r.iterations);
+        else
+            fprintf(fd, "      \"ns_per_iteration\": null, \"iterations\": null,\n");
+
+        if (base)
+        {
+            double change = 100.0 * (r.mean - base->mean) / base->mean;
+            double p = welch_slower(r, *base);
+            bool regression = p < opts.alpha && change < -opts.threshold;
+
+            regressions += regression;
+            fprintf(fd, "      \"baseline\": { \"mean\": %.4f, \"change_percent\": %.2f, \"p_slower\": %.5f, "
+                    "\"regression\": %s },\n", base->mean, change, p, regression ? "true" : "false");
+
+            if (regression && !opts.quiet)
+                fprintf(stderr, "REGRESSION %s %ux%u %u threads: %.1f%% slower (p = %.4f)\n",
+                        r.kernel.c_str(), r.width, r.height, r.threads, -change, p);
+        }
+
+        fprintf(fd, "      \"samples\": [");
+        for (size_t s = 0; s < r.mpix.size(); ++s)
+            fprintf(fd, "%s%.4f", s ? ", " : "", r.mpix[s]);
+        fprintf(fd, "] }");
+    }
+
+    fprintf(fd, "\n  ]");
+    if (opts.baseline)
+        fprintf(fd, ",\n  \"regressions\": %u", regressions);
+    fprintf(fd, "\n}\n");
+
+    if (opts.out)
+        fclose(fd);
+
+    return regressions ? 2 : 0;
+}
@@ -0,0 +1,390 @@
+#include "cpujit.h"
+#include "asyncbuild.h"
+#include "filewatch.h"
+#include "jitkernel.h"
+#include "kernelcache.h"
+#include "mslparse.h"
+#include "msltranslate.h"
+#include "mslvm.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the exports of METALTOY_KERNEL
+typedef unsigned (*JitAbiFn)();
+typedef unsigned (*JitOutputFn)();
+
+// No errno from math functions, so sqrtf and friends vectorize. No
+// contraction into fma, so kernels round like the built in ones, which are
+// compiled the same way (see src/CMakeLists.txt), and like the interpreter.
+static const char *compile_flags = "-O3 -march=native -ffp-contract=off -fno-math-errno -std=c++17 -shared -fPIC";
+
+// the headers a kernel is compiled against, part of its cache key
+static const char *jit_headers[] = {
+    "jitkernel.h", "cpukernels.h", "uniforms.h", "mslkernel.h", "msl/metal_stdlib", "spmd.h",
+};
+
+struct JitModule
+{
+    void *handle; // null for an interpreted kernel
+    MslVmProgram *program;
+    std::string name;
+    CpuKernel kernel;
+};
+
+static void destroy_module(JitModule *m)
+{
+    if (m->handle)
+        dlclose(m->handle);
+    else
+        msl_vm_destroy(m->program);
+    delete m;
+}
+
+// the whole file, or false if it cannot be read
+static bool read_file(const std::string &path, std::string *out)
+{
+    FILE *fd = fopen(path.c_str(), "rb");
+    char buf[4096];
+    size_t n;
+
+    if (!fd)
+        return false;
+
+    out->clear();
+    while ((n = fread(buf, 1, sizeof(buf), fd)) > 0)
+        out->append(buf, n);
+
+    bool failed = ferror(fd);
+    fclose(fd);
+    return !failed;
+}
+
+static bool write_file(const std::string &path, const std::string &data)
+{
+    FILE *fd = fopen(path.c_str(), "wb");
+
+    if (!fd)
+        return false;
+
+    bool failed = fwrite(data.data(), 1, data.size(), fd) != data.size();
+    return !fclose(fd) && !failed;
+}
+
+// in single quotes, for the shell
+static std::string quote(const std::string &s)
+{
+    std::string q = "'";
+
+    for (char c : s)
+    {
+        if (c == '\'')
+            q += "'\\''";
+        else
+            q += c;
+    }
+    return q + "'";
+}
+
+// in double quotes, for C
+static std::string c_string(const std::string &s)
+{
+    std::string q = "\"";
+
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            q += '\\';
+        q += c;
+    }
+    return q + "\"";
+}
+
+static bool ends_with(const std::string &s, const char *suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && !s.compare(s.size() - n, n, suffix);
+}
+
+// The C++ for a Metal source: its SPMD translation (see msltranslate.h) if
+// the source is in the subset mslparse.h takes, otherwise the source itself,
+// built against the emulated standard library and run a position at a time.
+static std::string metal_cpp(const std::string &path, const char *src, bool quiet)
+{
+    MslProgram prog;
+    std::string cpp, error;
+
+    if (!msl_parse(src, &prog, &error) && !msl_translate(prog, path.c_str(), &cpp, &error))
+        return cpp;
+
+    if (!quiet)
+        fprintf(stderr, "%s: %s; running it a position at a time\n", path.c_str(), error.c_str());
+    return "#include \"mslkernel.h\"\nnamespace metaltoy_msl {\n#line 1 " + c_string(path) + "\n" + src
+        + "\n}\nMETALTOY_MSL_KERNEL(metaltoy_msl::computeMain)\n";
+}
+
+// Runs a shell command and stores what it printed. Returns its exit status.
+static int run_command(const std::string &cmd, std::string *output)
+{
+    FILE *p = popen((cmd + " 2>&1").c_str(), "r");
+    char buf[4096];
+    size_t n;
+
+    if (!p)
+        return -1;
+
+    output->clear();
+    while ((n = fread(buf, 1, sizeof(buf), p)) > 0)
+        output->append(buf, n);
+    return pclose(p);
+}
+
+CpuJit::CpuJit( const char *srcpath, KernelCache *cache, bool quiet, bool interpret )
+: _path( srcpath )
+, _cache( cache )
+, _quiet( quiet )
+, _interpret( interpret )
+{
+    const char *cxx = getenv("CXX");
+    const char *s = getenv("S");
+    std::string version;
+
+    _compiler = cxx && *cxx ? cxx : "c++";
+    if (!_interpret && run_command(_compiler + " --version", &version) && ends_with(_path, ".metal"))
+    {
+        if (!quiet)
+            fprintf(stderr, "No %s to compile %s with, interpreting it\n", _compiler.c_str(), srcpath);
+        _interpret = true;
+    }
+    _compilerid = version.substr(0, version.find('\n'));
+
+    // What -march=native turns on here, as the compiler's predefined macros.
+    // An object built for another cpu can crash this one on an unknown
+    // instruction, so it is part of the cache key for caches shared
+    // between machines.
+    if (!_interpret)
+        run_command(_compiler + " -march=native -dM -E -x c++ /dev/null", &_target);
+
+    // like the renderer finds shader.metal
+    _includedir = s && *s ? std::string(s) + "/src" : METALTOY_SOURCE_DIR;
+
+    _watch = new FileWatcher(srcpath);
+    _builder = new AsyncBuilder(
+        [this](const char *src, unsigned long generation) -> void* {
+            // no point in starting if the source is already stale
+            if (_builder->superseded(generation))
+                return nullptr;
+            return build(src);
+        },
+        [](void *module) {
+            destroy_module(static_cast<JitModule*>(module));
+        });
+}
+
+CpuJit::~CpuJit()
+{
+    delete _watch;
+    delete _builder;
+    if (_retired)
+        destroy_module(_retired);
+    if (_current)
+        destroy_module(_current);
+}
+
+// Compiles src to bytecode. Returns nullptr on failure.
+JitModule *CpuJit::interpret( const char *src )
+{
+    MslProgram prog;
+    MslVmProgram *program = nullptr;
+    std::string error;
+    unsigned registers;
+
+    if (!ends_with(_path, ".metal"))
+    {
+        fprintf(stderr, "%s: only Metal kernels can be interpreted\n", _path.c_str());
+        return nullptr;
+    }
+    if (msl_parse(src, &prog, &error) || !(program = msl_vm_compile(prog, &error)))
+    {
+        fprintf(stderr, "%s: %s, keeping the previous kernel\n", _path.c_str(), error.c_str());
+        return nullptr;
+    }
+
+    JitModule *m = new JitModule;
+    size_t slash = _path.rfind('/');
+
+    m->handle = nullptr;
+    m->program = program;
+    m->name = "vm:" + _path.substr(slash == std::string::npos ? 0 : slash + 1);
+    m->kernel = { m->name.c_str(), msl_vm_eval, cpu_colorize_packed, 0, nullptr, program };
+
+    if (!_quiet)
+    {
+        unsigned n = msl_vm_size(program, &registers);
+        fprintf(stderr, "%s: %u instructions, %u registers\n", _path.c_str(), n, registers);
+    }
+    return m;
+}
+
+// Compiles src unless the cache has it already, and loads it. Runs on the
+// builder thread except for the first load(). Returns nullptr on failure.
+JitModule *CpuJit::build( const char *src )
+{
+    std::string key, sopath, headers, options, output;
+
+    if (_interpret)
+        return interpret(src);
+
+    for (const char *h : jit_headers)
+    {
+        std::string text;
+        if (!read_file(_includedir + "/" + h, &text))
+        {
+            fprintf(stderr, "Cannot read %s/%s. Set S to the metaltoy checkout.\n", _includedir.c_str(), h);
+            return nullptr;
+        }
+        headers += text;
+    }
+
+    // so the compiler's messages point at the file being edited
+    std::string text = "#line 1 " + c_string(_path) + "\n" + src;
+
+    // the cache key is the C++ compiled, so a change to the translation
+    // compiles anew
+    if (ends_with(_path, ".metal"))
+        text = metal_cpp(_path, src, _quiet);
+
+    options = std::string(compile_flags) + " -I" + _includedir + " -I" + _includedir + "/msl";
+    key = KernelCache::key((_compilerid + " abi " + std::to_string(METALTOY_JIT_ABI) + "\n" + _target).c_str(),
+            options.c_str(), (headers + text).c_str());
+
+    if (!_cache->lookup(key, ".so", &sopath))
+    {
+        if (!_cache->ok())
+        {
+            fprintf(stderr, "No kernel cache directory to compile %s into\n", _path.c_str());
+            return nullptr;
+        }
+
+        std::string cpp = _cache->tempPath(".cpp");
+        std::string so = _cache->tempPath(".so");
+        int status;
+
+        if (!_quiet)
+            fprintf(stderr, "Compiling %s...\n", _path.c_str());
+
+        if (!write_file(cpp, text))
+        {
+            unlink(cpp.c_str());
+            return nullptr;
+        }
+
+        status = run_command(_compiler + " " + compile_flags + " -I" + quote(_includedir)
+                + " -I" + quote(_includedir + "/msl") + " -o " + quote(so) + " " + quote(cpp), &output);
+        unlink(cpp.c_str());
+
+        if (status)
+        {
+            fprintf(stderr, "%sFailed to compile %s, keeping the previous kernel\n",
+                    output.c_str(), _path.c_str());
+            unlink(so.c_str());
+            return nullptr;
+        }
+        if (_cache->commit(so, key, ".so"))
+            return nullptr;
+    }
+
+    void *handle = dlopen(sopath.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        fprintf(stderr, "Failed to load %s: %s\n", sopath.c_str(), dlerror());
+        return nullptr;
+    }
+
+    JitAbiFn abi = (JitAbiFn)dlsym(handle, "metaltoy_jit_abi");
+    JitOutputFn format = (JitOutputFn)dlsym(handle, "metaltoy_jit_output");
+    CpuEvalFn eval = (CpuEvalFn)dlsym(handle, "metaltoy_jit_eval");
+
+    if (!abi || !format || !eval || abi() != METALTOY_JIT_ABI)
+    {
+        fprintf(stderr, "%s does not export a kernel. Missing METALTOY_KERNEL?\n", _path.c_str());
+        dlclose(handle);
+        return nullptr;
+    }
+
+    JitModule *m = new JitModule;
+    size_t slash = _path.rfind('/');
+
+    m->handle = handle;
+    m->program = nullptr;
+    m->name = "jit:" + _path.substr(slash == std::string::npos ? 0 : slash + 1);
+    // the value is the color, and may depend on time
+    m->kernel = { m->name.c_str(), eval,
+        format() == METALTOY_JIT_RGBA8 ? cpu_colorize_packed : cpu_colorize_gray, 0, nullptr, nullptr };
+    return m;
+}
+
+void CpuJit::install( JitModule *module )
+{
+    // the renderer may still point at the current kernel until it hears
+    // about the new one, so that one goes at the next poll
+    _retired = _current;
+    _current = module;
+
+    if (!_quiet)
+        fprintf(stderr, "Loaded %s\n", _path.c_str());
+}
+
+int CpuJit::load()
+{
+    JitModule *m;
+
+    // the watcher reports the file as changed once to begin with
+    _watch->changed();
+
+    if (!read_file(_path, &_source))
+    {
+        fprintf(stderr, "Cannot read %s\n", _path.c_str());
+        return -1;
+    }
+
+    m = build(_source.c_str());
+    if (!m)
+        return -1;
+
+    install(m);
+    return 0;
+}
+
+const CpuKernel *CpuJit::poll()
+{
+    std::string src;
+
+    if (_retired)
+    {
+        destroy_module(_retired);
+        _retired = nullptr;
+    }
+
+    JitModule *m = static_cast<JitModule*>(_builder->take());
+    if (m)
+        install(m);
+
+    // _source is the newest source submitted, not the one running, so
+    // undoing an edit that is still building builds the old source again
+    if (_watch->changed() && read_file(_path, &src) && src != _source)
+    {
+        _source = src;
+        _builder->submit(strdup(src.c_str()));
+    }
+
+    return kernel();
+}
+
+const CpuKernel *CpuJit::kernel() const
+{
+    return _current ? &_current->kernel : nullptr;
+}
@@ -0,0 +1,67 @@
+#ifndef METALTOY_CPUJIT_H
+#define METALTOY_CPUJIT_H
+
+#include "cpukernels.h"
+
+#include <string>
+
+class AsyncBuilder;
+class FileWatcher;
+class KernelCache;
+struct JitModule;
+
+// Hot reloading of cpu kernels: a C++ source file written against
+// jitkernel.h is compiled by the system compiler ($CXX, or c++) with -O3
+// -march=native -ffp-contract=off into a shared object, which is loaded with dlopen and run
+// like any built in kernel.
+//
+// Edits to the file are picked up by a FileWatcher and compiled on an
+// AsyncBuilder thread. Compiled objects go into the KernelCache, so a source
+// that was compiled before, in this or an earlier run, loads right away.
+// The frame loop calls poll() between frames to swap in a new kernel; until
+// then, and for good if the new source fails to compile, the previous
+// kernel keeps running.
+//
+// With interpret, or when there is no compiler, a .metal source is run by
+// the bytecode interpreter of mslvm.h instead. Slower to run, but a build
+// takes well under a millisecond.
+class CpuJit
+{
+    public:
+        CpuJit( const char *srcpath, KernelCache *cache, bool quiet = false, bool interpret = false );
+        ~CpuJit();
+
+        // Compiles and loads the source on the calling thread, for the first
+        // frame. return 0 on success
+        int load();
+
+        // Picks up a kernel built since the last call, and starts a build
+        // if the source changed. Returns the current kernel, nullptr if none
+        // has been built yet. Call between frames: a kernel stays valid until
+        // the poll after the one that replaced it.
+        const CpuKernel *poll();
+
+        const CpuKernel *kernel() const;
+        const std::string &path() const { return _path; }
+
+    private:
+        JitModule *build( const char *src );
+        JitModule *interpret( const char *src );
+        void install( JitModule *module );
+
+        std::string _path;
+        std::string _source; // the newest source loaded or submitted
+        std::string _compiler;
+        std::string _compilerid; // the compiler's --version, part of the cache key
+        std::string _target; // the macros -march=native defines, part of the cache key
+        std::string _includedir; // where jitkernel.h is
+        KernelCache *_cache;
+        bool _quiet;
+        bool _interpret;
+        FileWatcher *_watch;
+        AsyncBuilder *_builder;
+        JitModule *_current = nullptr;
+        JitModule *_retired = nullptr; // replaced at the last poll
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "cpukernels.h"
+#include "mandelbrot.h"
+#include "deepzoom.h"
+
+#include <math.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// The ports below keep the arithmetic of shader.metal in single precision and
+// in the same order, so they match the Metal output as closely as possible.
+
+static float thevoid(float stx, float sty)
+{
+    return 0.0f;
+}
+
+static float justice(float stx, float sty)
+{
+    if (stx < 0.5f)
+        return 0.0f;
+    return 1.0f;
+}
+
+// what a write of half4(c, c, c, 1.0) to an RGBA8Unorm texture stores
+static inline void write_pixel(uint8_t *out, float c)
+{
+    c = c < 0.0f ? 0.0f : (c > 1.0f ? 1.0f : c);
+    uint8_t v = (uint8_t)(c * 255.0f + 0.5f);
+    out[0] = v;
+    out[1] = v;
+    out[2] = v;
+    out[3] = 255;
+}
+
+CpuView cpu_default_view(unsigned width, unsigned height)
+{
+    CpuView v;
+    v.x0 = -1.5;
+    v.y0 = -1.0;
+    v.stepx = 2.0 / width;
+    v.stepy = 2.0 / height;
+    return v;
+}
+
+// the color mandelbrot() gives an iteration count
+static inline float palette_color(const CpuPalette &p, float value)
+{
+    return 0.5f + 0.5f * sinf(p.offset + value * p.frequency);
+}
+
+void cpu_build_colormap(const CpuPalette &palette, CpuColormap *map)
+{
+    map->palette = palette;
+    for (unsigned i = 0; i < CpuColormap::lutsize; ++i)
+        write_pixel(map->lut[i], palette_color(palette, (float)i));
+}
+
+// computeMain with color = fn(st), the value is the color. These work in
+// texture space and ignore the view.
+template <float (*Fn)(float, float)>
+static uint64_t eval_row(const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1, float *field)
+{
+    float sty = float(y) / d->height;
+
+    for (unsigned x = x0; x < x1; ++x)
+    {
+        float stx = float(x) / d->width;
+        *field++ = Fn(stx, sty);
+    }
+
+    return x1 - x0;
+}
+
+void cpu_colorize_gray(const CpuColormap *map, const float *field, size_t n, uint8_t *out)
+{
+    for (size_t i = 0; i < n; ++i, out += 4)
+        write_pixel(out, field[i]);
+}
+
+void cpu_colorize_packed(const CpuColormap *map, const float *field, size_t n, uint8_t *out)
+{
+    memcpy(out, field, n * 4);
+}
+
+// computeMain with color = mandelbrot(st), iterating with the given isa
+template <MandelbrotIsa Isa>
+static uint64_t mandelbrot_eval(const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1, float *field)
+{
+    static const MandelbrotLineFn iterate = mandelbrot_line_fn(Isa);
+    uint32_t iterations[256];
+    uint64_t cost = 0;
+
+    while (x0 < x1)
+    {
+        unsigned n = x1 - x0 < 256 ? x1 - x0 : 256;
+
+        cost += iterate(d, x0, y, n, false, iterations);
+        for (unsigned i = 0; i < n; ++i)
+            *field++ = (float)iterations[i];
+
+        // pixels that escape right away still cost something
+        cost += n;
+        x0 += n;
+    }
+
+    return cost;
+}
+
+template <MandelbrotIsa Isa>
+static uint64_t mandelbrot_eval_column(const CpuDispatch *d, unsigned x, unsigned y0, unsigned y1,
+        float *field, size_t stride)
+{
+    static const MandelbrotLineFn iterate = mandelbrot_line_fn(Isa);
+    uint32_t iterations[256];
+    uint64_t cost = 0;
+
+    while (y0 < y1)
+    {
+        unsigned n = y1 - y0 < 256 ? y1 - y0 : 256;
+
+        cost += iterate(d, x, y0, n, true, iterations);
+        for (unsigned i = 0; i < n; ++i, field += stride)
+            *field = (float)iterations[i];
+
+        cost += n;
+        y0 += n;
+    }
+
+    return cost;
+}
+
+// mandelbrot at zooms past float precision, by perturbation
+static uint64_t mandelbrot_deep_eval(const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1, float *field)
+{
+    return d->deep->evalRow(y, x0, x1, field);
+}
+
+// the field holds iteration counts
+static void colorize_palette(const CpuColormap *map, const float *field, size_t n, uint8_t *out)
+{
+    for (size_t i = 0; i < n; ++i, out += 4)
+    {
+        float v = field[i];
+        unsigned idx = (unsigned)v;
+
+        if (idx < CpuColormap::lutsize && (float)idx == v)
+            memcpy(out, map->lut[idx], 4);
+        else
+            write_pixel(out, palette_color(map->palette, v));
+    }
+}
+
+template <MandelbrotIsa Isa>
+static bool isa_supported()
+{
+    return mandelbrot_line_fn(Isa) != nullptr;
+}
+
+static bool always_supported()
+{
+    return true;
+}
+
+struct KernelEntry
+{
+    CpuKernel kernel;
+    bool (*supported)();
+};
+
+static const unsigned mandelbrot_flags = CpuKernelPannable | CpuKernelIterations;
+
+static const KernelEntry entries[] =
+{
+    { { "mandelbrot-scalar", mandelbrot_eval<MandelbrotIsaScalar>, colorize_palette, mandelbrot_flags,
+        mandelbrot_eval_column<MandelbrotIsaScalar> },
+        always_supported },
+    { { "mandelbrot-sse4", mandelbrot_eval<MandelbrotIsaSse4>, colorize_palette, mandelbrot_flags,
+        mandelbrot_eval_column<MandelbrotIsaSse4> },
+        isa_supported<MandelbrotIsaSse4> },
+    { { "mandelbrot-avx2", mandelbrot_eval<MandelbrotIsaAvx2>, colorize_palette, mandelbrot_flags,
+        mandelbrot_eval_column<MandelbrotIsaAvx2> },
+        isa_supported<MandelbrotIsaAvx2> },
+    { { "mandelbrot-avx512", mandelbrot_eval<MandelbrotIsaAvx512>, colorize_palette, mandelbrot_flags,
+        mandelbrot_eval_column<MandelbrotIsaAvx512> },
+        isa_supported<MandelbrotIsaAvx512> },
+    { { "mandelbrot-deep", mandelbrot_deep_eval, colorize_palette, CpuKernelIterations | CpuKernelDeepZoom },
+        always_supported },
+    { { "thevoid", eval_row<thevoid>, cpu_colorize_gray, 0 }, always_supported },
+    { { "justice", eval_row<justice>, cpu_colorize_gray, 0 }, always_supported },
+};
+
+// The entries this cpu can run, plus "mandelbrot" for the widest of the
+// mandelbrot variants. Built on first use.
+static const std::vector<CpuKernel> &available_kernels()
+{
+    static const std::vector<CpuKernel> kernels = []{
+        std::vector<CpuKernel> v;
+        std::string best = std::string("mandelbrot-") + mandelbrot_isa_name(mandelbrot_best_isa());
+
+        for (const KernelEntry &e : entries)
+        {
+            if (!e.supported())
+                continue;
+            if (best == e.kernel.name)
+            {
+                CpuKernel alias = e.kernel;
+                alias.name = "mandelbrot";
+                v.insert(v.begin(), alias);
+            }
+            v.push_back(e.kernel);
+        }
+        return v;
+    }();
+    return kernels;
+}
+
+const CpuKernel *cpu_find_kernel(const char *name)
+{
+    for (const CpuKernel &k : available_kernels())
+    {
+        if (!strcmp(k.name, name))
+            return &k;
+    }
+    return nullptr;
+}
+
+const CpuKernel *cpu_kernels(unsigned *count)
+{
+    const std::vector<CpuKernel> &kernels = available_kernels();
+    *count = kernels.size();
+    return kernels.data();
+}
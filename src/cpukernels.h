@@ -0,0 +1,129 @@
+#ifndef METALTOY_CPUKERNELS_H
+#define METALTOY_CPUKERNELS_H
+
+#include "uniforms.h"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+class DeepZoom;
+
+// C++ ports of the functions in shader.metal, run by CpuRenderer in place of
+// computeMain. A kernel comes in two stages: eval does the expensive part and
+// writes one float per pixel to a field (the iteration count, for mandelbrot),
+// and colorize turns field values into RGBA8. A change to the coloring then
+// only costs one memory-bound pass over the field.
+
+// The region of the complex plane that kernels like mandelbrot look at.
+// Pixel (x, y) is at (x0 + x * stepx, y0 + y * stepy).
+struct CpuView
+{
+    double x0, y0;
+    double stepx, stepy;
+};
+
+// the mapping of mandelbrot() in shader.metal, [-1.5, 0.5] x [-1, 1]
+CpuView cpu_default_view(unsigned width, unsigned height);
+
+// extra entries at the end of the coordinate tables, so simd kernels can
+// load whole vectors at the end of a row
+static const unsigned cpu_coord_padding = 16;
+
+// Pixels the mandelbrot interior shortcuts resolved, over a frame.
+struct CpuInteriorStats
+{
+    std::atomic<uint64_t> bulb{ 0 };     // in the main cardioid or the period 2 bulb
+    std::atomic<uint64_t> periodic{ 0 }; // orbit came back to an earlier value
+};
+
+struct CpuDispatch
+{
+    unsigned width;  // threads_per_grid.x
+    unsigned height; // threads_per_grid.y
+    const Uniforms *uniforms; // buffer(0)
+    // the view, as the coordinate of every column and row
+    const float *cx; // width + cpu_coord_padding entries
+    const float *cy; // height + cpu_coord_padding entries
+    // prepared for this frame, for CpuKernelDeepZoom kernels
+    const DeepZoom *deep;
+    // mandelbrot shortcuts for pixels inside the set, and where to count
+    // what they resolved (may be null)
+    bool interiorchecks;
+    CpuInteriorStats *interiorstats;
+    // CpuKernel::program
+    const void *program;
+};
+
+// colors are 0.5 + 0.5 * sin(offset + value * frequency), as in mandelbrot()
+struct CpuPalette
+{
+    float offset = 3.0f;
+    float frequency = 0.15f;
+};
+
+// A palette, with the colors of small integer field values looked up ahead
+// of time.
+struct CpuColormap
+{
+    static const unsigned lutsize = 1024;
+
+    CpuPalette palette;
+    uint8_t lut[lutsize][4];
+};
+
+void cpu_build_colormap(const CpuPalette &palette, CpuColormap *map);
+
+// Evaluates pixels [x0, x1) of row y. field points at pixel x0 of that row.
+// Returns the cost of the span in kernel specific units, e.g. iterations,
+// which is used to balance the work of the next frame.
+typedef uint64_t (*CpuEvalFn)(const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1, float *field);
+
+// Evaluates pixels [y0, y1) of column x. field points at pixel y0 of that
+// column, and consecutive pixels are stride floats apart.
+typedef uint64_t (*CpuEvalColumnFn)(const CpuDispatch *d, unsigned x, unsigned y0, unsigned y1,
+        float *field, size_t stride);
+
+// Colors n field values.
+typedef void (*CpuColorizeFn)(const CpuColormap *map, const float *field, size_t n, uint8_t *out);
+
+enum CpuKernelFlags
+{
+    // The field depends only on the view, not on time or anything else, so
+    // when the view pans by whole pixels the previous field can be shifted
+    // instead of evaluated again.
+    CpuKernelPannable = 1 << 0,
+    // the field holds escape-time iteration counts
+    CpuKernelIterations = 1 << 1,
+    // Evaluates through CpuDispatch::deep, which has its own view, instead
+    // of the coordinate tables.
+    CpuKernelDeepZoom = 1 << 2,
+};
+
+struct CpuKernel
+{
+    const char *name;
+    CpuEvalFn eval;
+    CpuColorizeFn colorize;
+    unsigned flags;
+    // Same results as eval, for when columns are what is needed. May be
+    // null, then columns are evaluated a pixel at a time.
+    CpuEvalColumnFn evalcolumn;
+    // for kernels that interpret a program, what they run, null otherwise
+    const void *program;
+};
+
+// for kernels whose field value is the color, as computeMain writing
+// half4(c, c, c, 1.0)
+void cpu_colorize_gray(const CpuColormap *map, const float *field, size_t n, uint8_t *out);
+
+// for kernels that write their own colors, as computeMain writing any half4:
+// each field value holds the bits of an RGBA8 pixel
+void cpu_colorize_packed(const CpuColormap *map, const float *field, size_t n, uint8_t *out);
+
+// returns nullptr if there is no kernel with that name
+const CpuKernel *cpu_find_kernel(const char *name);
+
+const CpuKernel *cpu_kernels(unsigned *count);
+
+#endif
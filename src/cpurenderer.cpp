@@ -0,0 +1,558 @@
+#include "cpurenderer.h"
+#include "mandelbrot.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+static inline double getCurrentTimeInSeconds()
+{
+    using Clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+// If b is a shifted by whole pixels, stores the shift and returns true.
+static bool pixel_offset(const CpuView &a, const CpuView &b, long *dx, long *dy)
+{
+    if (a.stepx != b.stepx || a.stepy != b.stepy)
+        return false;
+
+    double fx = (b.x0 - a.x0) / a.stepx;
+    double fy = (b.y0 - a.y0) / a.stepy;
+
+    *dx = lround(fx);
+    *dy = lround(fy);
+
+    // allow for rounding in the view arithmetic
+    return fabs(fx - *dx) < 1e-3 && fabs(fy - *dy) < 1e-3;
+}
+
+CpuRenderer::CpuRenderer( unsigned width, unsigned height, unsigned nthreads )
+: _pool( nthreads )
+, _scheduler( _pool )
+, _kernel( cpu_find_kernel("mandelbrot") )
+, _width( width )
+, _height( height )
+, _ring( frames_in_flight )
+{
+    _pixels = (uint8_t*)malloc((size_t)width * height * 4);
+    _field = (float*)malloc((size_t)width * height * sizeof(float));
+    _cx = (float*)calloc(width + cpu_coord_padding, sizeof(float));
+    _cy = (float*)calloc(height + cpu_coord_padding, sizeof(float));
+    _view = cpu_default_view(width, height);
+    cpu_build_colormap(CpuPalette(), &_colormap);
+}
+
+CpuRenderer::~CpuRenderer()
+{
+    free(_pixels);
+    free(_field);
+    free(_backpixels);
+    free(_backfield);
+    free(_cx);
+    free(_cy);
+}
+
+void CpuRenderer::setPalette( const CpuPalette &palette )
+{
+    cpu_build_colormap(palette, &_colormap);
+    _colorsstale = true;
+}
+
+void CpuRenderer::recolor()
+{
+    TRACE_SCOPE("CpuRenderer::recolor");
+    unsigned nthreads = _pool.size();
+    double start = getCurrentTimeInSeconds();
+
+    // memory bound and uniform, a band of rows per thread is fine
+    _pool.run([&](unsigned worker) {
+        size_t y0 = (uint64_t)_height * worker / nthreads;
+        size_t y1 = (uint64_t)_height * (worker + 1) / nthreads;
+
+        _kernel->colorize(&_colormap, _field + y0 * _width, (y1 - y0) * _width,
+                _pixels + y0 * _width * 4);
+    });
+
+    _colorsstale = false;
+    _lastseconds = getCurrentTimeInSeconds() - start;
+}
+
+void CpuRenderer::setKernel( const CpuKernel *kernel )
+{
+    cancel();
+    if (kernel != _kernel)
+    {
+        _scheduler.resetCosts();
+        _fieldvalid = false;
+    }
+    _kernel = kernel;
+}
+
+void CpuRenderer::setInteriorChecks( bool on )
+{
+    // the bulb test can disagree with iterating right on the boundary
+    if (on != _interiorchecks)
+        invalidate();
+    _interiorchecks = on;
+}
+
+void CpuRenderer::setSubdivision( CpuSubdivision mode )
+{
+    // filled pixels can differ from evaluated ones
+    if (mode != _subdivision)
+        invalidate();
+    _subdivision = mode;
+}
+
+uint32_t CpuRenderer::maxIterations() const
+{
+    if (_kernel->flags & CpuKernelDeepZoom)
+        return _deep.maxIterations();
+    return mandelbrot_max_iteration;
+}
+
+uint64_t CpuRenderer::evalRow( const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1 )
+{
+    return _kernel->eval(d, y, x0, x1, _field + (size_t)y * _width + x0);
+}
+
+uint64_t CpuRenderer::evalColumn( const CpuDispatch *d, unsigned x, unsigned y0, unsigned y1 )
+{
+    uint64_t cost = 0;
+
+    if (_kernel->evalcolumn)
+        return _kernel->evalcolumn(d, x, y0, y1, _field + (size_t)y0 * _width + x, _width);
+
+    for (unsigned y = y0; y < y1; ++y)
+        cost += evalRow(d, y, x, x + 1);
+    return cost;
+}
+
+// below this, the inside of a rectangle is evaluated rather than split
+static const unsigned subdivide_min = 6;
+
+// Whether the rectangle [x0, x1] x [y0, y1] of the plane lies in the main
+// cardioid or the period 2 bulb, where every point iterates to the maximum
+// count. Both are convex, the cardioid left of its cusp, so it is enough that
+// the corners are in the same one. The corners are moved out a little against
+// rounding in the kernels.
+static bool in_main_bulbs_rect(double x0, double y0, double x1, double y1)
+{
+    static const double margin = 1e-6;
+    double xs[2] = { x0 - margin, x1 + margin }, ys[2] = { y0 - margin, y1 + margin };
+    bool cardioid = true, bulb = true;
+
+    for (double x : xs)
+        for (double y : ys)
+        {
+            double xq = x - 0.25, y2 = y * y, q = xq * xq + y2;
+
+            cardioid = cardioid && x < 0.25 && q * (q + xq) < 0.25 * y2;
+            bulb = bulb && (x + 1.0) * (x + 1.0) + y2 < 0.0625;
+        }
+    return cardioid || bulb;
+}
+
+// The border of [x0, x1) x [y0, y1) is in _field already. Returns the cost of
+// the rest.
+uint64_t CpuRenderer::subdivide( const CpuDispatch *d, unsigned x0, unsigned y0, unsigned x1, unsigned y1 )
+{
+    float *field = _field;
+    size_t width = _width;
+    uint64_t cost = 0;
+
+    if (x1 - x0 <= 2 || y1 - y0 <= 2)
+        return 0;
+
+    float v = field[y0 * width + x0];
+    bool uniform = _subdivision == CpuSubdivisionAny || v == (float)maxIterations();
+
+    for (unsigned x = x0; uniform && x < x1; ++x)
+        uniform = field[y0 * width + x] == v && field[(y1 - 1) * width + x] == v;
+    for (unsigned y = y0 + 1; uniform && y < y1 - 1; ++y)
+        uniform = field[y * width + x0] == v && field[y * width + x1 - 1] == v;
+
+    // a filament can cross the border between two samples, so exactly only
+    // what is known to be inside the set is filled; the coordinate tables
+    // are not the view of deep zoom kernels
+    if (uniform && _subdivision == CpuSubdivisionInterior)
+        uniform = !(_kernel->flags & CpuKernelDeepZoom)
+            && in_main_bulbs_rect(std::min(_cx[x0 + 1], _cx[x1 - 2]), std::min(_cy[y0 + 1], _cy[y1 - 2]),
+                                  std::max(_cx[x0 + 1], _cx[x1 - 2]), std::max(_cy[y0 + 1], _cy[y1 - 2]));
+
+    if (uniform)
+    {
+        for (unsigned y = y0 + 1; y < y1 - 1; ++y)
+            for (unsigned x = x0 + 1; x < x1 - 1; ++x)
+                field[y * width + x] = v;
+        _filledpixels.fetch_add((uint64_t)(x1 - x0 - 2) * (y1 - y0 - 2), std::memory_order_relaxed);
+        return (uint64_t)(x1 - x0) * (y1 - y0) / 16 + 1;
+    }
+
+    if (x1 - x0 <= subdivide_min || y1 - y0 <= subdivide_min)
+    {
+        for (unsigned y = y0 + 1; y < y1 - 1; ++y)
+            cost += evalRow(d, y, x0 + 1, x1 - 1);
+        return cost;
+    }
+
+    // split the longer side, evaluate the line between the halves
+    if (x1 - x0 >= y1 - y0)
+    {
+        unsigned xm = (x0 + x1) / 2;
+
+        cost += evalColumn(d, xm, y0 + 1, y1 - 1);
+        cost += subdivide(d, x0, y0, xm + 1, y1);
+        cost += subdivide(d, xm, y0, x1, y1);
+    }
+    else
+    {
+        unsigned ym = (y0 + y1) / 2;
+
+        cost += evalRow(d, ym, x0 + 1, x1 - 1);
+        cost += subdivide(d, x0, y0, x1, ym + 1);
+        cost += subdivide(d, x0, ym, x1, y1);
+    }
+
+    return cost;
+}
+
+void CpuRenderer::pan( long dx, long dy )
+{
+    _view.x0 += dx * _view.stepx;
+    _view.y0 += dy * _view.stepy;
+    cancel();
+}
+
+// Fills in the uniforms and coordinate tables of a new frame.
+void CpuRenderer::beginFrame( float time, Uniforms *u )
+{
+    TRACE_SCOPE("CpuRenderer::beginFrame");
+    u->time = time;
+    u->deltatime = _ring.frameCount() > 1 ? time - _lasttime : 0.0f;
+    u->resolution[0] = _width;
+    u->resolution[1] = _height;
+    u->frame = (uint32_t)(_ring.frameCount() - 1);
+    _lasttime = time;
+    _interiorstats.bulb = 0;
+    _interiorstats.periodic = 0;
+    _filledpixels = 0;
+
+    for (unsigned x = 0; x < _width + cpu_coord_padding; ++x)
+        _cx[x] = (float)(_view.x0 + x * _view.stepx);
+    for (unsigned y = 0; y < _height + cpu_coord_padding; ++y)
+        _cy[y] = (float)(_view.y0 + y * _view.stepy);
+
+    // one reference orbit for the whole frame, before the tiles need it
+    if (_kernel->flags & CpuKernelDeepZoom)
+        _deep.prepare(_width, _height);
+}
+
+void CpuRenderer::generateTexture( float time )
+{
+    TRACE_SCOPE("CpuRenderer::generateTexture");
+    unsigned slot = _ring.acquire();
+    Uniforms *u = &_uniforms[slot];
+    CpuDispatch d = { _width, _height, u, _cx, _cy, &_deep, _interiorchecks, &_interiorstats,
+        _kernel->program };
+    double start = getCurrentTimeInSeconds();
+    long dx = 0, dy = 0;
+    bool reuse;
+
+    beginFrame(time, u);
+
+    // On a whole pixel pan, the part of the new frame the old one covered is
+    // copied over and only the newly exposed strips are evaluated.
+    reuse = _fieldvalid && (_kernel->flags & CpuKernelPannable)
+        && pixel_offset(_fieldview, _view, &dx, &dy)
+        && labs(dx) < (long)_width && labs(dy) < (long)_height;
+
+    if (reuse)
+    {
+        if (!_backfield)
+        {
+            _backfield = (float*)malloc((size_t)_width * _height * sizeof(float));
+            _backpixels = (uint8_t*)malloc((size_t)_width * _height * 4);
+        }
+        std::swap(_field, _backfield);
+        std::swap(_pixels, _backpixels);
+        _reusedpixels = (uint64_t)(_width - labs(dx)) * (_height - labs(dy));
+    }
+    else
+    {
+        _reusedpixels = 0;
+    }
+
+    auto eval_span = [&](unsigned y, unsigned x0, unsigned x1) -> uint64_t {
+        if (x0 >= x1)
+            return 0;
+
+        // color right after evaluating, while the span is in cache
+        size_t offset = (size_t)y * _width + x0;
+        uint64_t cost = _kernel->eval(&d, y, x0, x1, _field + offset);
+        _kernel->colorize(&_colormap, _field + offset, x1 - x0, _pixels + offset * 4);
+        return cost;
+    };
+
+    bool subdividing = _subdivision != CpuSubdivisionOff && !reuse
+        && (_kernel->flags & CpuKernelIterations);
+
+    _scheduler.run(_width, _height, [&](const Tile &t) {
+        uint64_t cost = 0;
+
+        if (subdividing)
+        {
+            size_t w = _width;
+
+            // the tile's border, then whatever of its inside is not uniform
+            cost += evalRow(&d, t.y0, t.x0, t.x1);
+            if (t.y1 - t.y0 > 1)
+                cost += evalRow(&d, t.y1 - 1, t.x0, t.x1);
+            if (t.y1 - t.y0 > 2)
+            {
+                cost += evalColumn(&d, t.x0, t.y0 + 1, t.y1 - 1);
+                if (t.x1 - t.x0 > 1)
+                    cost += evalColumn(&d, t.x1 - 1, t.y0 + 1, t.y1 - 1);
+            }
+            cost += subdivide(&d, t.x0, t.y0, t.x1, t.y1);
+
+            for (unsigned y = t.y0; y < t.y1; ++y)
+                _kernel->colorize(&_colormap, _field + y * w + t.x0, t.x1 - t.x0, _pixels + (y * w + t.x0) * 4);
+            return cost;
+        }
+
+        for (unsigned y = t.y0; y < t.y1; ++y)
+        {
+            long sy = (long)y + dy;
+
+            if (!reuse || sy < 0 || sy >= (long)_height)
+            {
+                cost += eval_span(y, t.x0, t.x1);
+                continue;
+            }
+
+            // the columns of this span the previous frame covered
+            long rx0 = (long)t.x0 > -dx ? (long)t.x0 : -dx;
+            long rx1 = (long)t.x1 < (long)_width - dx ? (long)t.x1 : (long)_width - dx;
+
+            if (rx0 >= rx1)
+            {
+                cost += eval_span(y, t.x0, t.x1);
+                continue;
+            }
+
+            size_t dst = (size_t)y * _width + rx0;
+            size_t src = (size_t)sy * _width + rx0 + dx;
+            size_t n = rx1 - rx0;
+
+            memcpy(_field + dst, _backfield + src, n * sizeof(float));
+            if (_colorsstale)
+                _kernel->colorize(&_colormap, _field + dst, n, _pixels + dst * 4);
+            else
+                memcpy(_pixels + dst * 4, _backpixels + src * 4, n * 4);
+
+            cost += n;
+            cost += eval_span(y, t.x0, rx0);
+            cost += eval_span(y, rx1, t.x1);
+        }
+
+        return cost;
+    });
+
+    _ring.release(slot);
+
+    _fieldview = _view;
+    _fieldvalid = true;
+    _colorsstale = false;
+    _lastseconds = getCurrentTimeInSeconds() - start;
+}
+
+// The samples of a progressive pass, as grids of pixels (ox + i * sx,
+// oy + j * sy). Together the passes cover every pixel exactly once.
+struct PassGrid
+{
+    unsigned ox, oy, sx, sy;
+};
+
+static const PassGrid pass_grids[][3] =
+{
+    { { 0, 0, 4, 4 } },                                  // 1/16
+    { { 2, 0, 4, 4 }, { 0, 2, 4, 4 }, { 2, 2, 4, 4 } },  // the rest of 1/4
+    { { 1, 0, 2, 2 } },                                  // the rest of the even rows
+    { { 0, 1, 1, 2 } },                                  // the odd rows
+};
+
+static const unsigned pass_grid_count[] = { 1, 3, 1, 1 };
+
+// after each pass, the block of pixels a sample stands in for
+static const unsigned pass_block[][2] = { { 4, 4 }, { 2, 2 }, { 1, 2 }, { 1, 1 } };
+
+// Evaluates the samples of a pass into _field. Each grid runs as a smaller
+// image with its own coordinate tables, so the kernels see contiguous rows.
+// Returns false if the generation changed before the pass was done.
+bool CpuRenderer::evalPass( unsigned pass, const CpuDispatch *d, unsigned generation )
+{
+    TRACE_SCOPE("CpuRenderer::evalPass");
+    std::atomic<bool> aborted{ false };
+    double start = getCurrentTimeInSeconds();
+
+    for (unsigned g = 0; g < pass_grid_count[pass]; ++g)
+    {
+        const PassGrid &grid = pass_grids[pass][g];
+        unsigned w = grid.ox < _width ? (_width - grid.ox + grid.sx - 1) / grid.sx : 0;
+        unsigned h = grid.oy < _height ? (_height - grid.oy + grid.sy - 1) / grid.sy : 0;
+        std::vector<float> cx(w + cpu_coord_padding), cy(h + cpu_coord_padding);
+        std::atomic<unsigned> nextrow{ 0 };
+
+        if (!w || !h)
+            continue;
+
+        for (unsigned i = 0; i < w + cpu_coord_padding; ++i)
+            cx[i] = (float)(_view.x0 + (grid.ox + i * grid.sx) * _view.stepx);
+        for (unsigned j = 0; j < h + cpu_coord_padding; ++j)
+            cy[j] = (float)(_view.y0 + (grid.oy + j * grid.sy) * _view.stepy);
+
+        CpuDispatch gd = *d;
+        gd.width = w;
+        gd.height = h;
+        gd.cx = cx.data();
+        gd.cy = cy.data();
+
+        // rows are handed out one at a time, which balances well enough and
+        // lets a cancel take effect within a row
+        _pool.run([&](unsigned worker) {
+            std::vector<float> row(w);
+            unsigned j;
+
+            while ((j = nextrow.fetch_add(1, std::memory_order_relaxed)) < h)
+            {
+                if (_generation.load(std::memory_order_relaxed) != generation)
+                {
+                    aborted = true;
+                    return;
+                }
+
+                float *out = _field + (size_t)(grid.oy + j * grid.sy) * _width + grid.ox;
+                _kernel->eval(&gd, j, 0, w, row.data());
+                for (unsigned i = 0; i < w; ++i)
+                    out[(size_t)i * grid.sx] = row[i];
+            }
+        });
+
+        if (aborted)
+            return false;
+    }
+
+    _lastseconds = getCurrentTimeInSeconds() - start;
+    return true;
+}
+
+// Colors every pixel from the sample that stands in for it after the pass.
+void CpuRenderer::showPass( unsigned pass )
+{
+    TRACE_SCOPE("CpuRenderer::showPass");
+    unsigned bx = pass_block[pass][0];
+    unsigned by = pass_block[pass][1];
+    unsigned nthreads = _pool.size();
+    unsigned nsamples = (_width + bx - 1) / bx;
+
+    _pool.run([&](unsigned worker) {
+        size_t y0 = (uint64_t)_height * worker / nthreads;
+        size_t y1 = (uint64_t)_height * (worker + 1) / nthreads;
+        std::vector<float> samples(nsamples);
+        std::vector<uint8_t> colors(nsamples * 4);
+
+        for (size_t y = y0; y < y1; ++y)
+        {
+            const float *src = _field + (y - y % by) * _width;
+            uint8_t *dst = _pixels + y * _width * 4;
+
+            if (bx == 1)
+            {
+                _kernel->colorize(&_colormap, src, _width, dst);
+                continue;
+            }
+
+            for (unsigned i = 0; i < nsamples; ++i)
+                samples[i] = src[i * bx];
+            _kernel->colorize(&_colormap, samples.data(), nsamples, colors.data());
+            for (unsigned i = 0, x = 0; i < nsamples; ++i)
+            {
+                uint32_t c;
+                memcpy(&c, &colors[i * 4], 4);
+                for (unsigned end = x + bx < _width ? x + bx : _width; x < end; ++x)
+                    memcpy(dst + x * 4, &c, 4);
+            }
+        }
+    });
+}
+
+int CpuRenderer::refine( float time )
+{
+    unsigned generation = _generation.load(std::memory_order_relaxed);
+
+    if (!(_kernel->flags & CpuKernelPannable))
+    {
+        generateTexture(time);
+        return progressive_passes - 1;
+    }
+
+    if (generation != _passgeneration)
+    {
+        _passgeneration = generation;
+        _pass = -1;
+    }
+    if (_pass == (int)progressive_passes - 1)
+        return _pass;
+
+    unsigned pass = _pass + 1;
+    unsigned slot = _ring.acquire();
+    CpuDispatch d = { _width, _height, &_uniforms[slot], _cx, _cy, &_deep, _interiorchecks, &_interiorstats,
+        _kernel->program };
+    bool done;
+
+    // all passes render the same frame
+    if (pass == 0)
+    {
+        beginFrame(time, &_uniforms[slot]);
+        _passuniforms = _uniforms[slot];
+        _fieldvalid = false;
+        _reusedpixels = 0;
+    }
+    else
+    {
+        _uniforms[slot] = _passuniforms;
+    }
+    done = evalPass(pass, &d, generation);
+    _ring.release(slot);
+
+    if (!done)
+    {
+        _pass = -1;
+        return -1;
+    }
+
+    showPass(pass);
+    _colorsstale = false;
+    _pass = pass;
+
+    if (pass == progressive_passes - 1)
+    {
+        _fieldview = _view;
+        _fieldvalid = true;
+    }
+    return pass;
+}
+
+double CpuRenderer::megapixelsPerSecond() const
+{
+    if (_lastseconds <= 0.0)
+        return 0.0;
+    return (double)_width * _height / _lastseconds / 1e6;
+}
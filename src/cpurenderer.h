@@ -0,0 +1,166 @@
+#ifndef METALTOY_CPURENDERER_H
+#define METALTOY_CPURENDERER_H
+
+#include "cpukernels.h"
+#include "deepzoom.h"
+#include "threadpool.h"
+#include "tilescheduler.h"
+#include "framering.h"
+#include "uniforms.h"
+
+#include <atomic>
+
+enum CpuSubdivision
+{
+    CpuSubdivisionOff,
+    // Fill rectangles whose border is all at the maximum iteration count and
+    // which lie in the main cardioid or the period 2 bulb. Exact: the field
+    // is the same as a full render, as tests/subdivide_test.cpp checks. Fills
+    // nothing for CpuKernelDeepZoom kernels.
+    CpuSubdivisionInterior,
+    // Fill rectangles whose border has any single iteration count. Faster,
+    // but can paint over small details inside a band.
+    CpuSubdivisionAny,
+    // Fill every rectangle whose border is all at the maximum iteration
+    // count. The mandelbrot set has no holes, so this only misses escaping
+    // filaments thinner than a pixel that cross the border between two
+    // samples, a few pixels per million on the default view.
+    CpuSubdivisionInteriorApprox,
+};
+
+// Software stand-in for the compute half of Renderer. Runs a CpuKernel over a
+// width x height RGBA8 image, in tiles spread over a thread pool.
+class CpuRenderer
+{
+    public:
+        // nthreads == 0 means one thread per hardware thread
+        CpuRenderer( unsigned width, unsigned height, unsigned nthreads );
+        ~CpuRenderer();
+
+        void setKernel( const CpuKernel *kernel );
+        const CpuKernel *kernel() const { return _kernel; }
+
+        // time is in seconds since start
+        void generateTexture( float time );
+
+        // The view takes effect at the next generateTexture. If it moved by
+        // whole pixels since the last frame, only the newly exposed pixels
+        // are evaluated and the rest are copied from that frame.
+        void setView( const CpuView &view ) { _view = view; cancel(); }
+        const CpuView &view() const { return _view; }
+        // move the view by whole pixels
+        void pan( long dx, long dy );
+        // make the next generateTexture evaluate every pixel
+        void invalidate() { _fieldvalid = false; cancel(); }
+
+        // Cardioid, bulb and cycle shortcuts for mandelbrot pixels inside the
+        // set, on by default. interiorStats counts what they resolved in the
+        // last generateTexture.
+        void setInteriorChecks( bool on );
+        bool interiorChecks() const { return _interiorchecks; }
+        const CpuInteriorStats &interiorStats() const { return _interiorstats; }
+
+        // Mariani-Silver subdivision for CpuKernelIterations kernels. Each tile
+        // evaluates only its border, fills its inside if the border is
+        // uniform, and otherwise splits in two and does the same for the
+        // halves. Off by default. filledPixels counts what the last
+        // generateTexture filled without evaluating.
+        void setSubdivision( CpuSubdivision mode );
+        CpuSubdivision subdivision() const { return _subdivision; }
+        uint64_t filledPixels() const { return _filledpixels.load(std::memory_order_relaxed); }
+
+        // The view of CpuKernelDeepZoom kernels, which need more precision
+        // than a CpuView has. Changes take effect at the next generateTexture.
+        DeepZoom &deepZoom() { return _deep; }
+        const DeepZoom &deepZoom() const { return _deep; }
+
+        // Progressive rendering, for frames too slow to wait for. Each call
+        // evaluates the next of progressive_passes passes, at 1/16, 1/4, 1/2
+        // and finally all of the pixels, each pass only the samples the
+        // earlier ones did not have. Afterwards pixels() shows the image so
+        // far, coarse samples standing in for missing ones. Returns the pass
+        // done, progressive_passes - 1 once the image is complete, or -1 if
+        // cancel() interrupted the pass. Kernels that are not
+        // CpuKernelPannable render in a single pass.
+        //
+        // A change of view, kernel or evaluation mode, or cancel(), makes the
+        // next call start over at the first pass.
+        int refine( float time );
+        static const unsigned progressive_passes = 4;
+        // Safe to call from any thread; aborts a refine in progress. E.g.
+        // after changing deepZoom().
+        void cancel() { _generation.fetch_add(1, std::memory_order_relaxed); }
+
+        // Takes effect at the next generateTexture or recolor.
+        void setPalette( const CpuPalette &palette );
+        const CpuPalette &palette() const { return _colormap.palette; }
+        // Colors the field of the last generateTexture again, e.g. after a
+        // palette change, without evaluating the kernel.
+        void recolor();
+
+        unsigned width() const { return _width; }
+        unsigned height() const { return _height; }
+        unsigned threadCount() const { return _pool.size(); }
+        // idle between frames, for work like encoding them
+        ThreadPool &pool() { return _pool; }
+        const TileScheduler &scheduler() const { return _scheduler; }
+        const FrameRing &frameRing() const { return _ring; }
+        const uint8_t *pixels() const { return _pixels; }
+        // kernel output before coloring, one float per pixel
+        const float *field() const { return _field; }
+
+        // pixels the last generateTexture copied from the previous frame
+        uint64_t reusedPixels() const { return _reusedpixels; }
+
+        // wall time of the last generateTexture call
+        double lastFrameSeconds() const { return _lastseconds; }
+        // throughput of the last generateTexture call
+        double megapixelsPerSecond() const;
+
+    private:
+        void beginFrame( float time, Uniforms *u );
+        bool evalPass( unsigned pass, const CpuDispatch *d, unsigned generation );
+        void showPass( unsigned pass );
+        uint32_t maxIterations() const;
+        uint64_t evalRow( const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1 );
+        uint64_t evalColumn( const CpuDispatch *d, unsigned x, unsigned y0, unsigned y1 );
+        uint64_t subdivide( const CpuDispatch *d, unsigned x0, unsigned y0, unsigned x1, unsigned y1 );
+
+        ThreadPool _pool;
+        TileScheduler _scheduler;
+        const CpuKernel *_kernel;
+        unsigned _width;
+        unsigned _height;
+        uint8_t *_pixels;
+        float *_field;
+        // the previous frame, while reusing it after a pan
+        uint8_t *_backpixels = nullptr;
+        float *_backfield = nullptr;
+        CpuColormap _colormap;
+        bool _colorsstale = false; // _pixels are from an older colormap
+        CpuView _view;
+        CpuView _fieldview;        // view _field was evaluated with
+        bool _fieldvalid = false;
+        uint64_t _reusedpixels = 0;
+        float *_cx;
+        float *_cy;
+        DeepZoom _deep;
+        bool _interiorchecks = true;
+        CpuInteriorStats _interiorstats;
+        CpuSubdivision _subdivision = CpuSubdivisionOff;
+        std::atomic<uint64_t> _filledpixels{ 0 };
+        // bumped by anything that makes progressive passes stale
+        std::atomic<unsigned> _generation{ 0 };
+        unsigned _passgeneration = ~0u;
+        int _pass = -1; // last progressive pass done
+        Uniforms _passuniforms;
+        double _lastseconds = 0.0;
+        // Per-frame uniforms, one slot per frame in flight. Frames complete
+        // before generateTexture returns, but going through the ring keeps
+        // this path honest about slot lifetimes.
+        FrameRing _ring;
+        Uniforms _uniforms[frames_in_flight];
+        float _lasttime = 0.0f;
+};
+
+#endif
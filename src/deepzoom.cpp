@@ -0,0 +1,297 @@
+#include "deepzoom.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+
+// Fixed
+
+bool Fixed::parse( const char *s, unsigned fraclimbs, Fixed *out )
+{
+    Fixed f(fraclimbs);
+    const char *intdigits, *fracdigits = nullptr;
+    size_t nint = 0, nfrac = 0;
+    long exponent = 0;
+    uint32_t integer = 0;
+
+    while (isspace((unsigned char)*s))
+        ++s;
+    if (*s == '-' || *s == '+')
+        f._negative = *s++ == '-';
+
+    intdigits = s;
+    while (isdigit((unsigned char)*s))
+        ++s, ++nint;
+    if (*s == '.')
+    {
+        fracdigits = ++s;
+        while (isdigit((unsigned char)*s))
+            ++s, ++nfrac;
+    }
+    if (nint + nfrac == 0)
+        return false;
+    if (*s == 'e' || *s == 'E')
+    {
+        char *end;
+        exponent = strtol(s + 1, &end, 10);
+        if (end == s + 1)
+            return false;
+        s = end;
+    }
+    if (*s != '\0')
+        return false;
+
+    // the fraction, from its last digit up: f = (f + digit) / 10
+    for (size_t i = nfrac; i-- > 0;)
+    {
+        f._limbs.back() += fracdigits[i] - '0';
+        f.divSmall(10);
+    }
+    // the integer part has to fit the integer limb
+    for (size_t i = 0; i < nint; ++i)
+        integer = integer * 10 + (intdigits[i] - '0');
+    f._limbs.back() += integer;
+
+    for (; exponent > 0; --exponent)
+        f.mulSmall(10);
+    for (; exponent < 0; ++exponent)
+        f.divSmall(10);
+
+    *out = f;
+    return true;
+}
+
+double Fixed::toDouble() const
+{
+    size_t fraclimbs = _limbs.size() - 1;
+    double d = 0.0;
+
+    // the top three limbs cover a double's mantissa
+    for (size_t i = _limbs.size(), n = 0; i-- > 0 && n < 3; ++n)
+        d += ldexp((double)_limbs[i], 32 * ((int)i - (int)fraclimbs));
+    return _negative ? -d : d;
+}
+
+void Fixed::divSmall( uint32_t d )
+{
+    uint64_t rem = 0;
+
+    for (size_t i = _limbs.size(); i-- > 0;)
+    {
+        uint64_t cur = (rem << 32) | _limbs[i];
+        _limbs[i] = (uint32_t)(cur / d);
+        rem = cur % d;
+    }
+}
+
+// the integer limb wraps if the result does not fit
+void Fixed::mulSmall( uint32_t m )
+{
+    uint64_t carry = 0;
+
+    for (uint32_t &limb : _limbs)
+    {
+        uint64_t cur = (uint64_t)limb * m + carry;
+        limb = (uint32_t)cur;
+        carry = cur >> 32;
+    }
+}
+
+int Fixed::compareMagnitudes( const Fixed &a, const Fixed &b )
+{
+    for (size_t i = a._limbs.size(); i-- > 0;)
+    {
+        if (a._limbs[i] != b._limbs[i])
+            return a._limbs[i] < b._limbs[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+Fixed Fixed::addMagnitudes( const Fixed &a, const Fixed &b, bool negative )
+{
+    Fixed r(a._limbs.size() - 1);
+    uint64_t carry = 0;
+
+    for (size_t i = 0; i < a._limbs.size(); ++i)
+    {
+        uint64_t sum = (uint64_t)a._limbs[i] + b._limbs[i] + carry;
+        r._limbs[i] = (uint32_t)sum;
+        carry = sum >> 32;
+    }
+    r._negative = negative;
+    return r;
+}
+
+// |a| >= |b|
+Fixed Fixed::subMagnitudes( const Fixed &a, const Fixed &b, bool negative )
+{
+    Fixed r(a._limbs.size() - 1);
+    int64_t borrow = 0;
+
+    for (size_t i = 0; i < a._limbs.size(); ++i)
+    {
+        int64_t diff = (int64_t)a._limbs[i] - b._limbs[i] - borrow;
+        borrow = diff < 0;
+        r._limbs[i] = (uint32_t)(diff + (borrow << 32));
+    }
+    r._negative = negative;
+    return r;
+}
+
+Fixed operator+( const Fixed &a, const Fixed &b )
+{
+    if (a._negative == b._negative)
+        return Fixed::addMagnitudes(a, b, a._negative);
+    if (Fixed::compareMagnitudes(a, b) >= 0)
+        return Fixed::subMagnitudes(a, b, a._negative);
+    return Fixed::subMagnitudes(b, a, b._negative);
+}
+
+Fixed operator-( const Fixed &a, const Fixed &b )
+{
+    Fixed negb = b;
+    negb._negative = !b._negative;
+    return a + negb;
+}
+
+// Truncates to the precision of the operands. Both have to have the same.
+Fixed operator*( const Fixed &a, const Fixed &b )
+{
+    size_t n = a._limbs.size();
+    size_t fraclimbs = n - 1;
+    std::vector<uint32_t> wide(2 * n, 0);
+    Fixed r(fraclimbs);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t carry = 0;
+
+        if (!a._limbs[i])
+            continue;
+        for (size_t j = 0; j < n; ++j)
+        {
+            uint64_t cur = (uint64_t)a._limbs[i] * b._limbs[j] + wide[i + j] + carry;
+            wide[i + j] = (uint32_t)cur;
+            carry = cur >> 32;
+        }
+        wide[i + n] = (uint32_t)carry;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        r._limbs[i] = wide[i + fraclimbs];
+    r._negative = a._negative != b._negative;
+    return r;
+}
+
+// DeepZoom
+
+bool DeepZoom::setCenter( const char *re, const char *im )
+{
+    Fixed tmp;
+
+    if (!Fixed::parse(re, 2, &tmp) || !Fixed::parse(im, 2, &tmp))
+        return false;
+
+    _centerre = re;
+    _centerim = im;
+    _dirty = true;
+    return true;
+}
+
+void DeepZoom::prepare( unsigned width, unsigned height )
+{
+    if (!_dirty && width == _width && height == _height)
+        return;
+
+    _width = width;
+    _height = height;
+    _step = _scale / width;
+    _dirty = false;
+    _rebases.store(0, std::memory_order_relaxed);
+
+    // enough bits to resolve a pixel, plus guard bits for the rounding the
+    // orbit accumulates
+    double bits = -log2(_step) + 64.0;
+    _fraclimbs = bits > 64.0 ? (unsigned)ceil(bits / 32.0) : 2;
+
+    Fixed cr, ci;
+    Fixed::parse(_centerre.c_str(), _fraclimbs, &cr);
+    Fixed::parse(_centerim.c_str(), _fraclimbs, &ci);
+
+    Fixed zr(_fraclimbs), zi(_fraclimbs);
+
+    _refre.assign(1, 0.0);
+    _refim.assign(1, 0.0);
+
+    // Z_0 .. Z_n, up to and including the first value that escapes
+    for (uint32_t i = 0; i < _maxiter; ++i)
+    {
+        Fixed zrzi = zr * zi;
+
+        zr = zr * zr - zi * zi + cr;
+        zi = zrzi + zrzi + ci;
+
+        double re = zr.toDouble();
+        double im = zi.toDouble();
+
+        _refre.push_back(re);
+        _refim.push_back(im);
+        if (re * re + im * im > 4.0)
+            break;
+    }
+}
+
+uint64_t DeepZoom::evalRow( unsigned y, unsigned x0, unsigned x1, float *field ) const
+{
+    const double *refre = _refre.data();
+    const double *refim = _refim.data();
+    size_t last = _refre.size() - 1;
+    double dcy = ((double)y - 0.5 * _height) * _step;
+    uint64_t cost = 0, rebases = 0;
+
+    for (unsigned x = x0; x < x1; ++x)
+    {
+        double dcx = ((double)x - 0.5 * _width) * _step;
+        double dx = 0.0, dy = 0.0;
+        size_t m = 0;
+        uint32_t n = 0;
+
+        while (n < _maxiter)
+        {
+            double zr = refre[m], zi = refim[m];
+            // the pixel's actual orbit
+            double fx = zr + dx, fy = zi + dy;
+            double mag = fx * fx + fy * fy;
+
+            if (mag > 4.0)
+                break;
+
+            // Rebase when the orbit is closer to zero than to the reference,
+            // where dz would otherwise swamp Z and the pixel glitch, or when
+            // the reference has no next value.
+            if (mag < dx * dx + dy * dy || m == last)
+            {
+                dx = fx;
+                dy = fy;
+                zr = zi = 0.0;
+                m = 0;
+                ++rebases;
+            }
+
+            // dz' = 2 Z dz + dz^2 + dc
+            double ndx = 2.0 * (zr * dx - zi * dy) + (dx * dx - dy * dy) + dcx;
+            double ndy = 2.0 * (zr * dy + zi * dx) + 2.0 * dx * dy + dcy;
+
+            dx = ndx;
+            dy = ndy;
+            ++m;
+            ++n;
+        }
+
+        *field++ = (float)n;
+        cost += n + 1;
+    }
+
+    _rebases.fetch_add(rebases, std::memory_order_relaxed);
+    return cost;
+}
@@ -0,0 +1,98 @@
+#ifndef METALTOY_DEEPZOOM_H
+#define METALTOY_DEEPZOOM_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Signed fixed point number with one 32 bit integer limb and a runtime
+// number of 32 bit fraction limbs. Just enough arithmetic for a reference
+// orbit, where values stay well below 2^31.
+class Fixed
+{
+    public:
+        Fixed( unsigned fraclimbs = 2 ) : _limbs( fraclimbs + 1, 0 ) {}
+
+        // Parses decimal notation such as "-0.7436438870371587e-3". Returns
+        // false if the string is not a number.
+        static bool parse( const char *s, unsigned fraclimbs, Fixed *out );
+
+        double toDouble() const;
+
+        friend Fixed operator+( const Fixed &a, const Fixed &b );
+        friend Fixed operator-( const Fixed &a, const Fixed &b );
+        friend Fixed operator*( const Fixed &a, const Fixed &b );
+
+    private:
+        // little endian magnitude, the last limb is the integer part
+        std::vector<uint32_t> _limbs;
+        bool _negative = false;
+
+        static Fixed addMagnitudes( const Fixed &a, const Fixed &b, bool negative );
+        static Fixed subMagnitudes( const Fixed &a, const Fixed &b, bool negative );
+        static int compareMagnitudes( const Fixed &a, const Fixed &b );
+        void divSmall( uint32_t d );
+        void mulSmall( uint32_t m );
+};
+
+// Deep zoom into the mandelbrot set by perturbation.
+//
+// Plain escape time runs out of float precision at a zoom of around 1e-5 and
+// of double precision at around 1e-13. Here a single reference orbit through
+// the center of the view is computed in arbitrary precision once per frame.
+// Every pixel then only iterates its difference to that orbit in double
+// precision:
+//
+//     dz' = 2 Z dz + dz^2 + dc
+//
+// which stays accurate however small dc gets, down to the double exponent
+// range of roughly 1e-300.
+//
+// Where the pixel's orbit gets closer to zero than to the reference (the
+// point where the delta would lose its precision and glitch), and when the
+// reference orbit has escaped or ended, the pixel is rebased: its full value
+// becomes the new delta and it continues from the start of the reference.
+class DeepZoom
+{
+    public:
+        // Center in decimal notation, as many digits as the zoom needs.
+        // Returns false if either is not a number.
+        bool setCenter( const char *re, const char *im );
+        // Width of the view in the complex plane. Pixel deltas are doubles, so
+        // this works down to about 1e-290.
+        void setScale( double scale ) { _scale = scale; _dirty = true; }
+        double scale() const { return _scale; }
+        void setMaxIterations( uint32_t n ) { _maxiter = n; _dirty = true; }
+        uint32_t maxIterations() const { return _maxiter; }
+
+        // Computes the reference orbit for a width x height image if anything
+        // changed since the last call.
+        void prepare( unsigned width, unsigned height );
+
+        // Writes the iteration counts of pixels [x0, x1) of row y. Returns
+        // the number of iterations done. Safe to call from many threads.
+        uint64_t evalRow( unsigned y, unsigned x0, unsigned x1, float *field ) const;
+
+        unsigned precisionBits() const { return _fraclimbs * 32; }
+        size_t referenceLength() const { return _refre.size(); }
+        // pixel rebases since the last prepare
+        uint64_t rebases() const { return _rebases.load(std::memory_order_relaxed); }
+
+    private:
+        std::string _centerre = "-0.5";
+        std::string _centerim = "0";
+        double _scale = 2.0;
+        uint32_t _maxiter = 512;
+        bool _dirty = true;
+
+        unsigned _width = 0;
+        unsigned _height = 0;
+        unsigned _fraclimbs = 0;
+        double _step = 0.0; // pixel size
+        std::vector<double> _refre;
+        std::vector<double> _refim;
+        mutable std::atomic<uint64_t> _rebases{ 0 };
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "filewatch.h"
+
+#include <poll.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+FileWatcher::FileWatcher( const char *path, unsigned settle_ms )
+: _path( path )
+, _settle( settle_ms )
+{
+    size_t slash = _path.rfind('/');
+
+    if (slash == std::string::npos)
+    {
+        _dir = ".";
+        _name = _path;
+    }
+    else
+    {
+        _dir = _path.substr(0, slash ? slash : 1);
+        _name = _path.substr(slash + 1);
+    }
+
+    if (pipe(_wakefd))
+        return;
+
+#ifdef __linux__
+    _fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (_fd < 0)
+        return;
+
+    if (inotify_add_watch(_fd, _dir.c_str(),
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY) < 0)
+        return;
+#endif
+
+    _ok = true;
+    _thread = std::thread(&FileWatcher::run, this);
+}
+
+FileWatcher::~FileWatcher()
+{
+    _quit = true;
+
+    if (_thread.joinable())
+    {
+        char c = 0;
+        (void)!write(_wakefd[1], &c, 1);
+        _thread.join();
+    }
+
+    if (_fd >= 0)
+        close(_fd);
+    if (_wakefd[0] >= 0)
+    {
+        close(_wakefd[0]);
+        close(_wakefd[1]);
+    }
+}
+
+bool FileWatcher::changed()
+{
+    unsigned v = _version.load(std::memory_order_acquire);
+
+    if (v == _seen)
+        return false;
+
+    _seen = v;
+    return true;
+}
+
+#ifdef __linux__
+
+// returns true if any of the pending events is about our file
+static bool drain_events(int fd, const std::string &name)
+{
+    alignas(struct inotify_event) char buf[4096];
+    bool hit = false;
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + n; )
+        {
+            struct inotify_event *ev = (struct inotify_event*)p;
+
+            if (ev->len && !strcmp(ev->name, name.c_str()))
+                hit = true;
+
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    return hit;
+}
+
+void FileWatcher::run()
+{
+    struct pollfd fds[2] = { { _fd, POLLIN, 0 }, { _wakefd[0], POLLIN, 0 } };
+    bool pending = false;
+
+    while (!_quit)
+    {
+        // wait forever for the first event of a burst, then only until the
+        // file has been quiet for the settle time
+        int r = poll(fds, 2, pending ? (int)_settle : -1);
+
+        if (r < 0)
+            continue;
+
+        if (r == 0)
+        {
+            pending = false;
+            _version.fetch_add(1, std::memory_order_release);
+            continue;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        if (drain_events(_fd, _name))
+            pending = true;
+    }
+}
+
+#else
+
+static bool stat_file(const std::string &path, struct stat *st)
+{
+    if (stat(path.c_str(), st))
+    {
+        memset(st, 0, sizeof(*st));
+        return false;
+    }
+    return true;
+}
+
+static inline long long mtime_ns(const struct stat &st)
+{
+#ifdef __APPLE__
+    return st.st_mtimespec.tv_sec * 1000000000ll + st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+#endif
+}
+
+void FileWatcher::run()
+{
+    // no inotify, poll the modification time instead
+    const int interval_ms = 100;
+    struct pollfd wake = { _wakefd[0], POLLIN, 0 };
+    struct stat last, now;
+    bool pending = false;
+
+    stat_file(_path, &last);
+
+    while (!_quit)
+    {
+        if (poll(&wake, 1, pending ? (int)_settle : interval_ms) > 0)
+            break;
+
+        stat_file(_path, &now);
+
+        bool differs = mtime_ns(now) != mtime_ns(last) || now.st_size != last.st_size
+            || now.st_ino != last.st_ino;
+        last = now;
+
+        if (differs)
+        {
+            pending = true;
+        }
+        else if (pending)
+        {
+            pending = false;
+            _version.fetch_add(1, std::memory_order_release);
+        }
+    }
+}
+
+#endif
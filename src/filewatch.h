@@ -0,0 +1,49 @@
+#ifndef METALTOY_FILEWATCH_H
+#define METALTOY_FILEWATCH_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Watches one file from a background thread and counts its changes, so the
+// frame loop can ask whether anything happened without touching the file
+// system. Bursts of writes (editors often truncate, write and rename in quick
+// succession) are coalesced into one change once the file has been quiet for
+// settle_ms.
+//
+// On Linux this is driven by inotify on the file's directory, which also
+// catches editors that save by renaming a new file over the old one.
+// Elsewhere the watcher thread polls the file's modification time.
+class FileWatcher
+{
+    public:
+        FileWatcher( const char *path, unsigned settle_ms = 30 );
+        ~FileWatcher();
+
+        // True if the file changed since the last call that returned true.
+        // The first call always returns true. Never blocks or does any I/O.
+        bool changed();
+
+        // false if the watch could not be set up, in which case changed()
+        // only ever reports the initial change
+        bool ok() const { return _ok; }
+
+        const std::string &path() const { return _path; }
+
+    private:
+        void run();
+
+        std::string _path;
+        std::string _dir;
+        std::string _name;
+        unsigned _settle;
+        std::atomic<unsigned> _version{ 1 };
+        unsigned _seen = 0;
+        std::atomic<bool> _quit{ false };
+        bool _ok = false;
+        int _fd = -1;       // inotify instance
+        int _wakefd[2] = { -1, -1 }; // written to on destruction
+        std::thread _thread;
+};
+
+#endif
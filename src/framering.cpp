@@ -0,0 +1,46 @@
+#include "framering.h"
+
+#include <assert.h>
+
+FrameRing::FrameRing( unsigned slots )
+: _slots( slots )
+{
+    assert(slots > 0 && slots <= 32);
+}
+
+unsigned FrameRing::acquire()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    unsigned slot = _next;
+
+    // slots are handed out in order, so this is the oldest frame's slot
+    _freed.wait(lock, [&]{ return !(_busy & (1u << slot)); });
+
+    _busy |= 1u << slot;
+    _next = (slot + 1) % _slots;
+    _frames++;
+
+    return slot;
+}
+
+void FrameRing::release( unsigned slot )
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        assert((_busy & (1u << slot)) && "releasing a slot that is not in flight");
+        _busy &= ~(1u << slot);
+    }
+    _freed.notify_all();
+}
+
+void FrameRing::drain()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _freed.wait(lock, [&]{ return _busy == 0; });
+}
+
+unsigned FrameRing::inFlight()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return __builtin_popcount(_busy);
+}
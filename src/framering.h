@@ -0,0 +1,41 @@
+#ifndef METALTOY_FRAMERING_H
+#define METALTOY_FRAMERING_H
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+
+// Tracks which of N per-frame slots (uniform buffers etc.) are still in use
+// by the device. A frame acquires the next slot before writing to it and the
+// device releases it once the frame's work has completed, from whatever
+// thread that is reported on. Acquire blocks while all slots are in flight,
+// which throttles the cpu to at most N frames ahead.
+class FrameRing
+{
+    public:
+        FrameRing( unsigned slots );
+
+        // Waits for the next slot in order to be free and marks it in flight.
+        unsigned acquire();
+
+        // Marks a slot handed out by acquire() as free again.
+        void release( unsigned slot );
+
+        // Waits until no slot is in flight.
+        void drain();
+
+        unsigned size() const { return _slots; }
+        // number of slots acquired so far, i.e. the index of the next frame
+        uint64_t frameCount() const { return _frames; }
+        unsigned inFlight();
+
+    private:
+        unsigned _slots;
+        unsigned _next = 0;
+        uint64_t _frames = 0;
+        uint32_t _busy = 0; // bit per slot
+        std::mutex _mutex;
+        std::condition_variable _freed;
+};
+
+#endif
@@ -9,5 +9,18 @@ extern unsigned int global_texture_height;
 extern unsigned int global_window_width;
 extern unsigned int global_window_height;
 extern bool global_quiet;
+extern bool global_cpu_compute;
+extern unsigned int global_thread_count;
+extern const char *global_cpu_kernel;
+extern bool global_interior_checks;
+extern bool global_interior_stats;
+extern int global_subdivision; // a CpuSubdivision
+extern bool global_progressive;
+extern const char *global_jit_source; // cpu kernel to compile at runtime, or null
+extern bool global_jit_interpret; // run global_jit_source on the bytecode vm instead
+extern unsigned int global_supersample; // texture pixels per window pixel, each way
+extern int global_resolve; // a ResolveFilter, how the texture is shrunk to the window
+extern const char *global_video_path; // Y4M file the frames are recorded into, or null
+extern const char *global_video_command; // encoder to pipe raw frames into, or null
 
 #endif
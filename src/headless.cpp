@@ -0,0 +1,345 @@
+#include "headless.h"
+#include "globals.h"
+#include "cpurenderer.h"
+#include "cpujit.h"
+#include "imageio.h"
+#include "kernelcache.h"
+#include "resolve.h"
+#include "tiledrender.h"
+#include "trace.h"
+#include "videowrite.h"
+
+#include <chrono>
+#include <errno.h>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+// Animation time advances as if frames were presented at this rate, so the
+// output does not depend on how fast the machine renders.
+static const float frame_rate = 60.0f;
+
+static inline double getCurrentTimeInSeconds()
+{
+    using Clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+// What frames are saved and recorded as: the renderer's pixels, or with
+// --resolve those resolved to the window size
+struct FrameOutput
+{
+    CpuRenderer &renderer;
+    Resolver resolver;
+    std::vector<uint8_t> resolved; // empty if frames are not resolved
+
+    FrameOutput( CpuRenderer &r ) : renderer( r ) {}
+
+    unsigned width() const { return resolved.empty() ? renderer.width() : resolver.width(); }
+    unsigned height() const { return resolved.empty() ? renderer.height() : resolver.height(); }
+
+    // The current frame, resolved on the renderer's threads if need be
+    const uint8_t *pixels()
+    {
+        if (resolved.empty())
+            return renderer.pixels();
+        resolver.resolve(renderer.pixels(), resolved.data(), &renderer.pool());
+        return resolved.data();
+    }
+};
+
+// Saves a frame as name.ppm, or name.png encoded on the renderer's threads.
+// return 0 on success
+static int save_image(const HeadlessOptions &opts, FrameOutput &out, const uint8_t *pixels, const char *name)
+{
+    char path[1024];
+    int r;
+
+    snprintf(path, sizeof(path), "%s.%s", name, opts.png ? "png" : "ppm");
+    if (opts.png)
+        r = write_png(path, out.width(), out.height(), pixels, opts.pnglevel, &out.renderer.pool());
+    else
+        r = write_ppm(path, out.width(), out.height(), pixels);
+
+    if (r)
+        fprintf(stderr, "Failed to write %s\n", path);
+    return r;
+}
+
+// Renders a frame in coarse to fine passes, saving every pass but the last
+// as frame_NNNNN_passN. return 0 on success
+static int render_progressive(const HeadlessOptions &opts, FrameOutput &out, float time, unsigned frame)
+{
+    CpuRenderer &renderer = out.renderer;
+    double start = getCurrentTimeInSeconds();
+    char path[1024];
+    int pass;
+
+    do
+    {
+        pass = renderer.refine(time);
+        if (pass < 0)
+            return -1;
+
+        if (!global_quiet)
+            fprintf(stderr, "  pass %d: %.2f ms\n", pass, (getCurrentTimeInSeconds() - start) * 1e3);
+
+        if (!opts.outdir || pass == CpuRenderer::progressive_passes - 1)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/frame_%05u_pass%d", opts.outdir, frame, pass);
+        if (save_image(opts, out, out.pixels(), path))
+            return -1;
+    } while (pass < (int)CpuRenderer::progressive_passes - 1);
+
+    return 0;
+}
+
+// Applies the deep zoom options. return 0 on success
+static int set_deep_view(const HeadlessOptions &opts, DeepZoom &deep)
+{
+    if (opts.center)
+    {
+        std::string center = opts.center;
+        size_t comma = center.find(',');
+
+        if (comma == std::string::npos
+                || !deep.setCenter(center.substr(0, comma).c_str(), center.substr(comma + 1).c_str()))
+        {
+            fprintf(stderr, "Expected --center re,im, got %s\n", opts.center);
+            return -1;
+        }
+    }
+    if (opts.scale > 0.0)
+        deep.setScale(opts.scale);
+    if (opts.maxiterations)
+        deep.setMaxIterations(opts.maxiterations);
+    return 0;
+}
+
+// Opens the video output asked for, if any. return 0 on success
+static int open_video(VideoWriter &video, unsigned width, unsigned height)
+{
+    const char *what = global_video_path ? global_video_path : global_video_command;
+    int r = 0;
+
+    if (global_video_path)
+        r = video.openFile(global_video_path, width, height, (unsigned)frame_rate);
+    else if (global_video_command)
+        r = video.openPipe(global_video_command, width, height);
+    if (r)
+        fprintf(stderr, "Failed to open video output %s\n", what);
+    return r;
+}
+
+// Renders the first frame into opts.tiled. Returns the process exit code.
+static int run_tiled(const HeadlessOptions &opts, const CpuKernel *kernel)
+{
+    TiledRenderer renderer(opts.tiledwidth, opts.tiledheight, global_thread_count);
+
+    renderer.setKernel(kernel);
+    renderer.setInteriorChecks(global_interior_checks);
+    if (set_deep_view(opts, renderer.deepZoom()))
+        return 1;
+
+    if (renderer.render(opts.tiled, 0.0f))
+        return 1;
+
+    if (!global_quiet)
+    {
+        double pixels = (double)renderer.width() * renderer.height();
+
+        fprintf(stderr, "%ux%u with %s on %u threads into %s: %.2f s, %.1f Mpix/s, "
+                "at most %u tiles (%.1f MB) in memory\n",
+                renderer.width(), renderer.height(), kernel->name, renderer.threadCount(), opts.tiled,
+                renderer.lastSeconds(), pixels / renderer.lastSeconds() / 1e6,
+                renderer.peakTiles(), renderer.bufferBytes() / 1e6);
+    }
+    return 0;
+}
+
+int run_headless(const HeadlessOptions &opts)
+{
+    const CpuKernel *kernel;
+    double total = 0.0;
+    char path[1024];
+
+    KernelCache cache;
+    std::unique_ptr<CpuJit> jit;
+
+    if (global_jit_source)
+    {
+        jit.reset(new CpuJit(global_jit_source, &cache, global_quiet, global_jit_interpret));
+        if (jit->load())
+            return 1;
+        kernel = jit->kernel();
+    }
+    else
+    {
+        kernel = cpu_find_kernel(global_cpu_kernel);
+    }
+    if (!kernel)
+    {
+        fprintf(stderr, "No cpu kernel named %s\n", global_cpu_kernel);
+        return 1;
+    }
+
+    if (opts.tiled)
+        return run_tiled(opts, kernel);
+
+    if (opts.outdir && mkdir(opts.outdir, 0755) && errno != EEXIST)
+    {
+        fprintf(stderr, "Failed to create output directory %s. Errno %d\n", opts.outdir, errno);
+        return 1;
+    }
+
+    CpuRenderer renderer(global_texture_width, global_texture_height, global_thread_count);
+    renderer.setKernel(kernel);
+    renderer.setInteriorChecks(global_interior_checks);
+    renderer.setSubdivision((CpuSubdivision)global_subdivision);
+
+    DeepZoom &deep = renderer.deepZoom();
+    if (set_deep_view(opts, deep))
+        return 1;
+
+    FrameOutput out(renderer);
+    if (opts.resolve && (renderer.width() != global_window_width || renderer.height() != global_window_height))
+    {
+        out.resolver.setup(renderer.width(), renderer.height(), global_window_width, global_window_height,
+                (ResolveFilter)global_resolve);
+        out.resolved.resize((size_t)out.width() * out.height() * 4);
+    }
+
+    // Offline, every frame is recorded: a full ring waits for the writer
+    // instead of dropping frames.
+    VideoWriter video;
+    if (open_video(video, out.width(), out.height()))
+        return 1;
+
+    for (unsigned frame = 0; frame < opts.frames; ++frame)
+    {
+        TRACE_SCOPE("frame");
+        float time = frame / frame_rate;
+        double start = getCurrentTimeInSeconds();
+        double seconds;
+
+        // the source may have been edited since the last frame
+        if (jit && jit->poll() != kernel)
+        {
+            kernel = jit->kernel();
+            renderer.setKernel(kernel);
+        }
+
+        if (opts.palettecycle && frame > 0)
+        {
+            CpuPalette palette;
+            palette.offset += time;
+            renderer.setPalette(palette);
+            renderer.recolor();
+        }
+        else
+        {
+            if (frame > 0)
+            {
+                renderer.pan(opts.pandx, opts.pandy);
+                if (opts.zoom != 1.0)
+                {
+                    deep.setScale(deep.scale() * opts.zoom);
+                    renderer.cancel();
+                }
+            }
+            if (!global_progressive)
+                renderer.generateTexture(time);
+            else if (render_progressive(opts, out, time, frame))
+                return 1;
+        }
+        // all passes of a progressive frame, otherwise the same as the
+        // renderer's own timing
+        seconds = global_progressive ? getCurrentTimeInSeconds() - start : renderer.lastFrameSeconds();
+        total += seconds;
+
+        if (!global_quiet)
+        {
+            const TileScheduler &sched = renderer.scheduler();
+            double umin, uavg;
+            double pixels = (double)renderer.width() * renderer.height();
+
+            sched.utilizationRange(&umin, &uavg);
+            fprintf(stderr, "frame %u: %.2f ms, %.1f Mpix/s, %u tiles, utilization %.0f%% avg %.0f%% min, "
+                    "%.0f%% reused, %.0f%% filled\n",
+                    frame, seconds * 1e3, pixels / seconds / 1e6,
+                    sched.tileCount(), uavg * 100, umin * 100,
+                    100.0 * renderer.reusedPixels() / pixels, 100.0 * renderer.filledPixels() / pixels);
+            if (global_interior_stats)
+            {
+                const CpuInteriorStats &stats = renderer.interiorStats();
+                fprintf(stderr, "  interior: %llu pixels by cardioid/bulb, %llu by periodicity\n",
+                        (unsigned long long)stats.bulb.load(), (unsigned long long)stats.periodic.load());
+            }
+            if (kernel->flags & CpuKernelDeepZoom)
+                fprintf(stderr, "  scale %.3g, %u bit reference of %zu iterations, %llu rebases\n",
+                        deep.scale(), deep.precisionBits(), deep.referenceLength() - 1,
+                        (unsigned long long)deep.rebases());
+        }
+
+        if (!video.isOpen() && !opts.outdir)
+            continue;
+
+        const uint8_t *pixels = out.pixels();
+
+        if (video.isOpen())
+        {
+            TRACE_SCOPE("readback");
+            int slot = video.acquire(true);
+
+            if (slot < 0)
+            {
+                fprintf(stderr, "Failed to write video frame %u\n", frame);
+                return 1;
+            }
+            memcpy(video.slotPixels(slot), pixels, (size_t)out.width() * out.height() * 4);
+            video.submit(slot);
+        }
+
+        if (!opts.outdir)
+            continue;
+
+        TRACE_SCOPE("save_image");
+        snprintf(path, sizeof(path), "%s/frame_%05u", opts.outdir, frame);
+        if (save_image(opts, out, pixels, path))
+            return 1;
+    }
+
+    if (video.isOpen())
+    {
+        if (video.close())
+        {
+            fprintf(stderr, "Failed to write video output\n");
+            return 1;
+        }
+        if (!global_quiet)
+            fprintf(stderr, "%llu frames of video, %.2f ms waiting for the writer\n",
+                    (unsigned long long)video.framesWritten(), video.waitSeconds() * 1e3);
+    }
+
+    if (!global_quiet && opts.frames > 0)
+    {
+        const TileScheduler &sched = renderer.scheduler();
+
+        fprintf(stderr, "%u frames of %ux%u with %s on %u threads: %.1f Mpix/s\n",
+                opts.frames, renderer.width(), renderer.height(), kernel->name,
+                renderer.threadCount(),
+                (double)renderer.width() * renderer.height() * opts.frames / total / 1e6);
+
+        // of the last frame
+        for (unsigned w = 0; w < renderer.threadCount(); ++w)
+            fprintf(stderr, "  thread %u: %.0f%% busy, %u tiles, %u stolen\n", w,
+                    sched.utilization(w) * 100, sched.workerStats()[w].tiles,
+                    sched.workerStats()[w].steals);
+    }
+
+    return 0;
+}
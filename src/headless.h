@@ -0,0 +1,37 @@
+#ifndef METALTOY_HEADLESS_H
+#define METALTOY_HEADLESS_H
+
+#include "pngwrite.h"
+
+struct HeadlessOptions
+{
+    unsigned frames = 1;
+    const char *outdir = nullptr; // frames are not saved if null
+    bool png = false; // save frames as PNG instead of PPM
+    PngLevel pnglevel = PngDefault;
+    // Frames are saved and recorded at the window size, resolved with
+    // global_resolve, instead of at the texture size.
+    bool resolve = false;
+    // Only the first frame is computed, the rest recolor it with a palette
+    // that shifts over time.
+    bool palettecycle = false;
+    // pixels to pan the view by every frame
+    long pandx = 0;
+    long pandy = 0;
+    // view of the mandelbrot-deep kernel
+    const char *center = nullptr; // "re,im" in decimal, default -0.5,0
+    double scale = 0.0;           // width of the view, 0 for the default
+    double zoom = 1.0;            // factor the scale changes by every frame
+    unsigned maxiterations = 0;   // 0 for the default
+    // Renders a single image of tiledwidth x tiledheight into this tiled
+    // TIFF instead of frames, streaming it out in tiles.
+    const char *tiled = nullptr;
+    unsigned tiledwidth = 0;
+    unsigned tiledheight = 0;
+};
+
+// Renders frames through the cpu compute path as fast as possible, without a
+// window or display link. Returns the process exit code.
+int run_headless(const HeadlessOptions &opts);
+
+#endif
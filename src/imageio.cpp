@@ -0,0 +1,237 @@
+#include "imageio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+int write_ppm(const char *path, unsigned width, unsigned height, const uint8_t *rgba)
+{
+    FILE *fd;
+    uint8_t *row;
+    int r = -1;
+
+    fd = fopen(path, "wb");
+    if (!fd)
+        return -1;
+
+    row = (uint8_t*)malloc((size_t)width * 3);
+
+    fprintf(fd, "P6\n%u %u\n255\n", width, height);
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        const uint8_t *src = rgba + (size_t)y * width * 4;
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            row[x * 3 + 0] = src[x * 4 + 0];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4 + 2];
+        }
+
+        if (fwrite(row, 3, width, fd) != width)
+            goto end;
+    }
+
+    r = 0;
+
+end:
+    free(row);
+    if (fclose(fd))
+        r = -1;
+    return r;
+}
+
+// TIFF field types
+static const uint16_t tiff_short = 3;
+static const uint16_t tiff_long = 4;
+static const uint16_t tiff_long8 = 16;
+
+// little endian, as files starting with II are
+static void put_le(std::vector<uint8_t> &out, uint64_t v, unsigned n)
+{
+    for (unsigned i = 0; i < n; ++i)
+        out.push_back((uint8_t)(v >> (8 * i)));
+}
+
+// An IFD entry. value is what goes in its value field: the values
+// themselves, packed little endian, if they fit there, otherwise their
+// offset in the file.
+static void put_entry(std::vector<uint8_t> &out, bool bigtiff, uint16_t tag, uint16_t type,
+        uint64_t count, uint64_t value)
+{
+    put_le(out, tag, 2);
+    put_le(out, type, 2);
+    put_le(out, count, bigtiff ? 8 : 4);
+    put_le(out, value, bigtiff ? 8 : 4);
+}
+
+// Writes count values, first, first + step, ..., a chunk at a time.
+// return 0 on success
+static int put_series(FILE *fd, uint64_t count, uint64_t first, uint64_t step, unsigned size)
+{
+    std::vector<uint8_t> chunk;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        put_le(chunk, first + i * step, size);
+        if (chunk.size() >= 65536 || i + 1 == count)
+        {
+            if (fwrite(chunk.data(), 1, chunk.size(), fd) != chunk.size())
+                return -1;
+            chunk.clear();
+        }
+    }
+    return 0;
+}
+
+TiledTiffWriter::~TiledTiffWriter()
+{
+    if (_fd)
+        fclose(_fd);
+    free(_tile);
+}
+
+int TiledTiffWriter::open( const char *path, unsigned width, unsigned height, unsigned tilesize )
+{
+    static const unsigned nentries = 11;
+
+    if (!width || !height || !tilesize || tilesize % 16)
+        return -1;
+
+    _width = width;
+    _height = height;
+    _tilesize = tilesize;
+    _cols = (width + tilesize - 1) / tilesize;
+    _rows = (height + tilesize - 1) / tilesize;
+    _written = 0;
+
+    uint64_t ntiles = (uint64_t)_cols * _rows;
+    uint64_t tilebytes = (uint64_t)tilesize * tilesize * 3;
+
+    // classic TIFF unless offsets no longer fit in 32 bits
+    _bigtiff = 8 + 2 + nentries * 12 + 4 + 6 + ntiles * 8 + ntiles * tilebytes > 0xffffffffull;
+
+    // Values that do not fit in the value field of their entry follow the
+    // IFD, then the tiles.
+    unsigned fieldsize = _bigtiff ? 8 : 4;
+    uint64_t ifd = _bigtiff ? 16 : 8;
+    uint64_t at = ifd + (_bigtiff ? 8 : 2) + nentries * (_bigtiff ? 20 : 12) + fieldsize;
+    uint64_t bits = 8 | 8 << 16 | 8ull << 32;
+    uint64_t offsets = 0;
+    uint64_t counts = tilebytes | (ntiles > 1 ? tilebytes << 32 : 0);
+    bool bitsout = 6 > fieldsize, offsetsout = ntiles > 1, countsout = ntiles * 4 > fieldsize;
+
+    if (bitsout)
+    {
+        bits = at;
+        at += 6;
+    }
+    if (offsetsout)
+    {
+        offsets = at;
+        at += ntiles * fieldsize;
+    }
+    if (countsout)
+    {
+        counts = at;
+        at += ntiles * 4;
+    }
+    uint64_t data = at;
+    if (!offsetsout)
+        offsets = data;
+
+    std::vector<uint8_t> head;
+    head.push_back('I');
+    head.push_back('I');
+    if (_bigtiff)
+    {
+        put_le(head, 43, 2);
+        put_le(head, 8, 2); // bytes per offset
+        put_le(head, 0, 2);
+        put_le(head, ifd, 8);
+        put_le(head, nentries, 8);
+    }
+    else
+    {
+        put_le(head, 42, 2);
+        put_le(head, ifd, 4);
+        put_le(head, nentries, 2);
+    }
+
+    // in ascending order of tags
+    put_entry(head, _bigtiff, 256, tiff_long, 1, width);             // ImageWidth
+    put_entry(head, _bigtiff, 257, tiff_long, 1, height);            // ImageLength
+    put_entry(head, _bigtiff, 258, tiff_short, 3, bits);             // BitsPerSample
+    put_entry(head, _bigtiff, 259, tiff_short, 1, 1);                // Compression, none
+    put_entry(head, _bigtiff, 262, tiff_short, 1, 2);                // PhotometricInterpretation, RGB
+    put_entry(head, _bigtiff, 277, tiff_short, 1, 3);                // SamplesPerPixel
+    put_entry(head, _bigtiff, 284, tiff_short, 1, 1);                // PlanarConfiguration, chunky
+    put_entry(head, _bigtiff, 322, tiff_long, 1, tilesize);          // TileWidth
+    put_entry(head, _bigtiff, 323, tiff_long, 1, tilesize);          // TileLength
+    put_entry(head, _bigtiff, 324, _bigtiff ? tiff_long8 : tiff_long, ntiles, offsets); // TileOffsets
+    put_entry(head, _bigtiff, 325, tiff_long, ntiles, counts);       // TileByteCounts
+    put_le(head, 0, fieldsize); // no next IFD
+    if (bitsout)
+    {
+        for (int i = 0; i < 3; ++i)
+            put_le(head, 8, 2);
+    }
+
+    _tile = (uint8_t*)malloc(tilebytes);
+    _fd = fopen(path, "wb");
+    if (!_fd || !_tile)
+        return -1;
+
+    if (fwrite(head.data(), 1, head.size(), _fd) != head.size()
+            || (offsetsout && put_series(_fd, ntiles, data, tilebytes, fieldsize))
+            || (countsout && put_series(_fd, ntiles, tilebytes, 0, 4)))
+        return -1;
+    return 0;
+}
+
+int TiledTiffWriter::writeTile( const uint8_t *rgba, size_t stride )
+{
+    unsigned x0 = (unsigned)(_written % _cols) * _tilesize;
+    unsigned y0 = (unsigned)(_written / _cols) * _tilesize;
+    // of the tile, inside the image
+    unsigned w = _width - x0 < _tilesize ? _width - x0 : _tilesize;
+    unsigned h = _height - y0 < _tilesize ? _height - y0 : _tilesize;
+    size_t tilebytes = (size_t)_tilesize * _tilesize * 3;
+
+    if (!_fd || _written >= (uint64_t)_cols * _rows)
+        return -1;
+
+    if (w < _tilesize || h < _tilesize)
+        memset(_tile, 0, tilebytes);
+
+    for (unsigned y = 0; y < h; ++y)
+    {
+        const uint8_t *src = rgba + y * stride;
+        uint8_t *dst = _tile + (size_t)y * _tilesize * 3;
+
+        for (unsigned x = 0; x < w; ++x)
+        {
+            dst[x * 3 + 0] = src[x * 4 + 0];
+            dst[x * 3 + 1] = src[x * 4 + 1];
+            dst[x * 3 + 2] = src[x * 4 + 2];
+        }
+    }
+
+    if (fwrite(_tile, 1, tilebytes, _fd) != tilebytes)
+        return -1;
+    ++_written;
+    return 0;
+}
+
+int TiledTiffWriter::close()
+{
+    bool complete = _written == (uint64_t)_cols * _rows;
+    int r = _fd && !fclose(_fd) && complete ? 0 : -1;
+
+    _fd = nullptr;
+    free(_tile);
+    _tile = nullptr;
+    return r;
+}
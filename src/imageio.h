@@ -0,0 +1,52 @@
+#ifndef METALTOY_IMAGEIO_H
+#define METALTOY_IMAGEIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Writes a tightly packed RGBA8 image as a binary PPM, dropping alpha.
+// return 0 on success
+int write_ppm(const char *path, unsigned width, unsigned height, const uint8_t *rgba);
+
+// Writes a tiled, uncompressed RGB8 TIFF a tile at a time, so an image of any
+// size can be written from a few tiles in memory. Tiles go in file order,
+// left to right then top to bottom, and their offsets are known up front, so
+// the header and the tile index are written by open() and nothing needs to
+// be seeked back to. Files past 4 GB are BigTIFF.
+class TiledTiffWriter
+{
+    public:
+        TiledTiffWriter() {}
+        ~TiledTiffWriter();
+
+        // tilesize is a multiple of 16. return 0 on success
+        int open( const char *path, unsigned width, unsigned height, unsigned tilesize );
+
+        // Appends the next tile, tilesize x tilesize RGBA8 pixels with rows
+        // stride bytes apart. Alpha is dropped, and so are the parts of edge
+        // tiles outside the image, which are written as black. return 0 on
+        // success
+        int writeTile( const uint8_t *rgba, size_t stride );
+
+        // Flushes and closes the file, which is complete once every tile has
+        // been written. return 0 on success
+        int close();
+
+        unsigned tileColumns() const { return _cols; }
+        unsigned tileRows() const { return _rows; }
+        bool bigTiff() const { return _bigtiff; }
+
+    private:
+        FILE *_fd = nullptr;
+        unsigned _width = 0;
+        unsigned _height = 0;
+        unsigned _tilesize = 0;
+        unsigned _cols = 0;
+        unsigned _rows = 0;
+        uint64_t _written = 0; // tiles so far
+        bool _bigtiff = false;
+        uint8_t *_tile = nullptr; // RGB, for writeTile
+};
+
+#endif
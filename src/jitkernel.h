@@ -0,0 +1,50 @@
+#ifndef METALTOY_JITKERNEL_H
+#define METALTOY_JITKERNEL_H
+
+// Included by kernels the cpu jit compiles (see cpujit.h). A kernel is a
+// function of the texture coordinate, like the functions computeMain calls in
+// shader.metal, that returns the gray level of the pixel:
+//
+//     #include "jitkernel.h"
+//
+//     static float stripes(float stx, float sty, const Uniforms &u)
+//     {
+//         return 0.5f + 0.5f * sinf(40.0f * stx + u.time);
+//     }
+//
+//     METALTOY_KERNEL(stripes)
+//
+// and METALTOY_KERNEL exports it under the names the jit looks up. Metal
+// sources are compiled through mslkernel.h instead.
+
+#include "cpukernels.h"
+
+#include <math.h>
+
+// Bump when CpuDispatch, Uniforms or the exported functions change, so
+// modules built against an older layout are rejected instead of run.
+#define METALTOY_JIT_ABI 3
+
+// what metaltoy_jit_output() says the field values are
+#define METALTOY_JIT_GRAY 0  // gray levels in [0, 1]
+#define METALTOY_JIT_RGBA8 1 // the bits of RGBA8 pixels
+
+#define METALTOY_KERNEL(fn) \
+    extern "C" unsigned metaltoy_jit_abi() \
+    { \
+        return METALTOY_JIT_ABI; \
+    } \
+    extern "C" unsigned metaltoy_jit_output() \
+    { \
+        return METALTOY_JIT_GRAY; \
+    } \
+    extern "C" uint64_t metaltoy_jit_eval(const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1, \
+            float *field) \
+    { \
+        float sty = float(y) / d->height; \
+        for (unsigned x = x0; x < x1; ++x) \
+            *field++ = fn(float(x) / d->width, sty, *d->uniforms); \
+        return x1 - x0; \
+    }
+
+#endif
@@ -0,0 +1,298 @@
+#include "kernelcache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// temporary files of a crashed process are removed after this long
+static const time_t stale_temp_seconds = 3600;
+
+static std::atomic<unsigned> temp_count{ 0 };
+
+// FIPS 180-4
+struct Sha256
+{
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    uint8_t block[64];
+    size_t used = 0;
+    uint64_t length = 0;
+
+    void update( const void *data, size_t n );
+    void final( uint8_t out[32] );
+    void compress();
+};
+
+static inline uint32_t rotr(uint32_t x, unsigned n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+void Sha256::compress()
+{
+    static const uint32_t k[64] =
+    {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t w[64];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+
+    for (unsigned i = 0; i < 16; ++i)
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+            | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    for (unsigned i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    for (unsigned i = 0; i < 64; ++i)
+    {
+        uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+void Sha256::update( const void *data, size_t n )
+{
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+
+    length += n;
+    while (n)
+    {
+        size_t take = 64 - used < n ? 64 - used : n;
+        memcpy(block + used, p, take);
+        used += take;
+        p += take;
+        n -= take;
+        if (used == 64)
+        {
+            compress();
+            used = 0;
+        }
+    }
+}
+
+void Sha256::final( uint8_t out[32] )
+{
+    uint64_t bits = length * 8;
+    uint8_t pad = 0x80;
+
+    update(&pad, 1);
+    pad = 0;
+    while (used != 56)
+        update(&pad, 1);
+    for (int i = 7; i >= 0; --i)
+    {
+        uint8_t byte = (uint8_t)(bits >> (i * 8));
+        update(&byte, 1);
+    }
+
+    for (unsigned i = 0; i < 8; ++i)
+    {
+        out[i * 4 + 0] = (uint8_t)(h[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)h[i];
+    }
+}
+
+// like mkdir -p. return 0 on success
+static int make_dirs(const std::string &path)
+{
+    for (size_t i = 1; i <= path.size(); ++i)
+    {
+        if (i < path.size() && path[i] != '/')
+            continue;
+        if (mkdir(path.substr(0, i).c_str(), 0755) && errno != EEXIST)
+            return -1;
+    }
+    return 0;
+}
+
+KernelCache::KernelCache( const char *dir, uint64_t maxbytes )
+: _maxbytes( maxbytes )
+{
+    const char *env;
+
+    if (dir)
+        _dir = dir;
+    else if ((env = getenv("METALTOY_CACHE_DIR")) && *env)
+        _dir = env;
+    else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+        _dir = std::string(env) + "/metaltoy";
+    else if ((env = getenv("HOME")) && *env)
+        _dir = std::string(env) + "/.cache/metaltoy";
+    else
+        return;
+
+    _ok = make_dirs(_dir) == 0;
+}
+
+std::string KernelCache::key( const char *backend, const char *options, const char *src )
+{
+    static const char hex[] = "0123456789abcdef";
+    Sha256 sha;
+    uint8_t digest[32];
+    std::string s;
+
+    // the terminating nulls keep ("ab", "c") and ("a", "bc") apart
+    sha.update(backend, strlen(backend) + 1);
+    sha.update(options, strlen(options) + 1);
+    sha.update(src, strlen(src));
+    sha.final(digest);
+
+    for (uint8_t b : digest)
+    {
+        s += hex[b >> 4];
+        s += hex[b & 15];
+    }
+    return s;
+}
+
+bool KernelCache::lookup( const std::string &key, const char *suffix, std::string *path )
+{
+    *path = _dir + "/" + key + suffix;
+
+    if (!_ok || access(path->c_str(), R_OK))
+        return false;
+
+    // the modification time is what eviction goes by
+    utimensat(AT_FDCWD, path->c_str(), nullptr, 0);
+    return true;
+}
+
+std::string KernelCache::tempPath( const char *suffix ) const
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "/tmp.%ld.%u", (long)getpid(), temp_count.fetch_add(1));
+    return _dir + name + suffix;
+}
+
+int KernelCache::commit( const std::string &tmppath, const std::string &key, const char *suffix )
+{
+    std::string path = _dir + "/" + key + suffix;
+
+    if (!_ok || rename(tmppath.c_str(), path.c_str()))
+    {
+        unlink(tmppath.c_str());
+        return -1;
+    }
+
+    evict(key);
+    return 0;
+}
+
+void KernelCache::evict( const std::string &keep )
+{
+    struct Entry
+    {
+        std::string name;
+        uint64_t size;
+        struct timespec used;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    time_t now = time(nullptr);
+    DIR *dir;
+    int lockfd;
+
+    if (!_ok)
+        return;
+
+    // one evicting process at a time, the others wait and then find there
+    // is nothing left to do
+    lockfd = open((_dir + "/lock").c_str(), O_RDWR | O_CREAT, 0644);
+    if (lockfd < 0)
+        return;
+    if (flock(lockfd, LOCK_EX))
+    {
+        close(lockfd);
+        return;
+    }
+
+    dir = opendir(_dir.c_str());
+    if (dir)
+    {
+        struct dirent *de;
+
+        while ((de = readdir(dir)))
+        {
+            std::string name = de->d_name;
+            std::string path = _dir + "/" + name;
+            struct stat st;
+
+            if (name[0] == '.' || name == "lock" || stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+                continue;
+
+            // another process may still be writing a recent one
+            if (!name.compare(0, 4, "tmp."))
+            {
+                if (now - st.st_mtime > stale_temp_seconds)
+                    unlink(path.c_str());
+                continue;
+            }
+
+            total += st.st_size;
+            if (!keep.empty() && !name.compare(0, keep.size(), keep))
+                continue;
+#ifdef __APPLE__
+            entries.push_back({ name, (uint64_t)st.st_size, st.st_mtimespec });
+#else
+            entries.push_back({ name, (uint64_t)st.st_size, st.st_mtim });
+#endif
+        }
+        closedir(dir);
+    }
+
+    if (total > _maxbytes)
+    {
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            if (a.used.tv_sec != b.used.tv_sec)
+                return a.used.tv_sec < b.used.tv_sec;
+            return a.used.tv_nsec < b.used.tv_nsec;
+        });
+
+        for (const Entry &e : entries)
+        {
+            if (total <= _maxbytes)
+                break;
+            if (!unlink((_dir + "/" + e.name).c_str()))
+                total -= e.size;
+        }
+    }
+
+    // closing drops the lock
+    close(lockfd);
+}
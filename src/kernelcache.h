@@ -0,0 +1,54 @@
+#ifndef METALTOY_KERNELCACHE_H
+#define METALTOY_KERNELCACHE_H
+
+#include <stdint.h>
+#include <string>
+
+// Compiled kernels on disk, keyed by a hash of everything that went into
+// compiling them, so an unchanged shader (or one edited back to an earlier
+// version) is never compiled twice.
+//
+// Artifacts are written to a temporary file and renamed into place, so other
+// processes only ever see complete ones. When the cache grows past its size
+// cap the least recently used artifacts are deleted, under a lock file so
+// concurrent processes do not evict against each other.
+class KernelCache
+{
+    public:
+        static const uint64_t default_max_bytes = 256ull << 20;
+
+        // dir == nullptr is $METALTOY_CACHE_DIR, or else metaltoy in
+        // $XDG_CACHE_HOME or ~/.cache. It is created if need be.
+        KernelCache( const char *dir = nullptr, uint64_t maxbytes = default_max_bytes );
+
+        // false if there is no cache directory, lookups then always miss
+        bool ok() const { return _ok; }
+        const std::string &dir() const { return _dir; }
+
+        // Hex SHA-256 over the backend (compiler and version), the compile
+        // options and the source.
+        static std::string key( const char *backend, const char *options, const char *src );
+
+        // Stores the path of the artifact for key with the given suffix. If
+        // it exists, marks it as used and returns true.
+        bool lookup( const std::string &key, const char *suffix, std::string *path );
+
+        // A path in the cache directory that nobody else uses, to write a
+        // new artifact into before commit().
+        std::string tempPath( const char *suffix ) const;
+
+        // Moves a finished temporary file into place as the artifact for key
+        // and evicts whatever no longer fits. return 0 on success
+        int commit( const std::string &tmppath, const std::string &key, const char *suffix );
+
+        // Deletes least recently used artifacts until the cache fits its cap.
+        // keep is never deleted.
+        void evict( const std::string &keep = std::string() );
+
+    private:
+        std::string _dir;
+        uint64_t _maxbytes;
+        bool _ok = false;
+};
+
+#endif
@@ -1,30 +1,225 @@
+#ifdef __APPLE__
 #include "app.h"
+#endif
 #include "globals.h"
+#include "headless.h"
+#include "resolve.h"
+#ifdef METALTOY_SOFTMETAL
+#include "softapp.h"
+#endif
+#include "trace.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 unsigned int global_texture_width = 512;
 unsigned int global_texture_height = 512;
 unsigned int global_window_width = 512;
 unsigned int global_window_height = 512;
 bool global_quiet = false;
+bool global_cpu_compute = false;
+unsigned int global_thread_count = 0;
+const char *global_cpu_kernel = "mandelbrot";
+bool global_interior_checks = true;
+bool global_interior_stats = false;
+int global_subdivision = 0;
+bool global_progressive = false;
+const char *global_jit_source = nullptr;
+bool global_jit_interpret = false;
+unsigned int global_supersample = 4;
+int global_resolve = ResolveBox;
+const char *global_video_path = nullptr;
+const char *global_video_command = nullptr;
 
 int main( int argc, char* argv[] )
 {
+    HeadlessOptions headless;
+    int res = 0;
+#ifdef __APPLE__
+    bool headless_mode = false;
+#else
+    // there is no window to draw into
+    bool headless_mode = true;
+#endif
+#ifdef METALTOY_SOFTMETAL
+    bool soft_mode = false;
+#endif
+
+    trace_set_thread_name("main");
+    trace_init_from_env();
+
     if (argc > 1)
     {
         for (int i = 1; i < argc; ++i) {
             const char *arg = argv[i];
+            if (arg[0] == '-' && arg[1] == '-')
+            {
+                const char *opt = arg + 2;
+                const char *val = i + 1 < argc ? argv[i + 1] : nullptr;
+
+                if (!strcmp(opt, "headless"))
+                {
+                    headless_mode = true;
+                    continue;
+                }
+#ifdef METALTOY_SOFTMETAL
+                if (!strcmp(opt, "soft"))
+                {
+                    soft_mode = true;
+                    continue;
+                }
+#endif
+                if (!strcmp(opt, "palette-cycle"))
+                {
+                    headless.palettecycle = true;
+                    continue;
+                }
+                if (!strcmp(opt, "progressive"))
+                {
+                    global_progressive = true;
+                    continue;
+                }
+                if (!strcmp(opt, "no-interior-checks"))
+                {
+                    global_interior_checks = false;
+                    continue;
+                }
+                if (!strcmp(opt, "interior-stats"))
+                {
+                    global_interior_stats = true;
+                    continue;
+                }
+
+                if (!val)
+                {
+                    fprintf(stderr, "Argument %s needs a value\n", arg);
+                    return 1;
+                }
+                ++i;
+
+                if (!strcmp(opt, "frames")) headless.frames = ::atoi(val);
+                else if (!strcmp(opt, "out")) headless.outdir = val;
+                else if (!strcmp(opt, "kernel")) global_cpu_kernel = val;
+                else if (!strcmp(opt, "jit") || !strcmp(opt, "vm"))
+                {
+                    global_jit_source = val;
+                    global_jit_interpret = !strcmp(opt, "vm");
+                    global_cpu_compute = true;
+                }
+                else if (!strcmp(opt, "video")) global_video_path = val;
+                else if (!strcmp(opt, "video-pipe")) global_video_command = val;
+                else if (!strcmp(opt, "threads")) global_thread_count = ::atoi(val);
+                else if (!strcmp(opt, "trace")) trace_start(val);
+                else if (!strcmp(opt, "subdivide"))
+                {
+                    static const char *modes[] = { "off", "interior", "any", "interior-approx" };
+                    int mode = -1;
+
+                    for (int m = 0; m < 4; ++m)
+                        if (!strcmp(val, modes[m]))
+                            mode = m;
+                    if (mode < 0)
+                    {
+                        fprintf(stderr, "Expected --subdivide off, interior, any or interior-approx, got %s\n", val);
+                        return 1;
+                    }
+                    global_subdivision = mode;
+                }
+                else if (!strcmp(opt, "center")) headless.center = val;
+                else if (!strcmp(opt, "scale")) headless.scale = ::atof(val);
+                else if (!strcmp(opt, "zoom")) headless.zoom = ::atof(val);
+                else if (!strcmp(opt, "max-iterations")) headless.maxiterations = ::atoi(val);
+                else if (!strcmp(opt, "tiled"))
+                {
+                    headless.tiled = val;
+                    headless_mode = true;
+                }
+                else if (!strcmp(opt, "size"))
+                {
+                    // not bounded by the texture limit, tiled renders stream
+                    if (sscanf(val, "%ux%u", &headless.tiledwidth, &headless.tiledheight) != 2
+                            || !headless.tiledwidth || !headless.tiledheight)
+                    {
+                        fprintf(stderr, "Expected --size widthxheight, got %s\n", val);
+                        return 1;
+                    }
+                }
+                else if (!strcmp(opt, "format"))
+                {
+                    if (strcmp(val, "ppm") && strcmp(val, "png"))
+                    {
+                        fprintf(stderr, "Expected --format ppm or png, got %s\n", val);
+                        return 1;
+                    }
+                    headless.png = !strcmp(val, "png");
+                }
+                else if (!strcmp(opt, "png-level"))
+                {
+                    static const char *levels[] = { "store", "fast", "default" };
+                    int level = -1;
+
+                    for (int l = 0; l < 3; ++l)
+                        if (!strcmp(val, levels[l]))
+                            level = l;
+                    if (level < 0)
+                    {
+                        fprintf(stderr, "Expected --png-level store, fast or default, got %s\n", val);
+                        return 1;
+                    }
+                    headless.pnglevel = (PngLevel)level;
+                }
+                else if (!strcmp(opt, "supersample"))
+                {
+                    global_supersample = ::atoi(val);
+                    if (global_supersample < 1 || global_supersample > 4)
+                    {
+                        fprintf(stderr, "Expected --supersample 1 to 4, got %s\n", val);
+                        return 1;
+                    }
+                }
+                else if (!strcmp(opt, "resolve"))
+                {
+                    static const char *filters[] = { "off", "box", "tent", "lanczos" };
+                    int filter = -1;
+
+                    for (int f = 0; f < ResolveFilterCount; ++f)
+                        if (!strcmp(val, filters[f]))
+                            filter = f;
+                    if (filter < 0)
+                    {
+                        fprintf(stderr, "Expected --resolve off, box, tent or lanczos, got %s\n", val);
+                        return 1;
+                    }
+                    global_resolve = filter;
+                    headless.resolve = filter != ResolveOff;
+                }
+                else if (!strcmp(opt, "pan"))
+                {
+                    if (sscanf(val, "%ld,%ld", &headless.pandx, &headless.pandy) != 2)
+                    {
+                        fprintf(stderr, "Expected --pan dx,dy, got %s\n", val);
+                        return 1;
+                    }
+                }
+                else
+                {
+                    fprintf(stderr, "Unknown argument %s\n", arg);
+                    return 1;
+                }
+                continue;
+            }
             if (arg[0] == '-')
             {
                 switch (arg[1])
                 {
                     case 'q': global_quiet = true; break;
+                    case 'c': global_cpu_compute = true; break;
                     default: fprintf(stderr, "Unknown argument %s\n", arg); return 1;
                 }
                 continue;
             }
 
-            int res = ::atoi(argv[1]);
+            res = ::atoi(arg);
 
             if (res < 1 || res > 4096)
             {
@@ -33,13 +228,33 @@ int main( int argc, char* argv[] )
                 return -1;
             }
 
-            global_window_width = res;
-            global_window_height = res;
-            global_texture_width = res * 4;
-            global_texture_height = res * 4;
         }
     }
 
+    // the texture is computed at a multiple of the window size and resolved
+    // down to it
+    if (res)
+    {
+        global_window_width = res;
+        global_window_height = res;
+        global_texture_width = res * global_supersample;
+        global_texture_height = res * global_supersample;
+    }
+
+    if (headless.tiled && !headless.tiledwidth)
+    {
+        headless.tiledwidth = global_texture_width;
+        headless.tiledheight = global_texture_height;
+    }
+
+#ifdef METALTOY_SOFTMETAL
+    if (soft_mode)
+        return run_soft(headless);
+#endif
+    if (headless_mode)
+        return run_headless(headless);
+
+#ifdef __APPLE__
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
     MyAppDelegate del;
@@ -49,6 +264,7 @@ int main( int argc, char* argv[] )
     pSharedApplication->run();
 
     pAutoreleasePool->release();
+#endif
 
     return 0;
 }
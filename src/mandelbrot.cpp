@@ -0,0 +1,384 @@
+#include "mandelbrot.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MANDELBROT_X86 1
+#include <immintrin.h>
+#endif
+
+// All variants iterate with the same single precision operations in the
+// same order as the scalar loop (the library is built with -ffp-contract=off
+// so the scalar code is not fused either). That is what keeps their iteration
+// counts identical. Pixel coordinates come from the tables in CpuDispatch,
+// which have padding for the lanes past the end of a row or column.
+//
+// With CpuDispatch::interiorchecks, pixels inside the set skip most of their
+// max_iteration iterations in two ways:
+//
+// - Points in the main cardioid or the period 2 bulb are known to be inside
+//   and are not iterated at all.
+// - Brent's cycle detection: the orbit is saved at iterations 1, 2, 4, 8, ...
+//   and compared with every later value. An orbit that comes back to a value
+//   exactly has entered a cycle of floats, and would run to max_iteration.
+//
+// The second is exact by construction. The first decides analytically what
+// the float loop decides by rounding, which differs at most for points right
+// on the boundary.
+
+static inline bool in_main_bulbs(float cx, float cy)
+{
+    float xq = cx - 0.25f;
+    float y2 = cy * cy;
+    float q = xq * xq + y2;
+
+    if (q * (q + xq) <= 0.25f * y2)
+        return true;
+    return (cx + 1.0f) * (cx + 1.0f) + y2 <= 0.0625f;
+}
+
+static inline void count_interior(const CpuDispatch *d, uint64_t bulb, uint64_t periodic)
+{
+    if (!d->interiorstats)
+        return;
+    if (bulb)
+        d->interiorstats->bulb.fetch_add(bulb, std::memory_order_relaxed);
+    if (periodic)
+        d->interiorstats->periodic.fetch_add(periodic, std::memory_order_relaxed);
+}
+
+// Coordinates of the pixels of a line: along row y from column x, or down
+// column x from row y.
+struct Line
+{
+    const float *cx, *cy;
+    unsigned stepx, stepy; // 1 along the line, 0 across it
+
+    Line(const CpuDispatch *d, unsigned x, unsigned y, bool column)
+    : cx(d->cx + x), cy(d->cy + y), stepx(!column), stepy(column) {}
+};
+
+// pixels [0, n) of the line from i that are inside the main bulbs
+static inline unsigned bulb_mask(const CpuDispatch *d, const Line &l, unsigned i, unsigned n)
+{
+    unsigned mask = 0;
+
+    if (!d->interiorchecks)
+        return 0;
+    for (unsigned k = 0; k < n; ++k)
+        mask |= (unsigned)in_main_bulbs(l.cx[(i + k) * l.stepx], l.cy[(i + k) * l.stepy]) << k;
+    return mask;
+}
+
+static uint64_t mandelbrot_line_scalar(const CpuDispatch *d, unsigned x0, unsigned y0, unsigned n,
+        bool column, uint32_t *iterations)
+{
+    Line l(d, x0, y0, column);
+    uint64_t work = 0, bulb = 0, periodic = 0;
+
+    for (unsigned i = 0; i < n; ++i)
+    {
+        float cx = l.cx[i * l.stepx];
+        float cy = l.cy[i * l.stepy];
+
+        if (d->interiorchecks && in_main_bulbs(cx, cy))
+        {
+            *iterations++ = mandelbrot_max_iteration;
+            ++bulb;
+            continue;
+        }
+
+        float x = 0.0f;
+        float y = 0.0f;
+        uint32_t iteration = 0;
+        float xtmp = 0.0f;
+        float savedx = 0.0f;
+        float savedy = 0.0f;
+        uint32_t saveat = 1;
+        bool cycled = false;
+        while (x * x + y * y <= 4 && iteration < mandelbrot_max_iteration)
+        {
+            xtmp = x * x - y * y + cx;
+            y = 2 * x * y + cy;
+            x = xtmp;
+            iteration += 1;
+
+            if (!d->interiorchecks)
+                continue;
+            if (x == savedx && y == savedy)
+            {
+                cycled = true;
+                break;
+            }
+            if (iteration == saveat)
+            {
+                savedx = x;
+                savedy = y;
+                saveat <<= 1;
+            }
+        }
+
+        work += iteration;
+        if (cycled)
+        {
+            iteration = mandelbrot_max_iteration;
+            ++periodic;
+        }
+        *iterations++ = iteration;
+    }
+
+    count_interior(d, bulb, periodic);
+    return work;
+}
+
+#ifdef MANDELBROT_X86
+
+// Each lane keeps an active mask. A lane's count only grows while it is
+// active, and the loop exits as soon as no lane is. Lanes past the end of the
+// line start out inactive, so short lines cost no more than their pixels.
+// Lanes the interior checks resolve get max_iteration and drop out of the
+// mask.
+
+__attribute__((target("sse4.1")))
+static uint64_t mandelbrot_line_sse4(const CpuDispatch *d, unsigned x0, unsigned y0, unsigned n,
+        bool column, uint32_t *iterations)
+{
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 four = _mm_set1_ps(4.0f);
+    const __m128i maxcount = _mm_set1_epi32(mandelbrot_max_iteration);
+    const __m128i lanebits = _mm_set_epi32(8, 4, 2, 1);
+    Line l(d, x0, y0, column);
+    alignas(16) uint32_t tmp[4];
+    uint64_t work = 0, bulb = 0, periodic = 0;
+
+    for (unsigned i = 0; i < n; i += 4)
+    {
+        unsigned m = n - i < 4 ? n - i : 4;
+        unsigned inside = bulb_mask(d, l, i, m);
+        __m128 cx = l.stepx ? _mm_loadu_ps(l.cx + i) : _mm_set1_ps(*l.cx);
+        __m128 cy = l.stepy ? _mm_loadu_ps(l.cy + i) : _mm_set1_ps(*l.cy);
+        __m128 x = _mm_setzero_ps();
+        __m128 yy = _mm_setzero_ps();
+        __m128 savedx = _mm_setzero_ps();
+        __m128 savedy = _mm_setzero_ps();
+        uint32_t saveat = 1;
+        __m128i in = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(inside), lanebits), lanebits);
+        __m128i count = _mm_and_si128(in, maxcount);
+        __m128 active = _mm_andnot_ps(_mm_castsi128_ps(in),
+                _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(m), _mm_set_epi32(3, 2, 1, 0))));
+
+        bulb += __builtin_popcount(inside);
+
+        for (uint32_t k = 0; k < mandelbrot_max_iteration; ++k)
+        {
+            __m128 x2 = _mm_mul_ps(x, x);
+            __m128 y2 = _mm_mul_ps(yy, yy);
+            active = _mm_and_ps(active, _mm_cmple_ps(_mm_add_ps(x2, y2), four));
+            if (!_mm_movemask_ps(active))
+                break;
+            // active lanes are all ones, i.e. -1
+            count = _mm_sub_epi32(count, _mm_castps_si128(active));
+            __m128 xtmp = _mm_add_ps(_mm_sub_ps(x2, y2), cx);
+            yy = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(two, x), yy), cy);
+            x = xtmp;
+            work += m;
+
+            if (!d->interiorchecks)
+                continue;
+            __m128 same = _mm_and_ps(active,
+                    _mm_and_ps(_mm_cmpeq_ps(x, savedx), _mm_cmpeq_ps(yy, savedy)));
+            if (int cycled = _mm_movemask_ps(same))
+            {
+                count = _mm_blendv_epi8(count, maxcount, _mm_castps_si128(same));
+                active = _mm_andnot_ps(same, active);
+                periodic += __builtin_popcount(cycled);
+            }
+            if (k + 1 == saveat)
+            {
+                savedx = x;
+                savedy = yy;
+                saveat <<= 1;
+            }
+        }
+
+        _mm_store_si128((__m128i*)tmp, count);
+        for (unsigned k = 0; k < m; ++k)
+            *iterations++ = tmp[k];
+    }
+
+    count_interior(d, bulb, periodic);
+    return work;
+}
+
+__attribute__((target("avx2")))
+static uint64_t mandelbrot_line_avx2(const CpuDispatch *d, unsigned x0, unsigned y0, unsigned n,
+        bool column, uint32_t *iterations)
+{
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 four = _mm256_set1_ps(4.0f);
+    const __m256i maxcount = _mm256_set1_epi32(mandelbrot_max_iteration);
+    const __m256i lanebits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+    Line l(d, x0, y0, column);
+    alignas(32) uint32_t tmp[8];
+    uint64_t work = 0, bulb = 0, periodic = 0;
+
+    for (unsigned i = 0; i < n; i += 8)
+    {
+        unsigned m = n - i < 8 ? n - i : 8;
+        unsigned inside = bulb_mask(d, l, i, m);
+        __m256 cx = l.stepx ? _mm256_loadu_ps(l.cx + i) : _mm256_set1_ps(*l.cx);
+        __m256 cy = l.stepy ? _mm256_loadu_ps(l.cy + i) : _mm256_set1_ps(*l.cy);
+        __m256 x = _mm256_setzero_ps();
+        __m256 yy = _mm256_setzero_ps();
+        __m256 savedx = _mm256_setzero_ps();
+        __m256 savedy = _mm256_setzero_ps();
+        uint32_t saveat = 1;
+        __m256i in = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(inside), lanebits), lanebits);
+        __m256i count = _mm256_and_si256(in, maxcount);
+        __m256 active = _mm256_andnot_ps(_mm256_castsi256_ps(in), _mm256_castsi256_ps(
+                _mm256_cmpgt_epi32(_mm256_set1_epi32(m), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0))));
+
+        bulb += __builtin_popcount(inside);
+
+        for (uint32_t k = 0; k < mandelbrot_max_iteration; ++k)
+        {
+            __m256 x2 = _mm256_mul_ps(x, x);
+            __m256 y2 = _mm256_mul_ps(yy, yy);
+            active = _mm256_and_ps(active,
+                    _mm256_cmp_ps(_mm256_add_ps(x2, y2), four, _CMP_LE_OQ));
+            if (!_mm256_movemask_ps(active))
+                break;
+            count = _mm256_sub_epi32(count, _mm256_castps_si256(active));
+            __m256 xtmp = _mm256_add_ps(_mm256_sub_ps(x2, y2), cx);
+            yy = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(two, x), yy), cy);
+            x = xtmp;
+            work += m;
+
+            if (!d->interiorchecks)
+                continue;
+            __m256 same = _mm256_and_ps(active, _mm256_and_ps(
+                    _mm256_cmp_ps(x, savedx, _CMP_EQ_OQ), _mm256_cmp_ps(yy, savedy, _CMP_EQ_OQ)));
+            if (int cycled = _mm256_movemask_ps(same))
+            {
+                count = _mm256_blendv_epi8(count, maxcount, _mm256_castps_si256(same));
+                active = _mm256_andnot_ps(same, active);
+                periodic += __builtin_popcount(cycled);
+            }
+            if (k + 1 == saveat)
+            {
+                savedx = x;
+                savedy = yy;
+                saveat <<= 1;
+            }
+        }
+
+        _mm256_store_si256((__m256i*)tmp, count);
+        for (unsigned k = 0; k < m; ++k)
+            *iterations++ = tmp[k];
+    }
+
+    count_interior(d, bulb, periodic);
+    return work;
+}
+
+__attribute__((target("avx512f")))
+static uint64_t mandelbrot_line_avx512(const CpuDispatch *d, unsigned x0, unsigned y0, unsigned n,
+        bool column, uint32_t *iterations)
+{
+    const __m512 two = _mm512_set1_ps(2.0f);
+    const __m512 four = _mm512_set1_ps(4.0f);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i maxcount = _mm512_set1_epi32(mandelbrot_max_iteration);
+    Line l(d, x0, y0, column);
+    uint64_t work = 0, bulb = 0, periodic = 0;
+
+    for (unsigned i = 0; i < n; i += 16)
+    {
+        unsigned m = n - i < 16 ? n - i : 16;
+        __mmask16 lanes = (__mmask16)((1u << m) - 1);
+        __mmask16 inside = (__mmask16)bulb_mask(d, l, i, m);
+        __m512 cx = l.stepx ? _mm512_loadu_ps(l.cx + i) : _mm512_set1_ps(*l.cx);
+        __m512 cy = l.stepy ? _mm512_loadu_ps(l.cy + i) : _mm512_set1_ps(*l.cy);
+        __m512 x = _mm512_setzero_ps();
+        __m512 yy = _mm512_setzero_ps();
+        __m512 savedx = _mm512_setzero_ps();
+        __m512 savedy = _mm512_setzero_ps();
+        uint32_t saveat = 1;
+        __m512i count = _mm512_maskz_mov_epi32(inside, maxcount);
+        __mmask16 active = lanes & ~inside;
+
+        bulb += __builtin_popcount(inside);
+
+        for (uint32_t k = 0; k < mandelbrot_max_iteration; ++k)
+        {
+            __m512 x2 = _mm512_mul_ps(x, x);
+            __m512 y2 = _mm512_mul_ps(yy, yy);
+            active = _mm512_mask_cmp_ps_mask(active, _mm512_add_ps(x2, y2), four, _CMP_LE_OQ);
+            if (!active)
+                break;
+            count = _mm512_mask_add_epi32(count, active, count, one);
+            __m512 xtmp = _mm512_add_ps(_mm512_sub_ps(x2, y2), cx);
+            yy = _mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(two, x), yy), cy);
+            x = xtmp;
+            work += m;
+
+            if (!d->interiorchecks)
+                continue;
+            __mmask16 same = _mm512_mask_cmp_ps_mask(
+                    _mm512_mask_cmp_ps_mask(active, x, savedx, _CMP_EQ_OQ), yy, savedy, _CMP_EQ_OQ);
+            if (same)
+            {
+                count = _mm512_mask_mov_epi32(count, same, maxcount);
+                active &= ~same;
+                periodic += __builtin_popcount(same);
+            }
+            if (k + 1 == saveat)
+            {
+                savedx = x;
+                savedy = yy;
+                saveat <<= 1;
+            }
+        }
+
+        _mm512_mask_storeu_epi32(iterations, lanes, count);
+        iterations += m;
+    }
+
+    count_interior(d, bulb, periodic);
+    return work;
+}
+
+#endif
+
+MandelbrotLineFn mandelbrot_line_fn(MandelbrotIsa isa)
+{
+    switch (isa)
+    {
+        case MandelbrotIsaScalar:
+            return mandelbrot_line_scalar;
+#ifdef MANDELBROT_X86
+        case MandelbrotIsaSse4:
+            return __builtin_cpu_supports("sse4.1") ? mandelbrot_line_sse4 : nullptr;
+        case MandelbrotIsaAvx2:
+            return __builtin_cpu_supports("avx2") ? mandelbrot_line_avx2 : nullptr;
+        case MandelbrotIsaAvx512:
+            return __builtin_cpu_supports("avx512f") ? mandelbrot_line_avx512 : nullptr;
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+MandelbrotIsa mandelbrot_best_isa()
+{
+    for (int isa = MandelbrotIsaCount - 1; isa > MandelbrotIsaScalar; --isa)
+    {
+        if (mandelbrot_line_fn((MandelbrotIsa)isa))
+            return (MandelbrotIsa)isa;
+    }
+    return MandelbrotIsaScalar;
+}
+
+const char *mandelbrot_isa_name(MandelbrotIsa isa)
+{
+    static const char *names[MandelbrotIsaCount] = { "scalar", "sse4", "avx2", "avx512" };
+    return names[isa];
+}
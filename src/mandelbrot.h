@@ -0,0 +1,35 @@
+#ifndef METALTOY_MANDELBROT_H
+#define METALTOY_MANDELBROT_H
+
+#include "cpukernels.h"
+
+// Escape-time core of mandelbrot() in shader.metal, in scalar and explicit
+// SIMD flavours. Every flavour produces exactly the same iteration counts,
+// with or without the interior checks.
+
+static const uint32_t mandelbrot_max_iteration = 512;
+
+enum MandelbrotIsa
+{
+    MandelbrotIsaScalar,
+    MandelbrotIsaSse4,   // 4 lanes
+    MandelbrotIsaAvx2,   // 8 lanes
+    MandelbrotIsaAvx512, // 16 lanes
+    MandelbrotIsaCount
+};
+
+// Writes the iteration counts of n pixels from (x, y), along the row or down
+// the column, to iterations. Returns the iterations actually done, which the
+// interior checks of CpuDispatch can make far fewer than the counts add up to.
+typedef uint64_t (*MandelbrotLineFn)(const CpuDispatch *d, unsigned x, unsigned y, unsigned n,
+        bool column, uint32_t *iterations);
+
+// returns nullptr if this cpu cannot run the given isa
+MandelbrotLineFn mandelbrot_line_fn(MandelbrotIsa isa);
+
+// the widest isa this cpu supports
+MandelbrotIsa mandelbrot_best_isa();
+
+const char *mandelbrot_isa_name(MandelbrotIsa isa);
+
+#endif
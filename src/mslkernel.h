@@ -0,0 +1,73 @@
+#ifndef METALTOY_MSLKERNEL_H
+#define METALTOY_MSLKERNEL_H
+
+// Included ahead of a Metal source the cpu jit compiles (see cpujit.h), which
+// builds it against the emulated Metal standard library in msl/ and runs its
+// computeMain a row at a time:
+//
+//     #include "mslkernel.h"
+//     namespace metaltoy_msl {
+//     ... shader.metal ...
+//     }
+//     METALTOY_MSL_KERNEL(metaltoy_msl::computeMain)
+//
+// The namespace keeps the source's own struct Uniforms apart from the one in
+// uniforms.h. computeMain takes the texture to write and the position in the
+// grid, and optionally the grid size and the uniforms, in that order.
+
+#include "jitkernel.h"
+
+#include <metal_stdlib>
+
+typedef metal::texture2d<metal::half, metal::access::write> MslOutputTexture;
+
+template <class U>
+static inline void msl_invoke(void (*fn)(MslOutputTexture, metal::uint2, metal::uint2, const U&),
+        const MslOutputTexture &tex, metal::uint2 index, metal::uint2 grid, const Uniforms *u)
+{
+    fn(tex, index, grid, *reinterpret_cast<const U*>(u));
+}
+
+static inline void msl_invoke(void (*fn)(MslOutputTexture, metal::uint2, metal::uint2),
+        const MslOutputTexture &tex, metal::uint2 index, metal::uint2 grid, const Uniforms *u)
+{
+    fn(tex, index, grid);
+}
+
+static inline void msl_invoke(void (*fn)(MslOutputTexture, metal::uint2),
+        const MslOutputTexture &tex, metal::uint2 index, metal::uint2 grid, const Uniforms *u)
+{
+    fn(tex, index);
+}
+
+// Pixels [x0, x1) of row y, written as RGBA8 into the bits of the field
+// values, which cpu_colorize_packed turns back into pixels.
+template <class Fn>
+static inline uint64_t msl_eval_row(Fn fn, const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1,
+        float *field)
+{
+    MslOutputTexture tex(reinterpret_cast<uint8_t*>(field), (size_t)(x1 - x0) * 4, d->width, d->height,
+            metal::uint2(x0, y), metal::uint2(x1 - x0, 1));
+    metal::uint2 grid(d->width, d->height);
+
+    for (unsigned x = x0; x < x1; ++x)
+        msl_invoke(fn, tex, metal::uint2(x, y), grid, d->uniforms);
+    return x1 - x0;
+}
+
+#define METALTOY_MSL_KERNEL(fn) \
+    extern "C" unsigned metaltoy_jit_abi() \
+    { \
+        return METALTOY_JIT_ABI; \
+    } \
+    extern "C" unsigned metaltoy_jit_output() \
+    { \
+        return METALTOY_JIT_RGBA8; \
+    } \
+    extern "C" uint64_t metaltoy_jit_eval(const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1, \
+            float *field) \
+    { \
+        return msl_eval_row(fn, d, y, x0, x1, field); \
+    }
+
+#endif
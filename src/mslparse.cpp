@@ -0,0 +1,1608 @@
+#include "mslparse.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum TokenKind
+{
+    TokenEnd,
+    TokenIdent,
+    TokenNumber,
+    TokenPunct,
+};
+
+struct Token
+{
+    TokenKind kind;
+    std::string text;
+    int line;
+};
+
+// longest first
+static const char *puncts[] = {
+    "<<=", ">>=", "::", "<=", ">=", "==", "!=", "&&", "||", "++", "--", "+=", "-=", "*=", "/=", "%=",
+    "&=", "|=", "^=", "<<", ">>", "->",
+};
+
+// Splits src into tokens, dropping comments and preprocessor lines.
+// return 0 on success
+static int tokenize(const char *src, std::vector<Token> *out, std::string *error)
+{
+    const char *p = src;
+    int line = 1;
+    bool linestart = true;
+
+    while (*p)
+    {
+        if (*p == '\n')
+        {
+            ++line;
+            ++p;
+            linestart = true;
+            continue;
+        }
+        if (isspace((unsigned char)*p))
+        {
+            ++p;
+            continue;
+        }
+        if (p[0] == '/' && p[1] == '/')
+        {
+            while (*p && *p != '\n')
+                ++p;
+            continue;
+        }
+        if (p[0] == '/' && p[1] == '*')
+        {
+            for (p += 2; *p && !(p[0] == '*' && p[1] == '/'); ++p)
+                if (*p == '\n')
+                    ++line;
+            if (*p)
+                p += 2;
+            continue;
+        }
+        // #include <metal_stdlib> and the like, the subset has no use for
+        // the preprocessor
+        if (*p == '#' && linestart)
+        {
+            while (*p && *p != '\n')
+                ++p;
+            continue;
+        }
+        linestart = false;
+
+        Token t;
+        const char *start = p;
+
+        t.line = line;
+        if (isalpha((unsigned char)*p) || *p == '_')
+        {
+            while (isalnum((unsigned char)*p) || *p == '_')
+                ++p;
+            t.kind = TokenIdent;
+        }
+        else if (isdigit((unsigned char)*p) || (*p == '.' && isdigit((unsigned char)p[1])))
+        {
+            if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+            {
+                for (p += 2; isxdigit((unsigned char)*p); ++p)
+                    ;
+            }
+            else
+            {
+                while (isdigit((unsigned char)*p) || *p == '.')
+                    ++p;
+                if (*p == 'e' || *p == 'E')
+                {
+                    ++p;
+                    if (*p == '+' || *p == '-')
+                        ++p;
+                    while (isdigit((unsigned char)*p))
+                        ++p;
+                }
+            }
+            while (isalpha((unsigned char)*p))
+                ++p;
+            t.kind = TokenNumber;
+        }
+        else
+        {
+            size_t n = 1;
+
+            for (const char *punct : puncts)
+            {
+                size_t len = strlen(punct);
+                if (!strncmp(p, punct, len))
+                {
+                    n = len;
+                    break;
+                }
+            }
+            if (!strchr("{}()[];,.<>=+-*/%&|^!~?:", *p))
+            {
+                *error = "line " + std::to_string(line) + ": unexpected character '" + std::string(1, *p) + "'";
+                return -1;
+            }
+            p += n;
+            t.kind = TokenPunct;
+        }
+        t.text.assign(start, p - start);
+        out->push_back(t);
+    }
+
+    out->push_back(Token{ TokenEnd, "", line });
+    return 0;
+}
+
+static int rank(MslBase b)
+{
+    switch (b)
+    {
+        case MslBool: return 0;
+        case MslInt: return 1;
+        case MslUint: return 2;
+        case MslFloat: return 3;
+        default: return -1;
+    }
+}
+
+static MslType make_type(MslBase base, unsigned n = 1)
+{
+    MslType t;
+    t.base = base;
+    t.n = n;
+    return t;
+}
+
+static std::unique_ptr<MslExpr> make_expr(MslExprKind kind, const MslType &type, int line)
+{
+    std::unique_ptr<MslExpr> e(new MslExpr);
+    e->kind = kind;
+    e->type = type;
+    e->line = line;
+    return e;
+}
+
+static std::unique_ptr<MslStmt> make_stmt(MslStmtKind kind, int line)
+{
+    std::unique_ptr<MslStmt> s(new MslStmt);
+    s->kind = kind;
+    s->line = line;
+    return s;
+}
+
+static std::unique_ptr<MslExpr> clone_expr(const MslExpr &e)
+{
+    std::unique_ptr<MslExpr> c(new MslExpr);
+
+    c->kind = e.kind;
+    c->type = e.type;
+    c->uniform = e.uniform;
+    c->line = e.line;
+    c->op = e.op;
+    c->fvalue = e.fvalue;
+    c->ivalue = e.ivalue;
+    c->var = e.var;
+    c->func = e.func;
+    c->field = e.field;
+    memcpy(c->swizzle, e.swizzle, sizeof(c->swizzle));
+    for (const auto &a : e.args)
+        c->args.push_back(clone_expr(*a));
+    return c;
+}
+
+// the categories of built in functions, by how their arguments convert
+enum BuiltinKind
+{
+    BuiltinFloat,   // float arguments of a common size, result the same
+    BuiltinNumeric, // numeric arguments of a common type, result the same
+    BuiltinReduce,  // float vectors to a float
+    BuiltinVector,  // float vectors, result the same
+    BuiltinBool,    // any, all
+    BuiltinSelect,
+};
+
+struct Builtin
+{
+    const char *name;
+    unsigned nargs;
+    BuiltinKind kind;
+};
+
+static const Builtin builtins[] = {
+    { "sin", 1, BuiltinFloat }, { "cos", 1, BuiltinFloat }, { "tan", 1, BuiltinFloat },
+    { "asin", 1, BuiltinFloat }, { "acos", 1, BuiltinFloat }, { "atan", 1, BuiltinFloat },
+    { "sinh", 1, BuiltinFloat }, { "cosh", 1, BuiltinFloat }, { "tanh", 1, BuiltinFloat },
+    { "exp", 1, BuiltinFloat }, { "exp2", 1, BuiltinFloat }, { "log", 1, BuiltinFloat },
+    { "log2", 1, BuiltinFloat }, { "log10", 1, BuiltinFloat }, { "sqrt", 1, BuiltinFloat },
+    { "rsqrt", 1, BuiltinFloat }, { "floor", 1, BuiltinFloat }, { "ceil", 1, BuiltinFloat },
+    { "round", 1, BuiltinFloat }, { "trunc", 1, BuiltinFloat }, { "fract", 1, BuiltinFloat },
+    { "saturate", 1, BuiltinFloat }, { "sign", 1, BuiltinFloat }, { "fabs", 1, BuiltinFloat },
+    { "pow", 2, BuiltinFloat }, { "powr", 2, BuiltinFloat }, { "atan2", 2, BuiltinFloat },
+    { "fmod", 2, BuiltinFloat }, { "fmin", 2, BuiltinFloat }, { "fmax", 2, BuiltinFloat },
+    { "step", 2, BuiltinFloat }, { "mix", 3, BuiltinFloat }, { "smoothstep", 3, BuiltinFloat },
+    { "fma", 3, BuiltinFloat },
+    { "abs", 1, BuiltinNumeric }, { "min", 2, BuiltinNumeric }, { "max", 2, BuiltinNumeric },
+    { "clamp", 3, BuiltinNumeric },
+    { "dot", 2, BuiltinReduce }, { "length", 1, BuiltinReduce }, { "length_squared", 1, BuiltinReduce },
+    { "distance", 2, BuiltinReduce },
+    { "normalize", 1, BuiltinVector }, { "cross", 2, BuiltinVector },
+    { "any", 1, BuiltinBool }, { "all", 1, BuiltinBool },
+    { "select", 3, BuiltinSelect },
+};
+
+static const Builtin *find_builtin(const std::string &name)
+{
+    for (const Builtin &b : builtins)
+        if (name == b.name)
+            return &b;
+    return nullptr;
+}
+
+// float constants of the Metal standard library
+static bool find_constant(const std::string &name, double *value)
+{
+    static const struct { const char *name; double value; } constants[] = {
+        { "M_PI_F", 3.14159265358979323846 }, { "M_PI_2_F", 1.57079632679489661923 },
+        { "M_PI_4_F", 0.78539816339744830962 }, { "M_1_PI_F", 0.31830988618379067154 },
+        { "M_2_PI_F", 0.63661977236758134308 }, { "M_E_F", 2.71828182845904523536 },
+        { "M_SQRT2_F", 1.41421356237309504880 }, { "M_LN2_F", 0.69314718055994530942 },
+        { "FLT_MAX", 3.402823466e+38 }, { "MAXFLOAT", 3.402823466e+38 },
+    };
+
+    for (const auto &c : constants)
+    {
+        if (name == c.name)
+        {
+            *value = c.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+class MslParser
+{
+    public:
+        MslParser( std::vector<Token> &tokens, MslProgram *prog )
+        : _tokens( tokens ), _prog( prog )
+        {}
+
+        int parse();
+        const std::string &error() const { return _error; }
+
+    private:
+        const Token &peek( unsigned ahead = 0 ) const
+        {
+            size_t i = _pos + ahead;
+            return _tokens[i < _tokens.size() ? i : _tokens.size() - 1];
+        }
+        bool is( const char *text, unsigned ahead = 0 ) const
+        {
+            const Token &t = peek(ahead);
+            return t.kind != TokenEnd && t.kind != TokenNumber && t.text == text;
+        }
+        bool accept( const char *text )
+        {
+            if (!is(text))
+                return false;
+            ++_pos;
+            return true;
+        }
+        bool expect( const char *text )
+        {
+            if (accept(text))
+                return true;
+            fail(std::string("expected '") + text + "' before '" + peek().text + "'");
+            return false;
+        }
+        // records the first error. Always returns nullptr
+        std::nullptr_t fail( const std::string &msg, int line = 0 )
+        {
+            if (_error.empty())
+                _error = "line " + std::to_string(line ? line : peek().line) + ": " + msg;
+            return nullptr;
+        }
+        int reject( const std::string &msg, int line = 0 )
+        {
+            fail(msg, line);
+            return -1;
+        }
+        bool failed() const { return !_error.empty(); }
+
+        void skipQualifiers( bool *kernel = nullptr, bool *stage = nullptr );
+        bool parseType( MslType *type );
+        bool parseAttribute( std::string *name, unsigned *index );
+
+        int parseStruct();
+        int parseGlobal( const MslType &type );
+        int parseFunction( const MslType &ret, bool kernel );
+
+        std::unique_ptr<MslStmt> parseStatement();
+        std::unique_ptr<MslStmt> parseBlock();
+        std::unique_ptr<MslStmt> parseDecl( const MslType &type );
+        std::unique_ptr<MslStmt> parseSimple(); // assignment, increment or call
+        std::unique_ptr<MslStmt> parseIf();
+        std::unique_ptr<MslStmt> parseLoop();
+
+        std::unique_ptr<MslExpr> parseExpr() { return parseTernary(); }
+        std::unique_ptr<MslExpr> parseTernary();
+        std::unique_ptr<MslExpr> parseBinary( int level );
+        std::unique_ptr<MslExpr> parseUnary();
+        std::unique_ptr<MslExpr> parsePostfix();
+        std::unique_ptr<MslExpr> parsePrimary();
+        std::unique_ptr<MslExpr> parseCall( const std::string &name, int line );
+        bool parseArgs( std::vector<std::unique_ptr<MslExpr>> *args );
+
+        std::unique_ptr<MslExpr> convert( std::unique_ptr<MslExpr> e, const MslType &to );
+        std::unique_ptr<MslExpr> toBool( std::unique_ptr<MslExpr> e );
+        std::unique_ptr<MslExpr> binary( const std::string &op, std::unique_ptr<MslExpr> a,
+                std::unique_ptr<MslExpr> b, int line );
+        std::unique_ptr<MslExpr> builtin( const Builtin &b, std::vector<std::unique_ptr<MslExpr>> args, int line );
+        bool commonType( const std::vector<std::unique_ptr<MslExpr>> &args, MslType *type, int line );
+
+        MslVar *declare( const std::string &name, const MslType &type, int line );
+        const MslVar *lookup( const std::string &name ) const;
+
+        std::vector<Token> &_tokens;
+        size_t _pos = 0;
+        MslProgram *_prog;
+        std::string _error;
+        MslFunction *_func = nullptr; // being parsed
+        std::vector<std::vector<MslVar*>> _scopes;
+        unsigned _loops = 0; // loops around the statement being parsed
+};
+
+// const, constant, device and the other qualifiers change nothing here
+void MslParser::skipQualifiers( bool *kernel, bool *stage )
+{
+    static const char *skip[] = { "const", "constexpr", "constant", "device", "thread", "static", "inline" };
+
+    for (;;)
+    {
+        bool found = false;
+
+        for (const char *q : skip)
+            found = found || accept(q);
+        if (accept("kernel"))
+        {
+            found = true;
+            if (kernel)
+                *kernel = true;
+        }
+        if (accept("vertex") || accept("fragment"))
+        {
+            found = true;
+            if (stage)
+                *stage = true;
+        }
+        if (!found)
+            return;
+    }
+}
+
+// Parses a type name if there is one. Returns false, having consumed nothing,
+// if the next token does not name a type.
+bool MslParser::parseType( MslType *type )
+{
+    static const struct { const char *name; MslBase base; } scalars[] = {
+        { "void", MslVoid }, { "bool", MslBool }, { "int", MslInt }, { "uint", MslUint },
+        { "float", MslFloat }, { "half", MslFloat },
+    };
+    size_t start = _pos;
+
+    if (is("metal") && is("::", 1))
+        _pos += 2;
+
+    const Token &t = peek();
+    if (t.kind != TokenIdent)
+    {
+        _pos = start;
+        return false;
+    }
+
+    for (const auto &s : scalars)
+    {
+        size_t len = strlen(s.name);
+
+        if (t.text.compare(0, len, s.name))
+            continue;
+        if (t.text.size() == len)
+        {
+            *type = make_type(s.base);
+            ++_pos;
+            return true;
+        }
+        if (t.text.size() == len + 1 && s.base != MslVoid && t.text[len] >= '2' && t.text[len] <= '4')
+        {
+            *type = make_type(s.base, t.text[len] - '0');
+            ++_pos;
+            return true;
+        }
+    }
+
+    if (t.text == "texture2d")
+    {
+        std::string args;
+
+        ++_pos;
+        if (!expect("<"))
+            return true;
+        while (!is(">") && peek().kind != TokenEnd)
+            args += peek(0).text, ++_pos;
+        expect(">");
+        if (args != "half,access::write" && args != "float,access::write")
+            fail("only texture2d<half, access::write> is supported", t.line);
+        *type = make_type(MslTexture);
+        return true;
+    }
+
+    for (size_t i = 0; i < _prog->structs.size(); ++i)
+    {
+        if (_prog->structs[i].name == t.text)
+        {
+            *type = make_type(MslStruct);
+            type->strct = (int)i;
+            ++_pos;
+            return true;
+        }
+    }
+
+    _pos = start;
+    return false;
+}
+
+// [[name]] or [[name(index)]]. Returns false if there is none.
+bool MslParser::parseAttribute( std::string *name, unsigned *index )
+{
+    if (!(is("[") && is("[", 1)))
+        return false;
+    _pos += 2;
+
+    *name = peek().text;
+    *index = 0;
+    ++_pos;
+    if (accept("("))
+    {
+        *index = (unsigned)strtoul(peek().text.c_str(), nullptr, 0);
+        ++_pos;
+        expect(")");
+    }
+    expect("]");
+    expect("]");
+    return true;
+}
+
+int MslParser::parse()
+{
+    while (peek().kind != TokenEnd && !failed())
+    {
+        bool kernel = false, stage = false;
+        MslType type;
+
+        if (accept("using"))
+        {
+            while (!accept(";") && peek().kind != TokenEnd)
+                ++_pos;
+            continue;
+        }
+        if (is("struct"))
+        {
+            parseStruct();
+            continue;
+        }
+
+        skipQualifiers(&kernel, &stage);
+        if (!parseType(&type))
+        {
+            fail("expected a declaration before '" + peek().text + "'");
+            break;
+        }
+        skipQualifiers(&kernel, &stage);
+
+        if (stage)
+        {
+            fail("vertex and fragment functions are not supported");
+            break;
+        }
+        if (peek().kind == TokenIdent && is("(", 1))
+            parseFunction(type, kernel);
+        else
+            parseGlobal(type);
+    }
+
+    if (!failed() && _prog->kernel < 0)
+        fail("no kernel function");
+    return failed() ? -1 : 0;
+}
+
+int MslParser::parseStruct()
+{
+    MslStructDef def;
+
+    expect("struct");
+    def.name = peek().text;
+    ++_pos;
+    if (!expect("{"))
+        return -1;
+
+    while (!accept("}") && !failed())
+    {
+        MslField f;
+        std::string attr;
+        unsigned index;
+
+        skipQualifiers();
+        if (!parseType(&f.type) || f.type.base == MslVoid || f.type.base == MslTexture)
+        {
+            fail("unsupported field type in struct " + def.name);
+            return -1;
+        }
+        do
+        {
+            f.name = peek().text;
+            ++_pos;
+            parseAttribute(&attr, &index);
+            def.fields.push_back(f);
+        } while (accept(","));
+        expect(";");
+    }
+    expect(";");
+
+    _prog->structs.push_back(def);
+    return failed() ? -1 : 0;
+}
+
+int MslParser::parseGlobal( const MslType &type )
+{
+    do
+    {
+        MslGlobal g;
+        int line = peek().line;
+
+        g.var.reset(new MslVar);
+        g.var->name = peek().text;
+        g.var->type = type;
+        g.var->uniform = true;
+        g.var->global = true;
+        g.var->index = (int)_prog->globals.size();
+        ++_pos;
+
+        if (type.base == MslVoid || type.base == MslStruct || type.base == MslTexture)
+            return reject("unsupported type of constant " + g.var->name, line);
+        if (!expect("="))
+            return -1;
+
+        g.init = parseExpr();
+        if (!g.init)
+            return -1;
+        if (!g.init->uniform)
+            return reject("constant " + g.var->name + " needs a constant value", line);
+        g.init = convert(std::move(g.init), type);
+        if (!g.init)
+            return -1;
+
+        _prog->globals.push_back(std::move(g));
+    } while (accept(","));
+
+    expect(";");
+    return failed() ? -1 : 0;
+}
+
+int MslParser::parseFunction( const MslType &ret, bool kernel )
+{
+    std::unique_ptr<MslFunction> fn(new MslFunction);
+    int line = peek().line;
+
+    fn->name = peek().text;
+    fn->ret = ret;
+    fn->kernel = kernel;
+    ++_pos;
+
+    for (const auto &other : _prog->functions)
+        if (other->name == fn->name)
+            return reject("function " + fn->name + " is defined twice; overloads are not supported", line);
+    if (kernel && ret.base != MslVoid)
+        return reject("a kernel returns void", line);
+    if (ret.base == MslStruct || ret.base == MslTexture)
+        return reject("functions cannot return structs or textures", line);
+
+    _func = fn.get();
+    _scopes.assign(1, {});
+    expect("(");
+
+    while (!failed() && !accept(")"))
+    {
+        MslType type;
+        std::string attr;
+        unsigned index = 0;
+        bool ref = false;
+        int pline = peek().line;
+
+        if (!fn->locals.empty())
+            expect(",");
+        skipQualifiers();
+        if (!parseType(&type))
+            return reject("expected a parameter type before '" + peek().text + "'");
+        skipQualifiers();
+        if (accept("*"))
+            return reject("pointer parameters are not supported", pline);
+        ref = accept("&");
+
+        MslVar *v = declare(peek().text, type, pline);
+        ++_pos;
+        if (!v)
+            return -1;
+
+        if (parseAttribute(&attr, &index))
+        {
+            if (attr == "thread_position_in_grid")
+                v->binding = MslBindPosition;
+            else if (attr == "threads_per_grid")
+                v->binding = MslBindGridSize;
+            else if (attr == "buffer")
+                v->binding = MslBindBuffer;
+            else if (attr == "texture")
+                v->binding = MslBindTexture;
+            else
+                return reject("unsupported attribute [[" + attr + "]]", pline);
+            v->bindindex = index;
+        }
+
+        if (kernel)
+        {
+            bool ok = false;
+
+            switch (v->binding)
+            {
+                case MslBindPosition:
+                case MslBindGridSize:
+                    ok = (type.base == MslUint || type.base == MslInt) && type.n <= 2;
+                    break;
+                case MslBindBuffer:
+                    ok = ref && index == 0 && type.base != MslTexture;
+                    break;
+                case MslBindTexture:
+                    ok = type.base == MslTexture && index == 0;
+                    break;
+                default:
+                    break;
+            }
+            if (!ok)
+                return reject("unsupported kernel parameter " + v->name
+                        + "; the grid position and size, a constant reference to buffer(0) and a "
+                        "texture(0) to write are", pline);
+            v->uniform = v->binding != MslBindPosition;
+        }
+        else if (ref || v->binding != MslBindNone || type.base == MslStruct || type.base == MslTexture)
+        {
+            return reject("only kernels take references, structs, textures or bound parameters", pline);
+        }
+    }
+    fn->nparams = (unsigned)fn->locals.size();
+
+    fn->body = parseBlock();
+    _func = nullptr;
+    if (failed())
+        return -1;
+
+    // after the body, so there is no recursion
+    _prog->functions.push_back(std::move(fn));
+    if (kernel)
+        _prog->kernel = (int)_prog->functions.size() - 1;
+    return 0;
+}
+
+MslVar *MslParser::declare( const std::string &name, const MslType &type, int line )
+{
+    if (type.base == MslVoid)
+        return fail("variable " + name + " of type void", line);
+    for (MslVar *v : _scopes.back())
+        if (v->name == name)
+            return fail(name + " is declared twice", line);
+
+    MslVar *v = new MslVar;
+    v->name = name;
+    v->type = type;
+    v->index = (int)_func->locals.size();
+    _func->locals.emplace_back(v);
+    _scopes.back().push_back(v);
+    return v;
+}
+
+const MslVar *MslParser::lookup( const std::string &name ) const
+{
+    for (auto s = _scopes.rbegin(); s != _scopes.rend(); ++s)
+        for (MslVar *v : *s)
+            if (v->name == name)
+                return v;
+    for (const MslGlobal &g : _prog->globals)
+        if (g.var->name == name)
+            return g.var.get();
+    return nullptr;
+}
+
+// Statements
+
+std::unique_ptr<MslStmt> MslParser::parseBlock()
+{
+    std::unique_ptr<MslStmt> block = make_stmt(MslBlock, peek().line);
+
+    if (!expect("{"))
+        return nullptr;
+
+    _scopes.emplace_back();
+    while (!accept("}"))
+    {
+        if (peek().kind == TokenEnd)
+            return fail("missing '}'");
+        std::unique_ptr<MslStmt> s = parseStatement();
+        if (!s)
+            return nullptr;
+        block->body.push_back(std::move(s));
+    }
+    _scopes.pop_back();
+    return block;
+}
+
+std::unique_ptr<MslStmt> MslParser::parseStatement()
+{
+    int line = peek().line;
+    MslType type;
+
+    if (is("{"))
+        return parseBlock();
+    if (accept(";"))
+        return make_stmt(MslBlock, line);
+    if (is("if"))
+        return parseIf();
+    if (is("while") || is("for") || is("do"))
+        return parseLoop();
+    if (is("break") || is("continue"))
+    {
+        std::unique_ptr<MslStmt> s = make_stmt(is("break") ? MslBreak : MslContinue, line);
+        if (!_loops)
+            return fail(peek().text + " outside of a loop");
+        ++_pos;
+        expect(";");
+        return failed() ? nullptr : std::move(s);
+    }
+    if (accept("return"))
+    {
+        std::unique_ptr<MslStmt> s = make_stmt(MslReturn, line);
+
+        if (!accept(";"))
+        {
+            if (_func->ret.base == MslVoid)
+                return fail("returning a value from a void function");
+            s->expr = parseExpr();
+            if (!s->expr || !(s->expr = convert(std::move(s->expr), _func->ret)))
+                return nullptr;
+            expect(";");
+        }
+        else if (_func->ret.base != MslVoid)
+        {
+            return fail("missing return value");
+        }
+        return failed() ? nullptr : std::move(s);
+    }
+
+    skipQualifiers();
+    if (parseType(&type))
+    {
+        std::unique_ptr<MslStmt> s = parseDecl(type);
+        if (s)
+            expect(";");
+        return failed() ? nullptr : std::move(s);
+    }
+
+    std::unique_ptr<MslStmt> s = parseSimple();
+    if (s)
+        expect(";");
+    return failed() ? nullptr : std::move(s);
+}
+
+// type name = value, name = value, ... as a block of MslDecls
+std::unique_ptr<MslStmt> MslParser::parseDecl( const MslType &type )
+{
+    std::unique_ptr<MslStmt> decls = make_stmt(MslBlock, peek().line);
+
+    decls->scope = false;
+
+    if (type.base == MslStruct || type.base == MslTexture)
+        return fail("local variables of struct and texture types are not supported");
+
+    do
+    {
+        std::unique_ptr<MslStmt> s = make_stmt(MslDecl, peek().line);
+        std::string name = peek().text;
+
+        if (peek().kind != TokenIdent)
+            return fail("expected a variable name before '" + name + "'");
+        ++_pos;
+        if (is("["))
+            return fail("arrays are not supported");
+
+        // the value may not see the variable yet
+        if (accept("="))
+        {
+            s->expr = parseExpr();
+            if (!s->expr || !(s->expr = convert(std::move(s->expr), type)))
+                return nullptr;
+        }
+        s->var = declare(name, type, s->line);
+        if (!s->var)
+            return nullptr;
+        decls->body.push_back(std::move(s));
+    } while (accept(","));
+
+    // a single declaration stays one, so for loops can tell
+    if (decls->body.size() == 1)
+        return std::move(decls->body[0]);
+    return decls;
+}
+
+std::unique_ptr<MslStmt> MslParser::parseSimple()
+{
+    static const char *assignops[] = { "=", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "<<=", ">>=" };
+    int line = peek().line;
+    std::string incdec;
+
+    if (is("++") || is("--"))
+        incdec = peek().text, ++_pos;
+
+    // tex.write(value, coord)
+    if (!incdec.size() && peek().kind == TokenIdent && is(".", 1) && is("write", 2))
+    {
+        const MslVar *tex = lookup(peek().text);
+
+        if (tex && tex->type.base == MslTexture)
+        {
+            std::vector<std::unique_ptr<MslExpr>> args;
+            std::unique_ptr<MslStmt> s = make_stmt(MslWrite, line);
+
+            _pos += 3;
+            if (!parseArgs(&args))
+                return nullptr;
+            if (args.size() < 2 || args.size() > 3)
+                return fail("texture write takes a value and a coordinate");
+            if (args[1]->type.n != 2 || !args[1]->type.numeric() || args[1]->type.base == MslFloat)
+                return fail("texture write coordinate must be uint2");
+            s->var = tex;
+            s->expr = convert(std::move(args[0]), make_type(MslFloat, 4));
+            s->expr2 = convert(std::move(args[1]), make_type(MslUint, 2));
+            return s->expr && s->expr2 ? std::move(s) : nullptr;
+        }
+    }
+
+    std::unique_ptr<MslExpr> target = parsePostfix();
+    if (!target)
+        return nullptr;
+
+    if (target->kind == MslCall && !incdec.size())
+    {
+        std::unique_ptr<MslStmt> s = make_stmt(MslExprStmt, line);
+        s->expr = std::move(target);
+        return s;
+    }
+
+    bool assignable = target->kind == MslVariable
+        || (target->kind == MslSwizzle && target->type.n == 1 && target->args[0]->kind == MslVariable);
+    const MslVar *var = target->kind == MslVariable ? target->var : (assignable ? target->args[0]->var : nullptr);
+    if (!assignable || var->uniform)
+        return fail("cannot assign to this; only variables and single components of them are assignable");
+
+    std::unique_ptr<MslStmt> s = make_stmt(MslAssign, line);
+    std::unique_ptr<MslExpr> value;
+    std::string op;
+
+    if (!incdec.size() && (is("++") || is("--")))
+        incdec = peek().text, ++_pos;
+
+    if (incdec.size())
+    {
+        std::unique_ptr<MslExpr> one = make_expr(MslLiteral, make_type(MslInt), line);
+        one->ivalue = 1;
+        one->uniform = true;
+        op = incdec.substr(0, 1);
+        value = std::move(one);
+    }
+    else
+    {
+        for (const char *a : assignops)
+            if (is(a))
+                op = a;
+        if (op.empty())
+            return fail("expected an assignment before '" + peek().text + "'");
+        ++_pos;
+        op.pop_back();
+        value = parseExpr();
+        if (!value)
+            return nullptr;
+    }
+
+    if (!op.empty())
+    {
+        value = binary(op, clone_expr(*target), std::move(value), line);
+        if (!value)
+            return nullptr;
+    }
+    s->expr = convert(std::move(value), target->type);
+    s->target = std::move(target);
+    return s->expr ? std::move(s) : nullptr;
+}
+
+std::unique_ptr<MslStmt> MslParser::parseIf()
+{
+    std::unique_ptr<MslStmt> s = make_stmt(MslIf, peek().line);
+
+    expect("if");
+    expect("(");
+    s->expr = parseExpr();
+    if (!s->expr || !(s->expr = toBool(std::move(s->expr))))
+        return nullptr;
+    expect(")");
+
+    _scopes.emplace_back();
+    s->then = parseStatement();
+    _scopes.pop_back();
+    if (!s->then)
+        return nullptr;
+
+    if (accept("else"))
+    {
+        _scopes.emplace_back();
+        s->otherwise = parseStatement();
+        _scopes.pop_back();
+        if (!s->otherwise)
+            return nullptr;
+    }
+    return s;
+}
+
+std::unique_ptr<MslStmt> MslParser::parseLoop()
+{
+    std::unique_ptr<MslStmt> s;
+    int line = peek().line;
+
+    _scopes.emplace_back();
+    if (accept("while"))
+    {
+        s = make_stmt(MslWhile, line);
+        expect("(");
+        s->expr = parseExpr();
+        if (!s->expr || !(s->expr = toBool(std::move(s->expr))))
+            return nullptr;
+        expect(")");
+    }
+    else if (accept("for"))
+    {
+        MslType type;
+
+        s = make_stmt(MslFor, line);
+        expect("(");
+        if (!accept(";"))
+        {
+            skipQualifiers();
+            s->init = parseType(&type) ? parseDecl(type) : parseSimple();
+            if (!s->init)
+                return nullptr;
+            expect(";");
+        }
+        if (!accept(";"))
+        {
+            s->expr = parseExpr();
+            if (!s->expr || !(s->expr = toBool(std::move(s->expr))))
+                return nullptr;
+            expect(";");
+        }
+        if (!accept(")"))
+        {
+            s->step = parseSimple();
+            if (!s->step)
+                return nullptr;
+            if (is(","))
+                return fail("for loops with more than one step are not supported");
+            expect(")");
+        }
+    }
+    else
+    {
+        expect("do");
+        s = make_stmt(MslDoWhile, line);
+    }
+    if (failed())
+        return nullptr;
+
+    ++_loops;
+    s->then = parseStatement();
+    --_loops;
+    if (!s->then)
+        return nullptr;
+
+    if (s->kind == MslDoWhile)
+    {
+        expect("while");
+        expect("(");
+        s->expr = parseExpr();
+        if (!s->expr || !(s->expr = toBool(std::move(s->expr))))
+            return nullptr;
+        expect(")");
+        expect(";");
+    }
+    _scopes.pop_back();
+    return failed() ? nullptr : std::move(s);
+}
+
+// Expressions
+
+std::unique_ptr<MslExpr> MslParser::convert( std::unique_ptr<MslExpr> e, const MslType &to )
+{
+    if (!e)
+        return nullptr;
+    if (e->type == to)
+        return e;
+
+    int line = e->line;
+    bool scalars = rank(e->type.base) >= 0 && rank(to.base) >= 0;
+    if (!scalars || (e->type.n != to.n && e->type.n != 1))
+        return fail("cannot convert between these types", line);
+
+    // literals convert right away
+    if (e->kind == MslLiteral && e->type.n == 1 && to.n == 1)
+    {
+        if (to.base == MslFloat && e->type.base != MslFloat)
+            e->fvalue = (double)e->ivalue;
+        else if (to.base != MslFloat && e->type.base == MslFloat)
+            e->ivalue = to.base == MslBool ? e->fvalue != 0.0 : (int64_t)e->fvalue;
+        else if (to.base == MslBool)
+            e->ivalue = e->ivalue != 0;
+        else if (to.base == MslUint)
+            e->ivalue = (uint32_t)e->ivalue;
+        else if (to.base == MslInt)
+            e->ivalue = (int32_t)e->ivalue;
+        e->type = to;
+        return e;
+    }
+
+    std::unique_ptr<MslExpr> c = make_expr(MslConvert, to, line);
+    c->uniform = e->uniform;
+    c->args.push_back(std::move(e));
+    return c;
+}
+
+std::unique_ptr<MslExpr> MslParser::toBool( std::unique_ptr<MslExpr> e )
+{
+    if (!e)
+        return nullptr;
+    if (e->type.n != 1)
+        return fail("a condition must be a scalar", e->line);
+    return convert(std::move(e), make_type(MslBool));
+}
+
+// The common type of arguments: the highest ranked base, and the size of the
+// vectors among them, to which scalars are broadcast.
+bool MslParser::commonType( const std::vector<std::unique_ptr<MslExpr>> &args, MslType *type, int line )
+{
+    int r = 0;
+    unsigned n = 1;
+
+    for (const auto &a : args)
+    {
+        if (rank(a->type.base) < 0)
+        {
+            fail("operand is not a number", line);
+            return false;
+        }
+        r = rank(a->type.base) > r ? rank(a->type.base) : r;
+        if (a->type.n != 1)
+        {
+            if (n != 1 && n != a->type.n)
+            {
+                fail("vector sizes do not match", line);
+                return false;
+            }
+            n = a->type.n;
+        }
+    }
+    static const MslBase bases[] = { MslBool, MslInt, MslUint, MslFloat };
+    *type = make_type(bases[r], n);
+    return true;
+}
+
+std::unique_ptr<MslExpr> MslParser::binary( const std::string &op, std::unique_ptr<MslExpr> a,
+        std::unique_ptr<MslExpr> b, int line )
+{
+    std::vector<std::unique_ptr<MslExpr>> args;
+    MslType common, result;
+
+    if (op == "&&" || op == "||")
+    {
+        a = toBool(std::move(a));
+        b = toBool(std::move(b));
+        if (!a || !b)
+            return nullptr;
+        common = result = make_type(MslBool);
+    }
+    else
+    {
+        args.push_back(std::move(a));
+        args.push_back(std::move(b));
+        if (!commonType(args, &common, line))
+            return nullptr;
+        a = std::move(args[0]);
+        b = std::move(args[1]);
+
+        bool compare = op == "<" || op == ">" || op == "<=" || op == ">=" || op == "==" || op == "!=";
+        bool integer = op == "%" || op == "&" || op == "|" || op == "^" || op == "<<" || op == ">>";
+
+        // arithmetic on bools is on ints
+        if (common.base == MslBool && !(op == "==" || op == "!="))
+            common.base = MslInt;
+        if (integer && common.base == MslFloat)
+            return fail("operator " + op + " needs integers" + (op == "%" ? ", use fmod for floats" : ""), line);
+        if (op == "<<" || op == ">>")
+            common = make_type(a->type.base == MslBool ? MslInt : a->type.base, common.n);
+
+        result = compare ? make_type(MslBool, common.n) : common;
+    }
+
+    a = convert(std::move(a), common);
+    b = convert(std::move(b), common);
+    if (!a || !b)
+        return nullptr;
+
+    std::unique_ptr<MslExpr> e = make_expr(MslBinary, result, line);
+    e->op = op;
+    e->uniform = a->uniform && b->uniform;
+    e->args.push_back(std::move(a));
+    e->args.push_back(std::move(b));
+    return e;
+}
+
+std::unique_ptr<MslExpr> MslParser::parseTernary()
+{
+    std::unique_ptr<MslExpr> c = parseBinary(0);
+
+    if (!c || !is("?"))
+        return c;
+
+    int line = peek().line;
+    std::vector<std::unique_ptr<MslExpr>> args;
+    MslType common;
+
+    ++_pos;
+    c = toBool(std::move(c));
+    std::unique_ptr<MslExpr> a = parseTernary();
+    if (!c || !a || !expect(":"))
+        return nullptr;
+    std::unique_ptr<MslExpr> b = parseTernary();
+    if (!b)
+        return nullptr;
+
+    args.push_back(std::move(a));
+    args.push_back(std::move(b));
+    if (!commonType(args, &common, line))
+        return nullptr;
+
+    std::unique_ptr<MslExpr> e = make_expr(MslSelect, common, line);
+    e->uniform = c->uniform && args[0]->uniform && args[1]->uniform;
+    e->args.push_back(std::move(c));
+    e->args.push_back(convert(std::move(args[0]), common));
+    e->args.push_back(convert(std::move(args[1]), common));
+    return e->args[1] && e->args[2] ? std::move(e) : nullptr;
+}
+
+// C precedence, lowest first
+static const char *binary_levels[][5] = {
+    { "||" }, { "&&" }, { "|" }, { "^" }, { "&" }, { "==", "!=" }, { "<", ">", "<=", ">=" },
+    { "<<", ">>" }, { "+", "-" }, { "*", "/", "%" },
+};
+
+std::unique_ptr<MslExpr> MslParser::parseBinary( int level )
+{
+    const int nlevels = sizeof(binary_levels) / sizeof(binary_levels[0]);
+
+    if (level == nlevels)
+        return parseUnary();
+
+    std::unique_ptr<MslExpr> a = parseBinary(level + 1);
+    while (a)
+    {
+        const char *op = nullptr;
+
+        for (const char *o : binary_levels[level])
+            if (o && is(o))
+                op = o;
+        if (!op)
+            break;
+
+        int line = peek().line;
+        ++_pos;
+        std::unique_ptr<MslExpr> b = parseBinary(level + 1);
+        if (!b)
+            return nullptr;
+        a = binary(op, std::move(a), std::move(b), line);
+    }
+    return a;
+}
+
+std::unique_ptr<MslExpr> MslParser::parseUnary()
+{
+    int line = peek().line;
+    MslType type;
+
+    if (accept("+"))
+        return parseUnary();
+    if (is("-") || is("!") || is("~"))
+    {
+        std::string op = peek().text;
+        ++_pos;
+        std::unique_ptr<MslExpr> a = parseUnary();
+        if (!a)
+            return nullptr;
+
+        if (op == "!")
+            a = toBool(std::move(a));
+        else if (rank(a->type.base) < 0 || (op == "~" && a->type.base == MslFloat))
+            return fail("operator " + op + " needs a number", line);
+        else if (a->type.base == MslBool)
+            a = convert(std::move(a), make_type(MslInt, a->type.n));
+        if (!a)
+            return nullptr;
+
+        // keeps negative literals literal
+        if (op == "-" && a->kind == MslLiteral)
+        {
+            a->fvalue = -a->fvalue;
+            a->ivalue = a->type.base == MslUint ? (uint32_t)-a->ivalue : -a->ivalue;
+            return a;
+        }
+
+        std::unique_ptr<MslExpr> e = make_expr(MslUnary, a->type, line);
+        e->op = op;
+        e->uniform = a->uniform;
+        e->args.push_back(std::move(a));
+        return e;
+    }
+    if (is("++") || is("--"))
+        return fail("increments are only supported as statements");
+
+    // (type)value
+    if (is("("))
+    {
+        size_t start = _pos;
+        ++_pos;
+        if (parseType(&type) && accept(")"))
+        {
+            std::unique_ptr<MslExpr> a = parseUnary();
+            if (!a)
+                return nullptr;
+            if (a->type.n != type.n && a->type.n != 1)
+                return fail("cannot cast between vector sizes", line);
+            return convert(std::move(a), type);
+        }
+        _pos = start;
+    }
+    return parsePostfix();
+}
+
+static int swizzle_index(char c)
+{
+    const char *xyzw = "xyzw", *rgba = "rgba";
+    const char *p = strchr(xyzw, c);
+
+    if (p && c)
+        return (int)(p - xyzw);
+    p = strchr(rgba, c);
+    return p && c ? (int)(p - rgba) : -1;
+}
+
+std::unique_ptr<MslExpr> MslParser::parsePostfix()
+{
+    std::unique_ptr<MslExpr> e = parsePrimary();
+
+    while (e)
+    {
+        int line = peek().line;
+
+        if (is("["))
+            return fail("arrays are not supported");
+        if (is("++") || is("--"))
+            return e; // a statement, parseSimple takes it from here
+        if (!accept("."))
+            break;
+
+        std::string name = peek().text;
+        ++_pos;
+
+        if (e->type.base == MslTexture)
+        {
+            if (name != "get_width" && name != "get_height")
+                return fail("the texture can only be written, and asked for its size");
+            expect("(");
+            expect(")");
+            std::unique_ptr<MslExpr> b = make_expr(MslBuiltin, make_type(MslUint), line);
+            b->op = name;
+            b->var = e->var;
+            b->uniform = true;
+            return failed() ? nullptr : std::move(b);
+        }
+
+        if (e->type.base == MslStruct)
+        {
+            const MslStructDef &def = _prog->structs[e->type.strct];
+            int field = -1;
+
+            for (size_t i = 0; i < def.fields.size(); ++i)
+                if (def.fields[i].name == name)
+                    field = (int)i;
+            if (field < 0)
+                return fail("struct " + def.name + " has no field " + name);
+
+            std::unique_ptr<MslExpr> m = make_expr(MslMember, def.fields[field].type, line);
+            m->field = field;
+            m->uniform = e->uniform;
+            m->args.push_back(std::move(e));
+            e = std::move(m);
+            continue;
+        }
+
+        if (name.size() > 4 || rank(e->type.base) < 0)
+            return fail("no member " + name);
+
+        std::unique_ptr<MslExpr> s = make_expr(MslSwizzle, make_type(e->type.base, (unsigned)name.size()), line);
+        for (size_t i = 0; i < name.size(); ++i)
+        {
+            int c = swizzle_index(name[i]);
+            if (c < 0 || c >= (int)e->type.n)
+                return fail("no component " + name + " in a vector of " + std::to_string(e->type.n));
+            s->swizzle[i] = (unsigned)c;
+        }
+        s->uniform = e->uniform;
+        s->args.push_back(std::move(e));
+        e = std::move(s);
+    }
+    return e;
+}
+
+// a parenthesized argument list
+bool MslParser::parseArgs( std::vector<std::unique_ptr<MslExpr>> *args )
+{
+    if (!expect("("))
+        return false;
+    while (!accept(")"))
+    {
+        if (!args->empty() && !expect(","))
+            return false;
+        std::unique_ptr<MslExpr> a = parseExpr();
+        if (!a)
+            return false;
+        args->push_back(std::move(a));
+    }
+    return true;
+}
+
+std::unique_ptr<MslExpr> MslParser::parsePrimary()
+{
+    const Token t = peek();
+    MslType type;
+    double constant;
+
+    if (accept("("))
+    {
+        std::unique_ptr<MslExpr> e = parseExpr();
+        if (!e || !expect(")"))
+            return nullptr;
+        return e;
+    }
+
+    if (t.kind == TokenNumber)
+    {
+        std::string text = t.text;
+        char last = (char)tolower(text.back());
+        bool hex = text.size() > 1 && (text[1] == 'x' || text[1] == 'X');
+        bool isfloat = !hex && (text.find_first_of(".eE") != std::string::npos || last == 'f' || last == 'h');
+        std::unique_ptr<MslExpr> e;
+
+        ++_pos;
+        if (isfloat)
+        {
+            e = make_expr(MslLiteral, make_type(MslFloat), t.line);
+            e->fvalue = strtod(text.c_str(), nullptr);
+        }
+        else
+        {
+            e = make_expr(MslLiteral, make_type(last == 'u' ? MslUint : MslInt), t.line);
+            e->ivalue = (int64_t)strtoull(text.c_str(), nullptr, 0);
+        }
+        e->uniform = true;
+        return e;
+    }
+
+    if (accept("true") || accept("false"))
+    {
+        std::unique_ptr<MslExpr> e = make_expr(MslLiteral, make_type(MslBool), t.line);
+        e->ivalue = t.text == "true";
+        e->uniform = true;
+        return e;
+    }
+
+    // float2(x, y), float(i), ...
+    if (parseType(&type))
+    {
+        std::vector<std::unique_ptr<MslExpr>> args;
+        unsigned components = 0;
+
+        if (rank(type.base) < 0)
+            return fail("cannot construct this type", t.line);
+        if (!parseArgs(&args))
+            return nullptr;
+
+        if (args.size() == 1)
+        {
+            if (args[0]->type.n != type.n && args[0]->type.n != 1)
+                return fail("cannot convert between vector sizes", t.line);
+            return convert(std::move(args[0]), type);
+        }
+
+        std::unique_ptr<MslExpr> e = make_expr(MslConstruct, type, t.line);
+        e->uniform = true;
+        for (auto &a : args)
+        {
+            components += a->type.n;
+            e->uniform = e->uniform && a->uniform;
+            e->args.push_back(convert(std::move(a), make_type(type.base, a->type.n)));
+            if (!e->args.back())
+                return nullptr;
+        }
+        if (components != type.n)
+            return fail("wrong number of components for a vector of " + std::to_string(type.n), t.line);
+        return e;
+    }
+
+    if (t.kind != TokenIdent)
+        return fail("unexpected '" + t.text + "'");
+
+    ++_pos;
+    if (t.text == "metal" && accept("::"))
+        return parsePrimary();
+
+    if (is("("))
+        return parseCall(t.text, t.line);
+
+    if (const MslVar *v = lookup(t.text))
+    {
+        std::unique_ptr<MslExpr> e = make_expr(MslVariable, v->type, t.line);
+        e->var = v;
+        e->uniform = v->uniform;
+        return e;
+    }
+
+    if (find_constant(t.text, &constant))
+    {
+        std::unique_ptr<MslExpr> e = make_expr(MslLiteral, make_type(MslFloat), t.line);
+        e->fvalue = constant;
+        e->uniform = true;
+        return e;
+    }
+    return fail("unknown name " + t.text, t.line);
+}
+
+std::unique_ptr<MslExpr> MslParser::parseCall( const std::string &name, int line )
+{
+    std::vector<std::unique_ptr<MslExpr>> args;
+
+    if (!parseArgs(&args))
+        return nullptr;
+
+    for (size_t i = 0; i < _prog->functions.size(); ++i)
+    {
+        const MslFunction &fn = *_prog->functions[i];
+
+        if (fn.name != name)
+            continue;
+        if (fn.kernel)
+            return fail("kernels cannot be called", line);
+        if (args.size() != fn.nparams)
+            return fail(name + " takes " + std::to_string(fn.nparams) + " arguments", line);
+
+        std::unique_ptr<MslExpr> e = make_expr(MslCall, fn.ret, line);
+        e->func = (int)i;
+        for (size_t a = 0; a < args.size(); ++a)
+        {
+            e->args.push_back(convert(std::move(args[a]), fn.locals[a]->type));
+            if (!e->args.back())
+                return nullptr;
+        }
+        return e;
+    }
+
+    const Builtin *b = find_builtin(name);
+    if (!b)
+        return fail("unknown function " + name, line);
+    if (args.size() != b->nargs)
+        return fail(name + " takes " + std::to_string(b->nargs) + " arguments", line);
+    return builtin(*b, std::move(args), line);
+}
+
+std::unique_ptr<MslExpr> MslParser::builtin( const Builtin &b, std::vector<std::unique_ptr<MslExpr>> args, int line )
+{
+    MslType common, result;
+
+    switch (b.kind)
+    {
+        case BuiltinFloat:
+        case BuiltinNumeric:
+        case BuiltinReduce:
+        case BuiltinVector:
+            if (!commonType(args, &common, line))
+                return nullptr;
+            if (b.kind != BuiltinNumeric || common.base == MslBool)
+                common.base = b.kind == BuiltinNumeric ? MslInt : MslFloat;
+            result = common;
+            if (b.kind == BuiltinReduce)
+                result.n = 1;
+            if (!strcmp(b.name, "cross") && common.n != 3)
+                return fail("cross takes float3", line);
+            break;
+        case BuiltinBool:
+            if (args[0]->type.base != MslBool)
+                return fail(std::string(b.name) + " takes bool vectors", line);
+            common = args[0]->type;
+            result = make_type(MslBool);
+            break;
+        case BuiltinSelect:
+        {
+            std::vector<std::unique_ptr<MslExpr>> values;
+            unsigned n;
+
+            values.push_back(std::move(args[0]));
+            values.push_back(std::move(args[1]));
+            if (!commonType(values, &common, line))
+                return nullptr;
+            n = args[2]->type.n;
+            if (n != 1 && n != common.n)
+                return fail("select condition has the wrong size", line);
+            args[0] = convert(std::move(values[0]), common);
+            args[1] = convert(std::move(values[1]), common);
+            args[2] = convert(std::move(args[2]), make_type(MslBool, n));
+            if (!args[0] || !args[1] || !args[2])
+                return nullptr;
+            result = common;
+            break;
+        }
+    }
+
+    std::unique_ptr<MslExpr> e = make_expr(MslBuiltin, result, line);
+    e->op = b.name;
+    e->uniform = true;
+    for (auto &a : args)
+    {
+        e->uniform = e->uniform && a->uniform;
+        if (b.kind != BuiltinSelect)
+            a = convert(std::move(a), common);
+        if (!a)
+            return nullptr;
+        e->args.push_back(std::move(a));
+    }
+    return e;
+}
+
+int msl_parse(const char *src, MslProgram *prog, std::string *error)
+{
+    std::vector<Token> tokens;
+
+    if (tokenize(src, &tokens, error))
+        return -1;
+
+    MslParser parser(tokens, prog);
+    if (parser.parse())
+    {
+        *error = parser.error();
+        return -1;
+    }
+    return 0;
+}
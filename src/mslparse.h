@@ -0,0 +1,162 @@
+#ifndef METALTOY_MSLPARSE_H
+#define METALTOY_MSLPARSE_H
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// A front end for the subset of Metal shading language that compute kernels
+// like the one in shader.metal use: constants, structs for buffers, functions
+// of scalars and vectors, loops and branches, and a kernel writing to a
+// texture. The parser checks types as it goes and makes every implicit
+// conversion an explicit MslConvert node, so back ends like msltranslate.h
+// only see operands of matching types.
+
+enum MslBase
+{
+    MslVoid,
+    MslBool,
+    MslInt,
+    MslUint,
+    MslFloat, // and half, which is computed as float
+    MslStruct,
+    MslTexture, // texture2d<half, access::write>, only as a kernel parameter
+};
+
+struct MslType
+{
+    MslBase base = MslVoid;
+    unsigned n = 1;   // components, 1 to 4
+    int strct = -1;   // index into MslProgram::structs
+
+    bool operator==( const MslType &o ) const { return base == o.base && n == o.n && strct == o.strct; }
+    bool operator!=( const MslType &o ) const { return !(*this == o); }
+    bool numeric() const { return base == MslInt || base == MslUint || base == MslFloat; }
+};
+
+// what a kernel parameter is bound to
+enum MslBinding
+{
+    MslBindNone,
+    MslBindPosition,  // [[thread_position_in_grid]]
+    MslBindGridSize,  // [[threads_per_grid]]
+    MslBindBuffer,    // [[buffer(n)]]
+    MslBindTexture,   // [[texture(n)]]
+};
+
+struct MslVar
+{
+    std::string name;
+    MslType type;
+    // the same for every grid position: constants, the grid size and
+    // buffers. Everything else may differ between positions.
+    bool uniform = false;
+    bool global = false;
+    MslBinding binding = MslBindNone;
+    unsigned bindindex = 0;
+    int index = 0; // in its function's locals, or in MslProgram::globals
+};
+
+enum MslExprKind
+{
+    MslLiteral,
+    MslVariable,
+    MslUnary,     // op is one of - ! ~
+    MslBinary,    // op is a C operator, operands have the same type
+    MslSelect,    // args[0] ? args[1] : args[2]
+    MslCall,      // a function of the program
+    MslBuiltin,   // op is the name, as in the Metal standard library
+    MslConstruct, // a vector from the components of its args
+    MslConvert,   // args[0] to type, converting the base and broadcasting
+    MslMember,    // field of a struct
+    MslSwizzle,   // components of a vector
+};
+
+struct MslExpr
+{
+    MslExprKind kind;
+    MslType type;
+    bool uniform = false;
+    int line = 0;
+    std::string op;
+    double fvalue = 0.0; // MslLiteral of float type
+    int64_t ivalue = 0;  // other MslLiterals
+    const MslVar *var = nullptr; // MslVariable, and the texture of get_width/get_height
+    int func = -1;       // MslCall, index into MslProgram::functions
+    int field = -1;      // MslMember
+    unsigned swizzle[4] = {}; // MslSwizzle, type.n of them
+    std::vector<std::unique_ptr<MslExpr>> args;
+};
+
+enum MslStmtKind
+{
+    MslBlock,
+    MslDecl,     // var = expr, expr may be null
+    MslAssign,   // target = expr, compound assignments are expanded
+    MslExprStmt, // a call
+    MslWrite,    // var.write(expr, expr2), a float4 at a uint2
+    MslIf,
+    MslWhile,
+    MslDoWhile,
+    MslFor,      // init, cond, step, body, all but body may be null
+    MslBreak,
+    MslContinue,
+    MslReturn,   // expr may be null
+};
+
+struct MslStmt
+{
+    MslStmtKind kind;
+    int line = 0;
+    const MslVar *var = nullptr;           // MslDecl, MslWrite (the texture)
+    std::unique_ptr<MslExpr> target;       // MslAssign, a variable, member or single component
+    std::unique_ptr<MslExpr> expr;         // value or condition
+    std::unique_ptr<MslExpr> expr2;        // MslWrite coordinate
+    std::vector<std::unique_ptr<MslStmt>> body; // MslBlock statements
+    bool scope = true;                     // MslBlock, false for the MslDecls of one declaration
+    std::unique_ptr<MslStmt> init, step;   // MslFor
+    std::unique_ptr<MslStmt> then, otherwise; // MslIf, and the body of loops in then
+};
+
+struct MslField
+{
+    std::string name;
+    MslType type;
+};
+
+struct MslStructDef
+{
+    std::string name;
+    std::vector<MslField> fields;
+};
+
+struct MslFunction
+{
+    std::string name;
+    MslType ret;
+    bool kernel = false;
+    unsigned nparams = 0; // the first locals
+    std::vector<std::unique_ptr<MslVar>> locals;
+    std::unique_ptr<MslStmt> body;
+};
+
+struct MslGlobal
+{
+    std::unique_ptr<MslVar> var;
+    std::unique_ptr<MslExpr> init;
+};
+
+struct MslProgram
+{
+    std::vector<MslStructDef> structs;
+    std::vector<MslGlobal> globals;
+    std::vector<std::unique_ptr<MslFunction>> functions;
+    int kernel = -1; // the last kernel function
+};
+
+// Parses src into prog. Returns 0 on success, otherwise error is set to
+// "line N: what went wrong", also for anything outside the subset.
+int msl_parse(const char *src, MslProgram *prog, std::string *error);
+
+#endif
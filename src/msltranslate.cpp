@@ -0,0 +1,573 @@
+#include "msltranslate.h"
+
+#include <stdio.h>
+
+static const char *scalar_types[][2] = {
+    // uniform, varying
+    { "void", "void" }, { "bool", "vbool" }, { "int32_t", "vint" }, { "uint32_t", "vuint" },
+    { "float", "vfloat" },
+};
+
+class MslTranslator
+{
+    public:
+        MslTranslator( const MslProgram &prog, const char *path )
+        : _prog( prog ), _path( path )
+        {}
+
+        int translate( std::string *out, std::string *error );
+
+    private:
+        std::string type( const MslType &t, bool uniform ) const;
+        std::string elem( MslBase base, bool uniform ) const { return scalar_types[base][uniform ? 0 : 1]; }
+        std::string name( const MslVar &v ) const;
+        std::string expr( const MslExpr &e, bool varying );
+        std::string literal( const MslExpr &e ) const;
+
+        void function( const MslFunction &fn );
+        void kernelEntry( const MslFunction &fn );
+        bool stmt( const MslStmt &s );
+        bool block( const MslStmt &s );
+        bool scoped( const MslStmt &s );
+        void assign( const std::string &target, const std::string &value );
+
+        // execution mask of the lanes that have not left the innermost loop
+        // or the function
+        std::string live() const;
+        // whether some lanes of those that entered the function may be off
+        bool masked() const { return _varying > 0 || !_loops.empty() || _diverged; }
+
+        void line( int n );
+        void emit( const std::string &text );
+
+        const MslProgram &_prog;
+        std::string _path;
+        std::string _out;
+        unsigned _indent = 0;
+        unsigned _labels = 0;     // for unique names of masks
+        std::vector<unsigned> _loops; // labels of the loops around
+        unsigned _varying = 0;    // varying ifs around
+        bool _diverged = false;   // some lanes returned early
+};
+
+std::string MslTranslator::type( const MslType &t, bool uniform ) const
+{
+    if (t.base == MslStruct)
+        return "S_" + _prog.structs[t.strct].name;
+    if (t.base == MslTexture)
+        return "SpmdRow";
+    if (t.n == 1)
+        return elem(t.base, uniform);
+    return "SpmdVec<" + elem(t.base, uniform) + ", " + std::to_string(t.n) + ">";
+}
+
+// unique, as MSL scopes may shadow names
+std::string MslTranslator::name( const MslVar &v ) const
+{
+    if (v.global)
+        return "g_" + v.name;
+    return "v" + std::to_string(v.index) + "_" + v.name;
+}
+
+std::string MslTranslator::literal( const MslExpr &e ) const
+{
+    char buf[64];
+
+    switch (e.type.base)
+    {
+        case MslBool:
+            return e.ivalue ? "true" : "false";
+        case MslInt:
+            return "int32_t(" + std::to_string(e.ivalue) + ")";
+        case MslUint:
+            return std::to_string((uint32_t)e.ivalue) + "u";
+        default:
+        {
+            std::string s;
+
+            snprintf(buf, sizeof(buf), "%.9g", e.fvalue);
+            s = buf;
+            if (s == "inf" || s == "-inf" || s == "nan")
+                return s[0] == '-' ? "-HUGE_VALF" : (s == "nan" ? "NAN" : "HUGE_VALF");
+            if (s.find_first_of(".e") == std::string::npos)
+                s += ".0";
+            return s + "f";
+        }
+    }
+}
+
+// e as C++, as lanes if varying or e is varying, otherwise as a scalar
+std::string MslTranslator::expr( const MslExpr &e, bool varying )
+{
+    if (e.uniform && varying)
+        return "spmd_varying(" + expr(e, false) + ")";
+
+    // the operands of a varying expression are all varying
+    bool v = !e.uniform;
+    std::string s;
+
+    switch (e.kind)
+    {
+        case MslLiteral:
+            return literal(e);
+
+        case MslVariable:
+            return name(*e.var);
+
+        case MslUnary:
+            if (e.op == "!")
+                return std::string(v ? "(~" : "(!") + expr(*e.args[0], v) + ")";
+            return "(" + e.op + expr(*e.args[0], v) + ")";
+
+        case MslBinary:
+        {
+            std::string a = expr(*e.args[0], v), b = expr(*e.args[1], v);
+            bool integer = e.args[0]->type.base != MslFloat;
+
+            if (integer && e.op == "/")
+                return "spmd_div(" + a + ", " + b + ")";
+            if (integer && e.op == "%")
+                return "spmd_mod(" + a + ", " + b + ")";
+            // on masks, both sides are evaluated anyway
+            if (v && (e.op == "&&" || e.op == "||"))
+                return "(" + a + " " + e.op[0] + " " + b + ")";
+            return "(" + a + " " + e.op + " " + b + ")";
+        }
+
+        case MslSelect:
+            return "spmd_select(" + expr(*e.args[0], v) + ", " + expr(*e.args[1], v) + ", "
+                + expr(*e.args[2], v) + ")";
+
+        case MslCall:
+            s = "f_" + _prog.functions[e.func]->name + "(exec_";
+            for (const auto &a : e.args)
+                s += ", " + expr(*a, true);
+            return s + ")";
+
+        case MslBuiltin:
+            if (e.op == "get_width" || e.op == "get_height")
+                return name(*e.var) + (e.op == "get_width" ? ".width" : ".height");
+            if (e.op == "select")
+                return "spmd_select(" + expr(*e.args[2], v) + ", " + expr(*e.args[1], v) + ", "
+                    + expr(*e.args[0], v) + ")";
+            s = "spmd::" + e.op + "(";
+            for (size_t i = 0; i < e.args.size(); ++i)
+                s += (i ? ", " : "") + expr(*e.args[i], v);
+            return s + ")";
+
+        case MslConstruct:
+            s = "spmd_make<" + type(e.type, !v) + ">(";
+            for (size_t i = 0; i < e.args.size(); ++i)
+                s += (i ? ", " : "") + expr(*e.args[i], v);
+            return s + ")";
+
+        case MslConvert:
+        {
+            const MslType &from = e.args[0]->type;
+
+            s = expr(*e.args[0], v);
+            if (from.base != e.type.base)
+            {
+                if (e.type.base == MslBool)
+                    s = "spmd_to_bool(" + s + ")";
+                else if (from.base == MslBool)
+                    s = "spmd_from_bool<" + elem(e.type.base, !v) + ">(" + s + ")";
+                else
+                    s = "spmd_convert<" + elem(e.type.base, !v) + ">(" + s + ")";
+            }
+            if (from.n != e.type.n)
+                s = "spmd_broadcast<" + std::to_string(e.type.n) + ">(" + s + ")";
+            return s;
+        }
+
+        case MslMember:
+            return expr(*e.args[0], v) + "." + _prog.structs[e.args[0]->type.strct].fields[e.field].name;
+
+        case MslSwizzle:
+            s = expr(*e.args[0], v);
+            if (e.type.n == 1)
+                return s + ".c[" + std::to_string(e.swizzle[0]) + "]";
+        {
+            std::string components = std::to_string(e.swizzle[0]);
+
+            for (unsigned i = 1; i < e.type.n; ++i)
+                components += ", " + std::to_string(e.swizzle[i]);
+            return "spmd_swizzle<" + components + ">(" + s + ")";
+        }
+    }
+    return s;
+}
+
+void MslTranslator::line( int n )
+{
+    _out += "#line " + std::to_string(n) + " \"";
+    for (char c : _path)
+    {
+        if (c == '"' || c == '\\')
+            _out += '\\';
+        _out += c;
+    }
+    _out += "\"\n";
+}
+
+void MslTranslator::emit( const std::string &text )
+{
+    if (!text.empty())
+        _out.append(_indent * 4, ' ');
+    _out += text;
+    _out += '\n';
+}
+
+std::string MslTranslator::live() const
+{
+    std::string m = "~ret_";
+
+    if (!_loops.empty())
+    {
+        std::string k = std::to_string(_loops.back());
+        m += " & ~brk" + k + " & ~cont" + k;
+    }
+    return m;
+}
+
+// Lanes that are off keep their values, unless all lanes that entered the
+// function are on.
+void MslTranslator::assign( const std::string &target, const std::string &value )
+{
+    if (masked())
+        emit(target + " = spmd_select(exec_, " + value + ", " + target + ");");
+    else
+        emit(target + " = " + value + ";");
+}
+
+// The statements of a block up to the first that leaves it. Returns whether
+// one does, for all lanes.
+bool MslTranslator::block( const MslStmt &s )
+{
+    for (const auto &child : s.body)
+        if (stmt(*child))
+            return true;
+    return false;
+}
+
+// s in braces, as the body of an if or a loop
+bool MslTranslator::scoped( const MslStmt &s )
+{
+    bool left;
+
+    if (s.kind == MslBlock)
+        return stmt(s);
+    emit("{");
+    ++_indent;
+    left = stmt(s);
+    --_indent;
+    emit("}");
+    return left;
+}
+
+bool MslTranslator::stmt( const MslStmt &s )
+{
+    std::string k;
+
+    if (s.kind != MslBlock)
+        line(s.line);
+
+    switch (s.kind)
+    {
+        case MslBlock:
+        {
+            bool left;
+
+            if (!s.scope)
+                return block(s);
+            emit("{");
+            ++_indent;
+            left = block(s);
+            --_indent;
+            emit("}");
+            return left;
+        }
+
+        case MslDecl:
+            emit(type(s.var->type, false) + " " + name(*s.var) + " = "
+                    + (s.expr ? expr(*s.expr, true) : "{}") + ";");
+            return false;
+
+        case MslAssign:
+        {
+            const MslExpr &t = *s.target;
+            std::string target = t.kind == MslVariable ? name(*t.var)
+                : name(*t.args[0]->var) + ".c[" + std::to_string(t.swizzle[0]) + "]";
+
+            assign(target, expr(*s.expr, true));
+            return false;
+        }
+
+        case MslExprStmt:
+            emit(expr(*s.expr, true) + ";");
+            return false;
+
+        case MslWrite:
+            emit("spmd_write(" + name(*s.var) + ", exec_, " + expr(*s.expr, true) + ", "
+                    + expr(*s.expr2, true) + ");");
+            return false;
+
+        case MslIf:
+        {
+            bool left;
+
+            // all lanes agree, so plain C++ does
+            if (s.expr->uniform)
+            {
+                emit("if (" + expr(*s.expr, false) + ")");
+                left = scoped(*s.then);
+                if (s.otherwise)
+                {
+                    emit("else");
+                    left = scoped(*s.otherwise) && left;
+                }
+                else
+                {
+                    left = false;
+                }
+                return left;
+            }
+
+            k = std::to_string(++_labels);
+            emit("{");
+            ++_indent;
+            emit("vbool save" + k + " = exec_;");
+            emit("vbool cond" + k + " = exec_ & " + expr(*s.expr, true) + ";");
+            emit("exec_ = cond" + k + ";");
+            ++_varying;
+            emit("if (spmd_any(exec_))");
+            scoped(*s.then);
+            if (s.otherwise)
+            {
+                emit("exec_ = save" + k + " & ~cond" + k + " & " + live() + ";");
+                emit("if (spmd_any(exec_))");
+                scoped(*s.otherwise);
+            }
+            --_varying;
+            emit("exec_ = save" + k + " & " + live() + ";");
+            --_indent;
+            emit("}");
+            return false;
+        }
+
+        case MslWhile:
+        case MslDoWhile:
+        case MslFor:
+        {
+            std::string cond = s.expr ? expr(*s.expr, true) : "";
+
+            k = std::to_string(++_labels);
+            emit("{");
+            ++_indent;
+            if (s.init)
+                stmt(*s.init);
+            emit("vbool save" + k + " = exec_;");
+            emit("vbool brk" + k + " = spmd_false();");
+            emit("for (;;)");
+            emit("{");
+            ++_indent;
+            if (s.kind != MslDoWhile && s.expr)
+            {
+                line(s.line);
+                emit("exec_ &= " + cond + ";");
+                emit("if (!spmd_any(exec_))");
+                emit("    break;");
+            }
+            emit("vbool iter" + k + " = exec_;");
+            emit("vbool cont" + k + " = spmd_false();");
+            _loops.push_back(_labels);
+            scoped(*s.then);
+            _loops.pop_back();
+            emit("exec_ = iter" + k + " & ~brk" + k + " & ~ret_;");
+            if (s.step)
+            {
+                _loops.push_back(_labels);
+                stmt(*s.step);
+                _loops.pop_back();
+            }
+            if (s.kind == MslDoWhile)
+            {
+                line(s.line);
+                emit("exec_ &= " + cond + ";");
+                emit("if (!spmd_any(exec_))");
+                emit("    break;");
+            }
+            --_indent;
+            emit("}");
+            emit("exec_ = save" + k + " & ~ret_;");
+            --_indent;
+            emit("}");
+            return false;
+        }
+
+        case MslBreak:
+        case MslContinue:
+            k = std::to_string(_loops.back());
+            emit((s.kind == MslBreak ? "brk" : "cont") + k + " |= exec_;");
+            emit("exec_ = spmd_false();");
+            return true;
+
+        case MslReturn:
+            // every lane that entered returns here
+            if (!masked())
+            {
+                emit(s.expr ? "return " + expr(*s.expr, true) + ";" : "return;");
+                return true;
+            }
+            if (s.expr)
+                emit("result_ = spmd_select(exec_, " + expr(*s.expr, true) + ", result_);");
+            emit("ret_ |= exec_;");
+            emit("exec_ = spmd_false();");
+            _diverged = true;
+            return true;
+    }
+    return false;
+}
+
+void MslTranslator::function( const MslFunction &fn )
+{
+    std::string sig = "static " + type(fn.ret, false) + " f_" + fn.name + "(vbool exec_";
+
+    for (unsigned i = 0; i < fn.nparams; ++i)
+    {
+        const MslVar &p = *fn.locals[i];
+
+        if (p.binding == MslBindBuffer || p.binding == MslBindTexture)
+            sig += ", const " + type(p.type, true) + " &" + name(p);
+        else
+            sig += ", " + type(p.type, p.uniform) + " " + name(p);
+    }
+
+    _diverged = false;
+    _out += "\n";
+    line(fn.body->line);
+    emit(sig + ")");
+    emit("{");
+    ++_indent;
+    emit("vbool ret_ = spmd_false();");
+    if (fn.ret.base != MslVoid)
+        emit(type(fn.ret, false) + " result_ = {};");
+
+    bool left = block(*fn.body);
+    if (!left || _diverged)
+        emit(fn.ret.base != MslVoid ? "return result_;" : "return;");
+    --_indent;
+    emit("}");
+}
+
+// metaltoy_jit_eval, which runs the kernel a row at a time, SPMD_WIDTH
+// positions per call
+void MslTranslator::kernelEntry( const MslFunction &fn )
+{
+    std::string call = "f_" + fn.name + "(exec_";
+
+    for (unsigned i = 0; i < fn.nparams; ++i)
+    {
+        const MslVar &p = *fn.locals[i];
+        std::string e = p.type.numeric() ? elem(p.type.base, p.uniform) : "";
+
+        switch (p.binding)
+        {
+            case MslBindPosition:
+                if (p.type.n == 1)
+                    call += ", spmd_convert<" + e + ">(spmd_iota(x))";
+                else
+                    call += ", spmd_convert<" + e + ">(index)";
+                break;
+            case MslBindGridSize:
+                if (p.type.n == 1)
+                    call += ", " + e + "(d->width)";
+                else
+                    call += ", spmd_convert<" + e + ">(grid)";
+                break;
+            case MslBindBuffer:
+                call += ", *reinterpret_cast<const " + type(p.type, true) + "*>(d->uniforms)";
+                break;
+            default:
+                call += ", row";
+                break;
+        }
+    }
+
+    _out += "\n";
+    _out += "extern \"C\" unsigned metaltoy_jit_abi()\n{\n    return METALTOY_JIT_ABI;\n}\n\n";
+    _out += "extern \"C\" unsigned metaltoy_jit_output()\n{\n    return METALTOY_JIT_RGBA8;\n}\n\n";
+    _out += "extern \"C\" uint64_t metaltoy_jit_eval(const CpuDispatch *d, unsigned y, unsigned x0, "
+        "unsigned x1, float *field)\n{\n";
+    _indent = 1;
+    emit("SpmdRow row = { reinterpret_cast<uint8_t*>(field), x0, x1, y, d->width, d->height };");
+    emit("SpmdVec<uint32_t, 2> grid = { { d->width, d->height } };");
+    emit("");
+    emit("for (unsigned x = x0; x < x1; x += SPMD_WIDTH)");
+    emit("{");
+    emit("    vbool exec_ = spmd_lanes_below(x1 - x);");
+    emit("    SpmdVec<vuint, 2> index = { { spmd_iota(x), spmd_varying(uint32_t(y)) } };");
+    emit("    " + call + ");");
+    emit("}");
+    emit("return x1 - x0;");
+    _indent = 0;
+    _out += "}\n";
+}
+
+int MslTranslator::translate( std::string *out, std::string *error )
+{
+    const MslFunction &kernel = *_prog.functions[_prog.kernel];
+    bool texture = false;
+
+    for (unsigned i = 0; i < kernel.nparams; ++i)
+        texture = texture || kernel.locals[i]->binding == MslBindTexture;
+    if (!texture)
+    {
+        *error = "line " + std::to_string(kernel.body->line) + ": the kernel has no texture to write to";
+        return -1;
+    }
+
+    _out = "// Generated by metaltoy from " + _path + "\n#include \"spmd.h\"\n";
+
+    for (const MslStructDef &def : _prog.structs)
+    {
+        _out += "\nstruct S_" + def.name + "\n{\n";
+        for (const MslField &f : def.fields)
+            _out += "    " + type(f.type, true) + " " + f.name + ";\n";
+        _out += "};\n";
+    }
+
+    for (const MslStructDef &def : _prog.structs)
+    {
+        // what the cpu passes as buffer(0)
+        for (unsigned i = 0; i < kernel.nparams; ++i)
+        {
+            const MslVar &p = *kernel.locals[i];
+            if (p.binding == MslBindBuffer && p.type.base == MslStruct && _prog.structs[p.type.strct].name == def.name)
+                _out += "static_assert(sizeof(S_" + def.name + ") <= sizeof(Uniforms), \"" + def.name
+                    + " is larger than the Uniforms in uniforms.h, which is what buffer(0) holds\");\n";
+        }
+    }
+
+    if (!_prog.globals.empty())
+        _out += "\n";
+    for (const MslGlobal &g : _prog.globals)
+    {
+        line(g.init->line);
+        _out += "static const " + type(g.var->type, true) + " " + name(*g.var) + " = "
+            + expr(*g.init, false) + ";\n";
+    }
+
+    for (const auto &fn : _prog.functions)
+        function(*fn);
+
+    kernelEntry(kernel);
+    *out = _out;
+    return 0;
+}
+
+int msl_translate(const MslProgram &prog, const char *path, std::string *out, std::string *error)
+{
+    MslTranslator t(prog, path);
+    return t.translate(out, error);
+}
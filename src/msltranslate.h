@@ -0,0 +1,19 @@
+#ifndef METALTOY_MSLTRANSLATE_H
+#define METALTOY_MSLTRANSLATE_H
+
+#include "mslparse.h"
+
+#include <string>
+
+// Translates a parsed Metal kernel to C++ for the cpu jit, in SPMD form: each
+// call of the generated metaltoy_jit_eval runs the kernel for SPMD_WIDTH grid
+// positions at once, on the vector types of spmd.h. Values that depend on
+// the position live in lanes; uniform ones (constants, the grid size, the
+// buffer) stay scalars. Branches and loops on varying conditions run under
+// an execution mask, and are skipped when no lane takes them.
+//
+// The output has #line directives for path, so compiler messages point into
+// the Metal source. return 0 on success
+int msl_translate(const MslProgram &prog, const char *path, std::string *out, std::string *error);
+
+#endif
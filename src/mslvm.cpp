@@ -0,0 +1,1205 @@
+#include "mslvm.h"
+
+#include <map>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+// Aligned explicitly: without avx enabled a vector type only gets 16 bytes,
+// and the avx variants of the interpreter below load them aligned.
+typedef int32_t VmInt __attribute__((vector_size(msl_vm_width * 4), aligned(msl_vm_width * 4)));
+typedef uint32_t VmUint __attribute__((vector_size(msl_vm_width * 4), aligned(msl_vm_width * 4)));
+typedef float VmFloat __attribute__((vector_size(msl_vm_width * 4), aligned(msl_vm_width * 4)));
+
+enum VmOpcode : uint16_t
+{
+    VmMov,
+    VmMovMasked, // in the lanes of the execution mask
+    VmAddF, VmSubF, VmMulF, VmDivF, VmNegF,
+    VmAddI, VmSubI, VmMulI, VmDivI, VmModI, VmNegI, VmDivU, VmModU,
+    VmAnd, VmOr, VmXor, VmNot, VmAndNot, VmShl, VmShrI, VmShrU,
+    // comparisons make masks, -1 for true
+    VmLtF, VmLeF, VmEqF, VmNeF, VmLtI, VmLeI, VmEqI, VmNeI, VmLtU, VmLeU,
+    VmIToF, VmUToF, VmFToI, VmFToU, VmNezF, VmNezI,
+    VmSelect, // a ? b : c
+    VmMinF, VmMaxF, VmMinI, VmMaxI, VmMinU, VmMaxU, VmAbsI,
+    // functions of floats, per lane
+    VmSin, VmCos, VmTan, VmAsin, VmAcos, VmAtan, VmSinh, VmCosh, VmTanh,
+    VmExp, VmExp2, VmLog, VmLog2, VmLog10, VmSqrt, VmRsqrt, VmFloor, VmCeil,
+    VmRound, VmTrunc, VmFract, VmAbsF, VmSign, VmSaturate,
+    VmPow, VmAtan2, VmFmod, VmStep,
+    VmJump,     // to dst
+    VmJumpNone, // to dst if no lane of a is set
+    VmWrite,    // color a to a + 3 at a + 4, a + 5, in the lanes of the mask
+    VmEnd,
+};
+
+struct VmOp
+{
+    uint16_t op, dst, a, b, c;
+};
+
+// registers with the same value in every lane, filled in before the program
+// runs
+enum VmPreloadKind
+{
+    VmPreloadConstant, // value is the bits
+    VmPreloadWord,     // of the buffer, at byte offset value
+    VmPreloadBool,     // a byte of the buffer, as a mask
+};
+
+struct VmPreload
+{
+    uint16_t reg;
+    VmPreloadKind kind;
+    uint32_t value;
+};
+
+// fixed registers
+enum
+{
+    VmRegExec,
+    VmRegX,
+    VmRegY,
+    VmRegWidth,
+    VmRegHeight,
+    VmFixedRegs,
+};
+
+struct MslVmProgram
+{
+    std::vector<VmOp> code;
+    std::vector<VmPreload> preloads;
+    unsigned nregs;
+};
+
+// Until the end of compilation, operands with this bit set are preloads
+// and the rest their index.
+static const uint16_t vm_preload_bit = 0x8000;
+
+// the registers of the components of a value
+struct VmVal
+{
+    uint16_t r[4];
+    unsigned n;
+};
+
+static const struct { const char *name; VmOpcode op; } vm_float_builtins[] = {
+    { "sin", VmSin }, { "cos", VmCos }, { "tan", VmTan }, { "asin", VmAsin }, { "acos", VmAcos },
+    { "atan", VmAtan }, { "sinh", VmSinh }, { "cosh", VmCosh }, { "tanh", VmTanh }, { "exp", VmExp },
+    { "exp2", VmExp2 }, { "log", VmLog }, { "log2", VmLog2 }, { "log10", VmLog10 }, { "sqrt", VmSqrt },
+    { "rsqrt", VmRsqrt }, { "floor", VmFloor }, { "ceil", VmCeil }, { "round", VmRound },
+    { "trunc", VmTrunc }, { "fract", VmFract }, { "fabs", VmAbsF }, { "sign", VmSign },
+    { "saturate", VmSaturate }, { "pow", VmPow }, { "powr", VmPow }, { "atan2", VmAtan2 },
+    { "fmod", VmFmod }, { "fmin", VmMinF }, { "fmax", VmMaxF }, { "step", VmStep },
+};
+
+class VmCompiler
+{
+    public:
+        VmCompiler( const MslProgram &prog )
+        : _prog( prog )
+        {}
+
+        MslVmProgram *compile( std::string *error );
+
+    private:
+        struct Loop
+        {
+            uint16_t brk, cont;
+            // whether code so far, in this iteration, may set them
+            bool broke = false, continued = false;
+        };
+
+        // a function being inlined, or the kernel
+        struct Frame
+        {
+            std::map<const MslVar*, VmVal> vars;
+            uint16_t ret;
+            VmVal result;
+            unsigned varying = 0; // ifs around
+            std::vector<Loop> loops;
+            bool diverged = false; // some lanes returned early
+        };
+
+        uint16_t temp();
+        VmVal temps( unsigned n );
+        uint16_t constant( uint32_t bits );
+        uint16_t constantf( float f );
+        uint16_t preload( VmPreloadKind kind, uint32_t value );
+        unsigned emit( VmOpcode op, uint16_t dst, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0 );
+        uint16_t op( VmOpcode op, uint16_t a, uint16_t b = 0, uint16_t c = 0 );
+        void patch( unsigned jump ) { _code[jump].dst = (uint16_t)_code.size(); }
+        void fail( const std::string &msg, int line );
+
+        // whether some lanes of those that entered the function may be off
+        bool masked() const { return frame().varying || !frame().loops.empty() || frame().diverged; }
+        Frame &frame() { return _frames.back(); }
+        const Frame &frame() const { return _frames.back(); }
+        void live();
+        void assign( const VmVal &dst, VmVal src );
+
+        VmVal expr( const MslExpr &e );
+        VmVal binary( const MslExpr &e );
+        VmVal builtin( const MslExpr &e );
+        VmVal convert( const MslExpr &e );
+        VmVal call( const MslExpr &e );
+        VmVal variable( const MslVar &v, int line );
+        bool bufferOffset( const MslExpr &e, unsigned *offset ) const;
+
+        bool stmt( const MslStmt &s );
+        bool stmtInner( const MslStmt &s );
+        bool block( const MslStmt &s );
+        void loop( const MslStmt &s );
+
+        const MslProgram &_prog;
+        std::vector<VmOp> _code;
+        std::vector<VmPreload> _preloads;
+        std::map<uint64_t, uint16_t> _preloadregs; // by kind and value
+        std::map<const MslVar*, VmVal> _globals;
+        std::vector<Frame> _frames;
+        unsigned _top = VmFixedRegs; // next free register
+        unsigned _max = VmFixedRegs;
+        std::string _error;
+};
+
+void VmCompiler::fail( const std::string &msg, int line )
+{
+    if (_error.empty())
+        _error = "line " + std::to_string(line) + ": " + msg;
+}
+
+uint16_t VmCompiler::temp()
+{
+    if (_top >= vm_preload_bit)
+    {
+        fail("the kernel needs more registers than the vm has", 0);
+        return 0;
+    }
+    _max = _top + 1 > _max ? _top + 1 : _max;
+    return (uint16_t)_top++;
+}
+
+VmVal VmCompiler::temps( unsigned n )
+{
+    VmVal v;
+
+    v.n = n;
+    for (unsigned i = 0; i < n; ++i)
+        v.r[i] = temp();
+    return v;
+}
+
+uint16_t VmCompiler::preload( VmPreloadKind kind, uint32_t value )
+{
+    uint64_t key = (uint64_t)kind << 32 | value;
+    auto found = _preloadregs.find(key);
+
+    if (found != _preloadregs.end())
+        return found->second;
+
+    uint16_t reg = (uint16_t)(vm_preload_bit | _preloads.size());
+    _preloads.push_back(VmPreload{ reg, kind, value });
+    _preloadregs[key] = reg;
+    return reg;
+}
+
+uint16_t VmCompiler::constant( uint32_t bits )
+{
+    return preload(VmPreloadConstant, bits);
+}
+
+uint16_t VmCompiler::constantf( float f )
+{
+    uint32_t bits;
+
+    memcpy(&bits, &f, 4);
+    return constant(bits);
+}
+
+unsigned VmCompiler::emit( VmOpcode op, uint16_t dst, uint16_t a, uint16_t b, uint16_t c )
+{
+    _code.push_back(VmOp{ op, dst, a, b, c });
+    return (unsigned)_code.size() - 1;
+}
+
+// op into a new register
+uint16_t VmCompiler::op( VmOpcode op, uint16_t a, uint16_t b, uint16_t c )
+{
+    uint16_t dst = temp();
+
+    emit(op, dst, a, b, c);
+    return dst;
+}
+
+// takes the lanes that have left the innermost loop or the function out of
+// the execution mask
+void VmCompiler::live()
+{
+    if (frame().diverged)
+        emit(VmAndNot, VmRegExec, VmRegExec, frame().ret);
+    if (!frame().loops.empty() && frame().loops.back().broke)
+        emit(VmAndNot, VmRegExec, VmRegExec, frame().loops.back().brk);
+    if (!frame().loops.empty() && frame().loops.back().continued)
+        emit(VmAndNot, VmRegExec, VmRegExec, frame().loops.back().cont);
+}
+
+void VmCompiler::assign( const VmVal &dst, VmVal src )
+{
+    // p = p.yx reads what it writes
+    for (unsigned i = 0; i < src.n; ++i)
+    {
+        for (unsigned j = 0; j < dst.n; ++j)
+        {
+            if (i != j && src.r[i] == dst.r[j])
+            {
+                for (unsigned k = 0; k < src.n; ++k)
+                    src.r[k] = op(VmMov, src.r[k]);
+                i = src.n;
+                break;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < dst.n; ++i)
+        if (dst.r[i] != src.r[i] || masked())
+            emit(masked() ? VmMovMasked : VmMov, dst.r[i], src.r[i]);
+}
+
+VmVal VmCompiler::variable( const MslVar &v, int line )
+{
+    VmVal val = {};
+
+    if (v.global)
+        return _globals[&v];
+
+    auto found = frame().vars.find(&v);
+    if (found != frame().vars.end())
+        return found->second;
+
+    val.n = v.type.n;
+    switch (v.binding)
+    {
+        case MslBindPosition:
+            val.r[0] = VmRegX;
+            val.r[1] = VmRegY;
+            break;
+        case MslBindGridSize:
+            val.r[0] = VmRegWidth;
+            val.r[1] = VmRegHeight;
+            break;
+        case MslBindBuffer:
+            // a scalar or vector buffer, structs are read a member at a time
+            for (unsigned i = 0; i < v.type.n; ++i)
+                val.r[i] = preload(v.type.base == MslBool ? VmPreloadBool : VmPreloadWord,
+                        v.type.base == MslBool ? i : i * 4);
+            break;
+        default:
+            fail("cannot use " + v.name + " here", line);
+            break;
+    }
+    return val;
+}
+
+// Metal layout: scalars are 4 bytes but bool 1, vectors are aligned to their
+// size, with 3 components taking 4
+static unsigned msl_align(const MslProgram &prog, const MslType &t);
+
+static unsigned msl_size(const MslProgram &prog, const MslType &t)
+{
+    if (t.base == MslStruct)
+    {
+        unsigned size = 0;
+
+        for (const MslField &f : prog.structs[t.strct].fields)
+        {
+            unsigned a = msl_align(prog, f.type);
+            size = (size + a - 1) / a * a + msl_size(prog, f.type);
+        }
+        unsigned a = msl_align(prog, t);
+        return (size + a - 1) / a * a;
+    }
+    return (t.base == MslBool ? 1 : 4) * (t.n == 3 ? 4 : t.n);
+}
+
+static unsigned msl_align(const MslProgram &prog, const MslType &t)
+{
+    if (t.base == MslStruct)
+    {
+        unsigned a = 1;
+
+        for (const MslField &f : prog.structs[t.strct].fields)
+            a = msl_align(prog, f.type) > a ? msl_align(prog, f.type) : a;
+        return a;
+    }
+    return msl_size(prog, t);
+}
+
+// where in the buffer a member is
+bool VmCompiler::bufferOffset( const MslExpr &e, unsigned *offset ) const
+{
+    if (e.kind == MslVariable)
+    {
+        *offset = 0;
+        return e.var->binding == MslBindBuffer;
+    }
+    if (e.kind != MslMember || !bufferOffset(*e.args[0], offset))
+        return false;
+
+    const MslStructDef &def = _prog.structs[e.args[0]->type.strct];
+    unsigned at = 0;
+
+    for (int i = 0; i <= e.field; ++i)
+    {
+        unsigned a = msl_align(_prog, def.fields[i].type);
+        at = (at + a - 1) / a * a;
+        if (i < e.field)
+            at += msl_size(_prog, def.fields[i].type);
+    }
+    *offset += at;
+    return true;
+}
+
+VmVal VmCompiler::expr( const MslExpr &e )
+{
+    VmVal v = {};
+
+    v.n = e.type.n;
+    switch (e.kind)
+    {
+        case MslLiteral:
+        {
+            if (e.type.base == MslFloat)
+                v.r[0] = constantf((float)e.fvalue);
+            else if (e.type.base == MslBool)
+                v.r[0] = constant(e.ivalue ? 0xffffffffu : 0);
+            else
+                v.r[0] = constant((uint32_t)e.ivalue);
+            return v;
+        }
+
+        case MslVariable:
+            return variable(*e.var, e.line);
+
+        case MslUnary:
+        {
+            VmVal a = expr(*e.args[0]);
+
+            for (unsigned i = 0; i < v.n; ++i)
+            {
+                if (e.op == "-")
+                    v.r[i] = op(e.type.base == MslFloat ? VmNegF : VmNegI, a.r[i]);
+                else
+                    v.r[i] = op(VmNot, a.r[i]);
+            }
+            return v;
+        }
+
+        case MslBinary:
+            return binary(e);
+
+        case MslSelect:
+        {
+            VmVal c = expr(*e.args[0]), a = expr(*e.args[1]), b = expr(*e.args[2]);
+
+            for (unsigned i = 0; i < v.n; ++i)
+                v.r[i] = op(VmSelect, c.r[0], a.r[i], b.r[i]);
+            return v;
+        }
+
+        case MslCall:
+            return call(e);
+
+        case MslBuiltin:
+            return builtin(e);
+
+        case MslConstruct:
+            v.n = 0;
+            for (const auto &arg : e.args)
+            {
+                VmVal a = expr(*arg);
+                for (unsigned i = 0; i < a.n; ++i)
+                    v.r[v.n++] = a.r[i];
+            }
+            return v;
+
+        case MslConvert:
+            return convert(e);
+
+        case MslMember:
+        {
+            unsigned offset;
+
+            if (!bufferOffset(e, &offset))
+            {
+                fail("only members of the buffer can be read", e.line);
+                return v;
+            }
+            for (unsigned i = 0; i < v.n; ++i)
+                v.r[i] = e.type.base == MslBool ? preload(VmPreloadBool, offset + i)
+                    : preload(VmPreloadWord, offset + 4 * i);
+            return v;
+        }
+
+        case MslSwizzle:
+        {
+            VmVal a = expr(*e.args[0]);
+
+            for (unsigned i = 0; i < v.n; ++i)
+                v.r[i] = a.r[e.swizzle[i]];
+            return v;
+        }
+    }
+    return v;
+}
+
+VmVal VmCompiler::binary( const MslExpr &e )
+{
+    VmVal a = expr(*e.args[0]), b = expr(*e.args[1]), v;
+    MslBase base = e.args[0]->type.base;
+    bool f = base == MslFloat, u = base == MslUint;
+    bool swap = e.op == ">" || e.op == ">=";
+    VmOpcode code;
+
+    if (e.op == "+") code = f ? VmAddF : VmAddI;
+    else if (e.op == "-") code = f ? VmSubF : VmSubI;
+    else if (e.op == "*") code = f ? VmMulF : VmMulI;
+    else if (e.op == "/") code = f ? VmDivF : (u ? VmDivU : VmDivI);
+    else if (e.op == "%") code = u ? VmModU : VmModI;
+    else if (e.op == "&" || e.op == "&&") code = VmAnd;
+    else if (e.op == "|" || e.op == "||") code = VmOr;
+    else if (e.op == "^") code = VmXor;
+    else if (e.op == "<<") code = VmShl;
+    else if (e.op == ">>") code = u ? VmShrU : VmShrI;
+    else if (e.op == "<" || e.op == ">") code = f ? VmLtF : (u ? VmLtU : VmLtI);
+    else if (e.op == "<=" || e.op == ">=") code = f ? VmLeF : (u ? VmLeU : VmLeI);
+    else if (e.op == "==") code = f ? VmEqF : VmEqI;
+    else code = f ? VmNeF : VmNeI;
+
+    v.n = e.type.n;
+    for (unsigned i = 0; i < v.n; ++i)
+        v.r[i] = swap ? op(code, b.r[i], a.r[i]) : op(code, a.r[i], b.r[i]);
+    return v;
+}
+
+VmVal VmCompiler::convert( const MslExpr &e )
+{
+    VmVal a = expr(*e.args[0]), v;
+    MslBase from = e.args[0]->type.base, to = e.type.base;
+
+    v.n = e.type.n;
+    for (unsigned i = 0; i < v.n; ++i)
+    {
+        uint16_t r = a.r[a.n == 1 ? 0 : i];
+
+        if (from == to || (from != MslFloat && from != MslBool && to != MslFloat && to != MslBool))
+            v.r[i] = r; // int and uint share the bits
+        else if (to == MslBool)
+            v.r[i] = op(from == MslFloat ? VmNezF : VmNezI, r);
+        else if (from == MslBool)
+            v.r[i] = op(VmAnd, r, to == MslFloat ? constantf(1.0f) : constant(1));
+        else if (to == MslFloat)
+            v.r[i] = op(from == MslUint ? VmUToF : VmIToF, r);
+        else
+            v.r[i] = op(to == MslUint ? VmFToU : VmFToI, r);
+    }
+    return v;
+}
+
+VmVal VmCompiler::builtin( const MslExpr &e )
+{
+    const std::string &name = e.op;
+    VmVal v, args[3] = {};
+    MslBase base = e.args.empty() ? MslUint : e.args[0]->type.base;
+    bool f = base == MslFloat, u = base == MslUint;
+
+    v.n = e.type.n;
+    if (name == "get_width" || name == "get_height")
+    {
+        v.r[0] = name == "get_width" ? VmRegWidth : VmRegHeight;
+        return v;
+    }
+
+    for (size_t i = 0; i < e.args.size(); ++i)
+        args[i] = expr(*e.args[i]);
+    VmVal &a = args[0], &b = args[1], &c = args[2];
+
+    for (const auto &fb : vm_float_builtins)
+    {
+        if (name == fb.name)
+        {
+            for (unsigned i = 0; i < v.n; ++i)
+                v.r[i] = op(fb.op, a.r[i], b.r[i]);
+            return v;
+        }
+    }
+
+    if (name == "abs" || name == "min" || name == "max" || name == "clamp")
+    {
+        for (unsigned i = 0; i < v.n; ++i)
+        {
+            if (name == "abs")
+                v.r[i] = f ? op(VmAbsF, a.r[i]) : (u ? a.r[i] : op(VmAbsI, a.r[i]));
+            if (name == "max" || name == "clamp")
+                v.r[i] = op(f ? VmMaxF : (u ? VmMaxU : VmMaxI), a.r[i], b.r[i]);
+            if (name == "min")
+                v.r[i] = op(f ? VmMinF : (u ? VmMinU : VmMinI), a.r[i], b.r[i]);
+            if (name == "clamp")
+                v.r[i] = op(f ? VmMinF : (u ? VmMinU : VmMinI), v.r[i], c.r[i]);
+        }
+        return v;
+    }
+
+    // a + (b - a) * t
+    if (name == "mix")
+    {
+        for (unsigned i = 0; i < v.n; ++i)
+            v.r[i] = op(VmAddF, a.r[i], op(VmMulF, op(VmSubF, b.r[i], a.r[i]), c.r[i]));
+        return v;
+    }
+
+    if (name == "fma")
+    {
+        for (unsigned i = 0; i < v.n; ++i)
+            v.r[i] = op(VmAddF, op(VmMulF, a.r[i], b.r[i]), c.r[i]);
+        return v;
+    }
+
+    // t * t * (3 - 2 * t), t = saturate((x - e0) / (e1 - e0))
+    if (name == "smoothstep")
+    {
+        for (unsigned i = 0; i < v.n; ++i)
+        {
+            uint16_t t = op(VmSaturate, op(VmDivF, op(VmSubF, c.r[i], a.r[i]), op(VmSubF, b.r[i], a.r[i])));
+            uint16_t s = op(VmSubF, constantf(3.0f), op(VmMulF, constantf(2.0f), t));
+            v.r[i] = op(VmMulF, op(VmMulF, t, t), s);
+        }
+        return v;
+    }
+
+    if (name == "select")
+    {
+        for (unsigned i = 0; i < v.n; ++i)
+            v.r[i] = op(VmSelect, c.r[c.n == 1 ? 0 : i], b.r[i], a.r[i]);
+        return v;
+    }
+
+    if (name == "any" || name == "all")
+    {
+        v.r[0] = a.r[0];
+        for (unsigned i = 1; i < a.n; ++i)
+            v.r[0] = op(name == "any" ? VmOr : VmAnd, v.r[0], a.r[i]);
+        return v;
+    }
+
+    if (name == "cross")
+    {
+        for (unsigned i = 0; i < 3; ++i)
+        {
+            unsigned j = (i + 1) % 3, k = (i + 2) % 3;
+            v.r[i] = op(VmSubF, op(VmMulF, a.r[j], b.r[k]), op(VmMulF, a.r[k], b.r[j]));
+        }
+        return v;
+    }
+
+    // the rest are geometry, on a - b for distance
+    VmVal d = a;
+    if (name == "distance")
+        for (unsigned i = 0; i < a.n; ++i)
+            d.r[i] = op(VmSubF, a.r[i], b.r[i]);
+    const VmVal &other = name == "dot" ? b : d;
+
+    uint16_t sum = op(VmMulF, d.r[0], other.r[0]);
+    for (unsigned i = 1; i < d.n; ++i)
+        sum = op(VmAddF, sum, op(VmMulF, d.r[i], other.r[i]));
+
+    if (name == "dot" || name == "length_squared")
+        v.r[0] = sum;
+    else if (name == "length" || name == "distance")
+        v.r[0] = op(VmSqrt, sum);
+    else // normalize
+    {
+        uint16_t scale = op(VmRsqrt, sum);
+        for (unsigned i = 0; i < v.n; ++i)
+            v.r[i] = op(VmMulF, a.r[i], scale);
+    }
+    return v;
+}
+
+// Inlines the function. Its registers are temporaries of the statement that
+// calls it.
+VmVal VmCompiler::call( const MslExpr &e )
+{
+    const MslFunction &fn = *_prog.functions[e.func];
+    std::vector<VmVal> args;
+    Frame callee;
+
+    for (const auto &a : e.args)
+        args.push_back(expr(*a));
+
+    // parameters may be assigned to, so they are copies
+    for (unsigned i = 0; i < fn.nparams; ++i)
+    {
+        VmVal p = temps(args[i].n);
+        for (unsigned j = 0; j < p.n; ++j)
+            emit(VmMov, p.r[j], args[i].r[j]);
+        callee.vars[fn.locals[i].get()] = p;
+    }
+    callee.ret = op(VmMov, constant(0));
+    callee.result = temps(fn.ret.base == MslVoid ? 0 : fn.ret.n);
+
+    uint16_t exec = op(VmMov, VmRegExec);
+    _frames.push_back(callee);
+    block(*fn.body);
+    VmVal result = frame().result;
+    _frames.pop_back();
+    emit(VmMov, VmRegExec, exec);
+    return result;
+}
+
+// the statements of a block up to the first that leaves it, for all lanes
+bool VmCompiler::block( const MslStmt &s )
+{
+    for (const auto &child : s.body)
+        if (stmt(*child))
+            return true;
+    return false;
+}
+
+// Temporaries are freed after each statement, and variables at the end of
+// their block.
+bool VmCompiler::stmt( const MslStmt &s )
+{
+    unsigned mark = _top;
+    bool left = stmtInner(s);
+
+    if (s.kind != MslDecl && (s.kind != MslBlock || s.scope))
+        _top = mark;
+    return left;
+}
+
+bool VmCompiler::stmtInner( const MslStmt &s )
+{
+    switch (s.kind)
+    {
+        case MslBlock:
+            return block(s);
+
+        case MslDecl:
+        {
+            VmVal var = temps(s.var->type.n);
+            unsigned mark = _top;
+
+            frame().vars[s.var] = var;
+            if (!s.expr)
+                for (unsigned i = 0; i < var.n; ++i)
+                    emit(VmMov, var.r[i], constant(0));
+            else
+            {
+                VmVal value = expr(*s.expr);
+                for (unsigned i = 0; i < var.n; ++i)
+                    emit(VmMov, var.r[i], value.r[i]);
+            }
+            _top = mark;
+            return false;
+        }
+
+        case MslAssign:
+        {
+            const MslExpr &t = *s.target;
+            VmVal dst = variable(t.kind == MslVariable ? *t.var : *t.args[0]->var, s.line);
+            VmVal value = expr(*s.expr);
+
+            if (t.kind == MslSwizzle)
+            {
+                dst.r[0] = dst.r[t.swizzle[0]];
+                dst.n = 1;
+            }
+            assign(dst, value);
+            return false;
+        }
+
+        case MslExprStmt:
+            expr(*s.expr);
+            return false;
+
+        case MslWrite:
+        {
+            VmVal color = expr(*s.expr), coord = expr(*s.expr2);
+            uint16_t args[] = { color.r[0], color.r[1], color.r[2], color.r[3], coord.r[0], coord.r[1] };
+            uint16_t first = temp();
+
+            for (unsigned i = 1; i < 6; ++i)
+                temp();
+            for (unsigned i = 0; i < 6; ++i)
+                emit(VmMov, (uint16_t)(first + i), args[i]);
+            emit(VmWrite, 0, first);
+            return false;
+        }
+
+        case MslIf:
+        {
+            uint16_t save = op(VmMov, VmRegExec);
+            uint16_t cond = expr(*s.expr).r[0];
+            unsigned skip;
+
+            // the else needs the condition for the lanes it runs
+            if (s.otherwise)
+                cond = op(VmAnd, VmRegExec, cond);
+            emit(VmAnd, VmRegExec, VmRegExec, cond);
+            ++frame().varying;
+            skip = emit(VmJumpNone, 0, VmRegExec);
+            stmt(*s.then);
+            patch(skip);
+            if (s.otherwise)
+            {
+                emit(VmAndNot, VmRegExec, save, cond);
+                live();
+                skip = emit(VmJumpNone, 0, VmRegExec);
+                stmt(*s.otherwise);
+                patch(skip);
+            }
+            --frame().varying;
+            emit(VmMov, VmRegExec, save);
+            live();
+            return false;
+        }
+
+        case MslWhile:
+        case MslDoWhile:
+        case MslFor:
+            loop(s);
+            return false;
+
+        case MslBreak:
+        case MslContinue:
+        {
+            Loop &l = frame().loops.back();
+            uint16_t mask = s.kind == MslBreak ? l.brk : l.cont;
+
+            (s.kind == MslBreak ? l.broke : l.continued) = true;
+            emit(VmOr, mask, mask, VmRegExec);
+            emit(VmMov, VmRegExec, constant(0));
+            return true;
+        }
+
+        case MslReturn:
+        {
+            VmVal value;
+
+            if (s.expr)
+                value = expr(*s.expr);
+            // every lane that entered returns here
+            if (!masked())
+            {
+                for (unsigned i = 0; s.expr && i < value.n; ++i)
+                    emit(VmMov, frame().result.r[i], value.r[i]);
+                emit(VmMov, VmRegExec, constant(0));
+                return true;
+            }
+            for (unsigned i = 0; s.expr && i < value.n; ++i)
+                emit(VmMovMasked, frame().result.r[i], value.r[i]);
+            emit(VmOr, frame().ret, frame().ret, VmRegExec);
+            emit(VmMov, VmRegExec, constant(0));
+            frame().diverged = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void VmCompiler::loop( const MslStmt &s )
+{
+    Loop l;
+    unsigned top, exit = 0;
+    bool hasexit = false;
+
+    if (s.init)
+        stmt(*s.init);
+
+    uint16_t save = op(VmMov, VmRegExec);
+    l.brk = op(VmMov, constant(0));
+    l.cont = op(VmMov, constant(0));
+
+    top = (unsigned)_code.size();
+    if (s.kind != MslDoWhile && s.expr)
+    {
+        unsigned mark = _top;
+        emit(VmAnd, VmRegExec, VmRegExec, expr(*s.expr).r[0]);
+        exit = emit(VmJumpNone, 0, VmRegExec);
+        hasexit = true;
+        _top = mark;
+    }
+
+    uint16_t iter = op(VmMov, VmRegExec);
+    frame().loops.push_back(l);
+    stmt(*s.then);
+    if (frame().loops.back().broke)
+        emit(VmAndNot, VmRegExec, iter, l.brk);
+    else
+        emit(VmMov, VmRegExec, iter);
+    if (frame().diverged)
+        emit(VmAndNot, VmRegExec, VmRegExec, frame().ret);
+    if (frame().loops.back().continued)
+        emit(VmMov, l.cont, constant(0));
+    if (s.step)
+        stmt(*s.step);
+    frame().loops.pop_back();
+
+    if (s.kind == MslDoWhile)
+    {
+        emit(VmAnd, VmRegExec, VmRegExec, expr(*s.expr).r[0]);
+        exit = emit(VmJumpNone, 0, VmRegExec);
+        hasexit = true;
+    }
+    // a loop without a condition ends when no lane is left in it
+    if (!hasexit)
+        exit = emit(VmJumpNone, 0, VmRegExec);
+    emit(VmJump, (uint16_t)top);
+    patch(exit);
+
+    if (frame().diverged)
+        emit(VmAndNot, VmRegExec, save, frame().ret);
+    else
+        emit(VmMov, VmRegExec, save);
+}
+
+MslVmProgram *VmCompiler::compile( std::string *error )
+{
+    const MslFunction &kernel = *_prog.functions[_prog.kernel];
+
+    for (unsigned i = 0; i < kernel.nparams; ++i)
+    {
+        const MslVar &p = *kernel.locals[i];
+        if (p.binding == MslBindBuffer && msl_size(_prog, p.type) > sizeof(Uniforms))
+            fail(p.name + " is larger than the Uniforms in uniforms.h, which is what buffer(0) holds",
+                    kernel.body->line);
+    }
+
+    // constants are computed once per run, unmasked
+    _frames.push_back(Frame());
+    frame().ret = op(VmMov, constant(0));
+    for (const MslGlobal &g : _prog.globals)
+    {
+        VmVal value = expr(*g.init);
+        VmVal var = temps(value.n);
+
+        for (unsigned i = 0; i < var.n; ++i)
+            emit(VmMov, var.r[i], value.r[i]);
+        _globals[g.var.get()] = var;
+    }
+    block(*kernel.body);
+    emit(VmEnd, 0);
+
+    if (_code.size() >= 0xffff)
+        fail("the kernel is too long for the vm", kernel.body->line);
+    if (_max + _preloads.size() >= 0xffff)
+        fail("the kernel needs more registers than the vm has", kernel.body->line);
+    if (!_error.empty())
+    {
+        *error = _error;
+        return nullptr;
+    }
+
+    // preloads go after the other registers
+    for (VmOp &o : _code)
+    {
+        uint16_t *operands[] = { &o.a, &o.b, &o.c };
+
+        for (uint16_t *r : operands)
+            if (*r & vm_preload_bit)
+                *r = (uint16_t)(_max + (*r & ~vm_preload_bit));
+    }
+    for (VmPreload &p : _preloads)
+        p.reg = (uint16_t)(_max + (p.reg & ~vm_preload_bit));
+
+    MslVmProgram *program = new MslVmProgram;
+    program->code = std::move(_code);
+    program->preloads = std::move(_preloads);
+    program->nregs = _max + (unsigned)program->preloads.size();
+    return program;
+}
+
+MslVmProgram *msl_vm_compile(const MslProgram &prog, std::string *error)
+{
+    VmCompiler compiler(prog);
+    return compiler.compile(error);
+}
+
+void msl_vm_destroy(MslVmProgram *program)
+{
+    delete program;
+}
+
+unsigned msl_vm_size(const MslVmProgram *program, unsigned *registers)
+{
+    *registers = program->nregs;
+    return (unsigned)program->code.size();
+}
+
+// Running
+
+// the bits of a register as floats, and back
+#define VM_F(v) ((VmFloat)(v))
+#define VM_I(v) ((VmInt)(v))
+
+// all bits set in the lanes where the integer division a / b would trap: b == 0,
+// and INT_MIN / -1 whose quotient does not fit
+#define VM_DIV_TRAP(a, b) (((b) == 0) | (((b) == -1) & ((a) == INT32_MIN)))
+
+static inline __attribute__((always_inline)) bool vm_none(VmInt m)
+{
+    uint64_t words[msl_vm_width / 2], any = 0;
+
+    memcpy(words, &m, sizeof(m));
+    for (uint64_t w : words)
+        any |= w;
+    return !any;
+}
+
+#define VM_LANES(expr) \
+    { \
+        VmFloat a = VM_F(r[o->a]), b = VM_F(r[o->b]), v; \
+        (void)b; \
+        for (unsigned i = 0; i < msl_vm_width; ++i) \
+            v[i] = expr; \
+        r[o->dst] = VM_I(v); \
+    } \
+    break
+
+// In a struct because a template argument drops the alignment of VmInt,
+// and std::vector would allocate it 16 byte aligned.
+struct VmRegister
+{
+    VmInt lanes;
+};
+
+// the window of the texture being written
+struct VmRow
+{
+    uint8_t *data;
+    unsigned x0, x1, y;
+};
+
+// Runs the program once over the lanes. Returns the instructions executed.
+// Compiled once per instruction set below, the lanes are a register or two
+// of avx512 or avx2 and four of sse otherwise.
+static inline __attribute__((always_inline)) uint64_t vm_run(const VmOp *code, VmInt *r, const VmRow &row)
+{
+    uint64_t executed = 0;
+
+    for (const VmOp *o = code;; ++o)
+    {
+        ++executed;
+        switch (o->op)
+        {
+            case VmMov: r[o->dst] = r[o->a]; break;
+            case VmMovMasked: r[o->dst] = (r[o->a] & r[VmRegExec]) | (r[o->dst] & ~r[VmRegExec]); break;
+
+            case VmAddF: r[o->dst] = VM_I(VM_F(r[o->a]) + VM_F(r[o->b])); break;
+            case VmSubF: r[o->dst] = VM_I(VM_F(r[o->a]) - VM_F(r[o->b])); break;
+            case VmMulF: r[o->dst] = VM_I(VM_F(r[o->a]) * VM_F(r[o->b])); break;
+            case VmDivF: r[o->dst] = VM_I(VM_F(r[o->a]) / VM_F(r[o->b])); break;
+            case VmNegF: r[o->dst] = VM_I(-VM_F(r[o->a])); break;
+
+            // wrapping, as on the gpu
+            case VmAddI: r[o->dst] = (VmInt)((VmUint)r[o->a] + (VmUint)r[o->b]); break;
+            case VmSubI: r[o->dst] = (VmInt)((VmUint)r[o->a] - (VmUint)r[o->b]); break;
+            case VmMulI: r[o->dst] = (VmInt)((VmUint)r[o->a] * (VmUint)r[o->b]); break;
+            case VmNegI: r[o->dst] = (VmInt)-(VmUint)r[o->a]; break;
+            // division by zero and INT_MIN / -1 are undefined in Metal but
+            // would trap here, also in lanes that are off, so the divisor is
+            // replaced by 1: the quotient is a, what INT_MIN / -1 wraps to,
+            // and the remainder 0
+            case VmDivI:
+            {
+                VmInt trap = VM_DIV_TRAP(r[o->a], r[o->b]);
+                r[o->dst] = r[o->a] / ((r[o->b] & ~trap) | (trap & 1));
+                break;
+            }
+            case VmModI:
+            {
+                VmInt trap = VM_DIV_TRAP(r[o->a], r[o->b]);
+                r[o->dst] = r[o->a] % ((r[o->b] & ~trap) | (trap & 1));
+                break;
+            }
+            case VmDivU: r[o->dst] = (VmInt)((VmUint)r[o->a] / (VmUint)(r[o->b] + ((r[o->b] == 0) & 1))); break;
+            case VmModU: r[o->dst] = (VmInt)((VmUint)r[o->a] % (VmUint)(r[o->b] + ((r[o->b] == 0) & 1))); break;
+
+            case VmAnd: r[o->dst] = r[o->a] & r[o->b]; break;
+            case VmOr: r[o->dst] = r[o->a] | r[o->b]; break;
+            case VmXor: r[o->dst] = r[o->a] ^ r[o->b]; break;
+            case VmNot: r[o->dst] = ~r[o->a]; break;
+            case VmAndNot: r[o->dst] = r[o->a] & ~r[o->b]; break;
+            case VmShl: r[o->dst] = (VmInt)((VmUint)r[o->a] << (VmUint)(r[o->b] & 31)); break;
+            case VmShrI: r[o->dst] = r[o->a] >> (r[o->b] & 31); break;
+            case VmShrU: r[o->dst] = (VmInt)((VmUint)r[o->a] >> (VmUint)(r[o->b] & 31)); break;
+
+            case VmLtF: r[o->dst] = VM_F(r[o->a]) < VM_F(r[o->b]); break;
+            case VmLeF: r[o->dst] = VM_F(r[o->a]) <= VM_F(r[o->b]); break;
+            case VmEqF: r[o->dst] = VM_F(r[o->a]) == VM_F(r[o->b]); break;
+            case VmNeF: r[o->dst] = VM_F(r[o->a]) != VM_F(r[o->b]); break;
+            case VmLtI: r[o->dst] = r[o->a] < r[o->b]; break;
+            case VmLeI: r[o->dst] = r[o->a] <= r[o->b]; break;
+            case VmEqI: r[o->dst] = r[o->a] == r[o->b]; break;
+            case VmNeI: r[o->dst] = r[o->a] != r[o->b]; break;
+            case VmLtU: r[o->dst] = (VmUint)r[o->a] < (VmUint)r[o->b]; break;
+            case VmLeU: r[o->dst] = (VmUint)r[o->a] <= (VmUint)r[o->b]; break;
+
+            case VmIToF: r[o->dst] = VM_I(__builtin_convertvector(r[o->a], VmFloat)); break;
+            case VmUToF: r[o->dst] = VM_I(__builtin_convertvector((VmUint)r[o->a], VmFloat)); break;
+            case VmFToI: r[o->dst] = __builtin_convertvector(VM_F(r[o->a]), VmInt); break;
+            case VmFToU: r[o->dst] = (VmInt)__builtin_convertvector(VM_F(r[o->a]), VmUint); break;
+            case VmNezF: r[o->dst] = VM_F(r[o->a]) != 0.0f; break;
+            case VmNezI: r[o->dst] = r[o->a] != 0; break;
+
+            case VmSelect: r[o->dst] = (r[o->b] & r[o->a]) | (r[o->c] & ~r[o->a]); break;
+
+            case VmMinF: VM_LANES(fminf(a[i], b[i]));
+            case VmMaxF: VM_LANES(fmaxf(a[i], b[i]));
+            case VmMinI: r[o->dst] = r[o->b] < r[o->a] ? r[o->b] : r[o->a]; break;
+            case VmMaxI: r[o->dst] = r[o->a] < r[o->b] ? r[o->b] : r[o->a]; break;
+            case VmMinU: r[o->dst] = (VmUint)r[o->b] < (VmUint)r[o->a] ? r[o->b] : r[o->a]; break;
+            case VmMaxU: r[o->dst] = (VmUint)r[o->a] < (VmUint)r[o->b] ? r[o->b] : r[o->a]; break;
+            case VmAbsI: r[o->dst] = r[o->a] < 0 ? -r[o->a] : r[o->a]; break;
+
+            case VmSin: VM_LANES(sinf(a[i]));
+            case VmCos: VM_LANES(cosf(a[i]));
+            case VmTan: VM_LANES(tanf(a[i]));
+            case VmAsin: VM_LANES(asinf(a[i]));
+            case VmAcos: VM_LANES(acosf(a[i]));
+            case VmAtan: VM_LANES(atanf(a[i]));
+            case VmSinh: VM_LANES(sinhf(a[i]));
+            case VmCosh: VM_LANES(coshf(a[i]));
+            case VmTanh: VM_LANES(tanhf(a[i]));
+            case VmExp: VM_LANES(expf(a[i]));
+            case VmExp2: VM_LANES(exp2f(a[i]));
+            case VmLog: VM_LANES(logf(a[i]));
+            case VmLog2: VM_LANES(log2f(a[i]));
+            case VmLog10: VM_LANES(log10f(a[i]));
+            case VmSqrt: VM_LANES(sqrtf(a[i]));
+            case VmRsqrt: VM_LANES(1.0f / sqrtf(a[i]));
+            case VmFloor: VM_LANES(floorf(a[i]));
+            case VmCeil: VM_LANES(ceilf(a[i]));
+            case VmRound: VM_LANES(roundf(a[i]));
+            case VmTrunc: VM_LANES(truncf(a[i]));
+            case VmFract: VM_LANES(a[i] - floorf(a[i]));
+            case VmAbsF: VM_LANES(fabsf(a[i]));
+            case VmSign: VM_LANES(a[i] > 0.0f ? 1.0f : (a[i] < 0.0f ? -1.0f : 0.0f));
+            case VmSaturate: VM_LANES(a[i] < 0.0f ? 0.0f : (a[i] > 1.0f ? 1.0f : a[i]));
+            case VmPow: VM_LANES(powf(a[i], b[i]));
+            case VmAtan2: VM_LANES(atan2f(a[i], b[i]));
+            case VmFmod: VM_LANES(fmodf(a[i], b[i]));
+            case VmStep: VM_LANES(b[i] < a[i] ? 0.0f : 1.0f);
+
+            case VmJump:
+                o = code + o->dst - 1;
+                break;
+            case VmJumpNone:
+                if (vm_none(r[o->a]))
+                    o = code + o->dst - 1;
+                break;
+
+            // rounded like the gpu does, writes outside the row are dropped
+            case VmWrite:
+            {
+                const VmInt *args = r + o->a;
+                VmUint pixel = VmUint{};
+
+                for (unsigned c = 0; c < 4; ++c)
+                {
+                    VmFloat v = VM_F(args[c]);
+                    v = v < 0.0f ? VmFloat{} : (v > 1.0f ? VmFloat{} + 1.0f : v);
+                    pixel |= __builtin_convertvector(v * 255.0f + 0.5f, VmUint) << (8 * c);
+                }
+                for (unsigned i = 0; i < msl_vm_width; ++i)
+                {
+                    uint32_t x = (uint32_t)args[4][i] - row.x0;
+
+                    if (r[VmRegExec][i] && (uint32_t)args[5][i] == row.y && x < row.x1 - row.x0)
+                    {
+                        uint32_t p = pixel[i];
+                        memcpy(row.data + (size_t)x * 4, &p, 4);
+                    }
+                }
+                break;
+            }
+
+            case VmEnd:
+                return executed;
+        }
+    }
+}
+
+static uint64_t vm_run_sse(const VmOp *code, VmInt *r, const VmRow &row)
+{
+    return vm_run(code, r, row);
+}
+
+__attribute__((target("avx2")))
+static uint64_t vm_run_avx2(const VmOp *code, VmInt *r, const VmRow &row)
+{
+    return vm_run(code, r, row);
+}
+
+__attribute__((target("avx512f")))
+static uint64_t vm_run_avx512(const VmOp *code, VmInt *r, const VmRow &row)
+{
+    return vm_run(code, r, row);
+}
+
+typedef uint64_t (*VmRunFn)(const VmOp *code, VmInt *r, const VmRow &row);
+
+static VmRunFn vm_pick_run()
+{
+    if (__builtin_cpu_supports("avx512f"))
+        return vm_run_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return vm_run_avx2;
+    return vm_run_sse;
+}
+
+uint64_t msl_vm_eval(const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1, float *field)
+{
+    static const VmRunFn run = vm_pick_run();
+    const MslVmProgram *p = static_cast<const MslVmProgram*>(d->program);
+    // per thread, the register files of the worker threads stay warm
+    thread_local std::vector<VmRegister> regs;
+    VmRow row = { reinterpret_cast<uint8_t*>(field), x0, x1, y };
+    const uint8_t *buffer = reinterpret_cast<const uint8_t*>(d->uniforms);
+    uint64_t executed = 0;
+
+    if (regs.size() < p->nregs)
+        regs.resize(p->nregs);
+    VmInt *r = &regs[0].lanes;
+
+    for (const VmPreload &pl : p->preloads)
+    {
+        uint32_t bits = pl.value;
+
+        // the buffer is a Uniforms, offsets past it read as 0
+        if (pl.kind == VmPreloadWord)
+        {
+            bits = 0;
+            if (pl.value + 4 <= sizeof(Uniforms))
+                memcpy(&bits, buffer + pl.value, 4);
+        }
+        else if (pl.kind == VmPreloadBool)
+            bits = pl.value < sizeof(Uniforms) && buffer[pl.value] ? 0xffffffffu : 0;
+        r[pl.reg] = VmInt{} + (int32_t)bits;
+    }
+    r[VmRegWidth] = VmInt{} + (int32_t)d->width;
+    r[VmRegHeight] = VmInt{} + (int32_t)d->height;
+    r[VmRegY] = VmInt{} + (int32_t)y;
+
+    for (unsigned x = x0; x < x1; x += msl_vm_width)
+    {
+        for (unsigned i = 0; i < msl_vm_width; ++i)
+        {
+            r[VmRegX][i] = (int32_t)(x + i);
+            r[VmRegExec][i] = x + i < x1 ? -1 : 0;
+        }
+        executed += run(p->code.data(), r, row);
+    }
+    return executed;
+}
@@ -0,0 +1,37 @@
+#ifndef METALTOY_MSLVM_H
+#define METALTOY_MSLVM_H
+
+#include "cpukernels.h"
+#include "mslparse.h"
+
+#include <string>
+
+// An interpreter for Metal kernels, for machines without a C++ compiler to
+// jit them with. The parsed kernel, with the functions it calls inlined, is
+// compiled to a register bytecode in which every register holds
+// msl_vm_width lanes, one per grid position, and every instruction works on
+// all of them. Vectors are split into their components. Branches and loops
+// run under an execution mask like the SPMD translation of msltranslate.h,
+// and jump over code no lane takes, so decoding an instruction is paid once
+// per msl_vm_width pixels.
+//
+// Compiling is a pass over the syntax tree, well under a millisecond for
+// shader.metal, so edits show up in the next frame.
+
+static const unsigned msl_vm_width = 16;
+
+struct MslVmProgram;
+
+// Compiles the kernel of prog. Returns nullptr, and sets error to
+// "line N: ...", if it does not fit the limits of the bytecode.
+MslVmProgram *msl_vm_compile(const MslProgram &prog, std::string *error);
+void msl_vm_destroy(MslVmProgram *program);
+
+// instructions and registers, for reporting
+unsigned msl_vm_size(const MslVmProgram *program, unsigned *registers);
+
+// A CpuEvalFn that runs the program of CpuDispatch::program. The field holds
+// RGBA8 pixels, for cpu_colorize_packed. Returns the instructions executed.
+uint64_t msl_vm_eval(const CpuDispatch *d, unsigned y, unsigned x0, unsigned x1, float *field);
+
+#endif
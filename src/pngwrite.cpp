@@ -0,0 +1,483 @@
+#include "pngwrite.h"
+#include "threadpool.h"
+#include "trace.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+
+// RGB8, bytes per pixel
+static const unsigned png_bpp = 3;
+// Raw bytes in a chunk of rows, about. Small enough that a screenshot has a
+// few chunks for every thread, large enough that the flush at the end of
+// each costs nothing.
+static const size_t png_chunk_bytes = 512 * 1024;
+// the deflate window, and so the most a chunk's dictionary can hold
+static const size_t png_window = 32768;
+
+enum { FilterNone, FilterSub, FilterUp, FilterAverage, FilterPaeth, FilterCount };
+
+typedef uint8_t Bytes __attribute__((vector_size(16)));
+typedef int8_t SignedBytes __attribute__((vector_size(16)));
+typedef int16_t Shorts __attribute__((vector_size(32)));
+typedef uint32_t Words __attribute__((vector_size(64)));
+
+static inline int paeth(int a, int b, int c)
+{
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// x filtered with F, given its left, upper and upper left neighbours
+template <int F>
+static inline uint8_t filter_byte(int x, int a, int b, int c)
+{
+    switch (F)
+    {
+        case FilterSub: return x - a;
+        case FilterUp: return x - b;
+        case FilterAverage: return x - ((a + b) >> 1);
+        case FilterPaeth: return x - paeth(a, b, c);
+        default: return x;
+    }
+}
+
+// Filters the n bytes of row cur with F into out, prev being the row above.
+// With Sum, returns the sum of the filtered bytes taken as signed, the usual
+// guess at how well a row compresses.
+template <int F, bool Sum>
+__attribute__((always_inline))
+static inline uint64_t filter_bytes(const uint8_t *cur, const uint8_t *prev, size_t n, uint8_t *out)
+{
+    Words sum = {};
+    uint64_t total = 0;
+    size_t i = 0;
+
+    // the first pixel has nothing to its left
+    for (; i < png_bpp && i < n; ++i)
+    {
+        out[i] = filter_byte<F>(cur[i], 0, prev[i], 0);
+        total += Sum ? abs((int8_t)out[i]) : 0;
+    }
+
+    for (; i + 16 <= n; i += 16)
+    {
+        Bytes x, a, b, c, f;
+
+        memcpy(&x, cur + i, 16);
+        memcpy(&a, cur + i - png_bpp, 16);
+        memcpy(&b, prev + i, 16);
+        memcpy(&c, prev + i - png_bpp, 16);
+
+        if (F == FilterSub)
+            f = x - a;
+        else if (F == FilterUp)
+            f = x - b;
+        else if (F == FilterAverage)
+            f = x - ((a & b) + ((a ^ b) >> 1));
+        else if (F == FilterPaeth)
+        {
+            Shorts sa = __builtin_convertvector(a, Shorts);
+            Shorts sb = __builtin_convertvector(b, Shorts);
+            Shorts sc = __builtin_convertvector(c, Shorts);
+            Shorts pa = sb - sc, pb = sa - sc;
+            Shorts pc = pa + pb;
+
+            pa = pa < 0 ? -pa : pa;
+            pb = pb < 0 ? -pb : pb;
+            pc = pc < 0 ? -pc : pc;
+            f = x - __builtin_convertvector((pa <= pb & pa <= pc) ? sa : (pb <= pc ? sb : sc), Bytes);
+        }
+        else
+            f = x;
+
+        memcpy(out + i, &f, 16);
+        if (Sum)
+        {
+            SignedBytes s = (SignedBytes)f;
+            sum += __builtin_convertvector((Bytes)(s < 0 ? -s : s), Words);
+        }
+    }
+
+    for (; i < n; ++i)
+    {
+        out[i] = filter_byte<F>(cur[i], cur[i - png_bpp], prev[i], prev[i - png_bpp]);
+        total += Sum ? abs((int8_t)out[i]) : 0;
+    }
+
+    if (Sum)
+        for (unsigned k = 0; k < 16; ++k)
+            total += sum[k];
+    return total;
+}
+
+// Drops the alpha of a row. rgb has room for 4 bytes past the row.
+__attribute__((always_inline))
+static inline void rgb_row(const uint8_t *rgba, unsigned width, uint8_t *rgb)
+{
+    unsigned x = 0;
+
+    for (; x + 4 <= width; x += 4)
+    {
+        Bytes p;
+
+        memcpy(&p, rgba + (size_t)x * 4, 16);
+        p = __builtin_shufflevector(p, p, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 15, 15, 15, 15);
+        memcpy(rgb + (size_t)x * 3, &p, 16);
+    }
+    for (; x < width; ++x)
+        memcpy(rgb + (size_t)x * 3, rgba + (size_t)x * 4, 3);
+}
+
+// Filters a raw row of n bytes into out, its filter type byte followed by
+// the filtered bytes. scratch holds a row for every filter.
+__attribute__((always_inline))
+static inline void filter_row(const uint8_t *cur, const uint8_t *prev, size_t n, PngLevel level,
+        uint8_t *scratch, uint8_t *out)
+{
+    uint64_t sums[FilterCount];
+    unsigned best = FilterNone;
+
+    switch (level)
+    {
+        case PngStore:
+            out[0] = FilterNone;
+            memcpy(out + 1, cur, n);
+            return;
+
+        case PngFast:
+            out[0] = FilterSub;
+            filter_bytes<FilterSub, false>(cur, prev, n, out + 1);
+            return;
+
+        default:
+            sums[FilterNone] = filter_bytes<FilterNone, true>(cur, prev, n, scratch);
+            sums[FilterSub] = filter_bytes<FilterSub, true>(cur, prev, n, scratch + n * FilterSub);
+            sums[FilterUp] = filter_bytes<FilterUp, true>(cur, prev, n, scratch + n * FilterUp);
+            sums[FilterAverage] = filter_bytes<FilterAverage, true>(cur, prev, n, scratch + n * FilterAverage);
+            sums[FilterPaeth] = filter_bytes<FilterPaeth, true>(cur, prev, n, scratch + n * FilterPaeth);
+            for (unsigned f = 1; f < FilterCount; ++f)
+                if (sums[f] < sums[best])
+                    best = f;
+            out[0] = (uint8_t)best;
+            memcpy(out + 1, scratch + n * best, n);
+            return;
+    }
+}
+
+// Filters rows y0 to y1 of the image into out, one after another. rows
+// holds two RGB rows with 16 bytes to spare, scratch what filter_row needs.
+__attribute__((always_inline))
+static inline void filter_rows(const uint8_t *rgba, unsigned width, unsigned y0, unsigned y1,
+        PngLevel level, uint8_t *rows, uint8_t *scratch, uint8_t *out)
+{
+    size_t n = (size_t)width * png_bpp;
+    uint8_t *prev = rows, *cur = rows + n + 16;
+
+    if (y0 > 0)
+        rgb_row(rgba + (size_t)(y0 - 1) * width * 4, width, prev);
+    else
+        memset(prev, 0, n);
+
+    for (unsigned y = y0; y < y1; ++y)
+    {
+        rgb_row(rgba + (size_t)y * width * 4, width, cur);
+        filter_row(cur, prev, n, level, scratch, out);
+        out += n + 1;
+        std::swap(prev, cur);
+    }
+}
+
+static void filter_rows_sse(const uint8_t *rgba, unsigned width, unsigned y0, unsigned y1,
+        PngLevel level, uint8_t *rows, uint8_t *scratch, uint8_t *out)
+{
+    filter_rows(rgba, width, y0, y1, level, rows, scratch, out);
+}
+
+__attribute__((target("avx2")))
+static void filter_rows_avx2(const uint8_t *rgba, unsigned width, unsigned y0, unsigned y1,
+        PngLevel level, uint8_t *rows, uint8_t *scratch, uint8_t *out)
+{
+    filter_rows(rgba, width, y0, y1, level, rows, scratch, out);
+}
+
+typedef void (*FilterRowsFn)(const uint8_t *rgba, unsigned width, unsigned y0, unsigned y1,
+        PngLevel level, uint8_t *rows, uint8_t *scratch, uint8_t *out);
+
+static FilterRowsFn filter_pick_rows()
+{
+    if (__builtin_cpu_supports("avx2"))
+        return filter_rows_avx2;
+    return filter_rows_sse;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// return 0 on success
+static int write_chunk(FILE *fd, const char *type, const uint8_t *data, size_t n)
+{
+    uint8_t head[8], tail[4];
+    uLong crc = crc32(0, (const Bytef*)type, 4);
+
+    // a null data restarts the crc
+    if (n)
+        crc = crc32(crc, data, (uInt)n);
+    put_be32(head, (uint32_t)n);
+    memcpy(head + 4, type, 4);
+    put_be32(tail, (uint32_t)crc);
+
+    if (fwrite(head, 1, 8, fd) != 8 || (n && fwrite(data, 1, n, fd) != n) || fwrite(tail, 1, 4, fd) != 4)
+        return -1;
+    return 0;
+}
+
+namespace {
+
+// A chunk of rows being deflated or waiting to be written
+struct PngSlot
+{
+    unsigned chunk = 0;
+    bool done = false;
+    bool ready = false; // the stream is initialized
+    z_stream z;
+    std::vector<uint8_t> rows;
+    std::vector<uint8_t> scratch;
+    std::vector<uint8_t> filtered; // the dictionary rows, then the chunk's
+    std::vector<uint8_t> out;
+    size_t outbytes = 0;
+    size_t rawbytes = 0;
+    uLong adler = 1;
+};
+
+struct PngImage
+{
+    const uint8_t *rgba;
+    unsigned width;
+    unsigned height;
+    PngLevel level;
+    size_t rowbytes;   // with the filter type byte
+    unsigned chunkrows;
+    unsigned chunks;
+    unsigned dictrows; // rows before a chunk that cover the window
+};
+
+}
+
+// Filters and deflates chunk c into slot->out. return 0 on success
+static int deflate_chunk(const PngImage &img, unsigned c, PngSlot *slot)
+{
+    TRACE_SCOPE("deflate_chunk");
+    static const FilterRowsFn filter = filter_pick_rows();
+    unsigned y0 = c * img.chunkrows;
+    unsigned y1 = img.height - y0 < img.chunkrows ? img.height : y0 + img.chunkrows;
+    unsigned d = y0 < img.dictrows ? y0 : img.dictrows;
+    bool last = c == img.chunks - 1;
+    size_t dictbytes = d * img.rowbytes;
+    uint8_t *in;
+    z_stream *z = &slot->z;
+
+    // the rows before the chunk again, exactly what was written before it
+    filter(img.rgba, img.width, y0 - d, y1, img.level, slot->rows.data(), slot->scratch.data(),
+            slot->filtered.data());
+    in = slot->filtered.data() + dictbytes;
+    slot->rawbytes = (y1 - y0) * img.rowbytes;
+    slot->adler = adler32(1, in, (uInt)slot->rawbytes);
+
+    if (deflateReset(z) != Z_OK)
+        return -1;
+    if (dictbytes)
+    {
+        size_t n = dictbytes < png_window ? dictbytes : png_window;
+        if (deflateSetDictionary(z, in - n, (uInt)n) != Z_OK)
+            return -1;
+    }
+
+    slot->out.resize(deflateBound(z, slot->rawbytes) + 64);
+    z->next_in = in;
+    z->avail_in = (uInt)slot->rawbytes;
+    z->next_out = slot->out.data();
+    z->avail_out = (uInt)slot->out.size();
+
+    // Every chunk but the last ends in a sync flush: an empty stored block
+    // that byte aligns it, so the next chunk's blocks can follow directly.
+    for (;;)
+    {
+        int r = deflate(z, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+        if (r == Z_STREAM_ERROR)
+            return -1;
+        if (last ? r == Z_STREAM_END : z->avail_out != 0)
+            break;
+
+        size_t used = slot->out.size() - z->avail_out;
+        slot->out.resize(slot->out.size() * 2);
+        z->next_out = slot->out.data() + used;
+        z->avail_out = (uInt)(slot->out.size() - used);
+    }
+
+    slot->outbytes = slot->out.size() - z->avail_out;
+    return 0;
+}
+
+int write_png(const char *path, unsigned width, unsigned height, const uint8_t *rgba,
+        PngLevel level, ThreadPool *pool)
+{
+    TRACE_SCOPE("write_png");
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    PngImage img;
+    uint8_t ihdr[13], zhead[2], ztail[4];
+    unsigned window;
+    int zlevel, strategy;
+    FILE *fd;
+
+    img.rgba = rgba;
+    img.width = width;
+    img.height = height;
+    img.level = level;
+    img.rowbytes = (size_t)width * png_bpp + 1;
+    img.chunkrows = png_chunk_bytes / img.rowbytes ? png_chunk_bytes / img.rowbytes : 1;
+    if (img.chunkrows > height)
+        img.chunkrows = height;
+    img.chunks = (height + img.chunkrows - 1) / img.chunkrows;
+    // stored blocks refer to nothing
+    img.dictrows = level == PngStore ? 0 : (png_window + img.rowbytes - 1) / img.rowbytes;
+
+    switch (level)
+    {
+        case PngStore: zlevel = 0; strategy = Z_DEFAULT_STRATEGY; break;
+        case PngFast: zlevel = 1; strategy = Z_RLE; break;
+        default: zlevel = 6; strategy = Z_DEFAULT_STRATEGY; break;
+    }
+
+    fd = fopen(path, "wb");
+    if (!fd)
+        return -1;
+
+    put_be32(ihdr, width);
+    put_be32(ihdr + 4, height);
+    ihdr[8] = 8;  // bits per channel
+    ihdr[9] = 2;  // RGB
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering
+    ihdr[12] = 0; // not interlaced
+
+    // deflate with a 32K window, and the level in FLEVEL
+    zhead[0] = 0x78;
+    zhead[1] = zlevel <= 1 ? 0x01 : 0x9c;
+
+    bool failed = fwrite(signature, 1, 8, fd) != 8 || write_chunk(fd, "IHDR", ihdr, 13)
+        || write_chunk(fd, "IDAT", zhead, 2);
+
+    window = pool ? 2 * pool->size() : 1;
+    if (window > img.chunks)
+        window = img.chunks;
+
+    std::vector<PngSlot> slots(window);
+    size_t n = (size_t)width * png_bpp;
+
+    for (PngSlot &s : slots)
+    {
+        memset(&s.z, 0, sizeof(s.z));
+        s.ready = deflateInit2(&s.z, zlevel, Z_DEFLATED, -15, 8, strategy) == Z_OK;
+        failed = failed || !s.ready;
+        s.rows.resize(2 * (n + 16));
+        if (level == PngDefault)
+            s.scratch.resize(n * FilterCount);
+        s.filtered.resize((size_t)(img.dictrows + img.chunkrows) * img.rowbytes);
+    }
+
+    // As in TiledRenderer: chunks are handed out in order, at most window
+    // ahead of the oldest unwritten one, and whoever finishes that one
+    // writes it and the finished ones after it.
+    std::mutex mutex;
+    std::condition_variable advanced;
+    unsigned next = 0, flushed = 0;
+    bool writing = false;
+    uLong adler = 1;
+
+    auto job = [&](unsigned) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        for (;;)
+        {
+            while (!failed && next < img.chunks && next >= flushed + window)
+                advanced.wait(lock);
+            if (failed || next >= img.chunks)
+                return;
+
+            unsigned chunk = next++;
+            PngSlot *slot = &slots[chunk % window];
+            int r;
+
+            slot->chunk = chunk;
+            slot->done = false;
+
+            lock.unlock();
+            r = deflate_chunk(img, chunk, slot);
+            lock.lock();
+
+            if (r)
+            {
+                failed = true;
+                advanced.notify_all();
+                return;
+            }
+            slot->done = true;
+
+            if (writing)
+                continue;
+
+            writing = true;
+            for (;;)
+            {
+                PngSlot *oldest = &slots[flushed % window];
+
+                if (failed || !oldest->done || oldest->chunk != flushed)
+                    break;
+
+                lock.unlock();
+                r = write_chunk(fd, "IDAT", oldest->out.data(), oldest->outbytes);
+                adler = adler32_combine(adler, oldest->adler, oldest->rawbytes);
+                lock.lock();
+
+                oldest->done = false;
+                if (r)
+                    failed = true;
+                else
+                    ++flushed;
+                advanced.notify_all();
+            }
+            writing = false;
+        }
+    };
+
+    if (!failed)
+    {
+        if (pool)
+            pool->run(job);
+        else
+            job(0);
+    }
+
+    for (PngSlot &s : slots)
+        if (s.ready)
+            deflateEnd(&s.z);
+
+    put_be32(ztail, (uint32_t)adler);
+    failed = failed || write_chunk(fd, "IDAT", ztail, 4) || write_chunk(fd, "IEND", nullptr, 0);
+    if (fclose(fd))
+        failed = true;
+    return failed ? -1 : 0;
+}
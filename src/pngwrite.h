@@ -0,0 +1,32 @@
+#ifndef METALTOY_PNGWRITE_H
+#define METALTOY_PNGWRITE_H
+
+#include <stdint.h>
+
+class ThreadPool;
+
+enum PngLevel
+{
+    // Rows unfiltered in stored deflate blocks, about the speed of a copy
+    PngStore,
+    // Rows Sub filtered and deflated at level 1 with run length matches
+    // only, which suits the flat areas of rendered images
+    PngFast,
+    // Each row's filter picked by the smallest sum of absolute values,
+    // deflated at level 6
+    PngDefault,
+};
+
+// Writes a tightly packed RGBA8 image as an RGB8 PNG, dropping alpha.
+//
+// The rows are split into chunks that are filtered and deflated on their
+// own, by all workers of pool at once, or on the calling thread without
+// one. Each chunk is deflated with the end of the chunk before it as its
+// dictionary and ends on a byte boundary, so the chunks join into one zlib
+// stream that compresses nearly as well as a single deflate. They are
+// written in order as they finish, so only a few are in memory at a time.
+// return 0 on success
+int write_png(const char *path, unsigned width, unsigned height, const uint8_t *rgba,
+        PngLevel level = PngDefault, ThreadPool *pool = nullptr);
+
+#endif
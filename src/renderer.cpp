@@ -1,8 +1,28 @@
 #include "renderer.h"
 #include "globals.h"
+#include "cpurenderer.h"
+#include "cpujit.h"
+#include "filewatch.h"
+#include "asyncbuild.h"
+#include "framering.h"
+#include "kernelcache.h"
+#include "resolve.h"
+#include "trace.h"
+#include "uniforms.h"
+#include "videowrite.h"
 
 #include <simd/simd.h>
 
+// Offsets of buffers bound to compute encoders must be 256 byte aligned on
+// macOS, so each uniform slot takes that much.
+static const size_t uniform_stride = 256;
+
+// Frames being read back or waiting for the video writer. Recording drops
+// frames rather than hold up rendering once all of them are taken.
+static const unsigned video_slots = 4;
+// what the display link runs at
+static const unsigned video_frame_rate = 60;
+
 static void error_msg(const char *msg)
 {
     if (global_quiet)
@@ -18,14 +38,12 @@ static inline double getCurrentTimeInSeconds()
     return tp.time_since_epoch().count() / 1e9;
 }
 
-static char *
-load_file(const char *relpath)
+// buf must hold 512 chars
+static void
+source_path(const char *relpath, char *buf)
 {
-    size_t sz, nr;
-    FILE *fd;
     const char *base;
     char *s;
-    char buf[512];
 
     base = getenv("S");
     if (!base)
@@ -37,6 +55,18 @@ load_file(const char *relpath)
     s = stpcpy(buf, base);
     *s++ = '/';
     s = stpcpy(s, relpath);
+}
+
+static char *
+load_file(const char *relpath)
+{
+    size_t sz, nr;
+    FILE *fd;
+    char *s;
+    char buf[512];
+
+    TRACE_SCOPE("load_file");
+    source_path(relpath, buf);
 
     fd = fopen(buf, "r");
 
@@ -70,6 +100,7 @@ static int build_shader_library(MTL::Device *device, const char *shader_src, MTL
     NS::Error *error = nullptr;
     MTL::Library *lib = nullptr;
 
+    TRACE_SCOPE("build_shader_library");
     lib = device->newLibrary(NS::String::string(
                 shader_src,
                 NS::UTF8StringEncoding), nullptr, &error);
@@ -84,14 +115,76 @@ static int build_shader_library(MTL::Device *device, const char *shader_src, MTL
     return 0;
 }
 
+// Compiled pipelines are cached as binary archives. Bump this when what goes
+// into a pipeline changes in a way the cache keys do not see.
+static const char *archive_version = "1";
+static const char *archive_suffix = ".binarchive";
+
+// The cache key of a pipeline built from src, for this device
+static std::string archive_key(MTL::Device *device, const char *options, const char *src)
+{
+    std::string backend = std::string("metal ") + device->name()->utf8String() + " " + archive_version;
+    return KernelCache::key(backend.c_str(), options, src);
+}
+
+static NS::URL *file_url(const std::string &path)
+{
+    return NS::URL::fileURLWithPath(NS::String::string(path.c_str(), NS::UTF8StringEncoding));
+}
+
+// The cached binary archive for key, or a new empty one to add the pipeline
+// to if there is none. Sets *hit if it came from the cache.
+static MTL::BinaryArchive *open_archive(MTL::Device *device, KernelCache *cache, const std::string &key, bool *hit)
+{
+    MTL::BinaryArchiveDescriptor *desc = MTL::BinaryArchiveDescriptor::alloc()->init();
+    MTL::BinaryArchive *archive = nullptr;
+    NS::Error *error = nullptr;
+    std::string path;
+
+    *hit = cache->lookup(key, archive_suffix, &path);
+    if (*hit)
+    {
+        desc->setUrl(file_url(path));
+        archive = device->newBinaryArchive(desc, &error);
+        // e.g. written by an older os, compile and replace it
+        if (!archive)
+        {
+            *hit = false;
+            desc->setUrl(nullptr);
+        }
+    }
+    if (!archive)
+        archive = device->newBinaryArchive(desc, &error);
+
+    desc->release();
+    return archive;
+}
+
+// Writes an archive the pipeline was added to into the cache
+static void save_archive(MTL::BinaryArchive *archive, KernelCache *cache, const std::string &key)
+{
+    NS::Error *error = nullptr;
+    std::string tmp = cache->tempPath(archive_suffix);
+
+    if (!archive->serializeToURL(file_url(tmp), &error))
+    {
+        error_msg("Failed to write pipeline to the kernel cache\n");
+        return;
+    }
+    cache->commit(tmp, key, archive_suffix);
+}
+
 // return 0 on success
-static int build_graphics_pipeline(MTL::Device *device, MTL::Library *lib, MTL::RenderPipelineState **out)
+static int build_graphics_pipeline(MTL::Device *device, MTL::Library *lib, KernelCache *cache,
+        const std::string &key, MTL::RenderPipelineState **out)
 {
     using NS::StringEncoding::UTF8StringEncoding;
     MTL::Function *vertexfn, *fragmentfn;
     NS::Error *error;
     MTL::RenderPipelineDescriptor *desc;
     MTL::RenderPipelineState *pso;
+    MTL::BinaryArchive *archive;
+    bool hit;
     int r = -1;
 
     error = nullptr;
@@ -119,17 +212,26 @@ static int build_graphics_pipeline(MTL::Device *device, MTL::Library *lib, MTL::
     desc->colorAttachments()->object(0)->
         setPixelFormat(MTL::PixelFormat::PixelFormatBGRA8Unorm_sRGB);
 
-    pso = device->newRenderPipelineState( desc, &error );
+    archive = open_archive(device, cache, key, &hit);
+    if (archive)
+        desc->setBinaryArchives(NS::Array::array(archive));
+
+    pso = device->newRenderPipelineState( desc, MTL::PipelineOptionNone, nullptr, &error );
     if ( !pso)
     {
         error_msg(error->localizedDescription()->utf8String() );
         goto end4;
     }
 
+    if (archive && !hit && archive->addRenderPipelineFunctions(desc, &error))
+        save_archive(archive, cache, key);
+
     r = 0;
     *out = pso;
 
 end4:
+    if (archive)
+        archive->release();
     desc->release();
     fragmentfn->release();
 end3:
@@ -138,21 +240,41 @@ end2:
     return r;
 }
 
-static int build_compute_pipeline(MTL::Device *device, MTL::Library *lib, MTL::ComputePipelineState **pipeline)
+// return 0 on success
+static int build_compute_pipeline(MTL::Device *device, MTL::Library *lib, const char *name,
+        KernelCache *cache, const std::string &key, MTL::ComputePipelineState **pipeline)
 {
-    NS::Error *error;
+    NS::Error *error = nullptr;
     MTL::Function *fn;
+    MTL::ComputePipelineDescriptor *desc;
+    MTL::BinaryArchive *archive;
     MTL::ComputePipelineState *pso;
+    bool hit;
 
-    fn = lib->newFunction( NS::String::string("computeMain", NS::UTF8StringEncoding) );
+    TRACE_SCOPE("build_compute_pipeline");
+    fn = lib->newFunction( NS::String::string(name, NS::UTF8StringEncoding) );
     if (!fn)
     {
         error_msg("Failed finding compute shader funciton\n");
         return -1;
     }
 
-    pso = device->newComputePipelineState( fn, &error);
+    desc = MTL::ComputePipelineDescriptor::alloc()->init();
+    desc->setComputeFunction(fn);
 
+    // a hit skips compiling the function for the gpu
+    archive = open_archive(device, cache, key, &hit);
+    if (archive)
+        desc->setBinaryArchives(NS::Array::array(archive));
+
+    pso = device->newComputePipelineState( desc, MTL::PipelineOptionNone, nullptr, &error);
+
+    if (pso && archive && !hit && archive->addComputePipelineFunctions(desc, &error))
+        save_archive(archive, cache, key);
+
+    if (archive)
+        archive->release();
+    desc->release();
     fn->release();
 
     if (!pso)
@@ -165,19 +287,114 @@ static int build_compute_pipeline(MTL::Device *device, MTL::Library *lib, MTL::C
     return 0;
 }
 
+// Runs on the AsyncBuilder thread. Returns the compute pipeline or nullptr.
+static void *build_compute_pipeline_async(MTL::Device *device, const char *src, KernelCache *cache,
+        const AsyncBuilder *builder, unsigned long generation)
+{
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+    MTL::Library *shaderlib;
+    MTL::ComputePipelineState *computepipeline = nullptr;
+
+    if (!build_shader_library(device, src, &shaderlib))
+    {
+        // no point in finishing if the source is already stale
+        if (!builder->superseded(generation) &&
+                build_compute_pipeline(device, shaderlib, "computeMain", cache,
+                    archive_key(device, "computeMain", src), &computepipeline))
+            computepipeline = nullptr;
+
+        shaderlib->release();
+    }
+
+    pool->release();
+    return computepipeline;
+}
+
 Renderer::Renderer( MTL::Device* pDevice )
 : _device( pDevice->retain() )
 {
+    char path[512];
+
     _cmdqueue = _device->newCommandQueue();
+    _ring = new FrameRing(frames_in_flight);
+    _cache = new KernelCache();
     _starttime = getCurrentTimeInSeconds();
 
+    source_path("src/shader.metal", path);
+    _shaderwatch = new FileWatcher(path);
+
+    _shaderbuilder = new AsyncBuilder(
+        [this](const char *src, unsigned long generation) {
+            return build_compute_pipeline_async(_device, src, _cache, _shaderbuilder, generation);
+        },
+        [](void *pso) {
+            static_cast<MTL::ComputePipelineState*>(pso)->release();
+        });
+
     buildBuffers();
     buildTexture();
     buildRenderPipeline();
+    if (global_resolve != ResolveOff
+            && (global_texture_width != global_window_width || global_texture_height != global_window_height))
+        buildResolve();
+    if (global_video_path || global_video_command)
+        buildVideo();
+
+    if (global_cpu_compute)
+    {
+        const CpuKernel *kernel = cpu_find_kernel(global_cpu_kernel);
+
+        if (global_jit_source)
+        {
+            _jit = new CpuJit(global_jit_source, _cache, global_quiet, global_jit_interpret);
+            if (!_jit->load())
+                kernel = _jit->kernel();
+        }
+
+        assert(kernel && "no cpu kernel with that name");
+
+        _cpu = new CpuRenderer(global_texture_width, global_texture_height, global_thread_count);
+        _cpu->setKernel(kernel);
+        _cpu->setInteriorChecks(global_interior_checks);
+        _cpu->setSubdivision((CpuSubdivision)global_subdivision);
+        _shadererror = false;
+    }
 }
 
 Renderer::~Renderer()
 {
+    delete _cpu;
+    delete _jit;
+    delete _shaderwatch;
+    delete _shaderbuilder;
+    delete _cache;
+    if (_computepso)
+        _computepso->release();
+    if (_resolvepso)
+        _resolvepso->release();
+    free(_shadersrc);
+    // completion handlers still refer to the ring
+    _ring->drain();
+    delete _ring;
+    if (_video)
+    {
+        char buf[160];
+
+        // waits for the frames that are still being read back
+        if (_video->close())
+            error_msg("Failed to write video output\n");
+        snprintf(buf, sizeof(buf), "video: %llu frames written, %llu dropped\n",
+                (unsigned long long)_video->framesWritten(), (unsigned long long)_video->framesDropped());
+        error_msg(buf);
+        delete _video;
+    }
+    for (MTL::Buffer *b : _videobuffers)
+        b->release();
+    if (_resolved)
+        _resolved->release();
+    if (_resolvebuffer)
+        _resolvebuffer->release();
+    delete _resolver;
     _cmdqueue->release();
     _device->release();
 }
@@ -194,7 +411,8 @@ void Renderer::buildRenderPipeline()
     er = build_shader_library(_device, src, &lib);
     assert(!er && "Failed to build quad shader library");
 
-    er = build_graphics_pipeline(_device, lib, &pso);
+    er = build_graphics_pipeline(_device, lib, _cache,
+            archive_key(_device, "vertexMain fragmentMain BGRA8Unorm_sRGB", src), &pso);
     assert(!er && "Failed to build quad pipeline");
 
     lib->release();
@@ -207,12 +425,25 @@ void Renderer::buildPipelinesIfNeedTo()
 {
     char *new_shadersrc;
     const char *old_shadersrc;
-    MTL::Library *shaderlib;
     MTL::ComputePipelineState *computepipeline;
-    MTL::RenderPipelineState *renderpipeline;
-    int er = 0;
 
-    // TODO check file time stamp first
+    // pick up whatever the builder finished since the last frame
+    computepipeline = static_cast<MTL::ComputePipelineState*>(_shaderbuilder->take());
+    if (computepipeline)
+    {
+        if (_computepso)
+            _computepso->release();
+
+        _shadererror = false;
+        _computepso = computepipeline;
+
+        error_msg("Pipeline rebuilding complete.\n");
+    }
+
+    // the watcher tells us when the file was written, until then there is
+    // nothing to read
+    if (!_shaderwatch->changed())
+        return;
 
     old_shadersrc = _shadersrc;
     new_shadersrc = load_file("src/shader.metal");
@@ -242,33 +473,9 @@ void Renderer::buildPipelinesIfNeedTo()
 
     error_msg("Shader has changed! Rebuilding pipelines...\n");
 
-    // assume error until proven otherwise
-    _shadererror = true;
-
-    er = build_shader_library(_device, new_shadersrc, &shaderlib);
-
-    if (er)
-    {
-        return;
-    }
-
-    er = build_compute_pipeline(_device, shaderlib, &computepipeline);
-
-    if (er)
-    {
-        shaderlib->release();
-        return;
-    }
-
-    shaderlib->release();
-
-    if (_computepso)
-        _computepso->release();
-
-    _shadererror = false;
-    _computepso = computepipeline;
-
-    error_msg("Pipeline rebuilding complete.\n");
+    // Compile in the background. The current pipeline keeps rendering until
+    // the new one is done, and is kept if the new source fails to build.
+    _shaderbuilder->submit(strdup(new_shadersrc));
 }
 
 void Renderer::buildBuffers()
@@ -329,7 +536,7 @@ void Renderer::buildBuffers()
     _colorbuffer = colorbuf;
     _uvbuffer = uvbuf;
     _indexbuffer = indexbuf;
-    _dynbuffer = _device->newBuffer( sizeof(float), MTL::ResourceStorageModeManaged );
+    _dynbuffer = _device->newBuffer( uniform_stride * frames_in_flight, MTL::ResourceStorageModeManaged );
 }
 
 void Renderer::buildTexture()
@@ -349,6 +556,186 @@ void Renderer::buildTexture()
     td->release();
 }
 
+// The texture is computed at global_supersample times the window size. With
+// a resolve, each frame is filtered down to the window size by resolveMain,
+// or by the Resolver when computing on the cpu, and the quad draws that
+// instead of sampling the large texture.
+void Renderer::buildResolve()
+{
+    MTL::TextureDescriptor *td;
+    MTL::Library *lib;
+    ResolveParams params = { (uint32_t)global_resolve };
+    char *src = load_file("src/resolve.metal");
+
+    if (!src || build_shader_library(_device, src, &lib))
+    {
+        error_msg("Failed to build the resolve shader, drawing the texture as it is\n");
+        free(src);
+        return;
+    }
+
+    int er = build_compute_pipeline(_device, lib, "resolveMain", _cache,
+            archive_key(_device, "resolveMain", src), &_resolvepso);
+    lib->release();
+    free(src);
+    if (er)
+    {
+        error_msg("Failed to build the resolve pipeline, drawing the texture as it is\n");
+        return;
+    }
+
+    td = MTL::TextureDescriptor::alloc()->init();
+    td->setWidth(global_window_width);
+    td->setHeight(global_window_height);
+    td->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+    td->setTextureType(MTL::TextureType2D);
+    td->setStorageMode(MTL::StorageModeManaged);
+    td->setUsage(MTL::ResourceUsageSample | MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
+    _resolved = _device->newTexture(td);
+    td->release();
+
+    _resolvebuffer = _device->newBuffer(sizeof(params), MTL::ResourceStorageModeManaged);
+    memcpy(_resolvebuffer->contents(), &params, sizeof(params));
+    _resolvebuffer->didModifyRange(NS::Range::Make(0, sizeof(params)));
+
+    _resolver = new Resolver();
+    _resolver->setup(global_texture_width, global_texture_height, global_window_width, global_window_height,
+            (ResolveFilter)global_resolve);
+    _resolvedpixels.resize((size_t)global_window_width * global_window_height * 4);
+}
+
+// Records what is drawn, the resolved texture when there is one
+void Renderer::buildVideo()
+{
+    unsigned w = (unsigned)shownTexture()->width(), h = (unsigned)shownTexture()->height();
+    size_t framebytes = (size_t)w * h * 4;
+    std::vector<uint8_t*> memory;
+    int r;
+
+    // shared, so the writer reads what the blit wrote without a copy
+    for (unsigned i = 0; i < video_slots; ++i)
+    {
+        _videobuffers.push_back(_device->newBuffer(framebytes, MTL::ResourceStorageModeShared));
+        memory.push_back(static_cast<uint8_t*>(_videobuffers.back()->contents()));
+    }
+
+    _video = new VideoWriter(video_slots);
+    _video->setSlotMemory(memory);
+    if (global_video_path)
+        r = _video->openFile(global_video_path, w, h, video_frame_rate);
+    else
+        r = _video->openPipe(global_video_command, w, h);
+
+    if (r)
+    {
+        error_msg("Failed to open video output, not recording\n");
+        delete _video;
+        _video = nullptr;
+    }
+}
+
+// Hands the finished texture to the video writer, or drops the frame if it
+// is behind. Nothing here waits: with cmdbuf the texture is blitted into the
+// slot's buffer as part of the frame and queued when the frame completes.
+// Without it the cpu renderer's pixels are copied.
+void Renderer::captureFrame( MTL::CommandBuffer *cmdbuf )
+{
+    TRACE_SCOPE("captureFrame");
+    MTL::Texture *tex = shownTexture();
+    unsigned w = (unsigned)tex->width(), h = (unsigned)tex->height();
+    int slot = _video->acquire(false);
+
+    if (slot < 0)
+        return;
+
+    if (!cmdbuf)
+    {
+        memcpy(_video->slotPixels(slot), _resolved ? _resolvedpixels.data() : _cpu->pixels(), (size_t)w * h * 4);
+        _video->submit(slot);
+        return;
+    }
+
+    MTL::BlitCommandEncoder *blit = cmdbuf->blitCommandEncoder();
+    blit->copyFromTexture(tex, 0, 0, MTL::Origin::Make(0, 0, 0), MTL::Size::Make(w, h, 1),
+            _videobuffers[slot], 0, w * 4, (NS::UInteger)w * h * 4);
+    blit->endEncoding();
+
+    VideoWriter *video = _video;
+    cmdbuf->addCompletedHandler([video, slot](MTL::CommandBuffer*) {
+        video->submit(slot);
+    });
+}
+
+void Renderer::generateTextureOnCpu()
+{
+    double now = getCurrentTimeInSeconds();
+
+    // between frames is when a recompiled kernel can be swapped in
+    if (_jit)
+    {
+        const CpuKernel *kernel = _jit->poll();
+        if (kernel && kernel != _cpu->kernel())
+            _cpu->setKernel(kernel);
+    }
+
+    // A pass per frame, so the image sharpens over the first few frames
+    // instead of the first one taking the time of all of them. Once complete,
+    // refine leaves the image alone until something changes.
+    if (global_progressive)
+    {
+        // the image is unchanged, but the video still runs at frame rate
+        if (_cpu->refine(now - _starttime) < 0)
+        {
+            if (_video)
+                captureFrame(nullptr);
+            return;
+        }
+    }
+    else
+    {
+        _cpu->generateTexture(now - _starttime);
+    }
+
+    // only what the quad draws is uploaded
+    if (_resolved)
+    {
+        _resolver->resolve(_cpu->pixels(), _resolvedpixels.data(), &_cpu->pool());
+
+        TRACE_SCOPE("replaceRegion");
+        _resolved->replaceRegion(MTL::Region::Make2D(0, 0, _resolver->width(), _resolver->height()),
+                0, _resolvedpixels.data(), _resolver->width() * 4);
+    }
+    else
+    {
+        TRACE_SCOPE("replaceRegion");
+        _texture->replaceRegion(MTL::Region::Make2D(0, 0, _cpu->width(), _cpu->height()),
+                0, _cpu->pixels(), _cpu->width() * 4);
+    }
+    if (_video)
+        captureFrame(nullptr);
+
+    // report throughput about once a second
+    if (now - _cpureporttime >= 1.0)
+    {
+        char buf[160];
+        double umin, uavg;
+        _cpu->scheduler().utilizationRange(&umin, &uavg);
+        snprintf(buf, sizeof(buf), "cpu %s: %.1f Mpix/s, %.2f ms/frame, %u threads, "
+                "utilization %.0f%% avg %.0f%% min\n",
+                _cpu->kernel()->name, _cpu->megapixelsPerSecond(),
+                _cpu->lastFrameSeconds() * 1e3, _cpu->threadCount(), uavg * 100, umin * 100);
+        error_msg(buf);
+        if (global_interior_stats)
+        {
+            const CpuInteriorStats &stats = _cpu->interiorStats();
+            snprintf(buf, sizeof(buf), "  interior: %llu pixels by cardioid/bulb, %llu by periodicity\n",
+                    (unsigned long long)stats.bulb.load(), (unsigned long long)stats.periodic.load());
+            error_msg(buf);
+        }
+        _cpureporttime = now;
+    }
+}
+
 void Renderer::generateTexture()
 {
     MTL::CommandBuffer *cmdbuf;
@@ -356,18 +743,42 @@ void Renderer::generateTexture()
     MTL::Size gridsize, thread_group_size;
     NS::UInteger tgs;
 
-    float *time = reinterpret_cast<float*>(_dynbuffer->contents());
-    *time = getCurrentTimeInSeconds() - _starttime;
-    _dynbuffer->didModifyRange(NS::Range::Make(0, sizeof(float)));
+    TRACE_SCOPE("generateTexture");
+    if (_cpu)
+    {
+        generateTextureOnCpu();
+        return;
+    }
+
+    // Waits if the gpu is still using the slot from frames_in_flight frames
+    // ago, so we never write uniforms an earlier command buffer reads.
+    unsigned slot = _ring->acquire();
+    size_t offset = slot * uniform_stride;
+    float time = getCurrentTimeInSeconds() - _starttime;
+
+    Uniforms *u = reinterpret_cast<Uniforms*>(
+            reinterpret_cast<char*>(_dynbuffer->contents()) + offset);
+    u->time = time;
+    u->deltatime = _ring->frameCount() > 1 ? time - _lasttime : 0.0f;
+    u->resolution[0] = global_texture_width;
+    u->resolution[1] = global_texture_height;
+    u->frame = (uint32_t)(_ring->frameCount() - 1);
+    _dynbuffer->didModifyRange(NS::Range::Make(offset, sizeof(Uniforms)));
+    _lasttime = time;
 
     cmdbuf = _cmdqueue->commandBuffer();
     assert(cmdbuf);
 
+    FrameRing *ring = _ring;
+    cmdbuf->addCompletedHandler([ring, slot](MTL::CommandBuffer*) {
+        ring->release(slot);
+    });
+
     enc = cmdbuf->computeCommandEncoder();
 
     enc->setComputePipelineState(_computepso);
     enc->setTexture(_texture, 0);
-    enc->setBuffer(_dynbuffer, 0, 0);
+    enc->setBuffer(_dynbuffer, offset, 0);
 
     gridsize = MTL::Size::Make(global_texture_width, global_texture_height, 1);
 
@@ -376,14 +787,32 @@ void Renderer::generateTexture()
     thread_group_size = MTL::Size::Make(tgs, 1, 1);
 
     enc->dispatchThreads( gridsize, thread_group_size );
+
+    // dispatches in an encoder run in order, so this sees the whole texture
+    if (_resolvepso)
+    {
+        enc->setComputePipelineState(_resolvepso);
+        enc->setTexture(_texture, 0);
+        enc->setTexture(_resolved, 1);
+        enc->setBuffer(_resolvebuffer, 0, 0);
+        enc->dispatchThreads(MTL::Size::Make(global_window_width, global_window_height, 1),
+                MTL::Size::Make(_resolvepso->maxTotalThreadsPerThreadgroup(), 1, 1));
+    }
     enc->endEncoding();
 
+    if (_video)
+        captureFrame(cmdbuf);
+
     cmdbuf->commit();
 }
 
 void Renderer::draw( MTK::View* pView )
 {
-    buildPipelinesIfNeedTo();
+    TRACE_SCOPE("draw");
+
+    // the cpu kernels are compiled in, there is nothing to rebuild
+    if (!_cpu)
+        buildPipelinesIfNeedTo();
 
     NS::AutoreleasePool* pool = NS::AutoreleasePool::alloc()->init();
 
@@ -404,7 +833,7 @@ void Renderer::draw( MTK::View* pView )
         enc->setVertexBuffer(_positionbuffer, 0, 0);
         enc->setVertexBuffer(_colorbuffer, 0, 1);
         enc->setVertexBuffer(_uvbuffer, 0, 2);
-        enc->setFragmentTexture(_texture, 0);
+        enc->setFragmentTexture(shownTexture(), 0);
         enc->drawIndexedPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle,
                 6, MTL::IndexTypeUInt16, _indexbuffer, 0 );
     }
@@ -4,6 +4,17 @@
 #include <Metal/Metal.hpp>
 #include <MetalKit/MetalKit.hpp>
 
+#include <vector>
+
+class CpuRenderer;
+class FileWatcher;
+class AsyncBuilder;
+class FrameRing;
+class KernelCache;
+class CpuJit;
+class VideoWriter;
+class Resolver;
+
 class Renderer
 {
     public:
@@ -13,23 +24,43 @@ class Renderer
         void buildBuffers();
         void buildTexture();
         void buildRenderPipeline();
+        void buildResolve();
         void generateTexture();
+        void generateTextureOnCpu();
         void buildPipelinesIfNeedTo();
+        void buildVideo();
+        void captureFrame( MTL::CommandBuffer *cmdbuf );
+        MTL::Texture *shownTexture() const { return _resolved ? _resolved : _texture; }
 
     private:
         MTL::Device* _device;
         MTL::CommandQueue* _cmdqueue;
         MTL::RenderPipelineState *_renderpso = nullptr;
         MTL::ComputePipelineState *_computepso = nullptr;
+        MTL::ComputePipelineState *_resolvepso = nullptr;
         MTL::Buffer *_indexbuffer;
         MTL::Buffer *_positionbuffer;
         MTL::Buffer *_colorbuffer;
         MTL::Buffer *_uvbuffer;
-        MTL::Buffer *_dynbuffer; // holds dynamic state
+        MTL::Buffer *_dynbuffer; // holds dynamic state, one Uniforms slot per frame in flight
+        FrameRing *_ring;
         MTL::Texture *_texture;
+        MTL::Texture *_resolved = nullptr; // _texture resolved to the window size, set when resolving
+        MTL::Buffer *_resolvebuffer = nullptr; // the ResolveParams of resolveMain
+        Resolver *_resolver = nullptr; // resolves the cpu renderer's pixels
+        std::vector<uint8_t> _resolvedpixels;
         double _starttime = 0.0;
+        float _lasttime = 0.0f;
         char *_shadersrc = nullptr;
-        bool _shadererror = true;
+        FileWatcher *_shaderwatch;
+        AsyncBuilder *_shaderbuilder; // compiles shader.metal off the render thread
+        KernelCache *_cache; // compiled pipelines from earlier runs
+        bool _shadererror = true; // no usable compute pipeline
+        CpuRenderer *_cpu = nullptr; // set when computing on the cpu
+        CpuJit *_jit = nullptr; // set when the cpu kernel is compiled at runtime
+        double _cpureporttime = 0.0;
+        VideoWriter *_video = nullptr; // set when recording
+        std::vector<MTL::Buffer*> _videobuffers; // what frames are read back into, one per video slot
 };
 
 #endif
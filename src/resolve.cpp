@@ -0,0 +1,248 @@
+#include "resolve.h"
+#include "threadpool.h"
+#include "trace.h"
+
+#include <atomic>
+#include <math.h>
+#include <string.h>
+
+// destination rows a worker takes at a time
+static const unsigned resolve_batch = 4;
+
+typedef float Floats8 __attribute__((vector_size(32)));
+typedef float Floats4 __attribute__((vector_size(16)));
+typedef uint8_t Bytes8 __attribute__((vector_size(8)));
+typedef uint8_t Bytes4 __attribute__((vector_size(4)));
+
+float Resolver::radius( ResolveFilter filter )
+{
+    switch (filter)
+    {
+        case ResolveBox: return 0.5f;
+        case ResolveTent: return 1.0f;
+        case ResolveLanczos: return 3.0f;
+        default: return 0.0f;
+    }
+}
+
+float Resolver::weight( ResolveFilter filter, float t )
+{
+    t = fabsf(t);
+    switch (filter)
+    {
+        case ResolveBox:
+            return t < 0.5f ? 1.0f : 0.0f;
+        case ResolveTent:
+            return t < 1.0f ? 1.0f - t : 0.0f;
+        case ResolveLanczos:
+        {
+            if (t >= 3.0f)
+                return 0.0f;
+            if (t < 1e-5f)
+                return 1.0f;
+            float a = (float)M_PI * t;
+            return 3.0f * sinf(a) * sinf(a / 3.0f) / (a * a);
+        }
+        default:
+            return 0.0f;
+    }
+}
+
+// The taps of destination pixel o are the source pixels within the filter's
+// radius of its center, the filter stretched to source pixels when
+// shrinking. Each pixel gets as many taps as the widest needs, the unused
+// ones with zero weight.
+void Resolver::buildTaps( unsigned src, unsigned dst, ResolveFilter filter, Taps *taps )
+{
+    float scale = (float)src / dst;
+    float stretch = scale > 1.0f ? scale : 1.0f;
+    float support = radius(filter) * stretch;
+    auto span = [&](unsigned o, long *lo, long *hi) {
+        float center = (o + 0.5f) * scale - 0.5f;
+        *lo = (long)ceilf(center - support);
+        *hi = (long)floorf(center + support);
+        return center;
+    };
+
+    taps->count = 1;
+    for (unsigned o = 0; o < dst; ++o)
+    {
+        long lo, hi;
+
+        span(o, &lo, &hi);
+        if (hi - lo + 1 > (long)taps->count)
+            taps->count = (unsigned)(hi - lo + 1);
+    }
+    taps->index.assign((size_t)dst * taps->count, 0);
+    taps->weight.assign((size_t)dst * taps->count, 0.0f);
+
+    for (unsigned o = 0; o < dst; ++o)
+    {
+        unsigned *index = &taps->index[(size_t)o * taps->count];
+        float *weight = &taps->weight[(size_t)o * taps->count];
+        long lo, hi;
+        float center = span(o, &lo, &hi);
+        float sum = 0.0f;
+        unsigned n = 0;
+
+        for (long i = lo; i <= hi; ++i, ++n)
+        {
+            long clamped = i < 0 ? 0 : i >= (long)src ? (long)src - 1 : i;
+
+            index[n] = (unsigned)clamped;
+            weight[n] = Resolver::weight(filter, (i - center) / stretch);
+            sum += weight[n];
+        }
+        // only a box enlarging by an even factor lands between two pixels
+        if (sum == 0.0f)
+        {
+            weight[0] = 1.0f;
+            sum = 1.0f;
+        }
+        for (unsigned t = 0; t < n; ++t)
+            weight[t] /= sum;
+        for (unsigned t = n; t < taps->count; ++t)
+            index[t] = index[0];
+    }
+}
+
+int Resolver::setup( unsigned srcwidth, unsigned srcheight, unsigned dstwidth, unsigned dstheight,
+        ResolveFilter filter )
+{
+    if (filter <= ResolveOff || filter >= ResolveFilterCount || !srcwidth || !srcheight || !dstwidth || !dstheight)
+        return -1;
+
+    _filter = filter;
+    _srcwidth = srcwidth;
+    _srcheight = srcheight;
+    _dstwidth = dstwidth;
+    _dstheight = dstheight;
+    buildTaps(srcwidth, dstwidth, filter, &_x);
+    buildTaps(srcheight, dstheight, filter, &_y);
+    return 0;
+}
+
+namespace {
+
+// what resolve_rows needs of a Resolver
+struct ResolveRows
+{
+    const uint8_t *src;
+    unsigned srcwidth;
+    uint8_t *dst;
+    unsigned dstwidth;
+    unsigned xcount;
+    unsigned ycount;
+    const unsigned *xindex;
+    const unsigned *yindex;
+    const float *xweight;
+    const float *yweight;
+};
+
+}
+
+// Destination rows y0 to y1. line holds a source row of floats.
+__attribute__((always_inline))
+static inline void resolve_rows(const ResolveRows &r, unsigned y0, unsigned y1, float *line)
+{
+    size_t n = (size_t)r.srcwidth * 4;
+    size_t stride = n;
+
+    for (unsigned y = y0; y < y1; ++y)
+    {
+        const unsigned *iy = r.yindex + (size_t)y * r.ycount;
+        const float *wy = r.yweight + (size_t)y * r.ycount;
+        uint8_t *out = r.dst + (size_t)y * r.dstwidth * 4;
+        size_t j = 0;
+
+        // the source rows under this one, summed down the columns
+        for (; j + 8 <= n; j += 8)
+        {
+            Floats8 acc = {};
+
+            for (unsigned t = 0; t < r.ycount; ++t)
+            {
+                Bytes8 b;
+
+                memcpy(&b, r.src + iy[t] * stride + j, sizeof(b));
+                acc += wy[t] * __builtin_convertvector(b, Floats8);
+            }
+            memcpy(line + j, &acc, sizeof(acc));
+        }
+        for (; j < n; ++j)
+        {
+            float acc = 0.0f;
+
+            for (unsigned t = 0; t < r.ycount; ++t)
+                acc += wy[t] * r.src[iy[t] * stride + j];
+            line[j] = acc;
+        }
+
+        // then along the row, a pixel's four channels at a time
+        for (unsigned x = 0; x < r.dstwidth; ++x)
+        {
+            const unsigned *ix = r.xindex + (size_t)x * r.xcount;
+            const float *wx = r.xweight + (size_t)x * r.xcount;
+            const Floats4 lo = { 0.0f, 0.0f, 0.0f, 0.0f }, hi = { 255.0f, 255.0f, 255.0f, 255.0f };
+            Floats4 acc = {};
+            Bytes4 px;
+
+            for (unsigned t = 0; t < r.xcount; ++t)
+            {
+                Floats4 p;
+
+                memcpy(&p, line + (size_t)ix[t] * 4, sizeof(p));
+                acc += wx[t] * p;
+            }
+
+            // Lanczos overshoots at edges
+            acc += 0.5f;
+            acc = acc < lo ? lo : acc;
+            acc = acc > hi ? hi : acc;
+            px = __builtin_convertvector(acc, Bytes4);
+            memcpy(out + (size_t)x * 4, &px, sizeof(px));
+        }
+    }
+}
+
+static void resolve_rows_sse(const ResolveRows &r, unsigned y0, unsigned y1, float *line)
+{
+    resolve_rows(r, y0, y1, line);
+}
+
+__attribute__((target("avx2")))
+static void resolve_rows_avx2(const ResolveRows &r, unsigned y0, unsigned y1, float *line)
+{
+    resolve_rows(r, y0, y1, line);
+}
+
+typedef void (*ResolveRowsFn)(const ResolveRows &r, unsigned y0, unsigned y1, float *line);
+
+static ResolveRowsFn resolve_pick_rows()
+{
+    if (__builtin_cpu_supports("avx2"))
+        return resolve_rows_avx2;
+    return resolve_rows_sse;
+}
+
+void Resolver::resolve( const uint8_t *src, uint8_t *dst, ThreadPool *pool ) const
+{
+    TRACE_SCOPE("Resolver::resolve");
+    static const ResolveRowsFn rows = resolve_pick_rows();
+    ResolveRows r = { src, _srcwidth, dst, _dstwidth, _x.count, _y.count,
+        _x.index.data(), _y.index.data(), _x.weight.data(), _y.weight.data() };
+    std::atomic<unsigned> next{ 0 };
+
+    auto job = [&](unsigned) {
+        std::vector<float> line((size_t)_srcwidth * 4);
+        unsigned y;
+
+        while ((y = next.fetch_add(resolve_batch, std::memory_order_relaxed)) < _dstheight)
+            rows(r, y, _dstheight - y < resolve_batch ? _dstheight : y + resolve_batch, line.data());
+    };
+
+    if (pool)
+        pool->run(job);
+    else
+        job(0);
+}
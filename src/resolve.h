@@ -0,0 +1,81 @@
+#ifndef METALTOY_RESOLVE_H
+#define METALTOY_RESOLVE_H
+
+#include <stdint.h>
+#include <vector>
+
+class ThreadPool;
+
+enum ResolveFilter
+{
+    // no resolve, the quad samples the compute texture bilinearly
+    ResolveOff,
+    // the average of the source pixels under each destination pixel
+    ResolveBox,
+    // a triangle two destination pixels wide, softer but without the
+    // blockiness of box
+    ResolveTent,
+    // Lanczos 3, the sharpest, with a little ringing at hard edges
+    ResolveLanczos,
+    ResolveFilterCount
+};
+
+// Per-dispatch data bound as buffer(0) of resolveMain. Mirrors struct
+// ResolveParams in resolve.metal, so keep the two in sync.
+struct ResolveParams
+{
+    uint32_t filter; // a ResolveFilter other than ResolveOff
+};
+
+// Downsamples the RGBA8 compute texture to the window, so every computed
+// pixel contributes to what is shown instead of the few a bilinear sample
+// lands next to. The filter is separable: each destination row is the
+// weighted sum of the source rows under it, which is then filtered along
+// the row, both with SIMD. Weights are worked out once per size, and rows
+// can be spread over a pool. Edges repeat the outermost pixels.
+//
+// Pixel values are filtered as they are, which is linear light for the
+// compute texture: the sRGB encoding happens in the drawable.
+class Resolver
+{
+    public:
+        Resolver() {}
+
+        // return 0 on success, -1 for ResolveOff or an empty size
+        int setup( unsigned srcwidth, unsigned srcheight, unsigned dstwidth, unsigned dstheight,
+                ResolveFilter filter );
+
+        // Resolves src, rows packed, into dst, rows packed, on pool's
+        // workers or on the calling thread without one
+        void resolve( const uint8_t *src, uint8_t *dst, ThreadPool *pool = nullptr ) const;
+
+        unsigned width() const { return _dstwidth; }
+        unsigned height() const { return _dstheight; }
+        ResolveFilter filter() const { return _filter; }
+
+        // of filter in destination pixels
+        static float radius( ResolveFilter filter );
+        // the weight at t destination pixels from the center
+        static float weight( ResolveFilter filter, float t );
+
+    private:
+        // the source pixels one axis of each destination pixel sums
+        struct Taps
+        {
+            unsigned count = 0; // per destination pixel
+            std::vector<unsigned> index;
+            std::vector<float> weight;
+        };
+
+        static void buildTaps( unsigned src, unsigned dst, ResolveFilter filter, Taps *taps );
+
+        ResolveFilter _filter = ResolveOff;
+        unsigned _srcwidth = 0;
+        unsigned _srcheight = 0;
+        unsigned _dstwidth = 0;
+        unsigned _dstheight = 0;
+        Taps _x;
+        Taps _y;
+};
+
+#endif
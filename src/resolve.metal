@@ -0,0 +1,72 @@
+#include <metal_stdlib>
+using namespace metal;
+
+// per-dispatch data, mirrors struct ResolveParams in resolve.h
+struct ResolveParams
+{
+    uint filter; // 1 box, 2 tent, 3 Lanczos 3
+};
+
+// Resolver::radius and Resolver::weight in resolve.cpp
+float resolve_radius(uint filter)
+{
+    return filter == 1 ? 0.5 : filter == 2 ? 1.0 : 3.0;
+}
+
+float resolve_weight(uint filter, float t)
+{
+    t = abs(t);
+    if (filter == 1)
+        return t < 0.5 ? 1.0 : 0.0;
+    if (filter == 2)
+        return max(0.0, 1.0 - t);
+    if (t >= 3.0)
+        return 0.0;
+    if (t < 1e-5)
+        return 1.0;
+    float a = M_PI_F * t;
+    return 3.0 * sin(a) * sin(a / 3.0) / (a * a);
+}
+
+// Downsamples the compute texture to the drawable size: every destination
+// pixel is the filtered sum of the source pixels within the filter's radius
+// of its center, the filter stretched to source pixels. Edges repeat.
+kernel void resolveMain( texture2d<float, access::read> src [[texture(0)]]
+                       , texture2d<float, access::write> dst [[texture(1)]]
+                       , constant ResolveParams &params [[buffer(0)]]
+                       , uint2 gid [[thread_position_in_grid]]
+)
+{
+    if (gid.x >= dst.get_width() || gid.y >= dst.get_height())
+        return;
+
+    float2 scale = float2(src.get_width(), src.get_height()) / float2(dst.get_width(), dst.get_height());
+    float2 stretch = max(scale, 1.0);
+    float2 support = resolve_radius(params.filter) * stretch;
+    float2 center = (float2(gid) + 0.5) * scale - 0.5;
+    int2 lo = int2(ceil(center - support));
+    int2 hi = int2(floor(center + support));
+    int2 last = int2(src.get_width(), src.get_height()) - 1;
+    float4 sum = 0.0;
+    float total = 0.0;
+
+    for (int y = lo.y; y <= hi.y; ++y)
+    {
+        float wy = resolve_weight(params.filter, (y - center.y) / stretch.y);
+
+        for (int x = lo.x; x <= hi.x; ++x)
+        {
+            float w = wy * resolve_weight(params.filter, (x - center.x) / stretch.x);
+
+            sum += w * src.read(uint2(clamp(int2(x, y), int2(0), last)));
+            total += w;
+        }
+    }
+
+    // only a box enlarging by an even factor lands between two pixels
+    if (total == 0.0)
+        sum = src.read(uint2(clamp(lo, int2(0), last)));
+    else
+        sum /= total;
+    dst.write(saturate(sum), gid);
+}
@@ -0,0 +1,28 @@
+// A cpu kernel for --jit: compiled with the system compiler when metaltoy
+// starts and again whenever it is saved, see cpujit.h. Not part of the
+// build. This is mandelbrot() of shader.metal, with the palette slowly
+// cycling to show the kernel sees the uniforms.
+
+#include "jitkernel.h"
+
+static float mandelbrot(float stx, float sty, const Uniforms &u)
+{
+    float x0 = 2.0f * stx - 1.5f;
+    float y0 = 2.0f * sty - 1.0f;
+    float x = 0.0f;
+    float y = 0.0f;
+    unsigned iteration = 0;
+    unsigned max_iteration = 512;
+
+    while (x * x + y * y <= 4.0f && iteration < max_iteration)
+    {
+        float xtmp = x * x - y * y + x0;
+        y = 2.0f * x * y + y0;
+        x = xtmp;
+        iteration += 1;
+    }
+
+    return 0.5f + 0.5f * sinf(3.0f + u.time + iteration * 0.15f);
+}
+
+METALTOY_KERNEL(mandelbrot)
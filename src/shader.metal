@@ -1,6 +1,32 @@
 #include <metal_stdlib>
 using namespace metal;
 
+// per-frame data, mirrors struct Uniforms in uniforms.h
+struct Uniforms
+{
+    float time;
+    float deltaTime;
+    uint2 resolution;
+    uint frame;
+};
+
+// Shortcuts for pixels inside the set, which would otherwise run all
+// max_iteration iterations: points in the main cardioid or the period 2 bulb
+// are not iterated at all, and an orbit that comes back exactly to a value
+// saved at iteration 1, 2, 4, 8, ... is in a cycle and stops there.
+constant bool interior_checks = true;
+
+bool in_main_bulbs(float x0, float y0)
+{
+    float xq = x0 - 0.25;
+    float y2 = y0 * y0;
+    float q = xq * xq + y2;
+
+    if (q * (q + xq) <= 0.25 * y2)
+        return true;
+    return (x0 + 1.0) * (x0 + 1.0) + y2 <= 0.0625;
+}
+
 half mandelbrot(float2 st)
 {
     float x0 = 2.0 * st.x - 1.5;
@@ -12,12 +38,33 @@ half mandelbrot(float2 st)
     uint iteration = 0;
     uint max_iteration = 512;
     float xtmp = 0.0;
+    float savedx = 0.0;
+    float savedy = 0.0;
+    uint saveat = 1;
+
+    if (interior_checks && in_main_bulbs(x0, y0))
+        iteration = max_iteration;
+
     while(x * x + y * y <= 4 && iteration < max_iteration)
     {
         xtmp = x * x - y * y + x0;
         y = 2 * x * y + y0;
         x = xtmp;
         iteration += 1;
+
+        if (!interior_checks)
+            continue;
+        if (x == savedx && y == savedy)
+        {
+            iteration = max_iteration;
+            break;
+        }
+        if (iteration == saveat)
+        {
+            savedx = x;
+            savedy = y;
+            saveat *= 2;
+        }
     }
 
     // Convert iteration result to colors
@@ -40,7 +87,7 @@ float justice(float2 st)
 kernel void computeMain(texture2d< half, access::write > tex [[texture(0)]],
                            uint2 index [[thread_position_in_grid]],
                            uint2 gridSize [[threads_per_grid]],
-                           device const float *time [[buffer(0)]])
+                           constant Uniforms &uniforms [[buffer(0)]])
 {
     float2 st;
     half3 color;
@@ -0,0 +1,118 @@
+#include "softapp.h"
+#include "globals.h"
+#include "cpukernels.h"
+#include "imageio.h"
+#include "pngwrite.h"
+#include "renderer.h"
+#include "threadpool.h"
+#include "trace.h"
+
+#include <softmetal.h>
+
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <memory>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <vector>
+
+static inline double getCurrentTimeInSeconds()
+{
+    using Clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+// Saves a BGRA drawable as frame_NNNNN.ppm, or .png encoded on pool.
+// return 0 on success
+static int save_frame(const MTL::Texture *tex, const HeadlessOptions &opts, ThreadPool *pool, unsigned frame)
+{
+    unsigned w = (unsigned)tex->width(), h = (unsigned)tex->height();
+    std::vector<uint8_t> rgba((size_t)w * h * 4);
+    const uint8_t *bgra = tex->data();
+    char path[1024];
+
+    for (size_t i = 0; i < rgba.size(); i += 4)
+    {
+        rgba[i + 0] = bgra[i + 2];
+        rgba[i + 1] = bgra[i + 1];
+        rgba[i + 2] = bgra[i + 0];
+        rgba[i + 3] = bgra[i + 3];
+    }
+
+    TRACE_SCOPE("save_frame");
+    snprintf(path, sizeof(path), "%s/frame_%05u.%s", opts.outdir, frame, opts.png ? "png" : "ppm");
+    if (opts.png ? write_png(path, w, h, rgba.data(), opts.pnglevel, pool) : write_ppm(path, w, h, rgba.data()))
+    {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int run_soft(const HeadlessOptions &opts)
+{
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+    std::atomic<bool> failed{ false };
+
+    if (opts.outdir && mkdir(opts.outdir, 0755) && errno != EEXIST)
+    {
+        fprintf(stderr, "Failed to create output directory %s. Errno %d\n", opts.outdir, errno);
+        return 1;
+    }
+
+    // what computeMain runs, when the renderer does not compute on the cpu
+    // itself
+    if (!global_cpu_compute && !softmetal_set_compute_kernel(cpu_find_kernel(global_cpu_kernel)))
+    {
+        fprintf(stderr, "No cpu kernel named %s that the soft device can run\n", global_cpu_kernel);
+        return 1;
+    }
+
+    MTL::Device *device = MTL::CreateSystemDefaultDevice();
+    CGRect frame = { { 0.0, 0.0 }, { (CGFloat)global_window_width, (CGFloat)global_window_height } };
+    MTK::View *view = MTK::View::alloc()->init(frame, device);
+
+    // as in app.cpp
+    view->setColorPixelFormat(MTL::PixelFormat::PixelFormatBGRA8Unorm_sRGB);
+    view->setClearColor(MTL::ClearColor::Make(0.0, 0.8, 1.0, 1.0));
+
+    // for encoding PNG frames, apart from the device's workers
+    std::unique_ptr<ThreadPool> pngpool;
+    if (opts.outdir && opts.png)
+        pngpool.reset(new ThreadPool(global_thread_count));
+
+    // on the queue thread, in presentation order
+    unsigned presented = 0;
+    view->setPresentHandler([&](const MTL::Texture *tex) {
+        if (opts.outdir && !failed && save_frame(tex, opts, pngpool.get(), presented))
+            failed = true;
+        ++presented;
+    });
+
+    Renderer *renderer = new Renderer(device);
+    double start = getCurrentTimeInSeconds();
+
+    for (unsigned f = 0; f < opts.frames && !failed; ++f)
+    {
+        TRACE_SCOPE("frame");
+        NS::AutoreleasePool *framepool = NS::AutoreleasePool::alloc()->init();
+
+        renderer->draw(view);
+        framepool->release();
+    }
+
+    // waits for the frames in flight
+    delete renderer;
+    double seconds = getCurrentTimeInSeconds() - start;
+
+    if (!global_quiet && opts.frames > 0)
+        fprintf(stderr, "%u frames of %ux%u on %s: %.2f ms/frame\n",
+                (unsigned)view->presentedCount(), global_window_width, global_window_height,
+                device->name()->utf8String(), seconds * 1e3 / opts.frames);
+
+    view->release();
+    device->release();
+    pool->release();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,12 @@
+#ifndef METALTOY_SOFTAPP_H
+#define METALTOY_SOFTAPP_H
+
+#include "headless.h"
+
+// Runs the Metal renderer on the softmetal device: the same Renderer as the
+// app, drawing into a view without a window. Frames are drawn as fast as the
+// device takes them, and saved like headless frames if opts.outdir is set.
+// Returns the process exit code.
+int run_soft(const HeadlessOptions &opts);
+
+#endif
@@ -0,0 +1,563 @@
+#ifndef METALTOY_SPMD_H
+#define METALTOY_SPMD_H
+
+// The runtime of the C++ that msltranslate.h makes of Metal kernels. The
+// generated code runs SPMD_WIDTH grid positions at once, one per lane of
+// GCC/Clang vector extension types: every varying value is a vfloat, vint or
+// vuint, vectors of them are SpmdVec<vfloat, 3> and so on, and values that
+// are the same for every position (uniforms, constants) stay plain scalars.
+// Branches and loops are executed for all lanes under an execution mask, a
+// vbool of -1 for the lanes that take them and 0 for the others.
+
+#include "jitkernel.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <limits>
+#include <string.h>
+#include <type_traits>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+// 8 lanes is one AVX register of floats, two SSE or NEON ones
+#ifndef SPMD_WIDTH
+#define SPMD_WIDTH 8
+#endif
+
+typedef float vfloat __attribute__((vector_size(SPMD_WIDTH * 4)));
+typedef int32_t vint __attribute__((vector_size(SPMD_WIDTH * 4)));
+typedef uint32_t vuint __attribute__((vector_size(SPMD_WIDTH * 4)));
+typedef vint vbool; // -1 true, 0 false
+
+// float2 and friends, of scalars laid out like in Metal, or of lanes
+template <class E, int N>
+struct alignas(std::is_arithmetic<E>::value ? sizeof(E) * (N == 3 ? 4 : N) : alignof(E)) SpmdVec
+{
+    E c[N];
+};
+
+#define SPMD_BINARY(op) \
+    template <class E, int N> \
+    static inline auto operator op( const SpmdVec<E, N> &a, const SpmdVec<E, N> &b ) \
+    { \
+        SpmdVec<decltype(a.c[0] op b.c[0]), N> r; \
+        for (int i = 0; i < N; ++i) \
+            r.c[i] = a.c[i] op b.c[i]; \
+        return r; \
+    }
+
+SPMD_BINARY(+) SPMD_BINARY(-) SPMD_BINARY(*) SPMD_BINARY(/)
+SPMD_BINARY(&) SPMD_BINARY(|) SPMD_BINARY(^) SPMD_BINARY(<<) SPMD_BINARY(>>)
+SPMD_BINARY(<) SPMD_BINARY(>) SPMD_BINARY(<=) SPMD_BINARY(>=) SPMD_BINARY(==) SPMD_BINARY(!=)
+
+#undef SPMD_BINARY
+
+template <class E, int N>
+static inline SpmdVec<E, N> operator-( const SpmdVec<E, N> &a )
+{
+    SpmdVec<E, N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = -a.c[i];
+    return r;
+}
+
+template <class E, int N>
+static inline SpmdVec<E, N> operator~( const SpmdVec<E, N> &a )
+{
+    SpmdVec<E, N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = ~a.c[i];
+    return r;
+}
+
+// Masks
+
+static inline vbool spmd_false()
+{
+    return vbool{};
+}
+
+// Taken at every branch and loop trip, so one test where there is one
+static inline bool spmd_any( vbool m )
+{
+#if defined(__AVX__) && SPMD_WIDTH == 8
+    return !_mm256_testz_si256((__m256i)m, (__m256i)m);
+#else
+    uint64_t w[SPMD_WIDTH / 2], r = 0;
+
+    memcpy(w, &m, sizeof(m));
+    for (int i = 0; i < SPMD_WIDTH / 2; ++i)
+        r |= w[i];
+    return r != 0;
+#endif
+}
+
+// lanes [0, n)
+static inline vbool spmd_lanes_below( unsigned n )
+{
+    vbool m;
+    for (int i = 0; i < SPMD_WIDTH; ++i)
+        m[i] = (unsigned)i < n ? -1 : 0;
+    return m;
+}
+
+// x, x + 1, ... x + SPMD_WIDTH - 1
+static inline vuint spmd_iota( uint32_t x )
+{
+    vuint v;
+    for (int i = 0; i < SPMD_WIDTH; ++i)
+        v[i] = x + i;
+    return v;
+}
+
+// Uniform to varying
+
+static inline vfloat spmd_varying( float a )
+{
+    return vfloat{} + a;
+}
+
+static inline vint spmd_varying( int32_t a )
+{
+    return vint{} + a;
+}
+
+static inline vuint spmd_varying( uint32_t a )
+{
+    return vuint{} + a;
+}
+
+static inline vbool spmd_varying( bool a )
+{
+    return vbool{} + (a ? -1 : 0);
+}
+
+template <class E, int N>
+static inline auto spmd_varying( const SpmdVec<E, N> &a )
+{
+    SpmdVec<decltype(spmd_varying(a.c[0])), N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = spmd_varying(a.c[i]);
+    return r;
+}
+
+// Conversions, to the scalar or lane type To
+
+template <class To, class From>
+static inline To spmd_convert( const From &a )
+{
+    if constexpr (std::is_arithmetic<From>::value)
+        return static_cast<To>(a);
+    else
+        return __builtin_convertvector(a, To);
+}
+
+template <class To, class E, int N>
+static inline SpmdVec<To, N> spmd_convert( const SpmdVec<E, N> &a )
+{
+    SpmdVec<To, N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = spmd_convert<To>(a.c[i]);
+    return r;
+}
+
+// nonzero to true: a bool, or a mask
+template <class From>
+static inline auto spmd_to_bool( const From &a )
+{
+    return a != 0;
+}
+
+template <class E, int N>
+static inline auto spmd_to_bool( const SpmdVec<E, N> &a )
+{
+    SpmdVec<decltype(a.c[0] != 0), N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = a.c[i] != 0;
+    return r;
+}
+
+// true to 1, from a bool or a mask
+template <class To, class From>
+static inline To spmd_from_bool( const From &a )
+{
+    if constexpr (std::is_arithmetic<From>::value)
+        return static_cast<To>(a);
+    else
+        return __builtin_convertvector(a & 1, To);
+}
+
+template <class To, class E, int N>
+static inline SpmdVec<To, N> spmd_from_bool( const SpmdVec<E, N> &a )
+{
+    SpmdVec<To, N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = spmd_from_bool<To>(a.c[i]);
+    return r;
+}
+
+template <int N, class E>
+static inline SpmdVec<E, N> spmd_broadcast( const E &a )
+{
+    SpmdVec<E, N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = a;
+    return r;
+}
+
+template <class E, int N>
+static inline void spmd_put( E *&out, const SpmdVec<E, N> &a )
+{
+    for (int i = 0; i < N; ++i)
+        *out++ = a.c[i];
+}
+
+template <class E>
+static inline void spmd_put( E *&out, const E &a )
+{
+    *out++ = a;
+}
+
+// float3(xy, z) and such
+template <class V, class... Args>
+static inline V spmd_make( const Args&... args )
+{
+    V v;
+    auto *out = v.c;
+    (spmd_put(out, args), ...);
+    return v;
+}
+
+template <unsigned... I, class E, int N>
+static inline SpmdVec<E, sizeof...(I)> spmd_swizzle( const SpmdVec<E, N> &a )
+{
+    return SpmdVec<E, sizeof...(I)>{ { a.c[I]... } };
+}
+
+// m ? a : b, per lane where m is a mask
+template <class T>
+static inline T spmd_select( bool m, const T &a, const T &b )
+{
+    return m ? a : b;
+}
+
+static inline vfloat spmd_select( vbool m, vfloat a, vfloat b )
+{
+    return m ? a : b;
+}
+
+static inline vint spmd_select( vbool m, vint a, vint b )
+{
+    return m ? a : b;
+}
+
+static inline vuint spmd_select( vbool m, vuint a, vuint b )
+{
+    return m ? a : b;
+}
+
+template <class E, int N>
+static inline SpmdVec<E, N> spmd_select( vbool m, const SpmdVec<E, N> &a, const SpmdVec<E, N> &b )
+{
+    SpmdVec<E, N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = spmd_select(m, a.c[i], b.c[i]);
+    return r;
+}
+
+template <class M, class E, int N>
+static inline SpmdVec<E, N> spmd_select( const SpmdVec<M, N> &m, const SpmdVec<E, N> &a, const SpmdVec<E, N> &b )
+{
+    SpmdVec<E, N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = spmd_select(m.c[i], a.c[i], b.c[i]);
+    return r;
+}
+
+// Integer division by zero and INT_MIN / -1 are undefined in Metal but would
+// trap on the cpu, also in lanes that are masked off, so the divisor is replaced
+// by 1: the quotient is a, what INT_MIN / -1 wraps to, and the remainder 0.
+template <class T>
+static inline bool spmd_div_traps( const T &a, const T &b )
+{
+    return b == 0 || (std::is_signed<T>::value && b == T(-1) && a == std::numeric_limits<T>::min());
+}
+
+template <class T>
+static inline T spmd_div( const T &a, const T &b )
+{
+    return a / (spmd_div_traps(a, b) ? T{} + 1 : b);
+}
+
+template <class T>
+static inline T spmd_mod( const T &a, const T &b )
+{
+    return a % (spmd_div_traps(a, b) ? T{} + 1 : b);
+}
+
+static inline vint spmd_div( vint a, vint b )
+{
+    return a / ((b == 0) | ((b == -1) & (a == INT32_MIN)) ? vint{} + 1 : b);
+}
+
+static inline vint spmd_mod( vint a, vint b )
+{
+    return a % ((b == 0) | ((b == -1) & (a == INT32_MIN)) ? vint{} + 1 : b);
+}
+
+static inline vuint spmd_div( vuint a, vuint b )
+{
+    return a / (b == 0 ? vuint{} + 1 : b);
+}
+
+static inline vuint spmd_mod( vuint a, vuint b )
+{
+    return a % (b == 0 ? vuint{} + 1 : b);
+}
+
+template <class E, int N>
+static inline SpmdVec<E, N> spmd_div( const SpmdVec<E, N> &a, const SpmdVec<E, N> &b )
+{
+    SpmdVec<E, N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = spmd_div(a.c[i], b.c[i]);
+    return r;
+}
+
+template <class E, int N>
+static inline SpmdVec<E, N> spmd_mod( const SpmdVec<E, N> &a, const SpmdVec<E, N> &b )
+{
+    SpmdVec<E, N> r;
+    for (int i = 0; i < N; ++i)
+        r.c[i] = spmd_mod(a.c[i], b.c[i]);
+    return r;
+}
+
+// The Metal standard library, for scalars, lanes and vectors of either
+namespace spmd
+{
+    // the lane type for a scalar one, for the templates below
+    template <class T> static inline T splat( float v ) { return T{} + v; }
+
+    // functions of floats, per lane. Simple loops like these vectorize where
+    // the target has an instruction for the function.
+    #define SPMD_MAP1(name, expr) \
+        static inline float name( float x ) { return expr; } \
+        static inline vfloat name( vfloat a ) \
+        { \
+            vfloat r; \
+            for (int i = 0; i < SPMD_WIDTH; ++i) \
+                r[i] = name(a[i]); \
+            return r; \
+        } \
+        template <class E, int N> \
+        static inline SpmdVec<E, N> name( const SpmdVec<E, N> &a ) \
+        { \
+            SpmdVec<E, N> r; \
+            for (int i = 0; i < N; ++i) \
+                r.c[i] = name(a.c[i]); \
+            return r; \
+        }
+
+    #define SPMD_MAP2(name, expr) \
+        static inline float name( float x, float y ) { return expr; } \
+        static inline vfloat name( vfloat a, vfloat b ) \
+        { \
+            vfloat r; \
+            for (int i = 0; i < SPMD_WIDTH; ++i) \
+                r[i] = name(a[i], b[i]); \
+            return r; \
+        } \
+        template <class E, int N> \
+        static inline SpmdVec<E, N> name( const SpmdVec<E, N> &a, const SpmdVec<E, N> &b ) \
+        { \
+            SpmdVec<E, N> r; \
+            for (int i = 0; i < N; ++i) \
+                r.c[i] = name(a.c[i], b.c[i]); \
+            return r; \
+        }
+
+    SPMD_MAP1(sin, sinf(x)) SPMD_MAP1(cos, cosf(x)) SPMD_MAP1(tan, tanf(x))
+    SPMD_MAP1(asin, asinf(x)) SPMD_MAP1(acos, acosf(x)) SPMD_MAP1(atan, atanf(x))
+    SPMD_MAP1(sinh, sinhf(x)) SPMD_MAP1(cosh, coshf(x)) SPMD_MAP1(tanh, tanhf(x))
+    SPMD_MAP1(exp, expf(x)) SPMD_MAP1(exp2, exp2f(x)) SPMD_MAP1(log, logf(x))
+    SPMD_MAP1(log2, log2f(x)) SPMD_MAP1(log10, log10f(x)) SPMD_MAP1(sqrt, sqrtf(x))
+    SPMD_MAP1(rsqrt, 1.0f / sqrtf(x)) SPMD_MAP1(floor, floorf(x)) SPMD_MAP1(ceil, ceilf(x))
+    SPMD_MAP1(round, roundf(x)) SPMD_MAP1(trunc, truncf(x)) SPMD_MAP1(fract, x - floorf(x))
+    SPMD_MAP1(fabs, fabsf(x))
+    SPMD_MAP1(saturate, x < 0.0f ? 0.0f : (x > 1.0f ? 1.0f : x))
+    SPMD_MAP1(sign, x > 0.0f ? 1.0f : (x < 0.0f ? -1.0f : 0.0f))
+    SPMD_MAP2(pow, powf(x, y)) SPMD_MAP2(powr, powf(x, y)) SPMD_MAP2(atan2, atan2f(x, y))
+    SPMD_MAP2(fmod, fmodf(x, y)) SPMD_MAP2(fmin, fminf(x, y)) SPMD_MAP2(fmax, fmaxf(x, y))
+    SPMD_MAP2(step, y < x ? 0.0f : 1.0f)
+
+    #undef SPMD_MAP1
+    #undef SPMD_MAP2
+
+    // of floats and integers alike
+    static inline float abs( float x ) { return fabsf(x); }
+    static inline vfloat abs( vfloat x ) { return fabs(x); }
+    static inline int32_t abs( int32_t x ) { return x < 0 ? -x : x; }
+    static inline vint abs( vint x ) { return x < 0 ? -x : x; }
+    static inline uint32_t abs( uint32_t x ) { return x; }
+    static inline vuint abs( vuint x ) { return x; }
+
+    template <class T> static inline T min( const T &a, const T &b ) { return b < a ? b : a; }
+    template <class T> static inline T max( const T &a, const T &b ) { return a < b ? b : a; }
+    template <class T> static inline T clamp( const T &x, const T &lo, const T &hi ) { return min(max(x, lo), hi); }
+    template <class T> static inline T mix( const T &a, const T &b, const T &t ) { return a + (b - a) * t; }
+    template <class T> static inline T fma( const T &a, const T &b, const T &c ) { return a * b + c; }
+
+    template <class T>
+    static inline T smoothstep( const T &e0, const T &e1, const T &x )
+    {
+        T t = clamp((x - e0) / (e1 - e0), splat<T>(0.0f), splat<T>(1.0f));
+        return t * t * (splat<T>(3.0f) - splat<T>(2.0f) * t);
+    }
+
+    template <class E, int N>
+    static inline SpmdVec<E, N> abs( const SpmdVec<E, N> &a )
+    {
+        SpmdVec<E, N> r;
+        for (int i = 0; i < N; ++i)
+            r.c[i] = abs(a.c[i]);
+        return r;
+    }
+
+    template <class E, int N>
+    static inline SpmdVec<E, N> min( const SpmdVec<E, N> &a, const SpmdVec<E, N> &b )
+    {
+        SpmdVec<E, N> r;
+        for (int i = 0; i < N; ++i)
+            r.c[i] = min(a.c[i], b.c[i]);
+        return r;
+    }
+
+    template <class E, int N>
+    static inline SpmdVec<E, N> max( const SpmdVec<E, N> &a, const SpmdVec<E, N> &b )
+    {
+        SpmdVec<E, N> r;
+        for (int i = 0; i < N; ++i)
+            r.c[i] = max(a.c[i], b.c[i]);
+        return r;
+    }
+
+    template <class E, int N>
+    static inline SpmdVec<E, N> smoothstep( const SpmdVec<E, N> &e0, const SpmdVec<E, N> &e1, const SpmdVec<E, N> &x )
+    {
+        SpmdVec<E, N> r;
+        for (int i = 0; i < N; ++i)
+            r.c[i] = smoothstep(e0.c[i], e1.c[i], x.c[i]);
+        return r;
+    }
+
+    // Geometry, where a scalar is a vector of one
+
+    template <class T> static inline T dot( const T &a, const T &b ) { return a * b; }
+    template <class T> static inline T length( const T &a ) { return abs(a); }
+    template <class T> static inline T length_squared( const T &a ) { return a * a; }
+    template <class T> static inline T distance( const T &a, const T &b ) { return abs(a - b); }
+    template <class T> static inline T normalize( const T &a ) { return sign(a); }
+
+    template <class E, int N>
+    static inline E dot( const SpmdVec<E, N> &a, const SpmdVec<E, N> &b )
+    {
+        E d = a.c[0] * b.c[0];
+        for (int i = 1; i < N; ++i)
+            d += a.c[i] * b.c[i];
+        return d;
+    }
+
+    template <class E, int N>
+    static inline E length( const SpmdVec<E, N> &a )
+    {
+        return sqrt(dot(a, a));
+    }
+
+    template <class E, int N>
+    static inline E length_squared( const SpmdVec<E, N> &a )
+    {
+        return dot(a, a);
+    }
+
+    template <class E, int N>
+    static inline E distance( const SpmdVec<E, N> &a, const SpmdVec<E, N> &b )
+    {
+        return length(a - b);
+    }
+
+    template <class E, int N>
+    static inline SpmdVec<E, N> normalize( const SpmdVec<E, N> &a )
+    {
+        return a * spmd_broadcast<N>(rsqrt(dot(a, a)));
+    }
+
+    template <class E>
+    static inline SpmdVec<E, 3> cross( const SpmdVec<E, 3> &a, const SpmdVec<E, 3> &b )
+    {
+        return SpmdVec<E, 3>{ { a.c[1] * b.c[2] - a.c[2] * b.c[1], a.c[2] * b.c[0] - a.c[0] * b.c[2],
+                a.c[0] * b.c[1] - a.c[1] * b.c[0] } };
+    }
+
+    // of bool vectors, and bools
+    static inline bool any( bool a ) { return a; }
+    static inline bool all( bool a ) { return a; }
+    static inline vbool any( vbool a ) { return a; }
+    static inline vbool all( vbool a ) { return a; }
+
+    template <class E, int N>
+    static inline E any( const SpmdVec<E, N> &a )
+    {
+        E r = a.c[0];
+        for (int i = 1; i < N; ++i)
+            r = r | a.c[i];
+        return r;
+    }
+
+    template <class E, int N>
+    static inline E all( const SpmdVec<E, N> &a )
+    {
+        E r = a.c[0];
+        for (int i = 1; i < N; ++i)
+            r = r & a.c[i];
+        return r;
+    }
+}
+
+// The texture a kernel writes to: pixels [x0, x1) of row y, as RGBA8 into the
+// bits of the field values, which cpu_colorize_packed turns back into pixels.
+struct SpmdRow
+{
+    uint8_t *data;
+    unsigned x0, x1, y;
+    unsigned width, height;
+};
+
+// tex.write(color, coord) of the lanes in exec, rounded like the gpu does.
+// Writes outside the row are dropped.
+static inline void spmd_write( const SpmdRow &row, vbool exec, const SpmdVec<vfloat, 4> &color,
+        const SpmdVec<vuint, 2> &coord )
+{
+    vuint pixel = vuint{};
+
+    for (int i = 0; i < 4; ++i)
+    {
+        vfloat v = color.c[i];
+        v = v < 0.0f ? vfloat{} : (v > 1.0f ? vfloat{} + 1.0f : v);
+        pixel |= __builtin_convertvector(v * 255.0f + 0.5f, vuint) << (8 * i);
+    }
+
+    exec &= (coord.c[1] == row.y) & (coord.c[0] - row.x0 < row.x1 - row.x0);
+    for (int i = 0; i < SPMD_WIDTH; ++i)
+    {
+        if (exec[i])
+        {
+            uint32_t p = pixel[i];
+            memcpy(row.data + (size_t)(coord.c[0][i] - row.x0) * 4, &p, 4);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,77 @@
+#include "threadpool.h"
+#include "trace.h"
+
+#include <stdio.h>
+
+ThreadPool::ThreadPool( unsigned nthreads )
+{
+    if (nthreads == 0)
+        nthreads = std::thread::hardware_concurrency();
+    if (nthreads == 0)
+        nthreads = 1;
+
+    _size = nthreads;
+
+    for (unsigned i = 1; i < _size; ++i)
+        _threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _wake.notify_all();
+
+    for (std::thread &t : _threads)
+        t.join();
+}
+
+void ThreadPool::run( const std::function<void(unsigned)> &job )
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _job = &job;
+        _pending = _size - 1;
+        _generation++;
+    }
+    _wake.notify_all();
+
+    job(0);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [this]{ return _pending == 0; });
+    _job = nullptr;
+}
+
+void ThreadPool::workerLoop( unsigned worker )
+{
+    unsigned long seen = 0;
+    char name[32];
+
+    snprintf(name, sizeof(name), "worker %u", worker);
+    trace_set_thread_name(name);
+
+    for (;;)
+    {
+        const std::function<void(unsigned)> *job;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [&]{ return _quit || _generation != seen; });
+            if (_quit)
+                return;
+            seen = _generation;
+            job = _job;
+        }
+
+        (*job)(worker);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (--_pending == 0)
+                _done.notify_one();
+        }
+    }
+}
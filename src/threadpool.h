@@ -0,0 +1,38 @@
+#ifndef METALTOY_THREADPOOL_H
+#define METALTOY_THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that all run the same job. The calling thread
+// takes part as worker 0, so a pool of size 1 spawns no threads at all.
+class ThreadPool
+{
+    public:
+        // nthreads == 0 means one worker per hardware thread
+        ThreadPool( unsigned nthreads );
+        ~ThreadPool();
+
+        unsigned size() const { return _size; }
+
+        // Runs job(worker) once on every worker and returns when all are done.
+        void run( const std::function<void(unsigned)> &job );
+
+    private:
+        void workerLoop( unsigned worker );
+
+        unsigned _size;
+        std::vector<std::thread> _threads;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::condition_variable _done;
+        const std::function<void(unsigned)> *_job = nullptr;
+        unsigned long _generation = 0;
+        unsigned _pending = 0;
+        bool _quit = false;
+};
+
+#endif
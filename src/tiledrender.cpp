@@ -0,0 +1,166 @@
+#include "tiledrender.h"
+#include "imageio.h"
+#include "trace.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline double getCurrentTimeInSeconds()
+{
+    using Clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+TiledRenderer::TiledRenderer( unsigned width, unsigned height, unsigned nthreads,
+        unsigned tilesize, unsigned window )
+: _pool( nthreads )
+, _kernel( cpu_find_kernel("mandelbrot") )
+, _width( width )
+, _height( height )
+, _tilesize( tilesize )
+, _window( window ? window : 2 * _pool.size() )
+{
+    size_t pixels = (size_t)tilesize * tilesize;
+
+    _slots.resize(_window);
+    for (Slot &s : _slots)
+    {
+        s.tile = 0;
+        s.done = false;
+        s.field = (float*)malloc(pixels * sizeof(float));
+        s.pixels = (uint8_t*)malloc(pixels * 4);
+    }
+    _cx = (float*)calloc(width + cpu_coord_padding, sizeof(float));
+    _cy = (float*)calloc(height + cpu_coord_padding, sizeof(float));
+    cpu_build_colormap(CpuPalette(), &_colormap);
+}
+
+TiledRenderer::~TiledRenderer()
+{
+    for (Slot &s : _slots)
+    {
+        free(s.field);
+        free(s.pixels);
+    }
+    free(_cx);
+    free(_cy);
+}
+
+size_t TiledRenderer::bufferBytes() const
+{
+    return _slots.size() * (size_t)_tilesize * _tilesize * (sizeof(float) + 4);
+}
+
+void TiledRenderer::renderTile( const CpuDispatch *d, uint64_t tile, Slot *slot )
+{
+    TRACE_SCOPE("TiledRenderer::renderTile");
+    unsigned cols = (_width + _tilesize - 1) / _tilesize;
+    unsigned x0 = (unsigned)(tile % cols) * _tilesize;
+    unsigned y0 = (unsigned)(tile / cols) * _tilesize;
+    unsigned x1 = _width - x0 < _tilesize ? _width : x0 + _tilesize;
+    unsigned y1 = _height - y0 < _tilesize ? _height : y0 + _tilesize;
+
+    for (unsigned y = y0; y < y1; ++y)
+    {
+        float *field = slot->field + (size_t)(y - y0) * _tilesize;
+
+        _kernel->eval(d, y, x0, x1, field);
+        _kernel->colorize(&_colormap, field, x1 - x0, slot->pixels + (size_t)(y - y0) * _tilesize * 4);
+    }
+}
+
+int TiledRenderer::render( const char *path, float time )
+{
+    TRACE_SCOPE("TiledRenderer::render");
+    TiledTiffWriter writer;
+    CpuView view = cpu_default_view(_width, _height);
+    Uniforms u = {};
+    CpuDispatch d = { _width, _height, &u, _cx, _cy, &_deep, _interiorchecks, &_interiorstats,
+        _kernel->program };
+    double start = getCurrentTimeInSeconds();
+
+    if (writer.open(path, _width, _height, _tilesize))
+    {
+        fprintf(stderr, "Failed to create %s\n", path);
+        return -1;
+    }
+
+    u.time = time;
+    u.resolution[0] = _width;
+    u.resolution[1] = _height;
+    for (unsigned x = 0; x < _width + cpu_coord_padding; ++x)
+        _cx[x] = (float)(view.x0 + x * view.stepx);
+    for (unsigned y = 0; y < _height + cpu_coord_padding; ++y)
+        _cy[y] = (float)(view.y0 + y * view.stepy);
+    if (_kernel->flags & CpuKernelDeepZoom)
+        _deep.prepare(_width, _height);
+
+    uint64_t ntiles = (uint64_t)writer.tileColumns() * writer.tileRows();
+    _next = 0;
+    _flushed = 0;
+    _writing = false;
+    _failed = false;
+    _peaktiles = 0;
+
+    _pool.run([&](unsigned) {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        for (;;)
+        {
+            // the oldest unwritten tile may be far behind
+            while (!_failed && _next < ntiles && _next >= _flushed + _window)
+                _advanced.wait(lock);
+            if (_failed || _next >= ntiles)
+                return;
+
+            uint64_t tile = _next++;
+            Slot *slot = &_slots[tile % _window];
+
+            slot->tile = tile;
+            slot->done = false;
+            if (_next - _flushed > _peaktiles)
+                _peaktiles = (unsigned)(_next - _flushed);
+
+            lock.unlock();
+            renderTile(&d, tile, slot);
+            lock.lock();
+            slot->done = true;
+
+            // whoever is writing picks this tile up when its turn comes
+            if (_writing)
+                continue;
+
+            _writing = true;
+            for (;;)
+            {
+                Slot *oldest = &_slots[_flushed % _window];
+                int r;
+
+                if (_failed || !oldest->done || oldest->tile != _flushed)
+                    break;
+
+                lock.unlock();
+                r = writer.writeTile(oldest->pixels, (size_t)_tilesize * 4);
+                lock.lock();
+
+                oldest->done = false;
+                if (r)
+                    _failed = true;
+                else
+                    ++_flushed;
+                _advanced.notify_all();
+            }
+            _writing = false;
+        }
+    });
+
+    if (writer.close() || _failed)
+    {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return -1;
+    }
+
+    _lastseconds = getCurrentTimeInSeconds() - start;
+    return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef METALTOY_TILEDRENDER_H
+#define METALTOY_TILEDRENDER_H
+
+#include "cpukernels.h"
+#include "deepzoom.h"
+#include "threadpool.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+// Renders a CpuKernel into a tiled TIFF of any size, for prints far past what
+// fits in memory as one image.
+//
+// Workers take tiles in file order and the worker that finishes the oldest
+// outstanding tile writes it, and any finished ones after it. A worker may
+// only start a tile within window tiles of the oldest unwritten one, so at
+// most window tiles are in memory however large the image. Apart from them
+// there are only the coordinate tables, which grow with width + height.
+class TiledRenderer
+{
+    public:
+        // nthreads == 0 means one thread per hardware thread. window == 0 is
+        // two tiles per thread.
+        TiledRenderer( unsigned width, unsigned height, unsigned nthreads,
+                unsigned tilesize = 256, unsigned window = 0 );
+        ~TiledRenderer();
+
+        void setKernel( const CpuKernel *kernel ) { _kernel = kernel; }
+        void setInteriorChecks( bool on ) { _interiorchecks = on; }
+        // the view of CpuKernelDeepZoom kernels
+        DeepZoom &deepZoom() { return _deep; }
+
+        // Renders the image at time into path. return 0 on success
+        int render( const char *path, float time );
+
+        unsigned width() const { return _width; }
+        unsigned height() const { return _height; }
+        unsigned threadCount() const { return _pool.size(); }
+        // of the last render
+        double lastSeconds() const { return _lastseconds; }
+        // the most tiles held in memory at once, at most the window
+        unsigned peakTiles() const { return _peaktiles; }
+        // bytes of the tile buffers
+        size_t bufferBytes() const;
+
+    private:
+        // a tile being rendered or waiting to be written
+        struct Slot
+        {
+            uint64_t tile;
+            bool done;
+            float *field;
+            uint8_t *pixels;
+        };
+
+        void renderTile( const CpuDispatch *d, uint64_t tile, Slot *slot );
+
+        ThreadPool _pool;
+        const CpuKernel *_kernel;
+        unsigned _width;
+        unsigned _height;
+        unsigned _tilesize;
+        unsigned _window;
+        std::vector<Slot> _slots; // tile i goes in slot i % _window
+        CpuColormap _colormap;
+        float *_cx;
+        float *_cy;
+        DeepZoom _deep;
+        bool _interiorchecks = true;
+        CpuInteriorStats _interiorstats;
+        double _lastseconds = 0.0;
+        unsigned _peaktiles = 0;
+
+        // the tiles of a render, under _mutex
+        std::mutex _mutex;
+        std::condition_variable _advanced; // _flushed moved, or a failure
+        uint64_t _next = 0;    // next tile to hand out
+        uint64_t _flushed = 0; // tiles written
+        bool _writing = false; // some worker is writing tiles
+        bool _failed = false;
+};
+
+#endif
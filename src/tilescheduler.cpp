@@ -0,0 +1,198 @@
+#include "tilescheduler.h"
+#include "trace.h"
+
+#include <chrono>
+
+// Aim for this many tiles per worker once costs are known. More tiles means
+// finer balancing but more scheduling overhead.
+static const unsigned tiles_per_worker = 16;
+
+static inline double getCurrentTimeInSeconds()
+{
+    using Clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t pack_range(uint32_t head, uint32_t tail)
+{
+    return ((uint64_t)head << 32) | tail;
+}
+
+TileScheduler::TileScheduler( ThreadPool &pool, unsigned tilesize, unsigned mintilesize )
+: _pool( pool )
+, _tilesize( tilesize )
+, _mintilesize( mintilesize )
+, _ranges( new std::atomic<uint64_t>[pool.size()] )
+, _stats( pool.size() )
+{
+}
+
+double TileScheduler::utilization( unsigned worker ) const
+{
+    if (_wall <= 0.0)
+        return 0.0;
+    return _stats[worker].busy / _wall;
+}
+
+void TileScheduler::utilizationRange( double *min, double *avg ) const
+{
+    double lo = 1.0, sum = 0.0;
+
+    for (unsigned w = 0; w < _stats.size(); ++w)
+    {
+        double u = utilization(w);
+        lo = u < lo ? u : lo;
+        sum += u;
+    }
+
+    *min = lo;
+    *avg = sum / _stats.size();
+}
+
+void TileScheduler::split( const Tile &t, unsigned cell, uint64_t cost, uint64_t target )
+{
+    unsigned w = t.x1 - t.x0;
+    unsigned h = t.y1 - t.y0;
+
+    if (cost <= target || w < 2 * _mintilesize || h < 2 * _mintilesize)
+    {
+        _tiles.push_back({ t, cell });
+        return;
+    }
+
+    // assume the cost is spread evenly over the quarters
+    unsigned xm = t.x0 + w / 2;
+    unsigned ym = t.y0 + h / 2;
+    split({ t.x0, t.y0, xm, ym }, cell, cost / 4, target);
+    split({ xm, t.y0, t.x1, ym }, cell, cost / 4, target);
+    split({ t.x0, ym, xm, t.y1 }, cell, cost / 4, target);
+    split({ xm, ym, t.x1, t.y1 }, cell, cost / 4, target);
+}
+
+void TileScheduler::buildTiles( unsigned width, unsigned height )
+{
+    unsigned cols = (width + _tilesize - 1) / _tilesize;
+    unsigned rows = (height + _tilesize - 1) / _tilesize;
+    uint64_t total = 0, target;
+
+    if (cols != _cols || rows != _rows || _costs.size() != (size_t)cols * rows)
+    {
+        _cols = cols;
+        _rows = rows;
+        _costs.assign((size_t)cols * rows, 0);
+        _newcosts.reset(new std::atomic<uint64_t>[(size_t)cols * rows]);
+    }
+
+    for (uint64_t c : _costs)
+        total += c;
+
+    // no splitting until there is something to go by, nor on a single thread
+    target = total / ((uint64_t)_pool.size() * tiles_per_worker);
+    if (total == 0 || _pool.size() == 1)
+        target = UINT64_MAX;
+
+    _tiles.clear();
+
+    for (unsigned row = 0; row < rows; ++row)
+    {
+        for (unsigned col = 0; col < cols; ++col)
+        {
+            unsigned cell = row * cols + col;
+            Tile t;
+
+            t.x0 = col * _tilesize;
+            t.y0 = row * _tilesize;
+            t.x1 = t.x0 + _tilesize < width ? t.x0 + _tilesize : width;
+            t.y1 = t.y0 + _tilesize < height ? t.y0 + _tilesize : height;
+
+            split(t, cell, _costs[cell], target);
+            _newcosts[cell].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool TileScheduler::next( unsigned worker, unsigned *task, bool *stolen )
+{
+    unsigned nworkers = _pool.size();
+
+    // own tiles, front to back
+    std::atomic<uint64_t> &own = _ranges[worker];
+    uint64_t r = own.load(std::memory_order_relaxed);
+    while ((uint32_t)(r >> 32) < (uint32_t)r)
+    {
+        uint32_t head = r >> 32;
+        if (own.compare_exchange_weak(r, pack_range(head + 1, (uint32_t)r), std::memory_order_relaxed))
+        {
+            *task = head;
+            *stolen = false;
+            return true;
+        }
+    }
+
+    // someone else's, back to front so we stay out of the owner's way
+    for (unsigned i = 1; i < nworkers; ++i)
+    {
+        std::atomic<uint64_t> &victim = _ranges[(worker + i) % nworkers];
+        r = victim.load(std::memory_order_relaxed);
+        while ((uint32_t)(r >> 32) < (uint32_t)r)
+        {
+            uint32_t tail = (uint32_t)r - 1;
+            if (victim.compare_exchange_weak(r, pack_range(r >> 32, tail), std::memory_order_relaxed))
+            {
+                *task = tail;
+                *stolen = true;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void TileScheduler::runTiles( unsigned width, unsigned height, TileFn fn, void *user )
+{
+    unsigned nworkers = _pool.size();
+    double start = getCurrentTimeInSeconds();
+
+    buildTiles(width, height);
+
+    for (unsigned w = 0; w < nworkers; ++w)
+    {
+        uint32_t head = (uint32_t)((uint64_t)_tiles.size() * w / nworkers);
+        uint32_t tail = (uint32_t)((uint64_t)_tiles.size() * (w + 1) / nworkers);
+        _ranges[w].store(pack_range(head, tail), std::memory_order_relaxed);
+        _stats[w] = TileWorkerStats();
+    }
+
+    _pool.run([&](unsigned worker) {
+        TileWorkerStats &stats = _stats[worker];
+        unsigned task;
+        bool stolen;
+
+        while (next(worker, &task, &stolen))
+        {
+            const Task &t = _tiles[task];
+            double t0 = getCurrentTimeInSeconds();
+            uint64_t cost;
+
+            {
+                TRACE_SCOPE(stolen ? "stolen tile" : "tile");
+                cost = fn(t.tile, user);
+            }
+
+            stats.busy += getCurrentTimeInSeconds() - t0;
+            stats.tiles++;
+            stats.steals += stolen;
+            _newcosts[t.cell].fetch_add(cost, std::memory_order_relaxed);
+        }
+    });
+
+    _totalcost = 0;
+    for (size_t i = 0; i < _costs.size(); ++i)
+    {
+        _costs[i] = _newcosts[i].load(std::memory_order_relaxed);
+        _totalcost += _costs[i];
+    }
+
+    _wall = getCurrentTimeInSeconds() - start;
+}
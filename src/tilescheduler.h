@@ -0,0 +1,87 @@
+#ifndef METALTOY_TILESCHEDULER_H
+#define METALTOY_TILESCHEDULER_H
+
+#include "threadpool.h"
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+struct Tile
+{
+    unsigned x0, y0, x1, y1;
+};
+
+struct TileWorkerStats
+{
+    double busy = 0.0; // seconds spent running tiles
+    unsigned tiles = 0;
+    unsigned steals = 0;
+};
+
+// Splits an image into tiles and runs them on a thread pool with work
+// stealing. Each worker starts on its own contiguous run of tiles and, once
+// that is empty, steals from the far end of another worker's run.
+//
+// The tile function returns the cost of the tile in arbitrary units (e.g.
+// iterations). Tiles that cost more than their share in one frame are split
+// into quarters in the next, so expensive regions end up in many small tiles
+// and cheap ones in a few large ones.
+class TileScheduler
+{
+    public:
+        // tilesize is the size of a tile before any splitting
+        TileScheduler( ThreadPool &pool, unsigned tilesize = 64, unsigned mintilesize = 8 );
+
+        template <typename Fn>
+        void run( unsigned width, unsigned height, const Fn &fn )
+        {
+            runTiles(width, height, [](const Tile &t, void *user) -> uint64_t {
+                return (*static_cast<const Fn*>(user))(t);
+            }, const_cast<Fn*>(&fn));
+        }
+
+        // forget the measured costs, e.g. when the kernel changes
+        void resetCosts() { _costs.clear(); }
+
+        // from the last run
+        const std::vector<TileWorkerStats> &workerStats() const { return _stats; }
+        double wallSeconds() const { return _wall; }
+        // what the tile function returned, summed over all tiles
+        uint64_t totalCost() const { return _totalcost; }
+        unsigned tileCount() const { return (unsigned)_tiles.size(); }
+        // fraction of the wall time the worker spent running tiles
+        double utilization( unsigned worker ) const;
+        void utilizationRange( double *min, double *avg ) const;
+
+    private:
+        struct Task
+        {
+            Tile tile;
+            unsigned cell; // index into _costs of the cell the tile is in
+        };
+
+        typedef uint64_t (*TileFn)(const Tile &t, void *user);
+
+        void runTiles( unsigned width, unsigned height, TileFn fn, void *user );
+        void buildTiles( unsigned width, unsigned height );
+        void split( const Tile &t, unsigned cell, uint64_t cost, uint64_t target );
+        bool next( unsigned worker, unsigned *task, bool *stolen );
+
+        ThreadPool &_pool;
+        unsigned _tilesize;
+        unsigned _mintilesize;
+        unsigned _cols = 0;
+        unsigned _rows = 0;
+        std::vector<uint64_t> _costs;     // per cell, measured last frame
+        std::unique_ptr<std::atomic<uint64_t>[]> _newcosts;
+        std::vector<Task> _tiles;
+        // per worker, the packed [head, tail) range of _tiles it still owns
+        std::unique_ptr<std::atomic<uint64_t>[]> _ranges;
+        std::vector<TileWorkerStats> _stats;
+        double _wall = 0.0;
+        uint64_t _totalcost = 0;
+};
+
+#endif
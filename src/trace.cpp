@@ -0,0 +1,206 @@
+#include "trace.h"
+
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+std::atomic<bool> trace_enabled_flag(false);
+
+struct TraceEvent
+{
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+};
+
+// Events of one thread. Only that thread appends; it fills in the event
+// and then publishes it by bumping count, so a writer reading up to count
+// never sees a half written one. Chunks are never moved or freed, which
+// keeps the published events valid for good.
+struct TraceBuffer
+{
+    static const unsigned chunksize = 4096;
+    static const unsigned maxchunks = 256; // a million events per thread
+
+    unsigned tid = 0;
+    char name[32] = {}; // under trace_mutex
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<TraceEvent*> chunks[maxchunks] = {};
+};
+
+static std::mutex trace_mutex;
+static std::vector<TraceBuffer*> trace_buffers; // under trace_mutex
+static std::string trace_exit_path;             // under trace_mutex
+static uint64_t trace_epoch = 0;                // under trace_mutex
+static thread_local TraceBuffer *thread_buffer = nullptr;
+
+uint64_t trace_now()
+{
+    using Clock = std::chrono::steady_clock;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static TraceBuffer *get_thread_buffer()
+{
+    if (thread_buffer)
+        return thread_buffer;
+
+    // threads come and go with their pools, their buffers stay for the dump
+    TraceBuffer *b = new TraceBuffer;
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    b->tid = (unsigned)trace_buffers.size();
+    trace_buffers.push_back(b);
+    thread_buffer = b;
+    return b;
+}
+
+void trace_record( const char *name, uint64_t start, uint64_t end )
+{
+    TraceBuffer *b = get_thread_buffer();
+    uint32_t n = b->count.load(std::memory_order_relaxed);
+    unsigned chunk = n / TraceBuffer::chunksize;
+
+    if (chunk >= TraceBuffer::maxchunks)
+    {
+        b->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TraceEvent *events = b->chunks[chunk].load(std::memory_order_relaxed);
+    if (!events)
+    {
+        events = new TraceEvent[TraceBuffer::chunksize];
+        b->chunks[chunk].store(events, std::memory_order_release);
+    }
+
+    events[n % TraceBuffer::chunksize] = TraceEvent{ name, start, end };
+    b->count.store(n + 1, std::memory_order_release);
+}
+
+void trace_set_thread_name( const char *name )
+{
+    TraceBuffer *b = get_thread_buffer();
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    snprintf(b->name, sizeof(b->name), "%s", name);
+}
+
+static void write_at_exit()
+{
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        path = trace_exit_path;
+    }
+
+    trace_stop();
+    if (trace_write(path.c_str()))
+        fprintf(stderr, "Failed to write trace to %s\n", path.c_str());
+    else
+        fprintf(stderr, "Wrote trace to %s\n", path.c_str());
+}
+
+void trace_start( const char *path )
+{
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        if (!trace_epoch)
+            trace_epoch = trace_now();
+        if (path)
+        {
+            if (trace_exit_path.empty())
+                atexit(write_at_exit);
+            trace_exit_path = path;
+        }
+    }
+    trace_enabled_flag.store(true, std::memory_order_relaxed);
+}
+
+void trace_stop()
+{
+    trace_enabled_flag.store(false, std::memory_order_relaxed);
+}
+
+void trace_init_from_env()
+{
+    const char *path = getenv("METALTOY_TRACE");
+
+    if (path && *path)
+        trace_start(path);
+}
+
+// the names are our own literals, this only guards against a stray quote
+static void write_string( FILE *f, const char *s )
+{
+    fputc('"', f);
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+int trace_write( const char *path )
+{
+    std::vector<TraceBuffer*> buffers;
+    std::vector<std::string> names;
+    uint64_t epoch;
+
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        buffers = trace_buffers;
+        for (TraceBuffer *b : buffers)
+            names.push_back(b->name);
+        epoch = trace_epoch;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+
+    // ts and dur are in microseconds
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"metaltoy\"}}");
+
+    for (size_t i = 0; i < buffers.size(); ++i)
+    {
+        const TraceBuffer *b = buffers[i];
+        uint32_t count = b->count.load(std::memory_order_acquire);
+        uint64_t dropped = b->dropped.load(std::memory_order_relaxed);
+
+        if (!names[i].empty())
+        {
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", b->tid);
+            write_string(f, names[i].c_str());
+            fprintf(f, "}}");
+        }
+        if (dropped)
+            fprintf(f, ",\n{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":0,"
+                    "\"args\":{\"events\":%llu}}", b->tid, (unsigned long long)dropped);
+
+        for (uint32_t n = 0; n < count; ++n)
+        {
+            const TraceEvent &e = b->chunks[n / TraceBuffer::chunksize].load(std::memory_order_acquire)
+                [n % TraceBuffer::chunksize];
+
+            fprintf(f, ",\n{\"name\":");
+            write_string(f, e.name);
+            fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    b->tid, (e.start - epoch) / 1e3, (e.end - e.start) / 1e3);
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+
+    bool failed = ferror(f);
+    if (fclose(f) || failed)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef METALTOY_TRACE_H
+#define METALTOY_TRACE_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Scoped timers that record a timeline of where frame time goes, written out
+// as Chrome trace JSON for chrome://tracing or ui.perfetto.dev.
+//
+// Every thread appends to its own buffer, so recording takes no locks. While
+// tracing is off a scope costs one relaxed load, so the scopes stay compiled
+// in everywhere.
+
+extern std::atomic<bool> trace_enabled_flag;
+
+static inline bool trace_enabled()
+{
+    return trace_enabled_flag.load(std::memory_order_relaxed);
+}
+
+// nanoseconds on a monotonic clock
+uint64_t trace_now();
+
+// Starts recording. With a path, whatever was recorded is written there at
+// exit. Also called for METALTOY_TRACE=path by trace_init_from_env().
+void trace_start( const char *path = nullptr );
+void trace_stop();
+void trace_init_from_env();
+
+// name must outlive the trace, e.g. a string literal
+void trace_record( const char *name, uint64_t start, uint64_t end );
+
+// shown instead of the thread number
+void trace_set_thread_name( const char *name );
+
+// Writes everything recorded so far, tracing may carry on. Events still
+// being recorded by other threads while this runs may or may not make it.
+// return 0 on success
+int trace_write( const char *path );
+
+class TraceScope
+{
+    public:
+        TraceScope( const char *name )
+        : _name( name )
+        , _start( trace_enabled() ? trace_now() : 0 )
+        {}
+
+        ~TraceScope()
+        {
+            if (_start)
+                trace_record(_name, _start, trace_now());
+        }
+
+    private:
+        TraceScope( const TraceScope& ) = delete;
+        TraceScope &operator=( const TraceScope& ) = delete;
+
+        const char *_name;
+        uint64_t _start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// times the rest of the enclosing block
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif
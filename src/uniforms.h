@@ -0,0 +1,23 @@
+#ifndef METALTOY_UNIFORMS_H
+#define METALTOY_UNIFORMS_H
+
+#include <stdint.h>
+
+// Per-frame data bound as buffer(0) of computeMain. Mirrors struct Uniforms
+// in shader.metal, so keep the two in sync. time comes first so kernels that
+// read buffer(0) as a plain float keep working.
+struct Uniforms
+{
+    float time;          // seconds since start
+    float deltatime;     // seconds since the previous frame
+    uint32_t resolution[2]; // grid size, a uint2 in the shader
+    uint32_t frame;      // frame index, starting at 0
+    uint32_t _pad;
+};
+
+static_assert(sizeof(Uniforms) == 24, "Uniforms must match the layout in shader.metal");
+
+// Number of frames the cpu may prepare ahead of the device.
+static const unsigned frames_in_flight = 3;
+
+#endif
@@ -0,0 +1,335 @@
+#include "videowrite.h"
+#include "trace.h"
+
+#include <chrono>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline double getCurrentTimeInSeconds()
+{
+    using Clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+// RGB to BT.601 studio range YUV in 8.8 fixed point, the usual integer
+// approximation. Chroma is taken from the sum of each 2x2 block, so its
+// rounding constant and shift are four times larger.
+#define LUMA(r, g, b) (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define CHROMA_U(r, g, b) (((-38 * (r) - 74 * (g) + 112 * (b) + 512) >> 10) + 128)
+#define CHROMA_V(r, g, b) (((112 * (r) - 94 * (g) - 18 * (b) + 512) >> 10) + 128)
+
+typedef uint32_t Rgba16 __attribute__((vector_size(64)));
+typedef int32_t Int16 __attribute__((vector_size(64)));
+typedef int32_t Int8 __attribute__((vector_size(32)));
+typedef uint8_t Byte16 __attribute__((vector_size(16)));
+typedef uint8_t Byte8 __attribute__((vector_size(8)));
+
+// Converts two rows of RGBA8 into their two luma rows and one row of each
+// chroma plane. row1 is row0 for the last row of an odd height.
+__attribute__((always_inline))
+static inline void i420_rows(const uint8_t *row0, const uint8_t *row1, unsigned width,
+        uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    unsigned x = 0;
+
+    // 16 pixels of both rows at a time, whatever width the target has
+    for (; x + 16 <= width; x += 16)
+    {
+        Rgba16 p0, p1;
+
+        memcpy(&p0, row0 + (size_t)x * 4, sizeof(p0));
+        memcpy(&p1, row1 + (size_t)x * 4, sizeof(p1));
+
+        Int16 r0 = (Int16)(p0 & 0xff), g0 = (Int16)((p0 >> 8) & 0xff), b0 = (Int16)((p0 >> 16) & 0xff);
+        Int16 r1 = (Int16)(p1 & 0xff), g1 = (Int16)((p1 >> 8) & 0xff), b1 = (Int16)((p1 >> 16) & 0xff);
+        Byte16 l0 = __builtin_convertvector(LUMA(r0, g0, b0), Byte16);
+        Byte16 l1 = __builtin_convertvector(LUMA(r1, g1, b1), Byte16);
+
+        memcpy(y0 + x, &l0, sizeof(l0));
+        memcpy(y1 + x, &l1, sizeof(l1));
+
+        // vertical pairs, then horizontal
+        Int16 r = r0 + r1, g = g0 + g1, b = b0 + b1;
+        Int8 rs = __builtin_shufflevector(r, r, 0, 2, 4, 6, 8, 10, 12, 14)
+            + __builtin_shufflevector(r, r, 1, 3, 5, 7, 9, 11, 13, 15);
+        Int8 gs = __builtin_shufflevector(g, g, 0, 2, 4, 6, 8, 10, 12, 14)
+            + __builtin_shufflevector(g, g, 1, 3, 5, 7, 9, 11, 13, 15);
+        Int8 bs = __builtin_shufflevector(b, b, 0, 2, 4, 6, 8, 10, 12, 14)
+            + __builtin_shufflevector(b, b, 1, 3, 5, 7, 9, 11, 13, 15);
+        Byte8 cu = __builtin_convertvector(CHROMA_U(rs, gs, bs), Byte8);
+        Byte8 cv = __builtin_convertvector(CHROMA_V(rs, gs, bs), Byte8);
+
+        memcpy(u + x / 2, &cu, sizeof(cu));
+        memcpy(v + x / 2, &cv, sizeof(cv));
+    }
+
+    // the rest a pair at a time, the last column doubled for an odd width
+    for (; x < width; x += 2)
+    {
+        const uint8_t *a = row0 + (size_t)x * 4, *c = row1 + (size_t)x * 4;
+        const uint8_t *b = x + 1 < width ? a + 4 : a, *d = x + 1 < width ? c + 4 : c;
+        int rs = a[0] + b[0] + c[0] + d[0];
+        int gs = a[1] + b[1] + c[1] + d[1];
+        int bs = a[2] + b[2] + c[2] + d[2];
+
+        y0[x] = LUMA(a[0], a[1], a[2]);
+        y1[x] = LUMA(c[0], c[1], c[2]);
+        if (x + 1 < width)
+        {
+            y0[x + 1] = LUMA(b[0], b[1], b[2]);
+            y1[x + 1] = LUMA(d[0], d[1], d[2]);
+        }
+        u[x / 2] = CHROMA_U(rs, gs, bs);
+        v[x / 2] = CHROMA_V(rs, gs, bs);
+    }
+}
+
+// Converts packed RGBA8 to planar 4:2:0, the three planes one after another
+__attribute__((always_inline))
+static inline void i420_frame(const uint8_t *rgba, unsigned width, unsigned height, uint8_t *yuv)
+{
+    size_t cw = (width + 1) / 2, ch = (height + 1) / 2;
+    size_t stride = (size_t)width * 4;
+    uint8_t *yplane = yuv;
+    uint8_t *uplane = yplane + (size_t)width * height;
+    uint8_t *vplane = uplane + cw * ch;
+
+    for (unsigned y = 0; y < height; y += 2)
+    {
+        unsigned y1 = y + 1 < height ? y + 1 : y;
+
+        i420_rows(rgba + y * stride, rgba + y1 * stride, width,
+                yplane + (size_t)y * width, yplane + (size_t)y1 * width,
+                uplane + y / 2 * cw, vplane + y / 2 * cw);
+    }
+}
+
+static void i420_frame_sse(const uint8_t *rgba, unsigned width, unsigned height, uint8_t *yuv)
+{
+    i420_frame(rgba, width, height, yuv);
+}
+
+__attribute__((target("avx2")))
+static void i420_frame_avx2(const uint8_t *rgba, unsigned width, unsigned height, uint8_t *yuv)
+{
+    i420_frame(rgba, width, height, yuv);
+}
+
+__attribute__((target("avx512f")))
+static void i420_frame_avx512(const uint8_t *rgba, unsigned width, unsigned height, uint8_t *yuv)
+{
+    i420_frame(rgba, width, height, yuv);
+}
+
+typedef void (*I420FrameFn)(const uint8_t *rgba, unsigned width, unsigned height, uint8_t *yuv);
+
+static I420FrameFn i420_pick_frame()
+{
+    if (__builtin_cpu_supports("avx512f"))
+        return i420_frame_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return i420_frame_avx2;
+    return i420_frame_sse;
+}
+
+VideoWriter::VideoWriter( unsigned slots )
+{
+    _slots.resize(slots ? slots : 1);
+}
+
+VideoWriter::~VideoWriter()
+{
+    close();
+    for (uint8_t *p : _owned)
+        free(p);
+}
+
+int VideoWriter::openFile( const char *path, unsigned width, unsigned height, unsigned fps )
+{
+    FILE *file = fopen(path, "wb");
+
+    if (!file)
+        return -1;
+
+    // C420jpeg is chroma sited between the pixels of its block, as it is
+    // taken from their average
+    if (fprintf(file, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+                width, height, fps) < 0)
+    {
+        fclose(file);
+        return -1;
+    }
+
+    _y4m = true;
+    return start(file, false, width, height);
+}
+
+int VideoWriter::openPipe( const char *command, unsigned width, unsigned height )
+{
+    FILE *file;
+
+    // an encoder that exits early fails the next write instead of killing us
+    signal(SIGPIPE, SIG_IGN);
+
+    file = popen(command, "w");
+    if (!file)
+        return -1;
+
+    _y4m = false;
+    return start(file, true, width, height);
+}
+
+int VideoWriter::start( FILE *file, bool pipe, unsigned width, unsigned height )
+{
+    size_t framebytes = (size_t)width * height * 4;
+
+    _file = file;
+    _pipe = pipe;
+    _width = width;
+    _height = height;
+    _yuv.resize((size_t)width * height + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2));
+
+    for (size_t i = 0; i < _slots.size(); ++i)
+    {
+        Slot &s = _slots[i];
+
+        s.state = SlotFree;
+        if (i < _memory.size())
+        {
+            s.pixels = _memory[i];
+        }
+        else
+        {
+            s.pixels = (uint8_t*)malloc(framebytes);
+            _owned.push_back(s.pixels);
+        }
+    }
+
+    _acquired = 0;
+    _written = 0;
+    _dropped = 0;
+    _closing = false;
+    _failed = false;
+    _waitseconds = 0.0;
+    _thread = std::thread(&VideoWriter::run, this);
+    return 0;
+}
+
+int VideoWriter::acquire( bool wait )
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (!_file || _closing || _failed)
+        return -1;
+
+    Slot *slot = &_slots[_acquired % _slots.size()];
+
+    if (slot->state != SlotFree && wait)
+    {
+        TRACE_SCOPE("VideoWriter::acquire wait");
+        double start = getCurrentTimeInSeconds();
+
+        while (!_failed && slot->state != SlotFree)
+            _freed.wait(lock);
+        _waitseconds += getCurrentTimeInSeconds() - start;
+        if (_failed)
+            return -1;
+    }
+
+    if (slot->state != SlotFree)
+    {
+        ++_dropped;
+        return -1;
+    }
+
+    slot->state = SlotFilling;
+    return (int)(_acquired++ % _slots.size());
+}
+
+void VideoWriter::submit( unsigned slot )
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _slots[slot].state = SlotQueued;
+    }
+    _queued.notify_one();
+}
+
+void VideoWriter::run()
+{
+    static const I420FrameFn convert = i420_pick_frame();
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    trace_set_thread_name("video writer");
+
+    for (;;)
+    {
+        // frames are written in the order they were acquired
+        Slot *slot = &_slots[_written % _slots.size()];
+        bool ok;
+
+        while (slot->state != SlotQueued && !(_closing && _written == _acquired))
+            _queued.wait(lock);
+        if (slot->state != SlotQueued)
+            return;
+
+        lock.unlock();
+        {
+            TRACE_SCOPE("VideoWriter::convert");
+            convert(slot->pixels, _width, _height, _yuv.data());
+        }
+        {
+            TRACE_SCOPE("VideoWriter::write");
+            ok = (!_y4m || fputs("FRAME\n", _file) >= 0)
+                && fwrite(_yuv.data(), 1, _yuv.size(), _file) == _yuv.size();
+        }
+        lock.lock();
+
+        slot->state = SlotFree;
+        if (ok)
+            ++_written;
+        else
+            _failed = true;
+        _freed.notify_all();
+
+        if (_failed)
+            return;
+    }
+}
+
+int VideoWriter::close()
+{
+    int r;
+
+    if (!_file)
+        return 0;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closing = true;
+    }
+    _queued.notify_one();
+    _thread.join();
+
+    // a command that fails, or cannot be found, exits with an error
+    if (_pipe)
+        r = pclose(_file) ? -1 : 0;
+    else
+        r = fclose(_file) ? -1 : 0;
+    _file = nullptr;
+
+    return _failed ? -1 : r;
+}
+
+uint64_t VideoWriter::framesWritten()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _written;
+}
+
+uint64_t VideoWriter::framesDropped()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _dropped;
+}
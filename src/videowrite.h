@@ -0,0 +1,94 @@
+#ifndef METALTOY_VIDEOWRITE_H
+#define METALTOY_VIDEOWRITE_H
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+// Streams RGBA8 frames out as 4:2:0 video, either a Y4M file or raw yuv420p
+// into the stdin of an encoder like ffmpeg.
+//
+// Frames go through a ring of slots. The renderer takes the next slot,
+// copies or blits a finished frame into it and submits it, possibly later
+// and from another thread, like a command buffer's completion handler. A
+// writer thread converts submitted slots to YUV and writes them in order.
+// Taking a slot never waits on the writer unless asked to: when the writer
+// is behind and all slots are taken the frame is dropped and counted, so a
+// slow disk or encoder never holds up rendering.
+class VideoWriter
+{
+    public:
+        VideoWriter( unsigned slots = 4 );
+        ~VideoWriter();
+
+        // Frames are read from memory instead of the writer's own buffers,
+        // width * height * 4 bytes for each slot, like buffers a device
+        // blits into. Must be set before open and outlive the writer.
+        void setSlotMemory( const std::vector<uint8_t*> &memory ) { _memory = memory; }
+
+        // Writes Y4M into path. return 0 on success
+        int openFile( const char *path, unsigned width, unsigned height, unsigned fps );
+        // Writes raw yuv420p frames into the stdin of command, which is run
+        // by the shell. return 0 on success
+        int openPipe( const char *command, unsigned width, unsigned height );
+
+        // The slot for the next frame, or -1 if the frame is dropped because
+        // every slot is queued or being written. With wait, blocks until the
+        // writer frees a slot instead. -1 as well once writing failed.
+        int acquire( bool wait );
+        // where the frame of an acquired slot goes, rows packed
+        uint8_t *slotPixels( unsigned slot ) { return _slots[slot].pixels; }
+        // Queues an acquired slot for writing. Any thread.
+        void submit( unsigned slot );
+
+        // Writes what was submitted and closes the file or waits for the
+        // command to exit. Every acquired slot must have been submitted.
+        // return 0 on success
+        int close();
+
+        bool isOpen() const { return _file != nullptr; }
+        unsigned slotCount() const { return (unsigned)_slots.size(); }
+        uint64_t framesWritten();
+        uint64_t framesDropped();
+        // time acquire(true) spent waiting for the writer
+        double waitSeconds() const { return _waitseconds; }
+
+    private:
+        enum SlotState { SlotFree, SlotFilling, SlotQueued };
+
+        struct Slot
+        {
+            SlotState state;
+            uint8_t *pixels;
+        };
+
+        int start( FILE *file, bool pipe, unsigned width, unsigned height );
+        void run();
+
+        std::vector<Slot> _slots; // frame i goes in slot i % size
+        std::vector<uint8_t*> _memory;
+        std::vector<uint8_t*> _owned;
+        std::vector<uint8_t> _yuv; // the converted frame, written at once
+        unsigned _width = 0;
+        unsigned _height = 0;
+        FILE *_file = nullptr;
+        bool _pipe = false;
+        bool _y4m = false;
+        std::thread _thread;
+        double _waitseconds = 0.0;
+
+        // under _mutex
+        std::mutex _mutex;
+        std::condition_variable _queued; // a slot was submitted, or closing
+        std::condition_variable _freed;  // a slot was written, or failure
+        uint64_t _acquired = 0;
+        uint64_t _written = 0;
+        uint64_t _dropped = 0;
+        bool _closing = false;
+        bool _failed = false;
+};
+
+#endif
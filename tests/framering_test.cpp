@@ -0,0 +1,92 @@
+#include "framering.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++failures; \
+        } \
+    } while (0)
+
+// how long a blocked acquire is given to (wrongly) return
+static const std::chrono::milliseconds settle(50);
+
+// Slots are handed out in order, and once all of them are in flight the next
+// acquire waits for the oldest one to be released.
+static void test_acquire_blocks_when_full()
+{
+    const unsigned n = 3;
+    FrameRing ring(n);
+    std::atomic<bool> acquired{ false };
+    unsigned extra = ~0u;
+
+    for (unsigned i = 0; i < n; ++i)
+        CHECK(ring.acquire() == i);
+    CHECK(ring.inFlight() == n);
+    CHECK(ring.frameCount() == n);
+
+    std::thread t([&]{
+        extra = ring.acquire();
+        acquired = true;
+    });
+
+    // releasing another slot does not help, it is slot 0's turn
+    std::this_thread::sleep_for(settle);
+    CHECK(!acquired);
+    ring.release(1);
+    std::this_thread::sleep_for(settle);
+    CHECK(!acquired);
+
+    ring.release(0);
+    t.join();
+    CHECK(acquired);
+    CHECK(extra == 0);
+    CHECK(ring.frameCount() == n + 1);
+}
+
+// drain returns once the device has released every slot, from another thread
+static void test_drain()
+{
+    const unsigned n = 4;
+    FrameRing ring(n);
+    unsigned slots[n];
+
+    // nothing in flight
+    ring.drain();
+
+    for (unsigned i = 0; i < n; ++i)
+        slots[i] = ring.acquire();
+
+    std::thread t([&]{
+        for (unsigned i = 0; i < n; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            ring.release(slots[i]);
+        }
+    });
+
+    ring.drain();
+    CHECK(ring.inFlight() == 0);
+    t.join();
+}
+
+int main()
+{
+    test_acquire_blocks_when_full();
+    test_drain();
+
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+#include <metal_stdlib>
+using namespace metal;
+
+// INT_MIN / -1 and division by zero, undefined in Metal, must not trap on the
+// cpu: the row y == 0 divides INT_MIN by -1 and the row y == 1 by 0
+kernel void computeMain(texture2d< half, access::write > tex [[texture(0)]],
+                           uint2 index [[thread_position_in_grid]])
+{
+    int a = int(index.x) - 2147483647 - 1;
+    int b = int(index.y) - 1;
+    int q = a / b + a % b;
+
+    tex.write(half4(half(q & 1), 0.0, 0.0, 1.0), index, 0);
+}
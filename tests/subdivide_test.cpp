@@ -0,0 +1,60 @@
+#include "cpurenderer.h"
+
+#include <stdio.h>
+
+static int failures = 0;
+
+// Renders the default mandelbrot view at size x size in full and subdivided,
+// and returns how many field values differ.
+static size_t differing_pixels(unsigned size, CpuSubdivision mode, bool interiorchecks)
+{
+    const CpuKernel *kernel = cpu_find_kernel("mandelbrot");
+    CpuRenderer full(size, size, 0), subdivided(size, size, 0);
+    size_t n = 0;
+
+    full.setKernel(kernel);
+    subdivided.setKernel(kernel);
+    full.setInteriorChecks(interiorchecks);
+    subdivided.setInteriorChecks(interiorchecks);
+    subdivided.setSubdivision(mode);
+    full.generateTexture(0.0f);
+    subdivided.generateTexture(0.0f);
+
+    for (size_t i = 0; i < (size_t)size * size; ++i)
+        n += full.field()[i] != subdivided.field()[i];
+    return n;
+}
+
+int main()
+{
+    static const unsigned sizes[] = { 64, 128, 256, 512, 1024, 2048 };
+    // interior-approx misses escaping filaments that slip between two border
+    // samples, a few pixels in a million of the default view
+    static const double max_fraction = 1e-5;
+
+    for (unsigned size : sizes)
+    {
+        for (bool checks : { true, false })
+        {
+            size_t n = differing_pixels(size, CpuSubdivisionInterior, checks);
+
+            if (n)
+            {
+                fprintf(stderr, "%ux%u, interior checks %s: %zu pixels differ from the full render\n",
+                        size, size, checks ? "on" : "off", n);
+                ++failures;
+            }
+        }
+
+        size_t n = differing_pixels(size, CpuSubdivisionInteriorApprox, true);
+
+        if (n > max_fraction * size * size)
+        {
+            fprintf(stderr, "%ux%u approximate: %zu pixels differ from the full render, more than %g of them\n",
+                    size, size, n, max_fraction);
+            ++failures;
+        }
+    }
+
+    return failures ? 1 : 0;
+}